@@ -0,0 +1,333 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "agent.h"
+#include "setup.h"
+
+/*
+ * The agent keeps the proxy password in memory, so it is asked only
+ * once, like ssh-agent does for keys.
+ *
+ * A client sends one line, "<username>\n", and gets back the password
+ * for that username, after which the agent closes the connection. If
+ * the agent has no password for the username, or the client runs as
+ * another user, it closes the connection without a reply.
+ *
+ * The password is kept in a page that is locked in memory, so it is
+ * never written to swap, and left out of core dumps.
+ */
+
+/* pending connections on the agent socket */
+#define AGENT_BACKLOG 16
+
+/* ms a client gets to send its request */
+#define AGENT_TIMEOUT 1000
+
+static volatile sig_atomic_t agent_stop;
+
+/*
+ * Make the socket at path a Unix socket address. Returns 0 if OK, -1
+ * if the path does not fit.
+ */
+
+static int
+agent_address(char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		warnx("%s: socket path too long", path);
+		return -1;
+	}
+	
+	strcpy(addr->sun_path, path);
+	
+	return 0;
+}
+
+/*
+ * Allocate AGENT_SECRET_SIZE bytes for a password, locked in memory,
+ * and left out of core dumps. Locking may fail if RLIMIT_MEMLOCK is
+ * too low, which is reported once. Returns NULL on error.
+ */
+
+static char *
+agent_vault(void)
+{
+	char *vault;
+	
+	vault = mmap(NULL, AGENT_SECRET_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (vault == MAP_FAILED) {
+		warn("agent: allocation failed");
+		return NULL;
+	}
+	
+	if (mlock(vault, AGENT_SECRET_SIZE) == -1)
+		warn("agent: can't lock password in memory");
+#ifdef MADV_DONTDUMP
+	madvise(vault, AGENT_SECRET_SIZE, MADV_DONTDUMP);
+#endif /* MADV_DONTDUMP */
+	
+	return vault;
+}
+
+/*
+ * Ask the agent at path for the password of username.
+ *
+ * Returns the password, kept in locked memory, or NULL if the agent
+ * has none; the caller then asks on the terminal. Only unexpected
+ * errors are reported, not an agent that isn't running.
+ */
+
+char *
+agent_request(char *path, char *username)
+{
+	int fd, len;
+	ssize_t nread;
+	size_t total = 0;
+	char *vault, line[AGENT_SECRET_SIZE];
+	struct sockaddr_un addr;
+	
+	if (agent_address(path, &addr) == -1)
+		return NULL;
+	
+	len = snprintf(line, sizeof(line), "%s\n", username);
+	if (len < 0 || len >= sizeof(line)) {
+		warnx("agent: username too long");
+		return NULL;
+	}
+	
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		warn("agent: socket() call failed");
+		return NULL;
+	}
+	
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		if (errno != ENOENT && errno != ECONNREFUSED)
+			warn("agent: failed to connect to %s", path);
+		close(fd);
+		return NULL;
+	}
+	
+	if (write(fd, line, len) != len || (vault = agent_vault()) == NULL) {
+		warn("agent: request failed");
+		close(fd);
+		return NULL;
+	}
+	
+	/* read the password up to eof, leaving room for the '\0' */
+	while (total < AGENT_SECRET_SIZE - 1 && (nread = read(fd,
+		vault + total, AGENT_SECRET_SIZE - 1 - total)) > 0)
+		total += nread;
+	
+	close(fd);
+	
+	if (total == 0) {
+		munmap(vault, AGENT_SECRET_SIZE);
+		return NULL;
+	}
+	
+	vault[total] = '\0';
+	
+	return vault;
+}
+
+/*
+ * Signal handler: stop the agent.
+ */
+
+static void
+agent_signal(int sig)
+{
+	agent_stop = 1;
+}
+
+/*
+ * Create the listening Unix socket at path, replacing a stale one.
+ * Only the user can connect to it. Returns the socket, or -1.
+ */
+
+static int
+agent_listen(char *path)
+{
+	int fd;
+	mode_t mask;
+	struct stat st;
+	struct sockaddr_un addr;
+	
+	if (agent_address(path, &addr) == -1)
+		return -1;
+	
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		warn("agent: socket() call failed");
+		return -1;
+	}
+	
+	mask = umask(077);
+	
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+		listen(fd, AGENT_BACKLOG) == -1 ||
+		fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+	{
+		warn("agent: can't listen on %s", path);
+		umask(mask);
+		close(fd);
+		return -1;
+	}
+	
+	umask(mask);
+	
+	return fd;
+}
+
+/*
+ * Serve one client: check that it runs as this user, read its request
+ * and send the password if the username matches.
+ */
+
+static void
+agent_serve(int fd, char *username, char *secret)
+{
+	ssize_t nread;
+	size_t len = 0, ulen = strlen(username);
+	char line[AGENT_SECRET_SIZE];
+	struct ucred cred;
+	struct timeval tv;
+	socklen_t clen = sizeof(cred);
+	
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &clen) == -1 ||
+		cred.uid != getuid())
+		return;
+	
+	/* a client that doesn't talk must not hold up the others */
+	tv.tv_sec = AGENT_TIMEOUT / 1000;
+	tv.tv_usec = (AGENT_TIMEOUT % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	
+	while (len < sizeof(line) && !memchr(line, '\n', len)) {
+		if ((nread = read(fd, line + len, sizeof(line) - len)) <= 0)
+			return;
+		len += nread;
+	}
+	
+	if (len != ulen + 1 || memcmp(line, username, ulen) != 0 ||
+		line[ulen] != '\n')
+		return;
+	
+	if (write(fd, secret, strlen(secret)) == -1)
+		warn("agent: reply failed");
+}
+
+/*
+ * Run the agent on config->agent until SIGINT or SIGTERM, handing out
+ * config->password to prcat clients for config->username. The password
+ * is moved to locked memory; the original is wiped.
+ *
+ * Returns an exit code.
+ */
+
+int
+agent_handler(struct config_t *config)
+{
+	int fd, lfd;
+	char *secret;
+	struct sigaction sa;
+	
+	if (!config->username || !config->password) {
+		warnx("agent: no username and password to keep");
+		return EX_USAGE;
+	}
+	
+	if (strlen(config->password) >= AGENT_SECRET_SIZE) {
+		warnx("agent: password too long");
+		return EX_USAGE;
+	}
+	
+	/* no core dumps or ptrace by other processes of this user */
+	prctl(PR_SET_DUMPABLE, 0);
+	
+	if ((secret = agent_vault()) == NULL)
+		return EX_OSERR;
+	
+	strcpy(secret, config->password);
+	explicit_bzero(config->password, strlen(config->password));
+	config->password = secret;
+	
+	if ((lfd = agent_listen(config->agent)) == -1)
+		return EX_UNAVAILABLE;
+	
+	/* stop on SIGINT and SIGTERM, without restarting accept */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = agent_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	
+	while (!agent_stop)
+	{
+		if ((fd = accept(lfd, NULL, NULL)) == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			warn("agent: accept failed");
+			break;
+		}
+		
+		agent_serve(fd, config->username, secret);
+		close(fd);
+	}
+	
+	explicit_bzero(secret, AGENT_SECRET_SIZE);
+	unlink(config->agent);
+	
+	return agent_stop ? EX_OK : EX_IOERR;
+}
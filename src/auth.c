@@ -0,0 +1,841 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/file.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "auth.h"
+#include "base64.h"
+#include "buffer.h"
+#include "md4.h"
+#include "md5.h"
+#include "proxy.h"
+#include "setup.h"
+
+/*
+ * Digest and NTLM authentication need a challenge from the proxy: the
+ * first CONNECT gets a 407 response, and the request is sent again
+ * with the answer. The requests ask the proxy to keep the connection
+ * open, so the answer can go on the same connection; NTLM requires it.
+ *
+ * A Digest challenge (the nonce) is kept in the auth cache file, and
+ * reused with the next nonce count by later runs, so they authenticate
+ * without a 407 round trip until the proxy expires the nonce.
+ */
+
+/* size of a Digest challenge parameter */
+#define AUTH_PARAM_SIZE 256
+
+/* requests sent for one tunnel, before giving up */
+#define AUTH_ROUNDS 3
+
+/* size of a line in the auth cache */
+#define AUTH_LINE_SIZE 1024
+
+/* NTLM negotiate flags: unicode, OEM, request target, NTLM, always
+ * sign, extended session security, target info, 128 and 56 bit */
+#define NTLM_FLAGS 0xa0888207
+
+/* NTLM message types */
+#define NTLM_NEGOTIATE		1
+#define NTLM_CHALLENGE		2
+#define NTLM_AUTHENTICATE	3
+
+/* NTLM target info: end of list, and timestamp */
+#define NTLM_AV_EOL		0
+#define NTLM_AV_TIMESTAMP	7
+
+/* seconds from 1601 (Windows epoch) to 1970 */
+#define NTLM_EPOCH 11644473600ULL
+
+/* a Digest challenge */
+typedef struct auth_digest_t {
+	char realm[AUTH_PARAM_SIZE];
+	char nonce[AUTH_PARAM_SIZE];
+	char opaque[AUTH_PARAM_SIZE];
+	int qop;		/* use qop=auth */
+	int sess;		/* MD5-sess algorithm */
+	int stale;		/* nonce expired, but the answer was right */
+	unsigned long nc;	/* nonce count of the last request */
+} auth_digest_t;
+
+/* state of the authentication of one tunnel */
+typedef struct auth_t {
+	struct config_t *config;
+	struct proxy_parser_t parser;	/* parser of the last response */
+	int offered;		/* proxy offered the scheme */
+	int digest;		/* have a Digest challenge */
+	struct auth_digest_t d;
+	unsigned char *challenge;	/* NTLM challenge message */
+	size_t clen;
+} auth_t;
+
+/*
+ * Get the next "name=value" or "name="quoted value"" parameter from
+ * the list at *p, like the parameters of a challenge. Returns 1 if
+ * there was one, 0 at the end of the list.
+ */
+
+static int
+auth_param(char **p, char *name, size_t nsize, char *value, size_t vsize)
+{
+	size_t n;
+	char *s = *p;
+	
+	while (*s == ' ' || *s == '\t' || *s == ',')
+		++s;
+	
+	if (!*s)
+		return 0;
+	
+	for (n = 0; *s && *s != '=' && *s != ',' && *s != ' '; ++s)
+		if (n < nsize - 1)
+			name[n++] = *s;
+	name[n] = '\0';
+	
+	n = 0;
+	if (*s == '=' && *++s == '"') {
+		for (++s; *s && *s != '"'; ++s) {
+			if (*s == '\\' && s[1])
+				++s;
+			if (n < vsize - 1)
+				value[n++] = *s;
+		}
+		if (*s)
+			++s;
+	} else {
+		for (; *s && *s != ',' && *s != ' '; ++s)
+			if (n < vsize - 1)
+				value[n++] = *s;
+	}
+	value[n] = '\0';
+	
+	*p = s;
+	
+	return 1;
+}
+
+/*
+ * Parse the parameters of a Digest challenge. Returns 0 if OK, -1 if
+ * the challenge can't be answered.
+ */
+
+static int
+auth_digest_parse(char *params, struct auth_digest_t *d)
+{
+	char name[32], value[AUTH_PARAM_SIZE], *qop, *last;
+	
+	memset(d, 0, sizeof(*d));
+	
+	while (auth_param(&params, name, sizeof(name), value, sizeof(value)))
+	{
+		if (strcasecmp(name, "realm") == 0)
+			strcpy(d->realm, value);
+		else if (strcasecmp(name, "nonce") == 0)
+			strcpy(d->nonce, value);
+		else if (strcasecmp(name, "opaque") == 0)
+			strcpy(d->opaque, value);
+		else if (strcasecmp(name, "stale") == 0)
+			d->stale = (strcasecmp(value, "true") == 0);
+		else if (strcasecmp(name, "algorithm") == 0) {
+			if (strcasecmp(value, "MD5-sess") == 0)
+				d->sess = 1;
+			else if (strcasecmp(value, "MD5") != 0)
+				return -1;
+		} else if (strcasecmp(name, "qop") == 0) {
+			for (qop = strtok_r(value, ", ", &last); qop;
+				qop = strtok_r(NULL, ", ", &last))
+				if (strcasecmp(qop, "auth") == 0)
+					d->qop = 1;
+		}
+	}
+	
+	return d->nonce[0] ? 0 : -1;
+}
+
+/*
+ * Find the cached Digest challenge for the proxy in the auth cache, and
+ * take the next nonce count for it; or, if update is set, replace the
+ * cached challenge with d. The file is locked, so runs in parallel
+ * never use the same nonce count. Returns 0 if OK, -1 if there is no
+ * cached challenge, or the cache can't be used.
+ */
+
+static int
+auth_cache(struct config_t *config, struct auth_digest_t *d, int update)
+{
+	int fd, found = -1;
+	char line[AUTH_LINE_SIZE];
+	char *data = NULL, *out = NULL, *p, *q, *end, *f[8];
+	size_t len = 0, olen = 0, size = 0, n;
+	ssize_t nread;
+	
+	if (!config->authcache)
+		return -1;
+	
+	if ((fd = open(config->authcache, O_RDWR | O_CREAT | O_CLOEXEC,
+		0600)) == -1)
+	{
+		warn("%s: can't open auth cache", config->authcache);
+		return -1;
+	}
+	
+	if (flock(fd, LOCK_EX) == -1)
+		goto done;
+	
+	/* read the whole file; it has a line per proxy */
+	for (;;) {
+		if (len + AUTH_LINE_SIZE > size) {
+			size += AUTH_LINE_SIZE * 4;
+			if ((p = realloc(data, size + 1)) == NULL)
+				goto done;
+			data = p;
+		}
+		if ((nread = read(fd, data + len, size - len)) <= 0)
+			break;
+		len += nread;
+	}
+	
+	if (nread == -1 || (out = malloc(len + AUTH_LINE_SIZE)) == NULL)
+		goto done;
+	
+	data[len] = '\0';
+	
+	/* "<host>\t<port>\t<realm>\t<nonce>\t<opaque>\t<qop>\t<sess>\t<nc>" */
+	for (p = data; p < data + len; p = end + 1)
+	{
+		if ((end = strchr(p, '\n')) == NULL)
+			end = data + len;
+		*end = '\0';
+		
+		for (q = p, n = 0; n < 8 && q; ++n)
+			f[n] = strsep(&q, "\t");
+		
+		if (n != 8 || strcmp(f[0], config->proxyname) != 0 ||
+			atoi(f[1]) != config->proxyport)
+		{
+			/* keep lines of other proxies */
+			if (n == 8)
+				olen += sprintf(out + olen, "%s\t%s\t%s\t%s\t"
+					"%s\t%s\t%s\t%s\n", f[0], f[1], f[2],
+					f[3], f[4], f[5], f[6], f[7]);
+			continue;
+		}
+		
+		if (update || strlen(f[2]) >= AUTH_PARAM_SIZE ||
+			strlen(f[3]) >= AUTH_PARAM_SIZE ||
+			strlen(f[4]) >= AUTH_PARAM_SIZE)
+			continue;
+		
+		memset(d, 0, sizeof(*d));
+		strcpy(d->realm, f[2]);
+		strcpy(d->nonce, f[3]);
+		strcpy(d->opaque, f[4]);
+		d->qop = atoi(f[5]);
+		d->sess = atoi(f[6]);
+		d->nc = strtoul(f[7], NULL, 10) + 1;
+		found = 0;
+	}
+	
+	if (found == -1 && !update)
+		goto done;
+	
+	/* the challenge, with the nonce count that was taken */
+	n = snprintf(line, sizeof(line), "%s\t%i\t%s\t%s\t%s\t%i\t%i\t%lu\n",
+		config->proxyname, config->proxyport, d->realm, d->nonce,
+		d->opaque, d->qop, d->sess, d->nc);
+	if (n < sizeof(line)) {
+		memcpy(out + olen, line, n);
+		olen += n;
+	}
+	
+	if (lseek(fd, 0, SEEK_SET) == -1 || ftruncate(fd, 0) == -1 ||
+		write(fd, out, olen) != olen)
+		warn("%s: can't update auth cache", config->authcache);
+	else
+		found = 0;
+	
+done:
+	close(fd);
+	free(data);
+	free(out);
+	
+	return found;
+}
+
+/*
+ * Write the 16 byte MD5 digest md as 32 hex digits to hex.
+ */
+
+static void
+auth_hex(const unsigned char *md, char *hex)
+{
+	int i;
+	
+	for (i = 0; i < MD5_SIZE; ++i)
+		sprintf(hex + i * 2, "%02x", md[i]);
+}
+
+/*
+ * Compute the MD5 hex digest of the strings, separated by ':'. The
+ * list ends with NULL.
+ */
+
+static void
+auth_md5(char *hex, ...)
+{
+	int first = 1;
+	char *s;
+	unsigned char md[MD5_SIZE];
+	struct md5_t ctx;
+	va_list ap;
+	
+	md5_init(&ctx);
+	
+	va_start(ap, hex);
+	while ((s = va_arg(ap, char *)) != NULL) {
+		if (!first)
+			md5_update(&ctx, ":", 1);
+		md5_update(&ctx, s, strlen(s));
+		first = 0;
+	}
+	va_end(ap);
+	
+	md5_final(&ctx, md);
+	auth_hex(md, hex);
+}
+
+/*
+ * Compose the Digest answer to the challenge in auth->d for the next
+ * request. Returns the header value, which must be freed, or NULL.
+ */
+
+static char *
+auth_digest(struct auth_t *auth)
+{
+	char *value, uri[AUTH_PARAM_SIZE + 8], nc[9], cnonce[17];
+	char ha1[33], ha2[33], response[33];
+	unsigned char rnd[8];
+	struct config_t *config = auth->config;
+	struct auth_digest_t *d = &auth->d;
+	size_t size;
+	int i;
+	
+	snprintf(uri, sizeof(uri), "%s:%i", config->hostname,
+		config->hostport);
+	snprintf(nc, sizeof(nc), "%08lx", d->nc);
+	
+	if (getentropy(rnd, sizeof(rnd)) == -1) {
+		warn("can't get random bytes");
+		return NULL;
+	}
+	for (i = 0; i < sizeof(rnd); ++i)
+		sprintf(cnonce + i * 2, "%02x", rnd[i]);
+	
+	auth_md5(ha1, config->username, d->realm, config->password, NULL);
+	if (d->sess)
+		auth_md5(ha1, ha1, d->nonce, cnonce, NULL);
+	auth_md5(ha2, "CONNECT", uri, NULL);
+	
+	if (d->qop)
+		auth_md5(response, ha1, d->nonce, nc, cnonce, "auth", ha2,
+			NULL);
+	else
+		auth_md5(response, ha1, d->nonce, ha2, NULL);
+	
+	size = strlen(config->username) + strlen(d->realm) +
+		strlen(d->nonce) + strlen(uri) + strlen(d->opaque) + 256;
+	if ((value = malloc(size)) == NULL) {
+		warn("malloc failed");
+		return NULL;
+	}
+	
+	i = snprintf(value, size, "Digest username=\"%s\", realm=\"%s\", "
+		"nonce=\"%s\", uri=\"%s\", response=\"%s\", algorithm=%s",
+		config->username, d->realm, d->nonce, uri, response,
+		d->sess ? "MD5-sess" : "MD5");
+	if (d->qop)
+		i += snprintf(value + i, size - i, ", qop=auth, nc=%s, "
+			"cnonce=\"%s\"", nc, cnonce);
+	if (d->opaque[0])
+		snprintf(value + i, size - i, ", opaque=\"%s\"", d->opaque);
+	
+	return value;
+}
+
+/*
+ * Store a 16 bit or 32 bit little endian number at p.
+ */
+
+static void
+auth_le16(unsigned char *p, unsigned int v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+}
+
+static void
+auth_le32(unsigned char *p, unsigned long v)
+{
+	auth_le16(p, v & 0xffff);
+	auth_le16(p + 2, (v >> 16) & 0xffff);
+}
+
+/*
+ * Read a 16 bit or 32 bit little endian number at p.
+ */
+
+static unsigned int
+auth_get16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned long
+auth_get32(const unsigned char *p)
+{
+	return auth_get16(p) | ((unsigned long)auth_get16(p + 2) << 16);
+}
+
+/*
+ * Convert the first len bytes of the UTF-8 string s to UTF-16LE at
+ * out, in upper case if upper is set (ASCII only). Characters outside
+ * the BMP become '?'. Returns the length of the result in bytes; out
+ * needs room for 2 * len bytes.
+ */
+
+static size_t
+auth_unicode(const char *s, size_t len, unsigned char *out, int upper)
+{
+	size_t n = 0;
+	unsigned int c;
+	const unsigned char *p = (const unsigned char *)s, *end = p + len;
+	
+	while (p < end)
+	{
+		if (*p < 0x80) {
+			c = upper ? toupper(*p) : *p;
+			p += 1;
+		} else if ((*p & 0xe0) == 0xc0 && end - p >= 2) {
+			c = ((p[0] & 0x1f) << 6) | (p[1] & 0x3f);
+			p += 2;
+		} else if ((*p & 0xf0) == 0xe0 && end - p >= 3) {
+			c = ((p[0] & 0x0f) << 12) | ((p[1] & 0x3f) << 6) |
+				(p[2] & 0x3f);
+			p += 3;
+		} else {
+			c = '?';
+			for (++p; p < end && (*p & 0xc0) == 0x80; ++p)
+				;
+		}
+		auth_le16(out + n, c);
+		n += 2;
+	}
+	
+	return n;
+}
+
+/*
+ * Fill in an NTLM security buffer: length and offset of data in the
+ * message at msg, of which *used bytes are taken. The data is copied
+ * to the end of the message.
+ */
+
+static void
+auth_secbuf(unsigned char *msg, size_t *used, int field,
+	const unsigned char *data, size_t len)
+{
+	auth_le16(msg + field, len);
+	auth_le16(msg + field + 2, len);
+	auth_le32(msg + field + 4, *used);
+	memcpy(msg + *used, data, len);
+	*used += len;
+}
+
+/*
+ * Compose the NTLM negotiate message (type 1). Returns the header value,
+ * which must be freed, or NULL.
+ */
+
+static char *
+auth_ntlm_negotiate(void)
+{
+	char *token, *value;
+	unsigned char msg[32];
+	
+	memset(msg, 0, sizeof(msg));
+	memcpy(msg, "NTLMSSP", 8);
+	auth_le32(msg + 8, NTLM_NEGOTIATE);
+	auth_le32(msg + 12, NTLM_FLAGS);
+	
+	/* domain and workstation are empty, at the end of the message */
+	auth_le32(msg + 20, sizeof(msg));
+	auth_le32(msg + 28, sizeof(msg));
+	
+	if ((token = base64_encode(msg, sizeof(msg))) == NULL)
+		return NULL;
+	
+	if ((value = malloc(strlen(token) + 6)) != NULL)
+		stpcpy(stpcpy(value, "NTLM "), token);
+	
+	free(token);
+	
+	return value;
+}
+
+/*
+ * Compose the NTLMv2 authenticate message (type 3) that answers the
+ * challenge message in auth->challenge. The username may be given as
+ * "DOMAIN\user". Returns the header value, which must be freed, or
+ * NULL.
+ */
+
+static char *
+auth_ntlm_authenticate(struct auth_t *auth)
+{
+	char *user, *domain, *token, *value = NULL, host[256], *dot;
+	unsigned char *c = auth->challenge, *msg = NULL, *blob = NULL;
+	unsigned char *info = NULL, *ubuf = NULL;
+	unsigned char nthash[MD4_SIZE], v2hash[MD5_SIZE], proof[MD5_SIZE];
+	unsigned char lm[24], cc[8], stamp[8];
+	size_t ulen, dlen, hlen, ilen = 0, blen, n, used, pos;
+	unsigned long flags;
+	uint64_t now;
+	int i;
+	
+	/* signature, type, target name, flags, challenge */
+	if (auth->clen < 32 || memcmp(c, "NTLMSSP", 8) != 0 ||
+		auth_get32(c + 8) != NTLM_CHALLENGE)
+	{
+		warnx("proxy sent an invalid NTLM challenge");
+		return NULL;
+	}
+	
+	flags = auth_get32(c + 20) & NTLM_FLAGS;
+	
+	/* target info, with the server time in it */
+	if (auth->clen >= 48) {
+		ilen = auth_get16(c + 40);
+		pos = auth_get32(c + 44);
+		if (pos > auth->clen || ilen > auth->clen - pos) {
+			warnx("proxy sent an invalid NTLM challenge");
+			return NULL;
+		}
+		info = c + pos;
+	}
+	
+	/* DOMAIN\user */
+	if ((user = strchr(auth->config->username, '\\'))) {
+		domain = auth->config->username;
+		dlen = user++ - domain;
+	} else {
+		user = auth->config->username;
+		domain = "";
+		dlen = 0;
+	}
+	ulen = strlen(user);
+	
+	if (gethostname(host, sizeof(host)) == -1)
+		strcpy(host, "PRCAT");
+	host[sizeof(host) - 1] = '\0';
+	if ((dot = strchr(host, '.')))
+		*dot = '\0';
+	hlen = strlen(host);
+	
+	n = strlen(auth->config->password);
+	if ((ubuf = malloc(2 * (n + ulen + dlen + hlen) + 2)) == NULL ||
+		(blob = malloc(28 + ilen + 4 + 8)) == NULL ||
+		(msg = malloc(64 + 2 * (ulen + dlen + hlen) + 24 + 16 +
+		28 + ilen + 4)) == NULL)
+	{
+		warn("malloc failed");
+		goto done;
+	}
+	
+	/* NT hash: MD4 of the password */
+	n = auth_unicode(auth->config->password, n, ubuf, 0);
+	md4(ubuf, n, nthash);
+	
+	/* NTLMv2 hash: HMAC of the upper case user, and the domain */
+	n = auth_unicode(user, ulen, ubuf, 1);
+	n += auth_unicode(domain, dlen, ubuf + n, 0);
+	md5_hmac(nthash, sizeof(nthash), ubuf, n, v2hash);
+	
+	if (getentropy(cc, sizeof(cc)) == -1) {
+		warn("can't get random bytes");
+		goto done;
+	}
+	
+	/* the server time if it sent it, or ours */
+	now = ((uint64_t)time(NULL) + NTLM_EPOCH) * 10000000;
+	for (i = 0; i < 8; ++i)
+		stamp[i] = now >> (i * 8);
+	for (pos = 0; info && pos + 4 <= ilen; pos += 4 + n) {
+		n = auth_get16(info + pos + 2);
+		if (auth_get16(info + pos) == NTLM_AV_EOL)
+			break;
+		if (auth_get16(info + pos) == NTLM_AV_TIMESTAMP && n == 8 &&
+			pos + 12 <= ilen)
+			memcpy(stamp, info + pos + 4, 8);
+	}
+	
+	/* blob: version, zero, time, client challenge, zero, target
+	 * info, zero; behind the server challenge for the proof */
+	memcpy(blob, c + 24, 8);
+	memset(blob + 8, 0, 28 + ilen + 4);
+	blob[8] = blob[9] = 1;
+	memcpy(blob + 16, stamp, 8);
+	memcpy(blob + 24, cc, 8);
+	if (ilen)
+		memcpy(blob + 36, info, ilen);
+	blen = 28 + ilen + 4;
+	md5_hmac(v2hash, sizeof(v2hash), blob, 8 + blen, proof);
+	
+	/* LMv2: the same for the client challenge only */
+	memcpy(lm, c + 24, 8);
+	memcpy(lm + 8, cc, 8);
+	md5_hmac(v2hash, sizeof(v2hash), lm, 16, lm);
+	memcpy(lm + 16, cc, 8);
+	
+	memset(msg, 0, 64);
+	memcpy(msg, "NTLMSSP", 8);
+	auth_le32(msg + 8, NTLM_AUTHENTICATE);
+	auth_le32(msg + 60, flags);
+	used = 64;
+	
+	n = auth_unicode(domain, dlen, ubuf, 0);
+	auth_secbuf(msg, &used, 28, ubuf, n);
+	n = auth_unicode(user, ulen, ubuf, 0);
+	auth_secbuf(msg, &used, 36, ubuf, n);
+	n = auth_unicode(host, hlen, ubuf, 1);
+	auth_secbuf(msg, &used, 44, ubuf, n);
+	auth_secbuf(msg, &used, 12, lm, sizeof(lm));
+	
+	/* NTLMv2 response: the proof, followed by the blob */
+	auth_le16(msg + 20, MD5_SIZE + blen);
+	auth_le16(msg + 22, MD5_SIZE + blen);
+	auth_le32(msg + 24, used);
+	memcpy(msg + used, proof, MD5_SIZE);
+	memcpy(msg + used + MD5_SIZE, blob + 8, blen);
+	used += MD5_SIZE + blen;
+	
+	/* no session key */
+	auth_le32(msg + 56, used);
+	
+	if ((token = base64_encode(msg, used)) == NULL)
+		goto done;
+	
+	if ((value = malloc(strlen(token) + 6)) != NULL)
+		stpcpy(stpcpy(value, "NTLM "), token);
+	
+	free(token);
+	
+done:
+	free(ubuf);
+	free(blob);
+	free(msg);
+	
+	return value;
+}
+
+/*
+ * Compose the next CONNECT request in the empty buffer, with the answer
+ * to the challenge the proxy sent, if any. Returns 0 if OK, -1 on error.
+ */
+
+static int
+auth_request(struct buffer_t *b, struct auth_t *auth)
+{
+	int slen;
+	char *value = NULL;
+	struct config_t *config = auth->config;
+	
+	if (config->auth == AUTH_DIGEST && auth->digest)
+		value = auth_digest(auth);
+	else if (config->auth == AUTH_NTLM && auth->challenge)
+		value = auth_ntlm_authenticate(auth);
+	else if (config->auth == AUTH_NTLM)
+		value = auth_ntlm_negotiate();
+	
+	if ((auth->digest || config->auth == AUTH_NTLM) && !value)
+		return -1;
+	
+	buffer_reset(b);
+	
+	slen = snprintf(b->data, b->size,
+		"CONNECT %s:%i HTTP/1.1\r\n"
+		"Host: %s:%i\r\n"
+		"Proxy-Connection: keep-alive\r\n"
+		"%s%s%s"
+		"\r\n", config->hostname, config->hostport,
+		config->hostname, config->hostport,
+		value ? "Proxy-Authorization: " : "",
+		value ? value : "", value ? "\r\n" : "");
+	
+	free(value);
+	
+	if (slen >= b->size) {
+		warnx("http send headers too long");
+		return -1;
+	}
+	
+	buffer_commit(b, slen);
+	
+	return 0;
+}
+
+/*
+ * Take what is needed from one header of a response; called by the
+ * parser, see proxy_parser_init.
+ */
+
+static void
+auth_header(void *arg, char *name, char *value)
+{
+	struct auth_t *auth = arg;
+	int scheme = auth->config->auth;
+	
+	if (strcasecmp(name, "Proxy-Authenticate") != 0) {
+		return;
+	} else if (scheme == AUTH_DIGEST &&
+		strncasecmp(value, "Digest ", 7) == 0) {
+		if (auth_digest_parse(value + 7, &auth->d) == 0) {
+			auth->offered = 1;
+			auth->digest = 1;
+		}
+	} else if (scheme == AUTH_NTLM && strncasecmp(value, "NTLM", 4) == 0
+		&& (value[4] == '\0' || value[4] == ' ')) {
+		auth->offered = 1;
+		if (value[4] && !auth->challenge)
+			auth->challenge = base64_decode(value + 5, &auth->clen);
+	}
+}
+
+/*
+ * Open the tunnel on a connected proxy socket, authenticating with
+ * Digest or NTLM as in config->auth.
+ *
+ * A cached Digest challenge is answered right away. Otherwise the
+ * proxy challenges the first request, and the request is sent again
+ * with the answer, on the same connection if the proxy keeps it open
+ * (the body of the 407, by Content-Length or chunked, is dropped). If
+ * it doesn't, AUTH_RECONNECT is returned, and the caller connects
+ * again and calls auth_connect for the new connection, which answers
+ * the challenge that was cached. NTLM can't continue on another
+ * connection.
+ *
+ * Returns 0 if the tunnel is open, with any data that followed the
+ * response in the buffer, AUTH_RECONNECT, or -1 on error.
+ */
+
+int
+auth_connect(int sock, struct buffer_t *b, struct config_t *config)
+{
+	int round, status = -1;
+	struct auth_t auth;
+	
+	memset(&auth, 0, sizeof(auth));
+	auth.config = config;
+	
+	if (config->auth == AUTH_DIGEST)
+		auth.digest = (auth_cache(config, &auth.d, 0) == 0);
+	
+	for (round = 0; round < AUTH_ROUNDS; ++round)
+	{
+		if (auth_request(b, &auth) == -1)
+			break;
+		
+		if (write(sock, b->data, b->len) != b->len) {
+			warn("http send headers failed");
+			break;
+		}
+		
+		auth.offered = 0;
+		proxy_parser_init(&auth.parser, auth_header, &auth);
+		
+		if (proxy_read(sock, b, &auth.parser) == PROXY_OK) {
+			status = 0;
+			break;
+		}
+		
+		if (auth.parser.status != 407)
+			break;
+		
+		if (!auth.offered) {
+			warnx("proxy connect failed: proxy does not offer "
+				"%s authentication", config->auth == AUTH_NTLM
+				? "NTLM" : "Digest");
+			break;
+		}
+		
+		/* a fresh challenge is answered; a second one after an
+		 * answer means the credentials are wrong, unless the
+		 * nonce was just stale */
+		if (config->auth == AUTH_DIGEST) {
+			if (round > 0 && !auth.d.stale) {
+				warnx("proxy connect failed: authentication "
+					"failed");
+				break;
+			}
+			auth.d.nc = 1;
+			auth_cache(config, &auth.d, 1);
+		} else if (!auth.challenge || round > 0) {
+			warnx("proxy connect failed: authentication failed");
+			break;
+		}
+		
+		/* drop the body, to send the answer on this connection */
+		if (proxy_drain(sock, b, &auth.parser) == -1) {
+			if (config->auth == AUTH_DIGEST)
+				status = AUTH_RECONNECT;
+			else
+				warnx("proxy closed the connection during NTLM "
+					"authentication");
+			break;
+		}
+	}
+	
+	free(auth.challenge);
+	
+	return status;
+}
@@ -30,6 +30,8 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include "base64.h"
+
 /* base64 characters */
 static char b64chars[] = {
 	'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M',
@@ -42,15 +44,19 @@ static char b64chars[] = {
 /* return base64 encoded string */
 char *
 base64(char *s)
+{
+	return base64_encode(s, strlen(s));
+}
+
+/* return base64 encoded string of slen bytes of binary data */
+char *
+base64_encode(const void *data, size_t slen)
 {
 	int i, j, blen;
-	size_t slen;
 	unsigned int bits = 0;
 	unsigned char tmp[4];
+	const unsigned char *s = data;
 	char *out;
-
-	/* length of s(tring) */
-	slen = strlen(s);
 	
 	/* function does not handle a buffer > INT_MAX;
 	 * check max length we can allocate a buffer for */
@@ -115,3 +121,47 @@ base64(char *s)
 	return out;
 }
 
+/* return the decoded data of a base64 string, and set *len to its length;
+ * decoding stops at the first character that is not base64 */
+unsigned char *
+base64_decode(char *s, size_t *len)
+{
+	int n;
+	size_t i, slen;
+	unsigned int bits = 0;
+	unsigned char *out;
+	char *p;
+
+	slen = strlen(s);
+
+	/* 3 bytes for every 4 characters, rounded up */
+	if ((out = malloc((slen / 4 + 1) * 3)) == NULL) {
+		warn("base64: malloc failed");
+		return NULL;
+	}
+
+	for (i = 0, n = 0, *len = 0; i < slen; i++) {
+		if ((p = memchr(b64chars, s[i], sizeof(b64chars))) == NULL)
+			break;
+
+		bits = (bits << 6) | (p - b64chars);
+
+		if (++n == 4) {
+			out[(*len)++] = (bits >> 16) & 0xff;
+			out[(*len)++] = (bits >> 8) & 0xff;
+			out[(*len)++] = bits & 0xff;
+			bits = 0;
+			n = 0;
+		}
+	}
+
+	/* 2 or 3 characters before the padding */
+	if (n == 2) {
+		out[(*len)++] = (bits >> 4) & 0xff;
+	} else if (n == 3) {
+		out[(*len)++] = (bits >> 10) & 0xff;
+		out[(*len)++] = (bits >> 2) & 0xff;
+	}
+
+	return out;
+}
@@ -26,6 +26,10 @@
 #ifndef _BASE64_H_
 #define _BASE64_H_
 
+#include <sys/types.h>
+
 char *base64(char *s);
+char *base64_encode(const void *data, size_t len);
+unsigned char *base64_decode(char *s, size_t *len);
 
 #endif /* _BASE64_H_ */
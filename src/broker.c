@@ -0,0 +1,867 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broker.h"
+#include "buffer.h"
+#include "connect.h"
+#include "event.h"
+#include "proxy.h"
+#include "setup.h"
+
+/*
+ * The broker keeps a pool of warm sockets, connected to the proxy, and
+ * hands them to prcat clients over a Unix socket.
+ *
+ * A client sends one line, "<hostname> <port>\n", and gets back one
+ * status byte. With BROKER_REPLY_CONNECT, the broker has already sent
+ * the CONNECT request for the client on the socket that comes with it
+ * (SCM_RIGHTS), and the client only reads the response. With
+ * BROKER_REPLY_TUNNEL, the socket is a tunnel the broker opened ahead
+ * of time, and the response was read already. With BROKER_REPLY_ERROR
+ * there is no socket, and the client connects by itself.
+ *
+ * The broker sends the CONNECT itself, so clients don't need the proxy
+ * credentials, and never prompt for a password.
+ */
+
+#define BROKER_REPLY_CONNECT	'C'	/* CONNECT sent, read response */
+#define BROKER_REPLY_TUNNEL	'T'	/* tunnel is open */
+#define BROKER_REPLY_ERROR	'E'	/* no socket available */
+
+/* longest hostname in a request line, plus '\0' */
+#define BROKER_HOST_SIZE	256
+
+#ifndef BROKER_BACKLOG
+#define BROKER_BACKLOG 64
+#endif
+
+/* max events handled per wakeup */
+#ifndef BROKER_EVENTS
+#define BROKER_EVENTS 64
+#endif
+
+/* destinations remembered for prefetching */
+#ifndef BROKER_HISTORY
+#define BROKER_HISTORY 32
+#endif
+
+/* halve the history counts every so many requests */
+#ifndef BROKER_DECAY
+#define BROKER_DECAY 64
+#endif
+
+/* seconds a prefetched tunnel is kept before it is reopened */
+#ifndef BROKER_TUNNEL_AGE
+#define BROKER_TUNNEL_AGE 30
+#endif
+
+/* milliseconds between housekeeping rounds when idle */
+#define BROKER_TICK 1000
+
+/* connection states */
+#define BROKER_FREE		0	/* slot is not in use */
+#define BROKER_CONNECTING	1	/* connecting to the proxy */
+#define BROKER_READY		2	/* warm socket, can be handed out */
+#define BROKER_REQUEST		3	/* prefetch: sending CONNECT */
+#define BROKER_RESPONSE		4	/* prefetch: reading the response */
+#define BROKER_OPEN		5	/* prefetch: tunnel is open */
+#define BROKER_CLIENT		6	/* client: reading its request */
+
+/* a socket to the proxy, or a client */
+typedef struct broker_conn_t {
+	int fd;
+	int state;			/* BROKER_* state */
+	time_t since;			/* tunnel opened at */
+	struct tcp_race_t race;		/* connecting to the proxy */
+	struct proxy_parser_t parser;	/* parser of the response */
+	char host[BROKER_HOST_SIZE];	/* prefetch destination */
+	int port;
+	struct buffer_t b;		/* request or response */
+} broker_conn_t;
+
+/* a destination clients asked for */
+typedef struct broker_dest_t {
+	char host[BROKER_HOST_SIZE];
+	int port;
+	unsigned long count;		/* recent requests */
+} broker_dest_t;
+
+typedef struct broker_t {
+	struct config_t *config;
+	struct tcp_addr_t addrs[TCP_MAX_ADDRS];	/* of the proxy */
+	int naddrs;
+	struct event_t ev;
+	int lfd;			/* listening Unix socket */
+	int npool;
+	struct broker_conn_t *pool;	/* warm sockets */
+	int ntunnels;
+	struct broker_conn_t *tunnels;	/* prefetched tunnels */
+	unsigned long requests;
+	time_t retry;			/* no new connections before */
+	struct broker_dest_t history[BROKER_HISTORY];
+} broker_t;
+
+static volatile sig_atomic_t broker_stop;
+
+/*
+ * Make the socket at path a Unix socket address. Returns 0 if OK, -1
+ * if the path does not fit.
+ */
+
+static int
+broker_address(char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		warnx("%s: socket path too long", path);
+		return -1;
+	}
+	
+	strcpy(addr->sun_path, path);
+	
+	return 0;
+}
+
+/*
+ * Ask the broker at path for a socket to the proxy, to open a tunnel
+ * to hostname:hostport. Sets *tunnel to 1 if the tunnel is open already,
+ * or 0 if the CONNECT was sent, and the response must still be read.
+ *
+ * Returns the socket, or -1 if the broker can't help; the caller then
+ * connects to the proxy by itself. Only unexpected errors are reported,
+ * not a broker that isn't running.
+ */
+
+int
+broker_request(char *path, char *hostname, int hostport, int *tunnel)
+{
+	int fd, sock = -1;
+	char status, line[BROKER_HOST_SIZE + 8];
+	char control[CMSG_SPACE(sizeof(int))];
+	struct sockaddr_un addr;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int len;
+	
+	if (broker_address(path, &addr) == -1)
+		return -1;
+	
+	len = snprintf(line, sizeof(line), "%s %i\n", hostname, hostport);
+	if (len < 0 || len >= sizeof(line)) {
+		warnx("broker: hostname too long");
+		return -1;
+	}
+	
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		warn("broker: socket() call failed");
+		return -1;
+	}
+	
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		if (errno != ENOENT && errno != ECONNREFUSED)
+			warn("broker: failed to connect to %s", path);
+		close(fd);
+		return -1;
+	}
+	
+	if (write(fd, line, len) != len) {
+		warn("broker: request failed");
+		close(fd);
+		return -1;
+	}
+	
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &status;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	
+	if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1) {
+		warnx("broker: no reply");
+		close(fd);
+		return -1;
+	}
+	
+	close(fd);
+	
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+		cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&sock, CMSG_DATA(cmsg), sizeof(int));
+	
+	if (sock != -1 && status != BROKER_REPLY_CONNECT &&
+		status != BROKER_REPLY_TUNNEL)
+	{
+		close(sock);
+		sock = -1;
+	}
+	
+	*tunnel = (status == BROKER_REPLY_TUNNEL);
+	
+	return sock;
+}
+
+/*
+ * Signal handler: stop the broker.
+ */
+
+static void
+broker_signal(int sig)
+{
+	broker_stop = 1;
+}
+
+/*
+ * Close a connection, and free its slot.
+ */
+
+static void
+broker_close(struct broker_t *br, struct broker_conn_t *c)
+{
+	if (c->state == BROKER_CONNECTING)
+		tcp_race_end(&c->race, &br->ev);
+	else if (c->fd != -1) {
+		event_del(&br->ev, c->fd);
+		close(c->fd);
+	}
+	
+	c->fd = -1;
+	c->state = BROKER_FREE;
+}
+
+/*
+ * Start racing the addresses of the proxy for a pool slot, see
+ * tcp_race_step. Prefetch slots must have their destination set.
+ * After a failure, the proxy gets a rest until the next tick.
+ */
+
+static void
+broker_dial(struct broker_t *br, struct broker_conn_t *c)
+{
+	if (time(NULL) < br->retry)
+		return;
+	
+	tcp_race_init(&c->race, br->addrs, br->naddrs);
+	
+	if (tcp_race_step(&c->race, &br->ev, c, -1) == -1) {
+		warn("broker: failed to connect to proxy");
+		br->retry = time(NULL) + 1;
+		return;
+	}
+	
+	c->state = BROKER_CONNECTING;
+}
+
+/*
+ * Check if a socket to the proxy is still there, without reading from
+ * it. A warm socket must have nothing to read; a tunnel may have data
+ * from the destination waiting.
+ */
+
+static int
+broker_alive(struct broker_conn_t *c, int tunnel)
+{
+	char byte;
+	ssize_t n;
+	
+	n = recv(c->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+	
+	if (n == -1)
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+	
+	return n == 1 && tunnel;
+}
+
+/*
+ * Remember that a client asked for host:port. Counts are halved now
+ * and then, so the history follows what clients use lately.
+ */
+
+static void
+broker_remember(struct broker_t *br, char *host, int port)
+{
+	int n, victim = 0;
+	struct broker_dest_t *d = br->history;
+	
+	if (++br->requests % BROKER_DECAY == 0)
+		for (n = 0; n < BROKER_HISTORY; ++n)
+			d[n].count /= 2;
+	
+	for (n = 0; n < BROKER_HISTORY; ++n) {
+		if (d[n].count && d[n].port == port &&
+			strcmp(d[n].host, host) == 0)
+		{
+			++d[n].count;
+			return;
+		}
+		if (d[n].count < d[victim].count)
+			victim = n;
+	}
+	
+	/* replace the least used destination */
+	strcpy(d[victim].host, host);
+	d[victim].port = port;
+	d[victim].count = 1;
+}
+
+/*
+ * Forget host:port, after a tunnel to it could not be opened.
+ */
+
+static void
+broker_forget(struct broker_t *br, char *host, int port)
+{
+	int n;
+	
+	for (n = 0; n < BROKER_HISTORY; ++n)
+		if (br->history[n].port == port &&
+			strcmp(br->history[n].host, host) == 0)
+			br->history[n].count = 0;
+}
+
+/*
+ * Pass fd to a client, with the given status byte. With fd -1, only
+ * the status is sent. The caller closes its copy of fd.
+ */
+
+static void
+broker_send(int client, char status, int fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = &status;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	
+	if (fd != -1) {
+		/* the client expects a blocking socket */
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	
+	if (sendmsg(client, &msg, MSG_NOSIGNAL) != 1)
+		warn("broker: reply failed");
+}
+
+/*
+ * Serve a client that wants a tunnel to host:port: hand it a tunnel
+ * that was opened already, or a warm socket with the CONNECT request
+ * sent on it.
+ */
+
+static void
+broker_serve(struct broker_t *br, struct broker_conn_t *client,
+	char *host, int port)
+{
+	int n;
+	struct broker_conn_t *c;
+	struct config_t *config = br->config;
+	
+	broker_remember(br, host, port);
+	
+	/* a prefetched tunnel */
+	for (n = 0; n < br->ntunnels; ++n)
+	{
+		c = &br->tunnels[n];
+		
+		if (c->state != BROKER_OPEN || c->port != port ||
+			strcmp(c->host, host) != 0)
+			continue;
+		
+		if (!broker_alive(c, 1)) {
+			broker_close(br, c);
+			continue;
+		}
+		
+		broker_send(client->fd, BROKER_REPLY_TUNNEL, c->fd);
+		broker_close(br, c);
+		return;
+	}
+	
+	/* a warm socket */
+	for (n = 0; n < br->npool; ++n)
+	{
+		c = &br->pool[n];
+		
+		if (c->state != BROKER_READY)
+			continue;
+		
+		if (!broker_alive(c, 0)) {
+			broker_close(br, c);
+			continue;
+		}
+		
+		/* the request is small and the socket is idle, so it
+		 * is written at once */
+		if (proxy_request(&client->b, host, port, config->username,
+			config->password) == -1 ||
+			write(c->fd, client->b.data, client->b.len) !=
+			client->b.len)
+		{
+			broker_close(br, c);
+			break;
+		}
+		
+		broker_send(client->fd, BROKER_REPLY_CONNECT, c->fd);
+		broker_close(br, c);
+		return;
+	}
+	
+	broker_send(client->fd, BROKER_REPLY_ERROR, -1);
+}
+
+/*
+ * Read the request line of a client, and serve it once it is complete.
+ * Returns 0 if the line is not complete yet, -1 if the client is done
+ * with and must be closed.
+ */
+
+static int
+broker_client(struct broker_t *br, struct broker_conn_t *c)
+{
+	int port;
+	ssize_t n;
+	char host[BROKER_HOST_SIZE];
+	
+	n = read(c->fd, c->b.data + c->b.len, buffer_room(&c->b) - 1);
+	
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (n <= 0)
+		return -1;
+	
+	buffer_commit(&c->b, n);
+	c->b.data[c->b.len] = '\0';
+	
+	if (strchr(c->b.data, '\n') == NULL)
+		return (buffer_room(&c->b) > 1) ? 0 : -1;
+	
+	if (sscanf(c->b.data, "%255s %i", host, &port) != 2) {
+		warnx("broker: invalid request");
+		return -1;
+	}
+	
+	broker_serve(br, c, host, port);
+	
+	return -1;
+}
+
+/*
+ * Accept all pending clients.
+ */
+
+static void
+broker_accept(struct broker_t *br)
+{
+	int fd;
+	struct broker_conn_t *c;
+	
+	while ((fd = accept(br->lfd, NULL, NULL)) != -1)
+	{
+		if ((c = calloc(1, sizeof(broker_conn_t))) == NULL ||
+			buffer_init(&c->b, BUFFER_MIN_SIZE) == -1)
+		{
+			warn("broker: client allocation failed");
+			free(c);
+			close(fd);
+			continue;
+		}
+		
+		c->fd = fd;
+		c->state = BROKER_CLIENT;
+		
+		if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+			fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+			event_add(&br->ev, fd, EVENT_READ, c) == -1)
+		{
+			warn("broker: can't watch client");
+			close(fd);
+			buffer_free(&c->b);
+			free(c);
+		}
+	}
+}
+
+/*
+ * Handle an event of fd on a socket to the proxy, or of one of the
+ * attempts to connect it. While connecting, fd is -1 when the next
+ * attempt is due.
+ */
+
+static void
+broker_process(struct broker_t *br, struct broker_conn_t *c, int fd)
+{
+	ssize_t n;
+	int status;
+	struct config_t *config = br->config;
+	
+	/* an attempt that lost the race, earlier in this wakeup */
+	if (c->state != BROKER_CONNECTING && fd != c->fd)
+		return;
+	
+	switch (c->state)
+	{
+	case BROKER_CONNECTING:
+		if ((c->fd = tcp_race_step(&c->race, &br->ev, c, fd)) ==
+			TCP_PENDING)
+		{
+			c->fd = -1;
+			return;
+		}
+		if (c->fd == -1) {
+			warn("broker: failed to connect to proxy");
+			br->retry = time(NULL) + 1;
+			if (c->host[0])
+				broker_forget(br, c->host, c->port);
+			broker_close(br, c);
+			return;
+		}
+		if (!c->host[0]) {
+			/* warm socket: readable means it was closed */
+			c->state = BROKER_READY;
+			event_mod(&br->ev, c->fd, EVENT_READ, c);
+			return;
+		}
+		if (proxy_request(&c->b, c->host, c->port, config->username,
+			config->password) == -1)
+		{
+			broker_close(br, c);
+			return;
+		}
+		c->state = BROKER_REQUEST;
+		/* FALLTHROUGH */
+	case BROKER_REQUEST:
+		if (buffer_writev(&c->b, c->fd) == -1 && errno != EAGAIN) {
+			broker_close(br, c);
+			return;
+		}
+		if (c->b.len)
+			return;
+		buffer_reset(&c->b);
+		proxy_parser_init(&c->parser, NULL, NULL);
+		c->state = BROKER_RESPONSE;
+		event_mod(&br->ev, c->fd, EVENT_READ, c);
+		return;
+	case BROKER_RESPONSE:
+		/* read byte by byte, to leave any data that follows the
+		 * headers in the socket for the client */
+		while ((n = read(c->fd, c->b.data + c->b.len, 1)) == 1)
+		{
+			buffer_commit(&c->b, 1);
+			status = proxy_response(&c->b, &c->parser);
+			if (status == PROXY_MORE)
+				continue;
+			if (status == PROXY_ERROR) {
+				broker_forget(br, c->host, c->port);
+				broker_close(br, c);
+				return;
+			}
+			/* not interested in events until handed out */
+			c->state = BROKER_OPEN;
+			c->since = time(NULL);
+			event_mod(&br->ev, c->fd, 0, c);
+			return;
+		}
+		if (n == 0 || (errno != EAGAIN && errno != EINTR))
+			broker_close(br, c);
+		return;
+	default:
+		/* warm socket got closed, or sent something */
+		broker_close(br, c);
+		return;
+	}
+}
+
+/*
+ * Refill the pool, reopen expired tunnels, and prefetch tunnels to the
+ * destinations that were used most lately (at least twice).
+ */
+
+static void
+broker_refill(struct broker_t *br)
+{
+	int n, m, k, best;
+	time_t now = time(NULL);
+	struct broker_conn_t *c;
+	struct broker_dest_t *d = br->history;
+	
+	for (n = 0; n < br->npool; ++n)
+		if (br->pool[n].state == BROKER_FREE)
+			broker_dial(br, &br->pool[n]);
+	
+	for (n = 0; n < br->ntunnels; ++n)
+	{
+		c = &br->tunnels[n];
+		
+		if (c->state == BROKER_OPEN &&
+			now - c->since > BROKER_TUNNEL_AGE)
+			broker_close(br, c);
+		
+		if (c->state != BROKER_FREE)
+			continue;
+		
+		/* pick the most used destination without a tunnel */
+		for (best = -1, m = 0; m < BROKER_HISTORY; ++m)
+		{
+			if (d[m].count < 2 ||
+				(best != -1 && d[m].count <= d[best].count))
+				continue;
+			
+			for (k = 0; k < br->ntunnels; ++k)
+				if (br->tunnels[k].state != BROKER_FREE &&
+					br->tunnels[k].port == d[m].port &&
+					strcmp(br->tunnels[k].host,
+					d[m].host) == 0)
+					break;
+			
+			if (k == br->ntunnels)
+				best = m;
+		}
+		
+		if (best == -1)
+			return;
+		
+		strcpy(c->host, d[best].host);
+		c->port = d[best].port;
+		broker_dial(br, c);
+	}
+}
+
+/*
+ * Start the next attempts of the races that are due, and return the
+ * ms until the next one, at most BROKER_TICK.
+ */
+
+static int
+broker_race(struct broker_t *br)
+{
+	int n;
+	long long left, wait = BROKER_TICK;
+	struct broker_conn_t *c;
+	
+	for (n = 0; n < br->npool + br->ntunnels; ++n)
+	{
+		c = (n < br->npool) ? &br->pool[n] :
+			&br->tunnels[n - br->npool];
+		
+		if (c->state != BROKER_CONNECTING)
+			continue;
+		
+		if (tcp_race_wait(&c->race) == 0)
+			broker_process(br, c, -1);
+		
+		if (c->state == BROKER_CONNECTING &&
+			(left = tcp_race_wait(&c->race)) != -1 && left < wait)
+			wait = left;
+	}
+	
+	return (int)wait;
+}
+
+/*
+ * Create the listening Unix socket at path, replacing a stale one.
+ * Only the user can connect to it. Returns the socket, or -1.
+ */
+
+static int
+broker_listen(char *path)
+{
+	int fd;
+	mode_t mask;
+	struct stat st;
+	struct sockaddr_un addr;
+	
+	if (broker_address(path, &addr) == -1)
+		return -1;
+	
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		warn("broker: socket() call failed");
+		return -1;
+	}
+	
+	mask = umask(077);
+	
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+		listen(fd, BROKER_BACKLOG) == -1 ||
+		fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+		fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+	{
+		warn("broker: can't listen on %s", path);
+		umask(mask);
+		close(fd);
+		return -1;
+	}
+	
+	umask(mask);
+	
+	return fd;
+}
+
+/*
+ * Run the broker on config->broker until SIGINT or SIGTERM.
+ *
+ * Keeps config->pool sockets connected to the proxy, and opens tunnels
+ * ahead of time to the config->prefetch destinations that clients used
+ * most lately. A warm socket that the proxy closes is replaced; a
+ * prefetched tunnel is reopened after BROKER_TUNNEL_AGE seconds, so it
+ * does not go stale at the destination.
+ *
+ * Returns an exit code.
+ */
+
+int
+broker_handler(struct config_t *config)
+{
+	int n, nready, wait;
+	struct broker_t br;
+	struct sigaction sa;
+	struct broker_conn_t *c;
+	struct event_item_t ready[BROKER_EVENTS];
+	
+	memset(&br, 0, sizeof(br));
+	br.config = config;
+	br.npool = config->pool;
+	br.ntunnels = config->prefetch;
+	
+	/* resolve the proxy once; every slot races its addresses */
+	if ((br.naddrs = tcp_addrs(config->proxyname, config->proxyport,
+		br.addrs, TCP_MAX_ADDRS)) == -1)
+		return EX_UNAVAILABLE;
+	
+	/* + 1: calloc(0) may return NULL */
+	br.pool = calloc(br.npool, sizeof(broker_conn_t));
+	br.tunnels = calloc(br.ntunnels + 1, sizeof(broker_conn_t));
+	if (br.pool == NULL || br.tunnels == NULL) {
+		warn("broker: allocation failed");
+		return EX_OSERR;
+	}
+	
+	for (n = 0; n < br.npool; ++n)
+		br.pool[n].fd = -1;
+	
+	for (n = 0; n < br.ntunnels; ++n) {
+		br.tunnels[n].fd = -1;
+		if (buffer_init(&br.tunnels[n].b, BUFFER_T_SIZE) == -1) {
+			warn("broker: buffer allocation failed");
+			return EX_OSERR;
+		}
+	}
+	
+	if (event_init(&br.ev) == -1) {
+		warn("event init failed");
+		return EX_OSERR;
+	}
+	
+	if ((br.lfd = broker_listen(config->broker)) == -1)
+		return EX_UNAVAILABLE;
+	
+	if (event_add(&br.ev, br.lfd, EVENT_READ, NULL) == -1) {
+		warn("can't watch listening socket");
+		return EX_OSERR;
+	}
+	
+	/* stop on SIGINT and SIGTERM, without restarting event_wait */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = broker_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	
+	while (!broker_stop)
+	{
+		broker_refill(&br);
+		wait = broker_race(&br);
+		
+		nready = event_wait(&br.ev, ready, BROKER_EVENTS, wait);
+		
+		if (nready == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("event wait failed");
+			break;
+		}
+		
+		for (n = 0; n < nready; ++n)
+		{
+			if ((c = ready[n].data) == NULL)
+				broker_accept(&br);
+			else if (c->state != BROKER_CLIENT)
+				broker_process(&br, c, ready[n].fd);
+			else if (broker_client(&br, c) == -1) {
+				broker_close(&br, c);
+				buffer_free(&c->b);
+				free(c);
+			}
+		}
+	}
+	
+	unlink(config->broker);
+	
+	return broker_stop ? EX_OK : EX_IOERR;
+}
@@ -28,12 +28,241 @@
  * THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #include "buffer.h"
 
+/*
+ * Initialize a buffer_t structure for first use, with room for size
+ * bytes. Returns 0 if OK, -1 if allocation failed.
+ */
+
+int
+buffer_init(struct buffer_t *buffer, size_t size)
+{
+	buffer->head = 0;
+	buffer->len = 0;
+	buffer->size = size;
+	
+	if ((buffer->data = malloc(size)) == NULL) {
+		buffer->size = 0;
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Free the storage of a buffer_t structure.
+ */
+
+void
+buffer_free(struct buffer_t *buffer)
+{
+	free(buffer->data);
+	buffer->data = NULL;
+	buffer->size = 0;
+	buffer->head = 0;
+	buffer->len = 0;
+}
+
+/*
+ * Drop all stored data, and start over at the beginning.
+ */
+
+void
+buffer_reset(struct buffer_t *buffer)
+{
+	buffer->head = 0;
+	buffer->len = 0;
+}
+
+/*
+ * Change the size of the storage. The stored data is kept, and moved
+ * to the beginning of the new storage. The new size must be able to
+ * hold the stored data.
+ *
+ * Returns 0 if OK, -1 on error (the buffer is left untouched).
+ */
+
+int
+buffer_resize(struct buffer_t *buffer, size_t size)
+{
+	int n, iovcnt;
+	char *data, *dp;
+	struct iovec iov[2];
+	
+	if (size < buffer->len) {
+		errno = EINVAL;
+		return -1;
+	}
+	
+	if ((data = malloc(size)) == NULL)
+		return -1;
+	
+	/* copy the stored data in order */
+	iovcnt = buffer_data_iov(buffer, iov);
+	for (n = 0, dp = data; n < iovcnt; dp += iov[n].iov_len, ++n)
+		memcpy(dp, iov[n].iov_base, iov[n].iov_len);
+	
+	free(buffer->data);
+	buffer->data = data;
+	buffer->size = size;
+	buffer->head = 0;
+	
+	return 0;
+}
+
+/*
+ * Returns the amount of bytes that can still be stored.
+ */
+
+size_t
+buffer_room(struct buffer_t *buffer)
+{
+	return buffer->size - buffer->len;
+}
+
+/*
+ * Point iov at the stored data, in order. The data wraps around at the
+ * end of the buffer, so this can take two iovecs.
+ *
+ * Returns the amount of iovecs used (0 if the buffer is empty).
+ */
+
+int
+buffer_data_iov(struct buffer_t *buffer, struct iovec *iov)
+{
+	size_t first;
+	
+	if (buffer->len == 0)
+		return 0;
+	
+	/* from head up to the end of data, or the end of the buffer */
+	first = buffer->size - buffer->head;
+	if (first >= buffer->len) {
+		iov[0].iov_base = buffer->data + buffer->head;
+		iov[0].iov_len = buffer->len;
+		return 1;
+	}
+	
+	iov[0].iov_base = buffer->data + buffer->head;
+	iov[0].iov_len = first;
+	iov[1].iov_base = buffer->data;
+	iov[1].iov_len = buffer->len - first;
+	
+	return 2;
+}
+
+/*
+ * Point iov at the free space after the stored data, in order. This
+ * can take two iovecs, just like the data.
+ *
+ * Returns the amount of iovecs used (0 if the buffer is full).
+ */
+
+int
+buffer_room_iov(struct buffer_t *buffer, struct iovec *iov)
+{
+	size_t tail;
+	
+	if (buffer->len == buffer->size)
+		return 0;
+	
+	/* offset of the first free byte */
+	tail = buffer->head + buffer->len;
+	if (tail >= buffer->size) {
+		tail -= buffer->size;
+		iov[0].iov_base = buffer->data + tail;
+		iov[0].iov_len = buffer->head - tail;
+		return 1;
+	}
+	
+	iov[0].iov_base = buffer->data + tail;
+	iov[0].iov_len = buffer->size - tail;
+	
+	if (buffer->head == 0)
+		return 1;
+	
+	iov[1].iov_base = buffer->data;
+	iov[1].iov_len = buffer->head;
+	
+	return 2;
+}
+
+/*
+ * Add len bytes that were put in the free space to the stored data.
+ */
+
+void
+buffer_commit(struct buffer_t *buffer, size_t len)
+{
+	buffer->len += len;
+}
+
+/*
+ * Remove len bytes from the start of the stored data. The free space
+ * does not move, so a read into it may still be in flight.
+ */
+
 void
-buffer_init(struct buffer_t *buffer)
+buffer_consume(struct buffer_t *buffer, size_t len)
+{
+	buffer->len -= len;
+	buffer->head += len;
+	if (buffer->head >= buffer->size)
+		buffer->head -= buffer->size;
+}
+
+/*
+ * Read as much data from fd as fits in the buffer, with one readv(2).
+ *
+ * Returns the result of readv: the number of bytes read, 0 on EOF or
+ * if the buffer is full, -1 on error.
+ */
+
+ssize_t
+buffer_readv(struct buffer_t *buffer, int fd)
 {
-	buffer->s_len = 0;
-	buffer->w_len = 0;
+	int iovcnt;
+	ssize_t nread;
+	struct iovec iov[2];
+	
+	if ((iovcnt = buffer_room_iov(buffer, iov)) == 0)
+		return 0;
+	
+	if ((nread = readv(fd, iov, iovcnt)) > 0)
+		buffer_commit(buffer, nread);
+	
+	return nread;
 }
 
+/*
+ * Write as much stored data to fd as it takes, with one writev(2).
+ * A short write leaves the rest of the data in the buffer.
+ *
+ * Returns the result of writev: the number of bytes written, -1 on
+ * error. Returns 0 if the buffer is empty.
+ */
+
+ssize_t
+buffer_writev(struct buffer_t *buffer, int fd)
+{
+	int iovcnt;
+	ssize_t nwritten;
+	struct iovec iov[2];
+	
+	if ((iovcnt = buffer_data_iov(buffer, iov)) == 0)
+		return 0;
+	
+	if ((nwritten = writev(fd, iov, iovcnt)) > 0)
+		buffer_consume(buffer, nwritten);
+	
+	return nwritten;
+}
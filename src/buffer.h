@@ -31,16 +31,38 @@
 #ifndef _BUFFER_H_
 #define _BUFFER_H_
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* default buffer size */
 #ifndef BUFFER_T_SIZE
 #define BUFFER_T_SIZE 4096
 #endif /* BUFFER_T_SIZE */
 
+/* limits for runtime buffer sizes */
+#define BUFFER_MIN_SIZE 1024
+#define BUFFER_MAX_SIZE (64 * 1024 * 1024)
+
+/* ring buffer: stored data starts at head and may wrap around */
 typedef struct buffer_t {
-	char data[BUFFER_T_SIZE];
-	short s_len;	/* bytes stored */
-	short w_len;	/* bytes written */
+	char *data;	/* malloc'ed storage */
+	size_t size;	/* size of storage */
+	size_t head;	/* offset of first stored byte */
+	size_t len;	/* bytes stored */
 } buffer_t;
 
-void buffer_init(struct buffer_t *buffer);
+int buffer_init(struct buffer_t *buffer, size_t size);
+void buffer_free(struct buffer_t *buffer);
+void buffer_reset(struct buffer_t *buffer);
+int buffer_resize(struct buffer_t *buffer, size_t size);
+
+size_t buffer_room(struct buffer_t *buffer);
+int buffer_data_iov(struct buffer_t *buffer, struct iovec *iov);
+int buffer_room_iov(struct buffer_t *buffer, struct iovec *iov);
+void buffer_commit(struct buffer_t *buffer, size_t len);
+void buffer_consume(struct buffer_t *buffer, size_t len);
+
+ssize_t buffer_readv(struct buffer_t *buffer, int fd);
+ssize_t buffer_writev(struct buffer_t *buffer, int fd);
 
 #endif /* _BUFFER_H_ */
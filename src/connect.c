@@ -32,57 +32,656 @@
 #include <sys/socket.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
-#include <strings.h>
-#include <sysexits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "connect.h"
+#include "event.h"
+#include "trace.h"
+
+/* MPTCP_SUBFLOW_ADDRS needs kernel headers of Linux 5.16 or later;
+ * without them, tcp_multipath_report can't list the subflows */
+#ifdef __linux__
+#if defined(__has_include)
+#if __has_include(<linux/mptcp.h>)
+#include <linux/mptcp.h>
+#endif
+#endif
+#ifndef TCP_IS_MPTCP
+#define TCP_IS_MPTCP 43
+#endif
+#endif
+
+/* protocol of new sockets: 0 for TCP, or IPPROTO_MPTCP; workers and
+ * the dnscache refresh thread create sockets, so it is atomic */
+static int tcp_proto;
 
 /*
- * Make a TCP connection to host:port. Returns the file descriptor of
- * the socket if a connection could be established. Returns -1 if there
- * was an error.
+ * Look up host with getaddrinfo, for a TCP connection to port.
+ * Returns the list of addresses, which must be freed with
+ * freeaddrinfo, or NULL if the lookup failed.
+ */
+
+static struct addrinfo *
+tcp_lookup(char *host, int port)
+{
+	int status;
+	char service[8];
+	struct addrinfo hints, *res;
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
+	
+	snprintf(service, sizeof(service), "%i", port);
+	
+	if ((status = getaddrinfo(host, service, &hints, &res)) != 0) {
+		warnx("%s: hostname lookup failed: %s", host,
+			gai_strerror(status));
+		return NULL;
+	}
+	
+	return res;
+}
+
+/*
+ * Format addr as "address:port" into name, for messages.
+ */
+
+static void
+tcp_name(struct sockaddr *addr, socklen_t len, char *name, size_t size)
+{
+	char host[NI_MAXHOST], port[NI_MAXSERV];
+	
+	if (getnameinfo(addr, len, host, sizeof(host), port, sizeof(port),
+		NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+	{
+		snprintf(name, size, "(unknown)");
+		return;
+	}
+	
+	snprintf(name, size, (addr->sa_family == AF_INET6) ?
+		"[%s]:%s" : "%s:%s", host, port);
+}
+
+/*
+ * Create a TCP socket for family, a Multipath TCP one if enabled (see
+ * tcp_multipath). If this kernel has no MPTCP or has it disabled, a
+ * TCP socket is created instead, and no more MPTCP sockets are tried.
+ * Returns the socket, or -1 with errno set.
+ */
+
+static int
+tcp_open(int family)
+{
+	int sock, proto = __atomic_load_n(&tcp_proto, __ATOMIC_RELAXED);
+	
+	if (!proto)
+		return socket(family, SOCK_STREAM, 0);
+	
+	if ((sock = socket(family, SOCK_STREAM, proto)) != -1)
+		return sock;
+	
+	if (errno != EPROTONOSUPPORT && errno != ENOPROTOOPT &&
+		errno != EINVAL)
+		return -1;
+	
+	/* only the first thread to find out tells */
+	if (__atomic_compare_exchange_n(&tcp_proto, &proto, 0, 0,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		warnx("multipath tcp not available, using tcp");
+	
+	return socket(family, SOCK_STREAM, 0);
+}
+
+/*
+ * Create a socket and start a non-blocking connection to addr. If data
+ * is not NULL, it goes as TCP Fast Open data in the SYN (RFC 7413), and
+ * *sent is set to the bytes of it that were queued: none if there is no
+ * TFO cookie for addr yet, or if TFO is disabled on this host.
+ * Returns the socket, or -1 with errno set.
+ */
+
+static int
+tcp_socket(struct sockaddr *addr, socklen_t len, const void *data,
+	size_t size, size_t *sent)
+{
+	int sock, error;
+	ssize_t n;
+	
+	if ((sock = tcp_open(addr->sa_family)) == -1)
+		return -1;
+	
+	if (fcntl(sock, F_SETFD, FD_CLOEXEC) == -1 ||
+		fcntl(sock, F_SETFL, O_NONBLOCK) == -1)
+		goto failed;
+	
+	if (data) {
+		*sent = 0;
+		if ((n = sendto(sock, data, size, MSG_FASTOPEN, addr,
+			len)) != -1)
+		{
+			*sent = n;
+			return sock;
+		}
+		/* no cookie: the SYN asks for one, without the data */
+		if (errno == EINPROGRESS)
+			return sock;
+		/* no client side TFO in this kernel, or disabled */
+		if (errno != EOPNOTSUPP && errno != EINVAL)
+			goto failed;
+	}
+	
+	if (connect(sock, addr, len) == -1 && errno != EINPROGRESS)
+		goto failed;
+	
+	return sock;
+	
+failed:
+	error = errno;
+	close(sock);
+	errno = error;
+	return -1;
+}
+
+/*
+ * Return a monotonic time in milliseconds.
+ */
+
+static long long
+tcp_now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Put up to max addresses of res in list, alternating between address
+ * families, starting with the family of the first address, as RFC 8305
+ * asks. Returns the number of addresses in list.
+ */
+
+static int
+tcp_interleave(struct addrinfo *res, struct addrinfo **list, int max)
+{
+	int n = 0, first;
+	struct addrinfo *a, *b;
+	
+	first = res->ai_family;
+	a = res;	/* next address of the first family */
+	b = res;	/* next address of another family */
+	
+	while (n < max)
+	{
+		while (a && a->ai_family != first)
+			a = a->ai_next;
+		while (b && b->ai_family == first)
+			b = b->ai_next;
+		
+		if (!a && !b)
+			break;
+		
+		if (a) {
+			list[n++] = a;
+			a = a->ai_next;
+		}
+		
+		if (b && n < max) {
+			list[n++] = b;
+			b = b->ai_next;
+		}
+	}
+	
+	return n;
+}
+
+/*
+ * Make the connections that follow Multipath TCP (RFC 8684) if enable
+ * is set, so the kernel can spread them over all interfaces that have
+ * an MPTCP endpoint. A server that does not speak MPTCP gets a plain
+ * TCP connection, as the kernel falls back by itself.
+ */
+
+void
+tcp_multipath(int enable)
+{
+#ifdef IPPROTO_MPTCP
+	__atomic_store_n(&tcp_proto, enable ? IPPROTO_MPTCP : 0,
+		__ATOMIC_RELAXED);
+#else
+	if (enable)
+		warnx("multipath tcp not supported, using tcp");
+#endif
+}
+
+/*
+ * Check the result of a non-blocking connection, once the socket
+ * became writable. Returns 0 if connected, -1 if not.
  */
 
 int
-tcp_connect(char *host, int port)
+tcp_finish(int sock)
 {
-	int sock;			/* socket file descriptor */
-	struct hostent *hent;		/* host lookup information */
-	struct sockaddr_in addr;	/* host connect information */
+	int error;
+	socklen_t len = sizeof(error);
 	
-	/* get hostent from hostname or address */
-	if((hent = gethostbyname(host)) == NULL) {
-		warnx("%s: hostname lookup failed", host);
+	if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+		return -1;
+	
+	if (error) {
+		errno = error;
 		return -1;
 	}
 	
-	/* create inet tcp socket */
-	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-		warn("socket() call failed");
+	return 0;
+}
+
+/*
+ * Look up all addresses of host, and store up to max of them in addrs
+ * for a connection to port, in the order tcp_race tries them. Returns
+ * the number of addresses, or -1 if the lookup failed.
+ */
+
+int
+tcp_addrs(char *host, int port, struct tcp_addr_t *addrs, int max)
+{
+	int n, naddrs;
+	struct addrinfo *res, *list[TCP_MAX_ADDRS];
+	
+	if ((res = tcp_lookup(host, port)) == NULL)
 		return -1;
+	
+	naddrs = tcp_interleave(res, list,
+		(max < TCP_MAX_ADDRS) ? max : TCP_MAX_ADDRS);
+	
+	for (n = 0; n < naddrs; ++n) {
+		memcpy(&addrs[n].ss, list[n]->ai_addr, list[n]->ai_addrlen);
+		addrs[n].len = list[n]->ai_addrlen;
 	}
 	
-	/* sockaddr_in: init to zero */
-	bzero(&addr, sizeof(addr));
-	/* sockaddr_in: set sin_family */
-	addr.sin_family = AF_INET;
-	/* sockaddr_in: set sin_addr.s_addr */
-	bcopy(hent->h_addr, &addr.sin_addr.s_addr, hent->h_length);
-	/* sockaddr_in: set sin_port */
-	addr.sin_port = htons(port);
+	freeaddrinfo(res);
 	
-	/* connect to host */
-	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-		close(sock);	/* cleanup */
+	return naddrs;
+}
+
+/*
+ * Prepare a Happy Eyeballs race (RFC 8305) between the naddrs addresses
+ * in addrs, which tcp_race_step runs.
+ */
+
+void
+tcp_race_init(struct tcp_race_t *r, struct tcp_addr_t *addrs, int naddrs)
+{
+	if (naddrs > TCP_MAX_ADDRS)
+		naddrs = TCP_MAX_ADDRS;
+	
+	memcpy(r->addrs, addrs, naddrs * sizeof(struct tcp_addr_t));
+	r->naddrs = naddrs;
+	r->next = 0;
+	r->pending = 0;
+	r->error = 0;
+	r->start = tcp_now();
+	r->data = NULL;
+	r->len = 0;
+	r->sent = 0;
+}
+
+/*
+ * Run a race: handle fd, one of its attempts that became writable, or
+ * -1 if there is no event (at the start, or after tcp_race_wait ms).
+ * The attempts are watched for EVENT_WRITE by ev, with data as event
+ * data.
+ *
+ * The addresses are tried in order: a new attempt starts every
+ * TCP_ATTEMPT_DELAY ms or as soon as one fails, and earlier attempts
+ * keep running. The first connection to complete wins. A dead address
+ * costs TCP_ATTEMPT_DELAY instead of a SYN timeout. If r->data is set,
+ * every attempt sends it in its SYN, see tcp_socket, and r->sent tells
+ * how much of it the winner sent.
+ *
+ * Returns the non-blocking socket of the winner, which stays watched
+ * by ev; the other attempts are ended. Returns TCP_PENDING while the
+ * race goes on, or -1 with errno set if all attempts failed.
+ */
+
+int
+tcp_race_step(struct tcp_race_t *r, struct event_t *ev, void *data, int fd)
+{
+	int n, sock;
+	long long now = tcp_now();
+	
+	for (n = 0; fd != -1 && n < r->next; ++n)
+	{
+		if (r->socks[n] != fd)
+			continue;
+		
+		if (tcp_finish(fd) == 0) {
+			r->socks[n] = -1;
+			r->sent = r->early[n];
+			tcp_race_end(r, ev);
+			return fd;
+		}
+		
+		/* failed: don't wait for the delay to start the next
+		 * attempt */
+		r->error = errno;
+		event_del(ev, fd);
+		close(fd);
+		r->socks[n] = -1;
+		--r->pending;
+		r->start = now;
+	}
+	
+	/* start the next attempt if it is time, or if there is nothing
+	 * else to wait for */
+	while (r->next < r->naddrs && (r->pending == 0 || now >= r->start))
+	{
+		sock = tcp_socket((struct sockaddr *)&r->addrs[r->next].ss,
+			r->addrs[r->next].len, r->data, r->len,
+			&r->early[r->next]);
+		
+		if (sock == -1) {
+			r->error = errno;
+		} else if (event_add(ev, sock, EVENT_WRITE, data) == -1) {
+			r->error = errno;
+			close(sock);
+			sock = -1;
+		} else {
+			++r->pending;
+		}
+		
+		r->socks[r->next++] = sock;
+		r->start = now + TCP_ATTEMPT_DELAY;
+	}
+	
+	if (r->pending)
+		return TCP_PENDING;
+	
+	errno = r->error;
+	return -1;
+}
+
+/*
+ * Returns the ms until the next attempt of a race starts, or -1 if
+ * there are no more addresses to try.
+ */
+
+long long
+tcp_race_wait(struct tcp_race_t *r)
+{
+	long long wait;
+	
+	if (r->next >= r->naddrs)
+		return -1;
+	
+	wait = r->start - tcp_now();
+	
+	return (wait > 0) ? wait : 0;
+}
+
+/*
+ * End the attempts of a race that are still running.
+ */
+
+void
+tcp_race_end(struct tcp_race_t *r, struct event_t *ev)
+{
+	int n;
+	
+	for (n = 0; n < r->next; ++n) {
+		if (r->socks[n] != -1) {
+			event_del(ev, r->socks[n]);
+			close(r->socks[n]);
+			r->socks[n] = -1;
+		}
+	}
+	
+	r->pending = 0;
+}
+
+/*
+ * Run race r to the end, for host:port (used in messages). Gives up
+ * after timeout ms, if timeout is not 0. Returns the file descriptor
+ * of the (blocking) socket if a connection could be established.
+ * Returns -1 if there was an error.
+ */
+
+static int
+tcp_run(char *host, int port, struct tcp_race_t *r, int timeout)
+{
+	int n, nready, sock;
+	long long wait, left, deadline;
+	struct event_t ev;
+	struct event_item_t ready[TCP_MAX_ADDRS];
+	
+	if (event_init(&ev) == -1) {
+		warn("event init failed");
+		return -1;
+	}
+	
+	deadline = tcp_now() + timeout;
+	sock = tcp_race_step(r, &ev, NULL, -1);
+	
+	while (sock == TCP_PENDING)
+	{
+		/* wait for a result, the next attempt, or the deadline */
+		wait = tcp_race_wait(r);
+		if (timeout) {
+			if ((left = deadline - tcp_now()) <= 0) {
+				tcp_race_end(r, &ev);
+				errno = ETIMEDOUT;
+				sock = -1;
+				break;
+			}
+			if (wait == -1 || left < wait)
+				wait = left;
+		}
+		
+		if ((nready = event_wait(&ev, ready, TCP_MAX_ADDRS,
+			(int)wait)) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			n = errno;
+			tcp_race_end(r, &ev);
+			errno = n;
+			sock = -1;
+			break;
+		}
+		
+		if (nready == 0)
+			sock = tcp_race_step(r, &ev, NULL, -1);
+		
+		for (n = 0; n < nready && sock == TCP_PENDING; ++n)
+			sock = tcp_race_step(r, &ev, NULL, ready[n].fd);
+	}
+	
+	if (sock != -1)
+		event_del(&ev, sock);
+	
+	n = errno;
+	event_free(&ev);
+	errno = n;
+	
+	if (sock == -1) {
 		warn("failed to connect to %s:%i", host, port);
 		return -1;
 	}
 	
+	/* callers expect a blocking socket */
+	if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK) == -1) {
+		warn("fcntl() call failed");
+		close(sock);
+		return -1;
+	}
+	
+	trace_mark("connect");
+	
 	/* all ok */
 	return sock;
 }
 
+/*
+ * Make a TCP connection to one of the naddrs addresses in addrs, which
+ * belong to host:port (used in messages), racing them as described at
+ * tcp_race_step. Gives up after timeout ms, if timeout is not 0.
+ * Returns the file descriptor of the socket if a connection could be
+ * established. Returns -1 if there was an error.
+ */
+
+int
+tcp_race(char *host, int port, struct tcp_addr_t *addrs, int naddrs,
+	int timeout)
+{
+	struct tcp_race_t race;
+	
+	tcp_race_init(&race, addrs, naddrs);
+	
+	return tcp_run(host, port, &race, timeout);
+}
+
+/*
+ * Make a TCP connection to host:port, trying all addresses of host, see
+ * tcp_race. Returns the file descriptor of the socket if a connection
+ * could be established. Returns -1 if there was an error.
+ */
+
+int
+tcp_connect(char *host, int port, int timeout)
+{
+	int naddrs;
+	struct tcp_addr_t addrs[TCP_MAX_ADDRS];
+	
+	/* get addresses from hostname or address */
+	if ((naddrs = tcp_addrs(host, port, addrs, TCP_MAX_ADDRS)) == -1)
+		return -1;
+	
+	trace_mark("resolve");
+	
+	return tcp_race(host, port, addrs, naddrs, timeout);
+}
+
+/*
+ * Connect to host:port as tcp_race does, sending data as TCP Fast Open
+ * data in the SYN (RFC 7413). The kernel falls back to a normal
+ * handshake when it has no cookie for the server yet, and sends the
+ * data once connected; if TFO is disabled on this host, connect first.
+ * Every attempt of the race sends the data, so an address that is
+ * slow to answer may get it too; its connection is closed as soon as
+ * another one wins. Sets *sent to the bytes of data that were sent;
+ * the caller sends the rest.
+ *
+ * Returns the file descriptor of the (blocking) socket, or -1 if there
+ * was an error.
+ */
+
+int
+tcp_fastopen(char *host, int port, struct tcp_addr_t *addrs, int naddrs,
+	const void *data, size_t len, size_t *sent, int timeout)
+{
+	int sock;
+	struct tcp_race_t race;
+	
+	tcp_race_init(&race, addrs, naddrs);
+	race.data = data;
+	race.len = len;
+	
+	if ((sock = tcp_run(host, port, &race, timeout)) != -1)
+		*sent = race.sent;
+	
+	return sock;
+}
+
+/*
+ * Check if the data sent by tcp_fastopen went out in the SYN, and was
+ * accepted by the server. Returns 1 if so, 0 if not.
+ */
+
+int
+tcp_fastopen_used(int sock)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == -1)
+		return 0;
+	
+	return (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+}
+
+/*
+ * Tell which subflows of sock, made with tcp_multipath, are up, or
+ * that it is a plain TCP connection.
+ */
+
+void
+tcp_multipath_report(int sock)
+{
+#if defined(__linux__) && defined(MPTCP_SUBFLOW_ADDRS)
+	int n, proto, mptcp;
+	socklen_t len;
+	char local[NI_MAXHOST + NI_MAXSERV + 3];
+	char remote[NI_MAXHOST + NI_MAXSERV + 3];
+	struct {
+		struct mptcp_subflow_data head;
+		struct mptcp_subflow_addrs addrs[TCP_MAX_SUBFLOWS];
+	} flows;
+	
+	len = sizeof(proto);
+	if (getsockopt(sock, SOL_SOCKET, SO_PROTOCOL, &proto, &len) == -1 ||
+		proto != IPPROTO_MPTCP)
+	{
+		warnx("multipath tcp: not used");
+		return;
+	}
+	
+	/* the proxy, or something in between, does not speak MPTCP */
+	len = sizeof(mptcp);
+	if (getsockopt(sock, IPPROTO_TCP, TCP_IS_MPTCP, &mptcp, &len) == -1 ||
+		!mptcp)
+	{
+		warnx("multipath tcp: refused by the proxy, fell back to tcp");
+		return;
+	}
+	
+	memset(&flows, 0, sizeof(flows));
+	flows.head.size_subflow_data = sizeof(flows.head);
+	flows.head.size_user = sizeof(flows.addrs[0]);
+	len = sizeof(flows);
+	
+	if (getsockopt(sock, SOL_MPTCP, MPTCP_SUBFLOW_ADDRS, &flows,
+		&len) == -1)
+	{
+		warn("multipath tcp: can't get subflows");
+		return;
+	}
+	
+	warnx("multipath tcp: %u subflows", flows.head.num_subflows);
+	
+	for (n = 0; n < flows.head.num_subflows && n < TCP_MAX_SUBFLOWS; ++n)
+	{
+		len = (flows.addrs[n].sa_family == AF_INET6) ?
+			sizeof(struct sockaddr_in6) :
+			sizeof(struct sockaddr_in);
+		tcp_name(&flows.addrs[n].sa_local, len, local,
+			sizeof(local));
+		tcp_name(&flows.addrs[n].sa_remote, len, remote,
+			sizeof(remote));
+		warnx("subflow %i: %s -> %s", n, local, remote);
+	}
+#else
+	warnx("multipath tcp: not used");
+#endif
+}
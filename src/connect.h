@@ -31,6 +31,63 @@
 #ifndef _CONNECT_H_
 #define _CONNECT_H_
 
-int tcp_connect(char *host, int port);
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* Happy Eyeballs connection attempt delay (RFC 8305), in ms */
+#define TCP_ATTEMPT_DELAY 250
+
+/* max addresses tried for one host */
+#ifndef TCP_MAX_ADDRS
+#define TCP_MAX_ADDRS 16
+#endif
+
+/* max multipath TCP subflows reported */
+#ifndef TCP_MAX_SUBFLOWS
+#define TCP_MAX_SUBFLOWS 8
+#endif
+
+/* tcp_race_step: the race goes on */
+#define TCP_PENDING -2
+
+/* a resolved address */
+typedef struct tcp_addr_t {
+	struct sockaddr_storage ss;
+	socklen_t len;
+} tcp_addr_t;
+
+struct event_t;
+
+/* a Happy Eyeballs race between the addresses of a host */
+typedef struct tcp_race_t {
+	struct tcp_addr_t addrs[TCP_MAX_ADDRS];
+	int socks[TCP_MAX_ADDRS];	/* attempts, -1 if ended */
+	int naddrs;
+	int next;			/* next address to try */
+	int pending;			/* attempts running */
+	int error;			/* errno of the last failure */
+	long long start;		/* ms, start of the next attempt */
+	const void *data;		/* sent in the SYN, or NULL */
+	size_t len;
+	size_t early[TCP_MAX_ADDRS];	/* of data, sent by each attempt */
+	size_t sent;			/* of data, sent by the winner */
+} tcp_race_t;
+
+void tcp_multipath(int enable);
+int tcp_finish(int sock);
+int tcp_addrs(char *host, int port, struct tcp_addr_t *addrs, int max);
+void tcp_race_init(struct tcp_race_t *r, struct tcp_addr_t *addrs,
+	int naddrs);
+int tcp_race_step(struct tcp_race_t *r, struct event_t *ev, void *data,
+	int fd);
+long long tcp_race_wait(struct tcp_race_t *r);
+void tcp_race_end(struct tcp_race_t *r, struct event_t *ev);
+int tcp_race(char *host, int port, struct tcp_addr_t *addrs, int naddrs,
+	int timeout);
+int tcp_connect(char *host, int port, int timeout);
+int tcp_fastopen(char *host, int port, struct tcp_addr_t *addrs,
+	int naddrs, const void *data, size_t len, size_t *sent, int timeout);
+int tcp_fastopen_used(int sock);
+void tcp_multipath_report(int sock);
 
 #endif /* _CONNECT_H_ */
@@ -0,0 +1,442 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "connect.h"
+#include "dnscache.h"
+
+/*
+ * The cache file holds a fixed number of entries, and is always
+ * replaced as a whole: a new file is written next to it and renamed
+ * over it. Readers map the file, and see either the old or the new one,
+ * never a mix, so no locking is needed. When two processes update the
+ * cache at the same time, the last rename wins; the other update is
+ * lost, which only costs a lookup later on.
+ *
+ * The file is only meant for the machine that wrote it: addresses are
+ * stored as they are in memory.
+ */
+
+#define DNSCACHE_MAGIC		"prcatdns"
+#define DNSCACHE_VERSION	1
+
+/* hosts in the cache, and addresses per host */
+#ifndef DNSCACHE_ENTRIES
+#define DNSCACHE_ENTRIES	16
+#endif
+#ifndef DNSCACHE_ADDRS
+#define DNSCACHE_ADDRS		8
+#endif
+
+/* TTL limits, and the TTL used when DNS does not give one (like for
+ * names from /etc/hosts), in seconds */
+#define DNSCACHE_MIN_TTL	10
+#define DNSCACHE_MAX_TTL	86400
+#define DNSCACHE_DEFAULT_TTL	300
+
+/* longest hostname, plus '\0' */
+#define DNSCACHE_HOST_SIZE	256
+
+typedef struct dnscache_entry_t {
+	char host[DNSCACHE_HOST_SIZE];
+	int64_t expires;		/* time(NULL) when expired */
+	int32_t ttl;			/* seconds */
+	int32_t naddrs;
+	struct tcp_addr_t addrs[DNSCACHE_ADDRS];	/* port is 0 */
+} dnscache_entry_t;
+
+typedef struct dnscache_file_t {
+	char magic[8];
+	int32_t version;
+	int32_t size;			/* sizeof(dnscache_file_t) */
+	struct dnscache_entry_t entry[DNSCACHE_ENTRIES];
+} dnscache_file_t;
+
+/* a background refresh */
+typedef struct dnscache_job_t {
+	char *path;
+	char host[DNSCACHE_HOST_SIZE];
+	int naddrs;			/* 0 to look host up */
+	struct tcp_addr_t addrs[DNSCACHE_ADDRS];
+} dnscache_job_t;
+
+static int dnscache_running;
+
+/* the new file, removed if the process exits while it is written;
+ * there is one refresh per process at most */
+static char dnscache_temp[PATH_MAX];
+static int dnscache_writing;
+
+/*
+ * Check if host is an address instead of a name; those are not cached.
+ */
+
+static int
+dnscache_numeric(char *host)
+{
+	struct in6_addr addr;
+	
+	return inet_pton(AF_INET, host, &addr) == 1 ||
+		inet_pton(AF_INET6, host, &addr) == 1;
+}
+
+/*
+ * Set the port of a cached address.
+ */
+
+static void
+dnscache_port(struct tcp_addr_t *addr, int port)
+{
+	if (addr->ss.ss_family == AF_INET)
+		((struct sockaddr_in *)&addr->ss)->sin_port = htons(port);
+	else if (addr->ss.ss_family == AF_INET6)
+		((struct sockaddr_in6 *)&addr->ss)->sin6_port = htons(port);
+}
+
+/*
+ * Map the cache file at path. Returns the mapping, or NULL if there is
+ * no valid cache file.
+ */
+
+static struct dnscache_file_t *
+dnscache_map(char *path)
+{
+	int fd;
+	struct stat st;
+	struct dnscache_file_t *cache;
+	
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return NULL;
+	
+	if (fstat(fd, &st) == -1 || st.st_size != sizeof(dnscache_file_t)) {
+		close(fd);
+		return NULL;
+	}
+	
+	cache = mmap(NULL, sizeof(dnscache_file_t), PROT_READ, MAP_SHARED,
+		fd, 0);
+	close(fd);
+	
+	if (cache == MAP_FAILED)
+		return NULL;
+	
+	if (memcmp(cache->magic, DNSCACHE_MAGIC, 8) != 0 ||
+		cache->version != DNSCACHE_VERSION ||
+		cache->size != sizeof(dnscache_file_t))
+	{
+		munmap(cache, sizeof(dnscache_file_t));
+		return NULL;
+	}
+	
+	return cache;
+}
+
+/*
+ * Look up host in the cache file at path, and store up to max of its
+ * addresses in addrs, for a connection to port.
+ *
+ * Returns the number of addresses, or 0 if host is not cached or has
+ * expired. Sets *refresh if the entry should be refreshed after use
+ * (see dnscache_refresh): when it is missing, or has less than a
+ * quarter of its TTL left.
+ */
+
+int
+dnscache_lookup(char *path, char *host, int port,
+	struct tcp_addr_t *addrs, int max, int *refresh)
+{
+	int n, naddrs = 0;
+	time_t now;
+	struct dnscache_entry_t *e;
+	struct dnscache_file_t *cache;
+	
+	*refresh = 0;
+	
+	if (dnscache_numeric(host) || strlen(host) >= DNSCACHE_HOST_SIZE)
+		return 0;
+	
+	*refresh = 1;
+	
+	if ((cache = dnscache_map(path)) == NULL)
+		return 0;
+	
+	now = time(NULL);
+	
+	for (n = 0; n < DNSCACHE_ENTRIES; ++n)
+	{
+		e = &cache->entry[n];
+		
+		if (e->expires <= now || strcmp(e->host, host) != 0)
+			continue;
+		
+		naddrs = (e->naddrs < max) ? e->naddrs : max;
+		if (naddrs > DNSCACHE_ADDRS)
+			naddrs = DNSCACHE_ADDRS;
+		
+		memcpy(addrs, e->addrs, naddrs * sizeof(tcp_addr_t));
+		
+		*refresh = (e->expires - now < e->ttl / 4);
+		break;
+	}
+	
+	munmap(cache, sizeof(dnscache_file_t));
+	
+	for (n = 0; n < naddrs; ++n)
+		dnscache_port(&addrs[n], port);
+	
+	return naddrs;
+}
+
+/*
+ * Ask DNS for the TTL of the addresses of host: the lowest TTL of the
+ * A and AAAA answers, including CNAMEs on the way. Returns the TTL, or
+ * -1 if DNS does not know host.
+ */
+
+static int
+dnscache_ttl(char *host)
+{
+	int n, t, len, ttl = -1;
+	int types[2] = { ns_t_a, ns_t_aaaa };
+	unsigned char answer[NS_PACKETSZ * 8];
+	ns_msg msg;
+	ns_rr rr;
+	
+	for (t = 0; t < 2; ++t)
+	{
+		len = res_query(host, ns_c_in, types[t], answer,
+			sizeof(answer));
+		
+		/* failed, or truncated */
+		if (len < 0 || len > sizeof(answer))
+			continue;
+		
+		if (ns_initparse(answer, len, &msg) == -1)
+			continue;
+		
+		for (n = 0; n < ns_msg_count(msg, ns_s_an); ++n) {
+			if (ns_parserr(&msg, ns_s_an, n, &rr) == -1)
+				break;
+			if (ttl == -1 || ns_rr_ttl(rr) < ttl)
+				ttl = ns_rr_ttl(rr);
+		}
+	}
+	
+	return ttl;
+}
+
+/*
+ * Store the naddrs addresses of host in the cache file at path, or look
+ * them up if there are none, replacing its old entry, or the entry that
+ * expires first.
+ *
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+dnscache_update(char *path, char *host, struct tcp_addr_t *addrs,
+	int naddrs)
+{
+	int fd, n, victim = 0, ttl;
+	struct dnscache_entry_t entry;
+	struct dnscache_file_t *old, *cache;
+	
+	memset(&entry, 0, sizeof(entry));
+	strcpy(entry.host, host);
+	
+	if (naddrs > 0) {
+		entry.naddrs = naddrs;
+		memcpy(entry.addrs, addrs, naddrs * sizeof(tcp_addr_t));
+	} else if ((entry.naddrs = tcp_addrs(host, 0, entry.addrs,
+		DNSCACHE_ADDRS)) <= 0)
+		return -1;
+	
+	if ((ttl = dnscache_ttl(host)) == -1)
+		ttl = DNSCACHE_DEFAULT_TTL;
+	if (ttl < DNSCACHE_MIN_TTL)
+		ttl = DNSCACHE_MIN_TTL;
+	if (ttl > DNSCACHE_MAX_TTL)
+		ttl = DNSCACHE_MAX_TTL;
+	
+	entry.ttl = ttl;
+	entry.expires = time(NULL) + ttl;
+	
+	if ((cache = calloc(1, sizeof(dnscache_file_t))) == NULL)
+		return -1;
+	
+	/* start from the current file, if there is a valid one */
+	if ((old = dnscache_map(path)) != NULL) {
+		memcpy(cache, old, sizeof(dnscache_file_t));
+		munmap(old, sizeof(dnscache_file_t));
+	} else {
+		memcpy(cache->magic, DNSCACHE_MAGIC, 8);
+		cache->version = DNSCACHE_VERSION;
+		cache->size = sizeof(dnscache_file_t);
+	}
+	
+	for (n = 0; n < DNSCACHE_ENTRIES; ++n) {
+		if (strcmp(cache->entry[n].host, host) == 0) {
+			victim = n;
+			break;
+		}
+		if (cache->entry[n].expires < cache->entry[victim].expires)
+			victim = n;
+	}
+	
+	cache->entry[victim] = entry;
+	
+	/* write a new file, and rename it over the old one */
+	if (snprintf(dnscache_temp, sizeof(dnscache_temp), "%s.XXXXXX",
+		path) >= sizeof(dnscache_temp) ||
+		(fd = mkstemp(dnscache_temp)) == -1)
+	{
+		free(cache);
+		return -1;
+	}
+	
+	__atomic_store_n(&dnscache_writing, 1, __ATOMIC_RELEASE);
+	
+	if (write(fd, cache, sizeof(dnscache_file_t)) !=
+		sizeof(dnscache_file_t) || close(fd) == -1 ||
+		rename(dnscache_temp, path) == -1)
+	{
+		unlink(dnscache_temp);
+		n = -1;
+	} else {
+		n = 0;
+	}
+	
+	__atomic_store_n(&dnscache_writing, 0, __ATOMIC_RELEASE);
+	
+	free(cache);
+	
+	return n;
+}
+
+/*
+ * Remove the new cache file if the process exits while a refresh writes
+ * it. The old file stays in place, see dnscache_update.
+ */
+
+static void
+dnscache_exit(void)
+{
+	if (__atomic_load_n(&dnscache_writing, __ATOMIC_ACQUIRE))
+		unlink(dnscache_temp);
+}
+
+
+/*
+ * Thread: refresh one host.
+ */
+
+static void *
+dnscache_run(void *arg)
+{
+	struct dnscache_job_t *job = arg;
+	
+	if (dnscache_update(job->path, job->host, job->addrs,
+		job->naddrs) == -1)
+		warnx("%s: dns cache update failed", job->path);
+	
+	free(job);
+	
+	return NULL;
+}
+
+/*
+ * Refresh host in the cache file at path, in the background, with the
+ * naddrs addresses that were just looked up, or with a lookup by the
+ * system resolver if naddrs is 0. The TTL is asked from DNS. The
+ * process does not wait for the refresh when it exits: the old file
+ * stays until the new one is renamed over it, so an update that did
+ * not finish is only lost.
+ *
+ * Returns 0 if the refresh was started, -1 if not.
+ */
+
+int
+dnscache_refresh(char *path, char *host, struct tcp_addr_t *addrs,
+	int naddrs)
+{
+	int n;
+	pthread_t thread;
+	struct dnscache_job_t *job;
+	
+	if (dnscache_running || dnscache_numeric(host) ||
+		strlen(host) >= DNSCACHE_HOST_SIZE)
+		return -1;
+	
+	if ((job = malloc(sizeof(dnscache_job_t))) == NULL)
+		return -1;
+	
+	job->path = path;
+	strcpy(job->host, host);
+	
+	/* cached without a port */
+	job->naddrs = (naddrs < DNSCACHE_ADDRS) ? naddrs : DNSCACHE_ADDRS;
+	for (n = 0; n < job->naddrs; ++n) {
+		job->addrs[n] = addrs[n];
+		dnscache_port(&job->addrs[n], 0);
+	}
+	
+	if ((errno = pthread_create(&thread, NULL, dnscache_run,
+		job)) != 0)
+	{
+		free(job);
+		return -1;
+	}
+	
+	pthread_detach(thread);
+	dnscache_running = 1;
+	atexit(dnscache_exit);
+	
+	return 0;
+}
@@ -0,0 +1,472 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "event.h"
+
+#ifdef EVENT_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+/* internal flag: fd is registered */
+#define EVENT_ADDED	0x100
+/* internal flag: fd is always ready (epoll refused it) */
+#define EVENT_FILE	0x200
+/* internal flag: fd is in the epoll set */
+#define EVENT_KERNEL	0x400
+/* mask of the public flags */
+#define EVENT_MASK	(EVENT_READ | EVENT_WRITE)
+
+/* max events fetched by one epoll_wait */
+#ifndef EVENT_WAIT_MAX
+#define EVENT_WAIT_MAX 64
+#endif
+
+/*
+ * Make sure fd fits in the items array. Returns 0 if OK, -1 on error.
+ */
+
+static int
+event_grow(struct event_t *ev, int fd)
+{
+	int n, length;
+	struct event_item_t *items;
+	
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	
+#ifndef EVENT_USE_EPOLL
+	if (fd >= FD_SETSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+#endif
+	
+	if (fd < ev->length)
+		return 0;
+	
+	/* grow in steps of 64 fds */
+	length = (fd | 63) + 1;
+	
+	items = realloc(ev->items, length * sizeof(event_item_t));
+	if (!items)
+		return -1;
+	
+	for (n = ev->length; n < length; ++n) {
+		items[n].fd = n;
+		items[n].events = 0;
+		items[n].data = NULL;
+	}
+	
+	ev->items = items;
+	ev->length = length;
+	
+	return 0;
+}
+
+/*
+ * Return the registered item for fd, or NULL if not registered.
+ */
+
+static struct event_item_t *
+event_item(struct event_t *ev, int fd)
+{
+	if (fd < 0 || fd >= ev->length ||
+		!(ev->items[fd].events & EVENT_ADDED))
+	{
+		errno = ENOENT;
+		return NULL;
+	}
+	
+	return &ev->items[fd];
+}
+
+#ifdef EVENT_USE_EPOLL
+
+/*
+ * Convert EVENT_* flags to epoll flags.
+ */
+
+static uint32_t
+event_to_epoll(int events)
+{
+	return ((events & EVENT_READ) ? EPOLLIN : 0) |
+		((events & EVENT_WRITE) ? EPOLLOUT : 0);
+}
+
+/*
+ * Apply events to the epoll set. An fd without events is taken out of
+ * the epoll set, or a hangup would wake up event_wait forever.
+ *
+ * Regular files (and /dev/null) can't be watched by epoll. They never
+ * block, so they are reported as ready on each call to event_wait,
+ * the same as select(2) would do.
+ *
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+event_ctl(struct event_t *ev, struct event_item_t *item, int events)
+{
+	int op;
+	struct epoll_event ee;
+	
+	item->events = (item->events & ~EVENT_MASK) | events;
+	
+	if (item->events & EVENT_FILE)
+		return 0;
+	
+	if (!events && !(item->events & EVENT_KERNEL))
+		return 0;
+	
+	if (!events)
+		op = EPOLL_CTL_DEL;
+	else if (item->events & EVENT_KERNEL)
+		op = EPOLL_CTL_MOD;
+	else
+		op = EPOLL_CTL_ADD;
+	
+	ee.events = event_to_epoll(events);
+	ee.data.fd = item->fd;
+	
+	if (epoll_ctl(ev->epfd, op, item->fd, &ee) == -1) {
+		if (op != EPOLL_CTL_ADD || errno != EPERM)
+			return -1;
+		item->events |= EVENT_FILE;
+		ev->nfiles++;
+		return 0;
+	}
+	
+	if (op == EPOLL_CTL_DEL)
+		item->events &= ~EVENT_KERNEL;
+	else
+		item->events |= EVENT_KERNEL;
+	
+	return 0;
+}
+
+/*
+ * Initialize an event_t structure. Returns 0 if OK, -1 on error.
+ */
+
+int
+event_init(struct event_t *ev)
+{
+	ev->length = 0;
+	ev->items = NULL;
+	ev->nfiles = 0;
+	
+	if ((ev->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		return -1;
+	
+	return 0;
+}
+
+/*
+ * Free all resources used by an event_t structure.
+ */
+
+void
+event_free(struct event_t *ev)
+{
+	close(ev->epfd);
+	free(ev->items);
+	ev->items = NULL;
+	ev->length = 0;
+}
+
+/*
+ * Start watching fd for events. The data pointer is handed back by
+ * event_wait. Returns 0 if OK, -1 on error.
+ */
+
+int
+event_add(struct event_t *ev, int fd, int events, void *data)
+{
+	if (event_grow(ev, fd) != 0)
+		return -1;
+	
+	ev->items[fd].events = EVENT_ADDED;
+	ev->items[fd].data = data;
+	
+	if (event_ctl(ev, &ev->items[fd], events) == -1) {
+		ev->items[fd].events = 0;
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Change the events and data of a watched fd.
+ * Returns 0 if OK, -1 on error.
+ */
+
+int
+event_mod(struct event_t *ev, int fd, int events, void *data)
+{
+	struct event_item_t *item;
+	
+	if (!(item = event_item(ev, fd)))
+		return -1;
+	
+	item->data = data;
+	
+	return event_ctl(ev, item, events);
+}
+
+/*
+ * Stop watching fd. Returns 0 if OK, -1 on error.
+ */
+
+int
+event_del(struct event_t *ev, int fd)
+{
+	struct event_item_t *item;
+	
+	if (!(item = event_item(ev, fd)))
+		return -1;
+	
+	if (event_ctl(ev, item, 0) == -1)
+		return -1;
+	
+	if (item->events & EVENT_FILE)
+		ev->nfiles--;
+	
+	item->events = 0;
+	item->data = NULL;
+	
+	return 0;
+}
+
+/*
+ * Wait for events on the watched fds, with a timeout in milliseconds
+ * (-1 waits forever). Up to max ready fds are stored in items.
+ *
+ * Returns the amount of ready fds, 0 on timeout, -1 on error.
+ */
+
+int
+event_wait(struct event_t *ev, struct event_item_t *items, int max,
+	int timeout)
+{
+	int n, fd, nready, count = 0;
+	struct epoll_event ee[EVENT_WAIT_MAX];
+	
+	/* always ready fds: take them first, then don't block */
+	for (fd = 0; ev->nfiles && fd < ev->length && count < max; ++fd) {
+		if ((ev->items[fd].events & EVENT_FILE) &&
+			(ev->items[fd].events & EVENT_MASK))
+		{
+			items[count].fd = fd;
+			items[count].events = ev->items[fd].events & EVENT_MASK;
+			items[count].data = ev->items[fd].data;
+			++count;
+		}
+	}
+	
+	if (count)
+		timeout = 0;
+	
+	if (max - count > EVENT_WAIT_MAX)
+		max = count + EVENT_WAIT_MAX;
+	
+	if (count == max)
+		return count;
+	
+	if ((nready = epoll_wait(ev->epfd, ee, max - count, timeout)) == -1)
+		return -1;
+	
+	for (n = 0; n < nready; ++n, ++count) {
+		fd = ee[n].data.fd;
+		items[count].fd = fd;
+		items[count].data = ev->items[fd].data;
+		/* hangup and error: let read/write find out */
+		if (ee[n].events & (EPOLLERR | EPOLLHUP))
+			items[count].events = ev->items[fd].events & EVENT_MASK;
+		else
+			items[count].events =
+				((ee[n].events & EPOLLIN) ? EVENT_READ : 0) |
+				((ee[n].events & EPOLLOUT) ? EVENT_WRITE : 0);
+	}
+	
+	return count;
+}
+
+#else /* EVENT_USE_EPOLL */
+
+/*
+ * Initialize an event_t structure. Returns 0 if OK, -1 on error.
+ */
+
+int
+event_init(struct event_t *ev)
+{
+	ev->length = 0;
+	ev->items = NULL;
+	ev->nfds = 0;
+	
+	FD_ZERO(&ev->rfds);
+	FD_ZERO(&ev->wfds);
+	
+	return 0;
+}
+
+/*
+ * Free all resources used by an event_t structure.
+ */
+
+void
+event_free(struct event_t *ev)
+{
+	free(ev->items);
+	ev->items = NULL;
+	ev->length = 0;
+}
+
+/*
+ * Change the events and data of a watched fd.
+ * Returns 0 if OK, -1 on error.
+ */
+
+int
+event_mod(struct event_t *ev, int fd, int events, void *data)
+{
+	struct event_item_t *item;
+	
+	if (!(item = event_item(ev, fd)))
+		return -1;
+	
+	if (events & EVENT_READ)
+		FD_SET(fd, &ev->rfds);
+	else
+		FD_CLR(fd, &ev->rfds);
+	
+	if (events & EVENT_WRITE)
+		FD_SET(fd, &ev->wfds);
+	else
+		FD_CLR(fd, &ev->wfds);
+	
+	item->events = EVENT_ADDED | events;
+	item->data = data;
+	
+	return 0;
+}
+
+/*
+ * Start watching fd for events. The data pointer is handed back by
+ * event_wait. Returns 0 if OK, -1 on error (EINVAL if the fd does not
+ * fit in an fd_set).
+ */
+
+int
+event_add(struct event_t *ev, int fd, int events, void *data)
+{
+	if (event_grow(ev, fd) != 0)
+		return -1;
+	
+	ev->items[fd].events = EVENT_ADDED;
+	
+	if (fd >= ev->nfds)
+		ev->nfds = fd + 1;
+	
+	return event_mod(ev, fd, events, data);
+}
+
+/*
+ * Stop watching fd. Returns 0 if OK, -1 on error.
+ */
+
+int
+event_del(struct event_t *ev, int fd)
+{
+	if (event_mod(ev, fd, 0, NULL) != 0)
+		return -1;
+	
+	ev->items[fd].events = 0;
+	
+	/* lower nfds to the highest registered fd + 1 */
+	while (ev->nfds > 0 && !(ev->items[ev->nfds - 1].events & EVENT_ADDED))
+		ev->nfds--;
+	
+	return 0;
+}
+
+/*
+ * Wait for events on the watched fds, with a timeout in milliseconds
+ * (-1 waits forever). Up to max ready fds are stored in items.
+ *
+ * Returns the amount of ready fds, 0 on timeout, -1 on error.
+ */
+
+int
+event_wait(struct event_t *ev, struct event_item_t *items, int max,
+	int timeout)
+{
+	int fd, events, count = 0;
+	fd_set rfds, wfds;
+	struct timeval tv, *tvp = NULL;
+	
+	/* re-init sets */
+	rfds = ev->rfds;
+	wfds = ev->wfds;
+	
+	if (timeout >= 0) {
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		tvp = &tv;
+	}
+	
+	if (select(ev->nfds, &rfds, &wfds, NULL, tvp) == -1)
+		return -1;
+	
+	for (fd = 0; fd < ev->nfds && count < max; ++fd)
+	{
+		events = (FD_ISSET(fd, &rfds) ? EVENT_READ : 0) |
+			(FD_ISSET(fd, &wfds) ? EVENT_WRITE : 0);
+		
+		if (!events)
+			continue;
+		
+		items[count].fd = fd;
+		items[count].events = events;
+		items[count].data = ev->items[fd].data;
+		++count;
+	}
+	
+	return count;
+}
+
+#endif /* EVENT_USE_EPOLL */
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _EVENT_H_
+#define _EVENT_H_
+
+#if defined(__linux__) && !defined(EVENT_USE_SELECT)
+#define EVENT_USE_EPOLL
+#endif
+
+#ifndef EVENT_USE_EPOLL
+#include <sys/select.h>
+#endif
+
+/* event flags */
+#define EVENT_READ	0x01	/* fd is readable (or hangup/error) */
+#define EVENT_WRITE	0x02	/* fd is writable (or hangup/error) */
+
+/* an fd with its interesting or ready events */
+typedef struct event_item_t {
+	int fd;
+	int events;	/* EVENT_* flags */
+	void *data;	/* owner data, handed back by event_wait */
+} event_item_t;
+
+/* holds the set of fds to wait for */
+typedef struct event_t {
+	int length;			/* array length of items */
+	struct event_item_t *items;	/* registered fds, indexed by fd */
+#ifdef EVENT_USE_EPOLL
+	int epfd;			/* epoll instance */
+	int nfiles;			/* amount of always ready fds */
+#else
+	int nfds;			/* highest fd + 1 */
+	fd_set rfds;			/* fds waiting for EVENT_READ */
+	fd_set wfds;			/* fds waiting for EVENT_WRITE */
+#endif
+} event_t;
+
+int event_init(struct event_t *ev);
+void event_free(struct event_t *ev);
+
+int event_add(struct event_t *ev, int fd, int events, void *data);
+int event_mod(struct event_t *ev, int fd, int events, void *data);
+int event_del(struct event_t *ev, int fd);
+
+int event_wait(struct event_t *ev, struct event_item_t *items, int max,
+	int timeout);
+
+#endif /* _EVENT_H_ */
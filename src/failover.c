@@ -0,0 +1,605 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "connect.h"
+#include "dnscache.h"
+#include "event.h"
+#include "failover.h"
+#include "proxy.h"
+#include "setup.h"
+
+/* proxies raced at the same time */
+#ifndef FAILOVER_RACE
+#define FAILOVER_RACE 2
+#endif
+
+/* weight of a new sample in the moving averages */
+#define FAILOVER_ALPHA 0.3
+
+/* ms added to the latency of a proxy that always fails */
+#define FAILOVER_PENALTY 5000.0
+
+/* seconds in which the failure score of an unused proxy halves, so a
+ * demoted proxy gets another chance */
+#define FAILOVER_HALFLIFE 3600
+
+/* attempt states */
+#define FAILOVER_CONNECTING	0	/* connecting to the proxy */
+#define FAILOVER_REQUEST	1	/* sending the CONNECT request */
+#define FAILOVER_RESPONSE	2	/* reading the CONNECT response */
+#define FAILOVER_DONE		3	/* failed, or lost */
+
+/* results of failover_process */
+#define FAILOVER_OPEN		1	/* tunnel is open */
+#define FAILOVER_WAIT		0	/* attempt goes on */
+#define FAILOVER_FAILED		-1	/* the proxy failed */
+#define FAILOVER_REFUSED	-2	/* refused for the destination */
+
+/* what we know about a proxy */
+typedef struct failover_score_t {
+	int known;		/* has samples */
+	double latency;		/* ms to open a tunnel, averaged */
+	double failure;		/* 0 (never fails) .. 1 (always fails) */
+	time_t updated;		/* last sample */
+} failover_score_t;
+
+/* an attempt to open the tunnel through one proxy */
+typedef struct failover_try_t {
+	int proxy;		/* index in config->proxies */
+	int fd;
+	int state;
+	int refresh;		/* DNS cache entry needs a refresh */
+	int resolved;		/* its addresses were looked up */
+	long long start;	/* ms */
+	struct tcp_race_t race;	/* connecting to its addresses */
+	struct proxy_parser_t parser;	/* parser of the response */
+	struct buffer_t b;
+} failover_try_t;
+
+/*
+ * Return a monotonic time in milliseconds.
+ */
+
+static long long
+failover_now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Return the index of a proxy in the configured list, or -1.
+ */
+
+static int
+failover_find(struct config_t *config, char *host, int port)
+{
+	int n;
+	
+	for (n = 0; n < config->nproxies; ++n) {
+		if (config->proxies[n].port == port &&
+			strcmp(config->proxies[n].name, host) == 0)
+			return n;
+	}
+	
+	return -1;
+}
+
+/*
+ * Load the scores of the configured proxies from the scores file. The
+ * file has a line "<host> <port> <latency> <failure> <updated>" for
+ * each proxy that was used; lines for other proxies are ignored.
+ */
+
+static void
+failover_load(struct config_t *config, struct failover_score_t *scores)
+{
+	int n, port;
+	long updated;
+	double latency, failure;
+	char line[512], host[256];
+	FILE *fp;
+	
+	if (!config->scores || (fp = fopen(config->scores, "r")) == NULL)
+		return;
+	
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (sscanf(line, "%255s %i %lf %lf %li", host, &port,
+			&latency, &failure, &updated) != 5)
+			continue;
+		
+		if ((n = failover_find(config, host, port)) == -1)
+			continue;
+		
+		scores[n].known = 1;
+		scores[n].latency = latency;
+		scores[n].failure = failure;
+		scores[n].updated = updated;
+	}
+	
+	fclose(fp);
+}
+
+/*
+ * Save the scores of the configured proxies, replacing the scores file
+ * atomically. Lines for other proxies are kept, so runs with another
+ * list of proxies don't forget them. Errors are not fatal; the scores
+ * are only a hint.
+ */
+
+static void
+failover_save(struct config_t *config, struct failover_score_t *scores)
+{
+	int n, fd, port;
+	char *tmp, line[512], host[256];
+	FILE *fp, *old;
+	struct stat st;
+	
+	/* don't replace a device (like /dev/null) with a file */
+	if (!config->scores || (stat(config->scores, &st) == 0 &&
+		!S_ISREG(st.st_mode)))
+		return;
+	
+	if ((tmp = malloc(strlen(config->scores) + 8)) == NULL)
+		return;
+	
+	sprintf(tmp, "%s.XXXXXX", config->scores);
+	
+	if ((fd = mkstemp(tmp)) == -1 || (fp = fdopen(fd, "w")) == NULL) {
+		if (fd != -1) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+		return;
+	}
+	
+	if ((old = fopen(config->scores, "r")) != NULL) {
+		while (fgets(line, sizeof(line), old)) {
+			if (sscanf(line, "%255s %i", host, &port) == 2 &&
+				failover_find(config, host, port) == -1)
+				fputs(line, fp);
+		}
+		fclose(old);
+	}
+	
+	for (n = 0; n < config->nproxies; ++n) {
+		if (scores[n].known)
+			fprintf(fp, "%s %i %.1f %.3f %li\n",
+				config->proxies[n].name,
+				config->proxies[n].port, scores[n].latency,
+				scores[n].failure, (long)scores[n].updated);
+	}
+	
+	if (fclose(fp) != 0 || rename(tmp, config->scores) == -1) {
+		warn("%s: can't save proxy scores", config->scores);
+		unlink(tmp);
+	}
+	
+	free(tmp);
+}
+
+/*
+ * Add a sample to the score of a proxy: the time it took to open the
+ * tunnel, or -1 if it failed.
+ */
+
+static void
+failover_sample(struct failover_score_t *score, long long ms)
+{
+	if (!score->known) {
+		score->known = 1;
+		score->latency = (ms == -1) ? 0 : ms;
+		score->failure = (ms == -1);
+	} else {
+		score->failure += FAILOVER_ALPHA *
+			((ms == -1) - score->failure);
+		if (ms != -1)
+			score->latency += FAILOVER_ALPHA *
+				(ms - score->latency);
+	}
+	
+	score->updated = time(NULL);
+}
+
+/*
+ * Return the expected cost of a proxy in ms; lower is better. Proxies
+ * without samples cost nothing, so they are tried early.
+ */
+
+static double
+failover_cost(struct failover_score_t *score, time_t now)
+{
+	long age;
+	double failure;
+	
+	if (!score->known)
+		return 0;
+	
+	/* forgive failures over time */
+	failure = score->failure;
+	for (age = now - score->updated; age >= FAILOVER_HALFLIFE &&
+		failure > 0.001; age -= FAILOVER_HALFLIFE)
+		failure /= 2;
+	
+	return score->latency + failure * FAILOVER_PENALTY;
+}
+
+/*
+ * Start an attempt: look up the addresses of the proxy, in the DNS
+ * cache if there is one, and race them. Returns 0 if OK, -1 if it
+ * failed right away.
+ */
+
+static int
+failover_start(struct config_t *config, struct event_t *ev,
+	struct failover_try_t *t)
+{
+	int naddrs = 0;
+	struct tcp_addr_t addrs[TCP_MAX_ADDRS];
+	struct config_proxy_t *p = &config->proxies[t->proxy];
+	
+	t->state = FAILOVER_DONE;
+	t->fd = -1;
+	t->refresh = 0;
+	t->resolved = 0;
+	proxy_parser_init(&t->parser, NULL, NULL);
+	t->start = failover_now();
+	
+	if (config->dnscache)
+		naddrs = dnscache_lookup(config->dnscache, p->name, p->port,
+			addrs, TCP_MAX_ADDRS, &t->refresh);
+	
+	if (naddrs <= 0) {
+		if ((naddrs = tcp_addrs(p->name, p->port, addrs,
+			TCP_MAX_ADDRS)) == -1)
+			return -1;
+		t->resolved = 1;
+	}
+	
+	if (proxy_request(&t->b, config->hostname, config->hostport,
+		config->username, config->password) == -1)
+		return -1;
+	
+	tcp_race_init(&t->race, addrs, naddrs);
+	
+	if (tcp_race_step(&t->race, ev, t, -1) == -1) {
+		warn("failed to connect to %s:%i", p->name, p->port);
+		return -1;
+	}
+	
+	t->state = FAILOVER_CONNECTING;
+	
+	return 0;
+}
+
+/*
+ * Check if a refused CONNECT is the fault of the proxy: an error of
+ * the proxy itself (5xx), or a response that makes no sense. A 4xx is
+ * about the destination or the credentials, as are 502 and 504, which
+ * tell the destination could not be reached.
+ */
+
+static int
+failover_blame(int status)
+{
+	if (status >= 400 && status < 500)
+		return 0;
+	
+	return status != 502 && status != 504;
+}
+
+/*
+ * Advance an attempt on an event of fd, or on a timeout if fd is -1.
+ * Returns FAILOVER_OPEN if the tunnel is open, FAILOVER_WAIT if the
+ * attempt goes on, FAILOVER_FAILED if the proxy failed, or
+ * FAILOVER_REFUSED if it refused the tunnel for the destination.
+ */
+
+static int
+failover_process(struct config_t *config, struct event_t *ev,
+	struct failover_try_t *t, int fd)
+{
+	ssize_t n;
+	int status;
+	struct config_proxy_t *p = &config->proxies[t->proxy];
+	
+	switch (t->state)
+	{
+	case FAILOVER_CONNECTING:
+		t->fd = tcp_race_step(&t->race, ev, t, fd);
+		if (t->fd == TCP_PENDING)
+			return FAILOVER_WAIT;
+		if (t->fd == -1) {
+			warn("failed to connect to %s:%i", p->name, p->port);
+			return FAILOVER_FAILED;
+		}
+		t->state = FAILOVER_REQUEST;
+		/* FALLTHROUGH */
+	case FAILOVER_REQUEST:
+		if (fd == -1)
+			return FAILOVER_WAIT;
+		if (buffer_writev(&t->b, t->fd) == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return FAILOVER_WAIT;
+			warn("http send headers failed");
+			return FAILOVER_FAILED;
+		}
+		if (t->b.len)
+			return FAILOVER_WAIT;
+		buffer_reset(&t->b);
+		t->state = FAILOVER_RESPONSE;
+		return (event_mod(ev, t->fd, EVENT_READ, t) == -1) ?
+			FAILOVER_FAILED : FAILOVER_WAIT;
+	case FAILOVER_RESPONSE:
+		if (fd == -1)
+			return FAILOVER_WAIT;
+		n = read(t->fd, t->b.data + t->b.len, buffer_room(&t->b));
+		if (n == 0) {
+			warnx("http read headers failed: eof from proxy");
+			return FAILOVER_FAILED;
+		} else if (n == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return FAILOVER_WAIT;
+			warn("http read headers failed");
+			return FAILOVER_FAILED;
+		}
+		buffer_commit(&t->b, n);
+		status = proxy_response(&t->b, &t->parser);
+		if (status == PROXY_MORE)
+			return FAILOVER_WAIT;
+		if (status == PROXY_OK)
+			return FAILOVER_OPEN;
+		return failover_blame(t->parser.status) ?
+			FAILOVER_FAILED : FAILOVER_REFUSED;
+	}
+	
+	return FAILOVER_FAILED;
+}
+
+/*
+ * End an attempt, and close its socket unless keep is set.
+ */
+
+static void
+failover_end(struct event_t *ev, struct failover_try_t *t, int keep)
+{
+	if (t->state == FAILOVER_CONNECTING) {
+		tcp_race_end(&t->race, ev);
+	} else if (t->state != FAILOVER_DONE) {
+		event_del(ev, t->fd);
+		if (!keep)
+			close(t->fd);
+	}
+	
+	t->state = FAILOVER_DONE;
+}
+
+/*
+ * Open the tunnel through the best of the configured proxies.
+ *
+ * The proxies are ranked by their scores: the time it took them to
+ * open a tunnel, and how often they failed, both as moving averages
+ * kept in the scores file across runs. The best FAILOVER_RACE proxies
+ * are raced: all get the CONNECT request at once, and the first one to
+ * respond with 2xx wins. If they all fail (or time out), the next ones
+ * are raced. The addresses of each proxy come from the DNS cache, if
+ * there is one, and are raced as in tcp_race.
+ *
+ * Connect and handshake failures, timeouts and errors of the proxy
+ * itself count against a proxy. A tunnel refused for the destination
+ * (4xx, 502, 504) does not, but the next proxy is still tried.
+ *
+ * Returns the socket of the tunnel, with any data that followed the
+ * response in b, or -1 if no proxy could open the tunnel.
+ */
+
+int
+failover_connect(struct config_t *config, struct buffer_t *b)
+{
+	int n, k, next, order[MAX_PROXIES], sock = -1;
+	int status, nready, active, expired;
+	long long left, wait;
+	time_t now = time(NULL);
+	double cost[MAX_PROXIES];
+	struct event_t ev;
+	struct event_item_t ready[FAILOVER_RACE];
+	struct failover_try_t tries[FAILOVER_RACE], *t, *win = NULL;
+	struct failover_score_t scores[MAX_PROXIES];
+	
+	memset(scores, 0, sizeof(scores));
+	failover_load(config, scores);
+	
+	/* rank the proxies, best first */
+	for (n = 0; n < config->nproxies; ++n) {
+		cost[n] = failover_cost(&scores[n], now);
+		for (k = n; k > 0 && cost[order[k - 1]] > cost[n]; --k)
+			order[k] = order[k - 1];
+		order[k] = n;
+	}
+	
+	if (event_init(&ev) == -1) {
+		warn("event init failed");
+		return -1;
+	}
+	
+	for (k = 0; k < FAILOVER_RACE; ++k) {
+		tries[k].state = FAILOVER_DONE;
+		if (buffer_init(&tries[k].b, b->size) == -1) {
+			warn("buffer allocation failed");
+			while (k--)
+				buffer_free(&tries[k].b);
+			event_free(&ev);
+			return -1;
+		}
+	}
+	
+	for (next = 0; sock == -1; )
+	{
+		/* keep FAILOVER_RACE attempts going, if there are proxies
+		 * left to try */
+		for (k = active = 0; k < FAILOVER_RACE; ++k) {
+			t = &tries[k];
+			while (t->state == FAILOVER_DONE &&
+				next < config->nproxies)
+			{
+				t->proxy = order[next++];
+				if (failover_start(config, &ev, t) == -1)
+					failover_sample(&scores[t->proxy], -1);
+			}
+			active += (t->state != FAILOVER_DONE);
+		}
+		
+		if (!active)
+			break;
+		
+		/* time out attempts, and wait for the first deadline, or
+		 * the next address of a proxy */
+		wait = -1;
+		expired = 0;
+		for (k = 0; k < FAILOVER_RACE; ++k) {
+			t = &tries[k];
+			if (t->state == FAILOVER_CONNECTING &&
+				(left = tcp_race_wait(&t->race)) != -1 &&
+				(wait == -1 || left < wait))
+				wait = left;
+			if (t->state == FAILOVER_DONE || !config->timeout)
+				continue;
+			left = t->start + config->timeout * 1000LL -
+				failover_now();
+			if (left <= 0) {
+				warnx("%s:%i: timed out",
+					config->proxies[t->proxy].name,
+					config->proxies[t->proxy].port);
+				failover_sample(&scores[t->proxy], -1);
+				failover_end(&ev, t, 0);
+				expired = 1;
+			} else if (wait == -1 || left < wait) {
+				wait = left;
+			}
+		}
+		
+		/* start the next ones first */
+		if (expired)
+			continue;
+		
+		if ((nready = event_wait(&ev, ready, FAILOVER_RACE,
+			(int)wait)) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			warn("event wait failed");
+			break;
+		}
+		
+		/* time to start the next address of a proxy */
+		if (nready == 0) {
+			for (k = 0; k < FAILOVER_RACE; ++k) {
+				ready[k].fd = -1;
+				ready[k].data = &tries[k];
+			}
+			nready = FAILOVER_RACE;
+		}
+		
+		for (n = 0; n < nready && sock == -1; ++n)
+		{
+			t = ready[n].data;
+			
+			/* may have timed out above */
+			if (t->state == FAILOVER_DONE)
+				continue;
+			
+			status = failover_process(config, &ev, t, ready[n].fd);
+			if (status == FAILOVER_WAIT)
+				continue;
+			
+			if (status == FAILOVER_OPEN) {
+				win = t;
+				sock = t->fd;
+				failover_sample(&scores[t->proxy],
+					failover_now() - t->start);
+			} else if (status == FAILOVER_FAILED) {
+				failover_sample(&scores[t->proxy], -1);
+			}
+			
+			failover_end(&ev, t, status == FAILOVER_OPEN);
+		}
+	}
+	
+	/* end the losers */
+	for (k = 0; k < FAILOVER_RACE; ++k)
+		failover_end(&ev, &tries[k], 0);
+	
+	/* the winner was not cached, or came from an old cache entry;
+	 * addresses that were looked up just now are stored as they are */
+	if (win && win->refresh)
+		dnscache_refresh(config->dnscache,
+			config->proxies[win->proxy].name,
+			win->race.addrs, win->resolved ? win->race.naddrs : 0);
+	
+	/* hand the data after the response to the caller */
+	buffer_reset(b);
+	if (win) {
+		memcpy(b->data, win->b.data + win->b.head, win->b.len);
+		buffer_commit(b, win->b.len);
+	}
+	
+	for (k = 0; k < FAILOVER_RACE; ++k)
+		buffer_free(&tries[k].b);
+	
+	event_free(&ev);
+	failover_save(config, scores);
+	
+	if (sock == -1)
+		warnx("no proxy could open the tunnel");
+	
+	/* callers expect a blocking socket */
+	if (sock != -1)
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+	
+	return sock;
+}
@@ -0,0 +1,892 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "connect.h"
+#include "event.h"
+#include "listen.h"
+#include "proxy.h"
+#include "setup.h"
+#include "socks.h"
+#include "tunnel.h"
+
+#ifndef LISTEN_BACKLOG
+#define LISTEN_BACKLOG 128
+#endif
+
+/* max events handled per wakeup of a worker */
+#ifndef LISTEN_EVENTS
+#define LISTEN_EVENTS 64
+#endif
+
+/* from linux/netfilter_ipv4.h and linux/netfilter_ipv6/ip6_tables.h */
+#ifdef __linux__
+#ifndef SO_ORIGINAL_DST
+#define SO_ORIGINAL_DST 80
+#endif
+#ifndef IP6T_SO_ORIGINAL_DST
+#define IP6T_SO_ORIGINAL_DST 80
+#endif
+#endif
+
+/* room for "[ipv6-address]" */
+#define LISTEN_HOST_SIZE (INET6_ADDRSTRLEN + 2)
+
+/* connection states */
+#define LISTEN_GREETING		0	/* reading the SOCKS greeting */
+#define LISTEN_SOCKS		1	/* reading the SOCKS request */
+#define LISTEN_CONNECTING	2	/* connecting to the proxy */
+#define LISTEN_REQUEST		3	/* sending the CONNECT request */
+#define LISTEN_RESPONSE		4	/* reading the CONNECT response */
+#define LISTEN_RELAY		5	/* tunnel is open */
+#define LISTEN_DEAD		6	/* closed, freed after the wakeup */
+
+/* settings shared by all workers */
+typedef struct listen_t {
+	struct config_t *config;
+	struct tunnel_opts_t *opts;
+	struct tcp_addr_t addrs[TCP_MAX_ADDRS];	/* of the proxy */
+	int naddrs;
+	struct sockaddr_storage local;	/* listening address */
+} listen_t;
+
+/* a worker thread with its own listening socket and connections */
+typedef struct listen_worker_t {
+	int id;
+	int lfd;			/* listening socket */
+	pthread_t thread;
+	struct event_t ev;
+	struct listen_t *ls;
+	struct listen_conn_t *dead;	/* closed, to be freed */
+	struct listen_conn_t *racing;	/* connecting to the proxy */
+	unsigned long accepted;		/* connections accepted */
+	unsigned long active;		/* connections open */
+	unsigned long long sent;	/* bytes sent to the proxy */
+	unsigned long long received;	/* bytes received from the proxy */
+} listen_worker_t;
+
+/* a client connection */
+typedef struct listen_conn_t {
+	struct tunnel_t tunnel;		/* first: event data of all fds */
+	int state;			/* LISTEN_* state */
+	int client;			/* accepted socket */
+	int sock;			/* proxy socket */
+	int reply;			/* SOCKS reply code owed, or -1 */
+	struct tcp_race_t race;		/* connecting to the proxy */
+	struct proxy_parser_t parser;	/* parser of the response */
+	struct buffer_t bx;		/* client to proxy, SOCKS first */
+	struct buffer_t by;		/* proxy to client, CONNECT first */
+	struct tunnel_stats_t stats[2];
+	struct listen_conn_t *prev;	/* previous racing connection */
+	struct listen_conn_t *next;	/* next racing or closed one */
+} listen_conn_t;
+
+/*
+ * Create a listening socket for addr, which is "host:port", ":port" or
+ * "*:port". With reuseport, SO_REUSEPORT lets each worker have its own
+ * socket on the same address, and the kernel spreads connections over
+ * them. Sets *reuseport to 0 if the option is not available.
+ *
+ * With transparent, IP_TRANSPARENT is set if allowed, so the socket can
+ * accept connections that TPROXY sends to it.
+ *
+ * Returns the socket, or -1 on error.
+ */
+
+int
+listen_socket(char *addr, int *reuseport, int transparent)
+{
+	int fd, on = 1, status;
+	char *host, *port;
+	struct addrinfo hints, *res, *ai;
+	
+	/* split at the last colon */
+	if ((host = strdup(addr)) == NULL) {
+		warn("strdup failed");
+		return -1;
+	}
+	
+	if ((port = strrchr(host, ':')) == NULL) {
+		warnx("%s: listen address needs a port", addr);
+		free(host);
+		return -1;
+	}
+	
+	*port++ = '\0';
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	
+	status = getaddrinfo((*host && strcmp(host, "*") != 0) ? host : NULL,
+		port, &hints, &res);
+	
+	if (status != 0) {
+		warnx("%s: %s", addr, gai_strerror(status));
+		free(host);
+		return -1;
+	}
+	
+	for (fd = -1, ai = res; ai && fd == -1; ai = ai->ai_next)
+	{
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+			ai->ai_protocol)) == -1)
+			continue;
+		
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		
+#ifdef IP_TRANSPARENT
+		/* needs CAP_NET_ADMIN, and only TPROXY needs it */
+		if (transparent && ai->ai_family == AF_INET)
+			setsockopt(fd, SOL_IP, IP_TRANSPARENT, &on,
+				sizeof(on));
+#endif
+		
+#ifdef SO_REUSEPORT
+		if (*reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+			&on, sizeof(on)) == -1)
+			*reuseport = 0;
+#else
+		*reuseport = 0;
+#endif
+		
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1 ||
+			listen(fd, LISTEN_BACKLOG) == -1 ||
+			fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+			fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		{
+			warn("%s: listen failed", addr);
+			close(fd);
+			fd = -1;
+		}
+	}
+	
+	freeaddrinfo(res);
+	free(host);
+	
+	return fd;
+}
+
+/*
+ * Return the port of a socket address, or -1 if it is not IP.
+ */
+
+static int
+listen_port(struct sockaddr_storage *sa)
+{
+	if (sa->ss_family == AF_INET)
+		return ntohs(((struct sockaddr_in *)sa)->sin_port);
+	if (sa->ss_family == AF_INET6)
+		return ntohs(((struct sockaddr_in6 *)sa)->sin6_port);
+	
+	return -1;
+}
+
+/*
+ * Check if a connection to dst would end up at the listening socket
+ * itself. This is the case for clients that connect to prcat directly
+ * instead of being redirected to it.
+ */
+
+static int
+listen_is_local(struct listen_t *ls, struct sockaddr_storage *dst)
+{
+	struct sockaddr_in *in4 = (struct sockaddr_in *)&ls->local;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&ls->local;
+	
+	if (listen_port(dst) != listen_port(&ls->local))
+		return 0;
+	
+	/* listening on all addresses */
+	if ((ls->local.ss_family == AF_INET &&
+		in4->sin_addr.s_addr == htonl(INADDR_ANY)) ||
+		(ls->local.ss_family == AF_INET6 &&
+		IN6_IS_ADDR_UNSPECIFIED(&in6->sin6_addr)))
+		return 1;
+	
+	if (dst->ss_family != ls->local.ss_family)
+		return 0;
+	
+	if (dst->ss_family == AF_INET)
+		return ((struct sockaddr_in *)dst)->sin_addr.s_addr ==
+			in4->sin_addr.s_addr;
+	
+	return IN6_ARE_ADDR_EQUAL(&((struct sockaddr_in6 *)dst)->sin6_addr,
+		&in6->sin6_addr);
+}
+
+/*
+ * Recover the original destination of a redirected client connection,
+ * and store it in host (at least LISTEN_HOST_SIZE bytes) and *port.
+ *
+ * With iptables REDIRECT or DNAT, conntrack knows the original address,
+ * and SO_ORIGINAL_DST returns it. With TPROXY, the connection is not
+ * rewritten, and the local address of the socket is the original one.
+ *
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+listen_origdst(struct listen_t *ls, int fd, char *host, int *port)
+{
+	void *addr;
+	char name[INET6_ADDRSTRLEN];
+	int family;
+	socklen_t len = sizeof(struct sockaddr_storage);
+	struct sockaddr_storage dst;
+	
+	if (getsockname(fd, (struct sockaddr *)&dst, &len) == -1) {
+		warn("getsockname failed");
+		return -1;
+	}
+	
+#ifdef __linux__
+	/* ask conntrack, keep the local address if it does not know */
+	len = sizeof(struct sockaddr_storage);
+	if (dst.ss_family == AF_INET)
+		getsockopt(fd, SOL_IP, SO_ORIGINAL_DST, &dst, &len);
+	else if (dst.ss_family == AF_INET6)
+		getsockopt(fd, SOL_IPV6, IP6T_SO_ORIGINAL_DST, &dst, &len);
+#endif
+	
+	/* a direct connection would be tunneled back to ourselves */
+	if (listen_is_local(ls, &dst)) {
+		warnx("connection was not redirected, dropped");
+		return -1;
+	}
+	
+	family = dst.ss_family;
+	
+	if (family == AF_INET) {
+		addr = &((struct sockaddr_in *)&dst)->sin_addr;
+	} else if (family == AF_INET6) {
+		addr = &((struct sockaddr_in6 *)&dst)->sin6_addr;
+		/* IPv4 client on a dual stack socket */
+		if (IN6_IS_ADDR_V4MAPPED(addr)) {
+			addr = (char *)addr + 12;
+			family = AF_INET;
+		}
+	} else {
+		warnx("unsupported address family %i", family);
+		return -1;
+	}
+	
+	if (inet_ntop(family, addr, name, sizeof(name)) == NULL) {
+		warn("inet_ntop failed");
+		return -1;
+	}
+	
+	if (family == AF_INET6)
+		snprintf(host, LISTEN_HOST_SIZE, "[%s]", name);
+	else
+		snprintf(host, LISTEN_HOST_SIZE, "%s", name);
+	
+	*port = listen_port(&dst);
+	
+	return 0;
+}
+
+/*
+ * Send a short handshake reply to the client. The reply is sent before
+ * any tunnel data, to an empty socket buffer, so it is written at once
+ * or not at all.
+ *
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+listen_reply(struct listen_conn_t *c, char *reply, size_t len)
+{
+	if (write(c->client, reply, len) != (ssize_t)len) {
+		warn("socks: reply failed");
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Take a connection off the list of those racing to the proxy, if it
+ * is on it.
+ */
+
+static void
+listen_unrace(struct listen_worker_t *w, struct listen_conn_t *c)
+{
+	if (c->prev)
+		c->prev->next = c->next;
+	else if (w->racing == c)
+		w->racing = c->next;
+	else
+		return;
+	
+	if (c->next)
+		c->next->prev = c->prev;
+	
+	c->prev = c->next = NULL;
+}
+
+/*
+ * Close a connection and release its resources. A SOCKS client that is
+ * still waiting for its reply is told why first.
+ *
+ * The connection itself is freed by listen_reap, as more events of the
+ * same wakeup may refer to it.
+ */
+
+static void
+listen_close(struct listen_worker_t *w, struct listen_conn_t *c)
+{
+	char reply[SOCKS_REPLY_SIZE];
+	
+	if (c->reply != -1) {
+		socks_reply(reply, c->reply);
+		listen_reply(c, reply, sizeof(reply));
+	}
+	
+	if (c->state == LISTEN_RELAY)
+		tunnel_free(&c->tunnel, &w->ev);
+	else if (c->state < LISTEN_CONNECTING)
+		event_del(&w->ev, c->client);
+	else if (c->state == LISTEN_CONNECTING) {
+		tcp_race_end(&c->race, &w->ev);
+		listen_unrace(w, c);
+	} else if (c->sock != -1)
+		event_del(&w->ev, c->sock);
+	
+	close(c->client);
+	if (c->sock != -1)
+		close(c->sock);
+	
+	buffer_free(&c->bx);
+	buffer_free(&c->by);
+	
+	__atomic_add_fetch(&w->sent, c->stats[TUNNEL_TX].bytes,
+		__ATOMIC_RELAXED);
+	__atomic_add_fetch(&w->received, c->stats[TUNNEL_RX].bytes,
+		__ATOMIC_RELAXED);
+	__atomic_sub_fetch(&w->active, 1, __ATOMIC_RELAXED);
+	
+	c->state = LISTEN_DEAD;
+	c->next = w->dead;
+	w->dead = c;
+}
+
+/*
+ * Free the connections closed during the last wakeup.
+ */
+
+static void
+listen_reap(struct listen_worker_t *w)
+{
+	struct listen_conn_t *c;
+	
+	while ((c = w->dead)) {
+		w->dead = c->next;
+		free(c);
+	}
+}
+
+/*
+ * Compose the CONNECT request for hostname and hostport, and start
+ * racing the addresses of the proxy, see tcp_race_step.
+ *
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+listen_dial(struct listen_worker_t *w, struct listen_conn_t *c,
+	char *hostname, int hostport)
+{
+	struct config_t *config = w->ls->config;
+	
+	c->state = LISTEN_CONNECTING;
+	
+	if (proxy_request(&c->by, hostname, hostport, config->username,
+		config->password) == -1)
+		return -1;
+	
+	tcp_race_init(&c->race, w->ls->addrs, w->ls->naddrs);
+	
+	if (tcp_race_step(&c->race, &w->ev, c, -1) == -1) {
+		warn("failed to connect to proxy");
+		return -1;
+	}
+	
+	/* listen_worker starts the next attempts when they are due */
+	c->next = w->racing;
+	if (c->next)
+		c->next->prev = c;
+	w->racing = c;
+	
+	return 0;
+}
+
+/*
+ * Set up a new client connection. In SOCKS mode, wait for the client
+ * to tell where to connect to. Otherwise, start connecting to the proxy
+ * right away; in transparent mode, the destination is the original
+ * destination of the client connection.
+ *
+ * Returns 0 if OK, -1 on error (the client socket is closed).
+ */
+
+static int
+listen_open(struct listen_worker_t *w, int client)
+{
+	int hostport;
+	size_t bufsize;
+	char *hostname, host[LISTEN_HOST_SIZE];
+	struct listen_conn_t *c;
+	struct config_t *config = w->ls->config;
+	
+	if ((c = calloc(1, sizeof(listen_conn_t))) == NULL) {
+		warn("connection allocation failed");
+		close(client);
+		return -1;
+	}
+	
+	c->client = client;
+	c->sock = -1;
+	c->reply = -1;
+	c->state = LISTEN_CONNECTING;
+	
+	__atomic_add_fetch(&w->accepted, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&w->active, 1, __ATOMIC_RELAXED);
+	
+	bufsize = tunnel_bufsize(w->ls->opts);
+	
+	if (buffer_init(&c->bx, bufsize) == -1 ||
+		buffer_init(&c->by, bufsize) == -1)
+	{
+		warn("buffer allocation failed");
+		listen_close(w, c);
+		return -1;
+	}
+	
+	if (config->socks) {
+		c->state = LISTEN_GREETING;
+		if (event_add(&w->ev, client, EVENT_READ, c) == -1) {
+			warn("can't watch fd %i", client);
+			listen_close(w, c);
+			return -1;
+		}
+		return 0;
+	}
+	
+	hostname = config->hostname;
+	hostport = config->hostport;
+	
+	if (config->transparent) {
+		if (listen_origdst(w->ls, client, host, &hostport) == -1) {
+			listen_close(w, c);
+			return -1;
+		}
+		hostname = host;
+	}
+	
+	if (listen_dial(w, c, hostname, hostport) == -1) {
+		listen_close(w, c);
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Accept all pending connections on the listening socket.
+ */
+
+static void
+listen_accept(struct listen_worker_t *w)
+{
+	int client;
+	
+	for (;;)
+	{
+		if ((client = accept(w->lfd, NULL, NULL)) == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+				errno != EINTR && errno != ECONNABORTED)
+				warn("accept failed");
+			return;
+		}
+		
+		fcntl(client, F_SETFD, FD_CLOEXEC);
+		
+		listen_open(w, client);
+	}
+}
+
+/*
+ * Read the SOCKS handshake from the client into bx, which holds no
+ * more than the handshake, and does not wrap around.
+ *
+ * Returns 1 if data was read, 0 if there is none, -1 on error or EOF.
+ */
+
+static int
+listen_socks_read(struct listen_conn_t *c)
+{
+	ssize_t n;
+	struct buffer_t *b = &c->bx;
+	
+	n = read(c->client, b->data + b->head + b->len,
+		b->size - b->head - b->len);
+	
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (n == -1)
+		warn("socks: read failed");
+	if (n <= 0)
+		return -1;
+	
+	buffer_commit(b, n);
+	
+	return 1;
+}
+
+/*
+ * Advance a connection that is not relaying yet, on an event of fd, or
+ * when the next attempt of its race is due if fd is -1.
+ *
+ * Returns 0 if OK, -1 if the connection must be closed.
+ */
+
+static int
+listen_setup(struct listen_worker_t *w, struct listen_conn_t *c, int fd)
+{
+	ssize_t n;
+	int port, code, status;
+	char host[SOCKS_HOST_SIZE], reply[SOCKS_REPLY_SIZE];
+	
+	switch (c->state)
+	{
+	case LISTEN_GREETING:
+		if ((status = listen_socks_read(c)) != 1)
+			return status;
+		reply[0] = 0;
+		status = socks_greeting(&c->bx, reply);
+		if (status == SOCKS_MORE)
+			return 0;
+		/* send the method selection, or the refusal */
+		if (reply[0] && listen_reply(c, reply, SOCKS_METHOD_SIZE) == -1)
+			return -1;
+		if (status == SOCKS_ERROR)
+			return -1;
+		c->state = LISTEN_SOCKS;
+		/* the request may have been sent along */
+		goto request;
+	case LISTEN_SOCKS:
+		if ((status = listen_socks_read(c)) != 1)
+			return status;
+request:
+		status = socks_request(&c->bx, host, &port, &code);
+		if (status == SOCKS_ERROR)
+			c->reply = code;
+		if (status != SOCKS_OK)
+			return (status == SOCKS_MORE) ? 0 : -1;
+		/* owe a failure reply, until the proxy says otherwise */
+		c->reply = SOCKS_FAILURE;
+		event_del(&w->ev, c->client);
+		return listen_dial(w, c, host, port);
+	case LISTEN_CONNECTING:
+		status = tcp_race_step(&c->race, &w->ev, c, fd);
+		if (status == TCP_PENDING)
+			return 0;
+		if (status == -1) {
+			warn("failed to connect to proxy");
+			return -1;
+		}
+		/* the winner is still watched for EVENT_WRITE */
+		listen_unrace(w, c);
+		c->sock = status;
+		c->state = LISTEN_REQUEST;
+		/* FALLTHROUGH */
+	case LISTEN_REQUEST:
+		if ((n = buffer_writev(&c->by, c->sock)) == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			warn("http send headers failed");
+			return -1;
+		}
+		if (c->by.len)
+			return 0;
+		/* request sent, wait for the response */
+		buffer_reset(&c->by);
+		proxy_parser_init(&c->parser, NULL, NULL);
+		if (event_mod(&w->ev, c->sock, EVENT_READ, c) == -1)
+			return -1;
+		c->state = LISTEN_RESPONSE;
+		return 0;
+	case LISTEN_RESPONSE:
+		n = read(c->sock, c->by.data + c->by.len, buffer_room(&c->by));
+		if (n == 0) {
+			warnx("http read headers failed: eof from proxy");
+			return -1;
+		} else if (n == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			warn("http read headers failed");
+			return -1;
+		}
+		buffer_commit(&c->by, n);
+		status = proxy_response(&c->by, &c->parser);
+		if (status == PROXY_ERROR && c->reply != -1)
+			c->reply = SOCKS_HOST_UNREACHABLE;
+		if (status != PROXY_OK)
+			return (status == PROXY_MORE) ? 0 : -1;
+		/* let a SOCKS client know right away */
+		if (c->reply != -1) {
+			c->reply = -1;
+			socks_reply(reply, SOCKS_SUCCEEDED);
+			if (listen_reply(c, reply, sizeof(reply)) == -1)
+				return -1;
+		}
+		/* tunnel is open: hand all fds to the tunnel */
+		event_del(&w->ev, c->sock);
+		c->state = LISTEN_RELAY;
+		return tunnel_init(&c->tunnel, &w->ev, c->client, c->client,
+			c->sock, c->sock, &c->bx, &c->by, w->ls->opts,
+			c->stats);
+	}
+	
+	return -1;
+}
+
+/*
+ * Worker thread: accept connections and handle all of them in one
+ * event loop. Never returns.
+ */
+
+static void *
+listen_worker(void *arg)
+{
+	int n, nready, status;
+	long long wait, left;
+	struct listen_worker_t *w = arg;
+	struct listen_conn_t *c, *next;
+	struct event_item_t ready[LISTEN_EVENTS];
+	
+	for (;;)
+	{
+		/* wait for events, or the next attempt of a race */
+		wait = -1;
+		for (c = w->racing; c; c = c->next)
+			if ((left = tcp_race_wait(&c->race)) != -1 &&
+				(wait == -1 || left < wait))
+				wait = left;
+		
+		if ((nready = event_wait(&w->ev, ready, LISTEN_EVENTS,
+			(int)wait)) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			err(EX_SOFTWARE, "event wait failed");
+		}
+		
+		for (n = 0; n < nready; ++n)
+		{
+			/* the listening socket has no event data */
+			if ((c = ready[n].data) == NULL) {
+				listen_accept(w);
+				continue;
+			}
+			
+			/* closed by an earlier event of this wakeup */
+			if (c->state == LISTEN_DEAD)
+				continue;
+			
+			if (c->state == LISTEN_RELAY)
+				status = tunnel_process(&c->tunnel, &w->ev,
+					ready[n].fd, ready[n].events);
+			else
+				status = listen_setup(w, c, ready[n].fd);
+			
+			if (status != 0)
+				listen_close(w, c);
+		}
+		
+		for (c = w->racing; c; c = next) {
+			next = c->next;
+			if (tcp_race_wait(&c->race) == 0 &&
+				listen_setup(w, c, -1) != 0)
+				listen_close(w, c);
+		}
+		
+		listen_reap(w);
+	}
+	
+	return NULL;
+}
+
+/*
+ * Print the connection counters of each worker.
+ */
+
+static void
+listen_report(struct listen_worker_t *workers, int count)
+{
+	int n;
+	
+	for (n = 0; n < count; ++n) {
+		warnx("worker %i: %lu connections, %lu active, "
+			"%llu bytes sent, %llu bytes received", n,
+			__atomic_load_n(&workers[n].accepted, __ATOMIC_RELAXED),
+			__atomic_load_n(&workers[n].active, __ATOMIC_RELAXED),
+			__atomic_load_n(&workers[n].sent, __ATOMIC_RELAXED),
+			__atomic_load_n(&workers[n].received,
+			__ATOMIC_RELAXED));
+	}
+}
+
+/*
+ * Accept local TCP connections on config->listen, and tunnel each one
+ * through the proxy to config->hostname and config->hostport.
+ *
+ * Connections are spread over config->workers threads. Each worker has
+ * its own SO_REUSEPORT socket, so the kernel balances new connections
+ * over the workers; without SO_REUSEPORT, the workers share a single
+ * socket. Each worker runs all its connections in one event loop: the
+ * connection to the proxy and the CONNECT request are non-blocking too,
+ * so a slow proxy does not hold up the other connections.
+ *
+ * In transparent mode, the destination of each connection is the one
+ * it had before iptables redirected it to us. In SOCKS mode, clients
+ * speak SOCKS5 and each tells where it wants to go; the reply is sent
+ * as soon as the proxy has opened the tunnel. The open file limit is
+ * raised as far as allowed, since every connection takes two fds.
+ *
+ * Runs until SIGINT or SIGTERM, and prints the counters of each worker
+ * if config->stats is set. Returns an exit code.
+ */
+
+int
+listen_handler(struct config_t *config, struct tunnel_opts_t *opts)
+{
+	int n, sig, reuseport = 1;
+	socklen_t len;
+	sigset_t set;
+	struct rlimit rl;
+	struct listen_t ls;
+	struct listen_worker_t *workers;
+	
+	ls.config = config;
+	ls.opts = opts;
+	
+	/* resolve the proxy once; every connection races its addresses */
+	if ((ls.naddrs = tcp_addrs(config->proxyname, config->proxyport,
+		ls.addrs, TCP_MAX_ADDRS)) == -1)
+		return EX_UNAVAILABLE;
+	
+	if (opts->relay == TUNNEL_RELAY_URING) {
+		warnx("uring relay not supported with listen, using copy");
+		opts->relay = TUNNEL_RELAY_COPY;
+	}
+	
+	if ((workers = calloc(config->workers, sizeof(listen_worker_t))) ==
+		NULL)
+	{
+		warn("worker allocation failed");
+		return EX_OSERR;
+	}
+	
+	/* allow as many connections as we can */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	
+	/* a client that goes away must not kill us */
+	signal(SIGPIPE, SIG_IGN);
+	
+	/* only the main thread takes SIGINT and SIGTERM */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	
+	for (n = 0; n < config->workers; ++n)
+	{
+		workers[n].id = n;
+		workers[n].ls = &ls;
+		
+		if (n == 0 || reuseport)
+			workers[n].lfd = listen_socket(config->listen,
+				&reuseport, config->transparent);
+		else
+			workers[n].lfd = workers[0].lfd;
+		
+		if (workers[n].lfd == -1)
+			return EX_UNAVAILABLE;
+		
+		/* needed to detect connections to ourselves */
+		len = sizeof(ls.local);
+		if (n == 0 && getsockname(workers[n].lfd,
+			(struct sockaddr *)&ls.local, &len) == -1)
+			err(EX_OSERR, "getsockname failed");
+		
+		if (event_init(&workers[n].ev) == -1)
+			err(EX_OSERR, "event init failed");
+		if (event_add(&workers[n].ev, workers[n].lfd, EVENT_READ,
+			NULL) == -1)
+			err(EX_OSERR, "can't watch listening socket");
+		
+		errno = pthread_create(&workers[n].thread, NULL,
+			listen_worker, &workers[n]);
+		if (errno)
+			err(EX_OSERR, "can't start worker %i", n);
+	}
+	
+	sigwait(&set, &sig);
+	
+	if (config->stats)
+		listen_report(workers, config->workers);
+	
+	return EX_OK;
+}
@@ -0,0 +1,321 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+
+/*
+ * The LZ4 block format: a block is a list of sequences, each a token
+ * byte, literals, and a match to copy from earlier output. The token
+ * holds the amount of literals in its high nibble, and the match
+ * length minus 4 in its low nibble; a nibble of 15 continues in bytes
+ * of 255, up to the first byte that is less. The literals follow, then
+ * the match offset as 2 bytes little endian. The last sequence has
+ * literals only; the last 5 bytes of a block are always literals, and
+ * the last match starts at least 12 bytes before the end.
+ *
+ * Blocks are compressed as part of a stream: a match may copy data of
+ * earlier blocks, up to LZ4_WINDOW bytes back, if the decompressor has
+ * them right before the block as well. Only the block format is
+ * implemented; there is no frame format and no checksum.
+ */
+
+/* shortest match */
+#define LZ4_MINMATCH 4
+
+/* literals at the end of a block */
+#define LZ4_LAST_LITERALS 5
+
+/* the last match starts this far from the end of a block */
+#define LZ4_MFLIMIT 12
+
+/* misses before the search skips ahead faster (as a shift) */
+#define LZ4_SKIP_TRIGGER 6
+
+/*
+ * Read 4 bytes as an unsigned int.
+ */
+
+static uint32_t
+lz4_read32(const unsigned char *p)
+{
+	uint32_t v;
+	
+	memcpy(&v, p, sizeof(v));
+	
+	return v;
+}
+
+/*
+ * Returns the match table index of the 4 bytes at p.
+ */
+
+static uint32_t
+lz4_hash(const unsigned char *p)
+{
+	return (lz4_read32(p) * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/*
+ * Write the bytes of a length beyond a full nibble. Returns the next
+ * output position.
+ */
+
+static unsigned char *
+lz4_length(unsigned char *op, size_t n)
+{
+	for (; n >= 255; n -= 255)
+		*op++ = 255;
+	*op++ = (unsigned char)n;
+	
+	return op;
+}
+
+/*
+ * Write a sequence: literals from anchor to ip, then a match of mlen
+ * bytes at offset (no match if mlen is 0). Returns the next output
+ * position, or NULL if it would not fit before oend.
+ */
+
+static unsigned char *
+lz4_sequence(unsigned char *op, unsigned char *oend,
+	const unsigned char *anchor, const unsigned char *ip,
+	size_t offset, size_t mlen)
+{
+	unsigned char *token;
+	size_t lit = ip - anchor;
+	
+	/* token, literal length bytes, literals, offset, match bytes */
+	if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 +
+		mlen / 255 + 1)
+		return NULL;
+	
+	token = op++;
+	
+	if (lit >= 15) {
+		*token = 15 << 4;
+		op = lz4_length(op, lit - 15);
+	} else {
+		*token = (unsigned char)(lit << 4);
+	}
+	
+	memcpy(op, anchor, lit);
+	op += lit;
+	
+	if (mlen == 0)
+		return op;
+	
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	
+	mlen -= LZ4_MINMATCH;
+	if (mlen >= 15) {
+		*token |= 15;
+		op = lz4_length(op, mlen - 15);
+	} else {
+		*token |= mlen;
+	}
+	
+	return op;
+}
+
+/*
+ * Reset the compressor, for a new stream.
+ */
+
+void
+lz4_init(struct lz4_t *z)
+{
+	memset(z->table, 0, sizeof(z->table));
+}
+
+/*
+ * Tell the compressor the data of the stream was moved delta bytes
+ * towards the start of its buffer.
+ */
+
+void
+lz4_slide(struct lz4_t *z, size_t delta)
+{
+	int n;
+	
+	for (n = 0; n < (1 << LZ4_HASH_LOG); ++n)
+		z->table[n] = (z->table[n] > delta) ? z->table[n] - delta : 0;
+}
+
+/*
+ * Compress len bytes at base + pos into a block at dst, of at most cap
+ * bytes. Matches may copy from the data before it, down to base.
+ *
+ * Returns the size of the block, or 0 if it doesn't fit in cap bytes;
+ * a small cap gives up early on data that doesn't compress.
+ */
+
+size_t
+lz4_compress(struct lz4_t *z, const unsigned char *base, size_t pos,
+	size_t len, unsigned char *dst, size_t cap)
+{
+	uint32_t h;
+	size_t mlen, misses = 0;
+	const unsigned char *ip = base + pos, *anchor = ip, *ref;
+	const unsigned char *end = ip + len, *mflimit, *matchlimit;
+	unsigned char *op = dst, *oend = dst + cap;
+	
+	/* too short for a match: all literals */
+	mflimit = (len > LZ4_MFLIMIT) ? end - LZ4_MFLIMIT : ip;
+	matchlimit = end - ((len > LZ4_MFLIMIT) ? LZ4_LAST_LITERALS : 0);
+	
+	while (ip < mflimit)
+	{
+		h = lz4_hash(ip);
+		ref = base + z->table[h];
+		z->table[h] = ip - base;
+		
+		if (ref >= ip || ip - ref > LZ4_WINDOW ||
+			lz4_read32(ref) != lz4_read32(ip))
+		{
+			/* data that doesn't compress is skipped faster */
+			ip += 1 + (misses++ >> LZ4_SKIP_TRIGGER);
+			continue;
+		}
+		
+		misses = 0;
+		
+		/* extend the match forwards, and backwards over the
+		 * literals */
+		for (mlen = LZ4_MINMATCH; ip + mlen < matchlimit &&
+			ip[mlen] == ref[mlen]; ++mlen)
+			;
+		for (; ip > anchor && ref > base && ip[-1] == ref[-1];
+			--ip, --ref)
+			++mlen;
+		
+		if ((op = lz4_sequence(op, oend, anchor, ip, ip - ref,
+			mlen)) == NULL)
+			return 0;
+		
+		ip += mlen;
+		anchor = ip;
+	}
+	
+	/* the rest is literals */
+	if ((op = lz4_sequence(op, oend, anchor, end, 0, 0)) == NULL)
+		return 0;
+	
+	return op - dst;
+}
+
+/*
+ * Read the bytes of a length beyond a full nibble, adding them to *n.
+ * Returns the next input position, or NULL if the input ends.
+ */
+
+static const unsigned char *
+lz4_getlength(const unsigned char *ip, const unsigned char *iend,
+	size_t *n)
+{
+	unsigned char b;
+	
+	do {
+		if (ip == iend)
+			return NULL;
+		b = *ip++;
+		*n += b;
+	} while (b == 255);
+	
+	return ip;
+}
+
+/*
+ * Decompress the block of len bytes at src into base + pos, writing at
+ * most cap bytes. Matches may copy from the data before it, down to
+ * base, which must be the data the compressor had there.
+ *
+ * Returns the amount of bytes written, or -1 if the block is not valid.
+ */
+
+ssize_t
+lz4_decompress(const unsigned char *src, size_t len, unsigned char *base,
+	size_t pos, size_t cap)
+{
+	int token;
+	size_t lit, mlen, offset;
+	const unsigned char *ip = src, *iend = src + len, *ref;
+	unsigned char *op = base + pos, *oend = op + cap;
+	
+	while (ip < iend)
+	{
+		token = *ip++;
+		
+		lit = token >> 4;
+		if (lit == 15 && (ip = lz4_getlength(ip, iend, &lit)) == NULL)
+			return -1;
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			return -1;
+		
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		
+		/* the last sequence has no match */
+		if (ip == iend)
+			break;
+		
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		
+		mlen = token & 15;
+		if (mlen == 15 && (ip = lz4_getlength(ip, iend, &mlen)) == NULL)
+			return -1;
+		mlen += LZ4_MINMATCH;
+		
+		if (offset == 0 || offset > (size_t)(op - base) ||
+			mlen > (size_t)(oend - op))
+			return -1;
+		
+		/* a match may overlap the data it copies */
+		ref = op - offset;
+		if (offset >= mlen) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		} else {
+			while (mlen--)
+				*op++ = *ref++;
+		}
+	}
+	
+	return op - (base + pos);
+}
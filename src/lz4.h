@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* bits of the hash of 4 bytes, that index the match table */
+#define LZ4_HASH_LOG 12
+
+/* largest match offset */
+#define LZ4_WINDOW 65535
+
+/* worst case compressed size of len bytes */
+#define LZ4_BOUND(len) ((len) + (len) / 255 + 16)
+
+/* compressor state: where 4 bytes with each hash were seen last */
+typedef struct lz4_t {
+	uint32_t table[1 << LZ4_HASH_LOG];
+} lz4_t;
+
+void lz4_init(struct lz4_t *z);
+void lz4_slide(struct lz4_t *z, size_t delta);
+size_t lz4_compress(struct lz4_t *z, const unsigned char *base, size_t pos,
+	size_t len, unsigned char *dst, size_t cap);
+ssize_t lz4_decompress(const unsigned char *src, size_t len,
+	unsigned char *base, size_t pos, size_t cap);
+
+#endif /* _LZ4_H_ */
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "md4.h"
+
+/*
+ * MD4 (RFC 1320) is broken, but NTLM hashes passwords with it, so this
+ * is only here for NTLM authentication.
+ */
+
+#define F(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define G(x, y, z) (((x) & (y)) | ((x) & (z)) | ((y) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/* per round: order of the words, and shift amounts */
+static const int md4_word[3][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15 },
+	{ 0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15 }
+};
+static const int md4_shift[3][4] = {
+	{ 3, 7, 11, 19 }, { 3, 5, 9, 13 }, { 3, 9, 11, 15 }
+};
+
+/*
+ * Hash one 64 byte block into the state.
+ */
+
+static void
+md4_block(uint32_t *state, const unsigned char *block)
+{
+	int i, r;
+	uint32_t a, b, c, d, f, t, x[16];
+	
+	/* the block is little endian */
+	for (i = 0; i < 16; ++i)
+		x[i] = (uint32_t)block[i * 4] |
+			(uint32_t)block[i * 4 + 1] << 8 |
+			(uint32_t)block[i * 4 + 2] << 16 |
+			(uint32_t)block[i * 4 + 3] << 24;
+	
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	
+	/* 3 rounds of 16 steps, rotating the registers after each */
+	for (i = 0; i < 48; ++i)
+	{
+		r = i / 16;
+		
+		if (r == 0)
+			f = F(b, c, d);
+		else if (r == 1)
+			f = G(b, c, d) + 0x5a827999;
+		else
+			f = H(b, c, d) + 0x6ed9eba1;
+		
+		t = d;
+		d = c;
+		c = b;
+		b = ROTL(a + f + x[md4_word[r][i % 16]], md4_shift[r][i % 4]);
+		a = t;
+	}
+	
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+/*
+ * Compute the MD4 hash of len bytes of data, and store the MD4_SIZE
+ * byte digest.
+ */
+
+void
+md4(const void *data, size_t len, unsigned char *digest)
+{
+	int i;
+	size_t n, padlen;
+	uint64_t bits = (uint64_t)len * 8;
+	uint32_t state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe,
+		0x10325476 };
+	unsigned char block[128];
+	const unsigned char *p = data;
+	
+	for (n = len; n >= 64; n -= 64, p += 64)
+		md4_block(state, p);
+	
+	/* the rest, a 1 bit, zeros up to 56 mod 64, and the length */
+	padlen = (n < 56) ? 64 : 128;
+	memset(block, 0, sizeof(block));
+	memcpy(block, p, n);
+	block[n] = 0x80;
+	for (i = 0; i < 8; ++i)
+		block[padlen - 8 + i] = bits >> (i * 8);
+	
+	md4_block(state, block);
+	if (padlen == 128)
+		md4_block(state, block + 64);
+	
+	for (i = 0; i < 16; ++i)
+		digest[i] = state[i / 4] >> ((i % 4) * 8);
+}
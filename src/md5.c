@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "md5.h"
+
+#define F(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define G(x, y, z) (((x) & (z)) | ((y) & ~(z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/* per step shift amounts, 4 per round */
+static const int md5_shift[16] = {
+	7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21
+};
+
+/* sines: floor(abs(sin(i + 1)) * 2^32) */
+static const uint32_t md5_sine[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf,
+	0x4787c62a, 0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af,
+	0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e,
+	0x49b40821, 0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+	0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8, 0x21e1cde6,
+	0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+	0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122,
+	0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039,
+	0xe6db99e5, 0x1fa27cf8, 0xc4ac5665, 0xf4292244, 0x432aff97,
+	0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d,
+	0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+	0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+/*
+ * Hash one 64 byte block into the state.
+ */
+
+static void
+md5_block(uint32_t *state, const unsigned char *block)
+{
+	int i, k;
+	uint32_t a, b, c, d, f, t, x[16];
+	
+	/* the block is little endian */
+	for (i = 0; i < 16; ++i)
+		x[i] = (uint32_t)block[i * 4] |
+			(uint32_t)block[i * 4 + 1] << 8 |
+			(uint32_t)block[i * 4 + 2] << 16 |
+			(uint32_t)block[i * 4 + 3] << 24;
+	
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	
+	/* 4 rounds of 16 steps, rotating the registers after each */
+	for (i = 0; i < 64; ++i)
+	{
+		switch (i / 16) {
+		case 0:
+			f = F(b, c, d);
+			k = i;
+			break;
+		case 1:
+			f = G(b, c, d);
+			k = (5 * i + 1) % 16;
+			break;
+		case 2:
+			f = H(b, c, d);
+			k = (3 * i + 5) % 16;
+			break;
+		default:
+			f = I(b, c, d);
+			k = (7 * i) % 16;
+			break;
+		}
+		
+		t = d;
+		d = c;
+		c = b;
+		b += ROTL(a + f + x[k] + md5_sine[i],
+			md5_shift[(i / 16) * 4 + i % 4]);
+		a = t;
+	}
+	
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+/*
+ * Start a new hash.
+ */
+
+void
+md5_init(struct md5_t *ctx)
+{
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->count = 0;
+}
+
+/*
+ * Add len bytes of data to the hash.
+ */
+
+void
+md5_update(struct md5_t *ctx, const void *data, size_t len)
+{
+	size_t used, n;
+	const unsigned char *p = data;
+	
+	used = ctx->count % 64;
+	ctx->count += len;
+	
+	while (len)
+	{
+		n = (len < 64 - used) ? len : 64 - used;
+		memcpy(ctx->block + used, p, n);
+		used += n;
+		p += n;
+		len -= n;
+		
+		if (used == 64) {
+			md5_block(ctx->state, ctx->block);
+			used = 0;
+		}
+	}
+}
+
+/*
+ * Finish the hash, and store the MD5_SIZE byte digest.
+ */
+
+void
+md5_final(struct md5_t *ctx, unsigned char *digest)
+{
+	int i;
+	uint64_t bits = ctx->count * 8;
+	unsigned char pad[72];
+	size_t padlen;
+	
+	/* a 1 bit, zeros up to 56 mod 64, and the length in bits */
+	padlen = 64 - (ctx->count + 8) % 64;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; ++i)
+		pad[padlen + i] = bits >> (i * 8);
+	
+	md5_update(ctx, pad, padlen + 8);
+	
+	for (i = 0; i < 16; ++i)
+		digest[i] = ctx->state[i / 4] >> ((i % 4) * 8);
+}
+
+/*
+ * Compute HMAC-MD5 (RFC 2104) of data with key, and store the MD5_SIZE
+ * byte digest.
+ */
+
+void
+md5_hmac(const void *key, size_t klen, const void *data, size_t len,
+	unsigned char *digest)
+{
+	int i;
+	unsigned char k[64], pad[64];
+	struct md5_t ctx;
+	
+	/* long keys are hashed first */
+	memset(k, 0, sizeof(k));
+	if (klen > 64) {
+		md5_init(&ctx);
+		md5_update(&ctx, key, klen);
+		md5_final(&ctx, k);
+	} else {
+		memcpy(k, key, klen);
+	}
+	
+	/* inner hash */
+	for (i = 0; i < 64; ++i)
+		pad[i] = k[i] ^ 0x36;
+	md5_init(&ctx);
+	md5_update(&ctx, pad, 64);
+	md5_update(&ctx, data, len);
+	md5_final(&ctx, digest);
+	
+	/* outer hash */
+	for (i = 0; i < 64; ++i)
+		pad[i] = k[i] ^ 0x5c;
+	md5_init(&ctx);
+	md5_update(&ctx, pad, 64);
+	md5_update(&ctx, digest, MD5_SIZE);
+	md5_final(&ctx, digest);
+}
@@ -0,0 +1,1029 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "connect.h"
+#include "event.h"
+#include "listen.h"
+#include "lz4.h"
+#include "mux.h"
+#include "peer.h"
+
+/*
+ * A multiplexed peer link carries many streams between a prcat in
+ * listen mode (-z -l) and a prcat peer (-Z), over one tunnel through
+ * the proxy. Every connection accepted by the client is a stream, and
+ * the peer connects each stream to its destination.
+ *
+ * Both sides start with MUX_MAGIC, then send frames: a header of
+ * MUX_HEADER bytes (type, flags, payload length in 2 bytes, stream id
+ * in 4 bytes, in network byte order), then the payload. Stream ids are
+ * never reused within a link, so a frame for a stream that is gone is
+ * simply dropped. The payload of a data frame is compressed as in peer
+ * mode, with one codec per direction of the link.
+ *
+ * Every stream has its own window: it may send MUX_WINDOW_SIZE bytes
+ * that the receiver did not write out yet, and the receiver tells how
+ * much it wrote with window frames. A stream whose destination is slow
+ * stops at its window, without holding up the link for the others.
+ * Streams take turns on the link with at most MUX_CHUNK bytes, and data
+ * is only queued while the link queue is short, so a bulk transfer
+ * can't make an interactive stream wait for more than a few chunks.
+ */
+
+/* frame types */
+#define MUX_OPEN	1	/* open a stream */
+#define MUX_DATA	2	/* data of a stream */
+#define MUX_WINDOW	3	/* receiver wrote this many more bytes */
+#define MUX_EOF		4	/* no more data on a stream */
+#define MUX_CLOSE	5	/* stream is gone */
+
+/* frame flags */
+#define MUX_COMPRESSED	0x01	/* payload is an LZ4 block */
+
+/* frame header */
+#define MUX_HEADER 8
+
+/* bytes a stream may send before the receiver wrote them */
+#define MUX_WINDOW_SIZE (256 * 1024)
+
+/* max bytes of a stream in one data frame */
+#define MUX_CHUNK 16384
+
+/* data frames are only queued while the link queue is shorter */
+#define MUX_QUEUE 16384
+
+/* largest frame */
+#define MUX_FRAME (MUX_HEADER + LZ4_BOUND(MUX_CHUNK))
+
+/* max events handled per wakeup */
+#define MUX_EVENTS 64
+
+/* stream state flags */
+#define MUX_CONNECTING	0x01	/* connecting to the destination */
+#define MUX_EOF_IN	0x02	/* socket hit EOF, MUX_EOF was sent */
+#define MUX_EOF_OUT	0x04	/* got MUX_EOF, shut down when written */
+#define MUX_SHUT	0x08	/* socket was shut down */
+#define MUX_DEAD	0x10	/* stream is gone, freed after the wakeup */
+
+/* a stream: a local connection */
+typedef struct mux_stream_t {
+	int fd;				/* local socket */
+	uint32_t id;
+	int state;			/* MUX_* state flags */
+	int events;			/* events being watched */
+	size_t credit;			/* bytes it may send */
+	size_t consumed;		/* bytes written, not told yet */
+	struct buffer_t b;		/* data from the peer */
+	struct tcp_race_t race;		/* connecting to the destination */
+	struct mux_stream_t *next;
+} mux_stream_t;
+
+/* a link and its streams */
+typedef struct mux_t {
+	struct config_t *config;
+	struct event_t ev;
+	int link;			/* socket to the peer */
+	int levents;			/* events watched on link */
+	int lfd;			/* listening socket, or -1 */
+	int hello;			/* greeting not seen yet */
+	uint32_t next;			/* id of the next stream */
+	struct tcp_addr_t addrs[TCP_MAX_ADDRS];	/* of the destination */
+	int naddrs;
+	struct mux_stream_t *streams;
+	unsigned char *out;		/* frames to send */
+	size_t osize;			/* size of out */
+	size_t olen;			/* bytes in out */
+	size_t ooff;			/* bytes of out sent */
+	unsigned char in[MUX_FRAME];	/* frames received */
+	size_t ilen;			/* bytes in in */
+	struct peer_codec_t tx;		/* compresses data frames */
+	struct peer_codec_t rx;		/* expands data frames */
+	unsigned long opened;		/* streams opened */
+	unsigned long long sent;	/* stream bytes sent */
+	unsigned long long received;	/* stream bytes received */
+	unsigned long long wsent;	/* link bytes sent */
+	unsigned long long wreceived;	/* link bytes received */
+} mux_t;
+
+/* set by SIGINT and SIGTERM */
+static volatile sig_atomic_t mux_stop;
+
+/*
+ * Signal handler: stop the client.
+ */
+
+static void
+mux_signal(int sig)
+{
+	mux_stop = 1;
+}
+
+/*
+ * Returns the link queue room of len bytes, moving or growing it if
+ * needed, or NULL on error.
+ */
+
+static unsigned char *
+mux_reserve(struct mux_t *m, size_t len)
+{
+	size_t size;
+	unsigned char *out;
+	
+	if (m->ooff && m->ooff == m->olen)
+		m->olen = m->ooff = 0;
+	
+	if (m->olen + len <= m->osize)
+		return m->out + m->olen;
+	
+	/* move the unsent frames to the start */
+	if (m->ooff) {
+		memmove(m->out, m->out + m->ooff, m->olen - m->ooff);
+		m->olen -= m->ooff;
+		m->ooff = 0;
+		if (m->olen + len <= m->osize)
+			return m->out + m->olen;
+	}
+	
+	for (size = m->osize ? m->osize : MUX_FRAME; size < m->olen + len; )
+		size *= 2;
+	
+	if ((out = realloc(m->out, size)) == NULL) {
+		warn("link queue allocation failed");
+		return NULL;
+	}
+	
+	m->out = out;
+	m->osize = size;
+	
+	return m->out + m->olen;
+}
+
+/*
+ * Write a frame header at p.
+ */
+
+static void
+mux_header(unsigned char *p, int type, int flags, size_t len, uint32_t id)
+{
+	p[0] = type;
+	p[1] = flags;
+	p[2] = (len >> 8) & 0xff;
+	p[3] = len & 0xff;
+	p[4] = (id >> 24) & 0xff;
+	p[5] = (id >> 16) & 0xff;
+	p[6] = (id >> 8) & 0xff;
+	p[7] = id & 0xff;
+}
+
+/*
+ * Queue a control frame for stream id, with a 4 byte value as payload
+ * if type is MUX_WINDOW. Returns 0 if OK, -1 on error.
+ */
+
+static int
+mux_control(struct mux_t *m, int type, uint32_t id, uint32_t value)
+{
+	size_t len = (type == MUX_WINDOW) ? 4 : 0;
+	unsigned char *p;
+	
+	if ((p = mux_reserve(m, MUX_HEADER + len)) == NULL)
+		return -1;
+	
+	mux_header(p, type, 0, len, id);
+	
+	if (len) {
+		p[8] = (value >> 24) & 0xff;
+		p[9] = (value >> 16) & 0xff;
+		p[10] = (value >> 8) & 0xff;
+		p[11] = value & 0xff;
+	}
+	
+	m->olen += MUX_HEADER + len;
+	
+	return 0;
+}
+
+/*
+ * Returns the stream with id, or NULL if it is gone.
+ */
+
+static struct mux_stream_t *
+mux_find(struct mux_t *m, uint32_t id)
+{
+	struct mux_stream_t *s;
+	
+	for (s = m->streams; s; s = s->next)
+		if (s->id == id && !(s->state & MUX_DEAD))
+			return s;
+	
+	return NULL;
+}
+
+/*
+ * Add a stream for the connected socket fd, or -1 for a stream that
+ * races the addresses of the destination. Returns the stream, or NULL
+ * on error; fd is closed in that case.
+ */
+
+static struct mux_stream_t *
+mux_add(struct mux_t *m, int fd, uint32_t id, int state)
+{
+	struct mux_stream_t *s;
+	
+	if ((s = calloc(1, sizeof(*s))) == NULL ||
+		buffer_init(&s->b, MUX_WINDOW_SIZE) == -1)
+	{
+		warn("stream allocation failed");
+		free(s);
+		if (fd != -1)
+			close(fd);
+		return NULL;
+	}
+	
+	if (fd != -1 && event_add(&m->ev, fd, 0, s) == -1) {
+		warn("can't watch fd %i", fd);
+		buffer_free(&s->b);
+		free(s);
+		close(fd);
+		return NULL;
+	}
+	
+	s->fd = fd;
+	s->id = id;
+	s->state = state;
+	s->credit = MUX_WINDOW_SIZE;
+	s->next = m->streams;
+	m->streams = s;
+	m->opened++;
+	
+	return s;
+}
+
+/*
+ * End a stream: tell the peer, unless it told us, and free it after
+ * this wakeup. Returns 0 if OK, -1 on error.
+ */
+
+static int
+mux_close(struct mux_t *m, struct mux_stream_t *s, int tell)
+{
+	s->state |= MUX_DEAD;
+	
+	return tell ? mux_control(m, MUX_CLOSE, s->id, 0) : 0;
+}
+
+/*
+ * Free the streams that are gone.
+ */
+
+static void
+mux_reap(struct mux_t *m)
+{
+	struct mux_stream_t *s, **sp;
+	
+	for (sp = &m->streams; (s = *sp); )
+	{
+		if (!(s->state & MUX_DEAD)) {
+			sp = &s->next;
+			continue;
+		}
+		
+		*sp = s->next;
+		if (s->state & MUX_CONNECTING) {
+			tcp_race_end(&s->race, &m->ev);
+		} else {
+			event_del(&m->ev, s->fd);
+			close(s->fd);
+		}
+		buffer_free(&s->b);
+		free(s);
+	}
+}
+
+/*
+ * Read from the socket of a stream, and queue it as a data frame, or
+ * an EOF frame. Returns 0 if OK, -1 on error.
+ */
+
+static int
+mux_read(struct mux_t *m, struct mux_stream_t *s)
+{
+	int compressed;
+	size_t len, max;
+	ssize_t nread;
+	unsigned char *p;
+	
+	max = (s->credit < MUX_CHUNK) ? s->credit : MUX_CHUNK;
+	
+	if ((p = mux_reserve(m, MUX_HEADER + LZ4_BOUND(max))) == NULL)
+		return -1;
+	
+	if ((nread = read(s->fd, peer_codec_room(&m->tx), max)) == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		/* the connection is broken, so is the stream */
+		return mux_close(m, s, 1);
+	}
+	
+	if (nread == 0) {
+		s->state |= MUX_EOF_IN;
+		return mux_control(m, MUX_EOF, s->id, 0);
+	}
+	
+	len = peer_codec_pack(&m->tx, nread, p + MUX_HEADER, &compressed);
+	mux_header(p, MUX_DATA, compressed ? MUX_COMPRESSED : 0, len, s->id);
+	m->olen += MUX_HEADER + len;
+	
+	s->credit -= nread;
+	m->sent += nread;
+	
+	return 0;
+}
+
+/*
+ * Write data from the peer to the socket of a stream, and shut it down
+ * after the peer's EOF. Nothing happens while the stream connects; the
+ * buffer and the EOF are handled once the connect is done. Returns 0 if
+ * OK, -1 on error.
+ */
+
+static int
+mux_write(struct mux_t *m, struct mux_stream_t *s)
+{
+	ssize_t nwritten;
+	
+	/* no socket yet */
+	if (s->state & MUX_CONNECTING)
+		return 0;
+	
+	if (s->b.len) {
+		if ((nwritten = buffer_writev(&s->b, s->fd)) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+				errno == EINTR)
+				return 0;
+			return mux_close(m, s, 1);
+		}
+		
+		/* make room in the window of the peer, in steps so
+		 * window frames don't take too much of the link */
+		s->consumed += nwritten;
+		if (s->consumed >= MUX_WINDOW_SIZE / 4) {
+			if (mux_control(m, MUX_WINDOW, s->id,
+				s->consumed) == -1)
+				return -1;
+			s->consumed = 0;
+		}
+	}
+	
+	if (s->b.len == 0 && (s->state & MUX_EOF_OUT) &&
+		!(s->state & MUX_SHUT))
+	{
+		shutdown(s->fd, SHUT_WR);
+		s->state |= MUX_SHUT;
+	}
+	
+	/* done in both directions */
+	if ((s->state & MUX_EOF_IN) && (s->state & MUX_SHUT))
+		return mux_close(m, s, 0);
+	
+	return 0;
+}
+
+/*
+ * Copy data from the peer into the buffer of a stream.
+ */
+
+static void
+mux_put(struct buffer_t *b, const unsigned char *data, size_t len)
+{
+	size_t pos, n;
+	
+	while (len)
+	{
+		pos = (b->head + b->len) % b->size;
+		n = (len < b->size - pos) ? len : b->size - pos;
+		memcpy(b->data + pos, data, n);
+		buffer_commit(b, n);
+		data += n;
+		len -= n;
+	}
+}
+
+/*
+ * Open a stream for the peer: start racing the addresses of the
+ * destination, see tcp_race_step. Returns 0 if OK, -1 on error.
+ */
+
+static int
+mux_open(struct mux_t *m, uint32_t id)
+{
+	struct mux_stream_t *s;
+	
+	if (m->lfd != -1 || mux_find(m, id)) {
+		warnx("peer opened a stream it can't open");
+		return -1;
+	}
+	
+	if ((s = mux_add(m, -1, id, MUX_CONNECTING)) == NULL)
+		return mux_control(m, MUX_CLOSE, id, 0);
+	
+	tcp_race_init(&s->race, m->addrs, m->naddrs);
+	
+	if (tcp_race_step(&s->race, &m->ev, s, -1) == -1) {
+		warn("failed to connect to %s:%i", m->config->hostname,
+			m->config->hostport);
+		return mux_close(m, s, 1);
+	}
+	
+	return 0;
+}
+
+/*
+ * Handle a frame from the peer. Returns 0 if OK, -1 on error.
+ */
+
+static int
+mux_frame(struct mux_t *m, int type, int flags, unsigned char *payload,
+	size_t len, uint32_t id)
+{
+	ssize_t raw = 0;
+	unsigned char *data = NULL;
+	struct mux_stream_t *s;
+	
+	if (type == MUX_OPEN)
+		return mux_open(m, id);
+	
+	/* expand data, also for streams that are gone: the codec
+	 * needs all of it */
+	if (type == MUX_DATA) {
+		raw = peer_codec_unpack(&m->rx, payload, len,
+			(flags & MUX_COMPRESSED) != 0, &data);
+		if (raw == -1) {
+			warnx("peer sent a bad frame");
+			return -1;
+		}
+		m->received += raw;
+	}
+	
+	if ((s = mux_find(m, id)) == NULL)
+		return 0;
+	
+	switch (type) {
+	case MUX_DATA:
+		if ((size_t)raw > buffer_room(&s->b)) {
+			warnx("peer overran the window of a stream");
+			return -1;
+		}
+		mux_put(&s->b, data, raw);
+		return mux_write(m, s);
+	case MUX_WINDOW:
+		if (len != 4)
+			break;
+		s->credit += ((uint32_t)payload[0] << 24) |
+			((uint32_t)payload[1] << 16) |
+			((uint32_t)payload[2] << 8) | payload[3];
+		return 0;
+	case MUX_EOF:
+		s->state |= MUX_EOF_OUT;
+		return mux_write(m, s);
+	case MUX_CLOSE:
+		return mux_close(m, s, 0);
+	}
+	
+	warnx("peer sent a bad frame");
+	return -1;
+}
+
+/*
+ * Handle all complete frames in m->in, and keep the partial one.
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+mux_parse(struct mux_t *m)
+{
+	size_t off, len;
+	unsigned char *p;
+	
+	for (off = 0; ; off += MUX_HEADER + len)
+	{
+		p = m->in + off;
+		
+		if (m->hello) {
+			if (m->ilen - off < sizeof(MUX_MAGIC) - 1)
+				break;
+			if (memcmp(p, MUX_MAGIC, sizeof(MUX_MAGIC) - 1) != 0) {
+				warnx("the far end is not a prcat peer");
+				return -1;
+			}
+			m->hello = 0;
+			off += sizeof(MUX_MAGIC) - 1;
+			p += sizeof(MUX_MAGIC) - 1;
+		}
+		
+		if (m->ilen - off < MUX_HEADER)
+			break;
+		
+		len = (p[2] << 8) | p[3];
+		if (MUX_HEADER + len > sizeof(m->in)) {
+			warnx("peer sent a bad frame");
+			return -1;
+		}
+		if (m->ilen - off < MUX_HEADER + len)
+			break;
+		
+		if (mux_frame(m, p[0], p[1], p + MUX_HEADER, len,
+			((uint32_t)p[4] << 24) | ((uint32_t)p[5] << 16) |
+			((uint32_t)p[6] << 8) | p[7]) == -1)
+			return -1;
+	}
+	
+	/* keep the partial frame */
+	m->ilen -= off;
+	memmove(m->in, m->in + off, m->ilen);
+	
+	return 0;
+}
+
+/*
+ * Read frames from the peer, and handle all complete ones.
+ *
+ * Returns 0 if OK, 1 if the peer closed the link, -1 on error.
+ */
+
+static int
+mux_input(struct mux_t *m)
+{
+	ssize_t nread;
+	
+	nread = read(m->link, m->in + m->ilen, sizeof(m->in) - m->ilen);
+	
+	if (nread == 0) {
+		return 1;
+	} else if (nread == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		warn("peer link read failed");
+		return -1;
+	}
+	
+	m->ilen += nread;
+	m->wreceived += nread;
+	
+	return mux_parse(m);
+}
+
+/*
+ * Send queued frames to the peer. Returns 0 if OK, -1 on error.
+ */
+
+static int
+mux_flush(struct mux_t *m)
+{
+	ssize_t nwritten;
+	
+	if (m->ooff == m->olen)
+		return 0;
+	
+	if ((nwritten = write(m->link, m->out + m->ooff,
+		m->olen - m->ooff)) == -1)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		warn("peer link write failed");
+		return -1;
+	}
+	
+	m->ooff += nwritten;
+	m->wsent += nwritten;
+	
+	return 0;
+}
+
+/*
+ * Accept a local connection, and open a stream for it.
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+mux_accept(struct mux_t *m)
+{
+	int fd;
+	
+	if ((fd = accept(m->lfd, NULL, NULL)) == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+			errno != ECONNABORTED)
+			warn("accept failed");
+		return 0;
+	}
+	
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+		warn("can't set fd %i non-blocking", fd);
+		close(fd);
+		return 0;
+	}
+	
+	if (mux_add(m, fd, m->next, 0) == NULL)
+		return 0;
+	
+	return mux_control(m, MUX_OPEN, m->next++, 0);
+}
+
+/*
+ * Handle events of fd, the socket of a stream or one of its attempts to
+ * connect. While connecting, fd is -1 when the next attempt is due.
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+mux_event(struct mux_t *m, struct mux_stream_t *s, int fd, int events)
+{
+	int sock;
+	
+	if (s->state & MUX_DEAD)
+		return 0;
+	
+	if (s->state & MUX_CONNECTING) {
+		sock = tcp_race_step(&s->race, &m->ev, s, fd);
+		if (sock == TCP_PENDING)
+			return 0;
+		if (sock == -1) {
+			warn("failed to connect to %s:%i",
+				m->config->hostname, m->config->hostport);
+			return mux_close(m, s, 1);
+		}
+		/* the winner is still watched for EVENT_WRITE */
+		s->fd = sock;
+		s->events = EVENT_WRITE;
+		s->state &= ~MUX_CONNECTING;
+		
+		/* write what the peer sent meanwhile, and its EOF */
+		if (mux_write(m, s) == -1)
+			return -1;
+		if (s->state & MUX_DEAD)
+			return 0;
+	} else if (fd != s->fd) {
+		/* an attempt that lost the race, earlier in this wakeup */
+		return 0;
+	} else if ((events & EVENT_WRITE) && mux_write(m, s) == -1) {
+		return -1;
+	}
+	
+	/* only one chunk per stream per wakeup, and only while the
+	 * link queue is short */
+	if ((events & EVENT_READ) && !(s->state & (MUX_EOF_IN | MUX_DEAD)) &&
+		s->credit && m->olen - m->ooff < MUX_QUEUE)
+		return mux_read(m, s);
+	
+	return 0;
+}
+
+/*
+ * Free the streams that are gone, and update the watched events of
+ * the link and all streams. Returns 0 if OK, -1 on error.
+ */
+
+static int
+mux_update(struct mux_t *m)
+{
+	int events;
+	struct mux_stream_t *s;
+	
+	mux_reap(m);
+	
+	for (s = m->streams; s; s = s->next)
+	{
+		/* the attempts of a race are watched by the race */
+		if (s->state & MUX_CONNECTING)
+			continue;
+		
+		events = 0;
+		if (!(s->state & MUX_EOF_IN) && s->credit &&
+			m->olen - m->ooff < MUX_QUEUE)
+			events |= EVENT_READ;
+		if (s->b.len)
+			events |= EVENT_WRITE;
+		
+		if (events == s->events)
+			continue;
+		if (event_mod(&m->ev, s->fd, events, s) == -1) {
+			warn("can't watch fd %i", s->fd);
+			return -1;
+		}
+		s->events = events;
+	}
+	
+	events = EVENT_READ | ((m->ooff < m->olen) ? EVENT_WRITE : 0);
+	
+	if (events != m->levents) {
+		if (event_mod(&m->ev, m->link, events, &m->link) == -1) {
+			warn("can't watch the peer link");
+			return -1;
+		}
+		m->levents = events;
+	}
+	
+	return 0;
+}
+
+/*
+ * Start the next attempts of the streams that are connecting, when
+ * they are due, and set *wait to the ms until the next one, or -1.
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+mux_race(struct mux_t *m, int *wait)
+{
+	long long left;
+	struct mux_stream_t *s;
+	
+	*wait = -1;
+	
+	for (s = m->streams; s; s = s->next)
+	{
+		if ((s->state & (MUX_CONNECTING | MUX_DEAD)) != MUX_CONNECTING)
+			continue;
+		
+		if (tcp_race_wait(&s->race) == 0 &&
+			mux_event(m, s, -1, 0) == -1)
+			return -1;
+		
+		if ((s->state & (MUX_CONNECTING | MUX_DEAD)) ==
+			MUX_CONNECTING &&
+			(left = tcp_race_wait(&s->race)) != -1 &&
+			(*wait == -1 || left < *wait))
+			*wait = (int)left;
+	}
+	
+	return 0;
+}
+
+/*
+ * Run the link until the peer closes it, or the client is stopped.
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+mux_loop(struct mux_t *m)
+{
+	int n, nready, status, wait;
+	struct event_item_t ready[MUX_EVENTS];
+	
+	while (!mux_stop)
+	{
+		if (mux_race(m, &wait) == -1 || mux_update(m) == -1)
+			return -1;
+		
+		if ((nready = event_wait(&m->ev, ready, MUX_EVENTS,
+			wait)) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			warn("event wait failed");
+			return -1;
+		}
+		
+		for (n = 0; n < nready; ++n)
+		{
+			if (ready[n].data == &m->link) {
+				if ((ready[n].events & EVENT_WRITE) &&
+					mux_flush(m) == -1)
+					return -1;
+				if (!(ready[n].events & EVENT_READ))
+					continue;
+				if ((status = mux_input(m)) != 0)
+					return (status == 1) ? 0 : -1;
+			} else if (ready[n].data == &m->lfd) {
+				status = mux_accept(m);
+			} else {
+				status = mux_event(m, ready[n].data,
+					ready[n].fd, ready[n].events);
+			}
+			
+			if (status == -1)
+				return -1;
+		}
+		
+		/* send what this wakeup queued right away */
+		if (mux_flush(m) == -1)
+			return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Prepare a link on sock. Returns 0 if OK, -1 on error.
+ */
+
+static int
+mux_init(struct mux_t *m, struct config_t *config, int sock)
+{
+	int lowat = MUX_QUEUE;
+	
+	memset(m, 0, sizeof(*m));
+	m->config = config;
+	m->link = sock;
+	m->lfd = -1;
+	
+	/* keep little unsent data in the kernel, so a new frame of an
+	 * interactive stream doesn't queue behind a lot of bulk data */
+#ifdef TCP_NOTSENT_LOWAT
+	setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+		sizeof(lowat));
+#else
+	(void)lowat;
+#endif
+	
+	if (fcntl(sock, F_SETFL, O_NONBLOCK) == -1) {
+		warn("can't set the peer link non-blocking");
+		return -1;
+	}
+	
+	if (peer_codec_init(&m->tx, 1) == -1 ||
+		peer_codec_init(&m->rx, 0) == -1)
+	{
+		warn("buffer allocation failed");
+		return -1;
+	}
+	
+	if (event_init(&m->ev) == -1) {
+		warn("event init failed");
+		return -1;
+	}
+	
+	if (event_add(&m->ev, sock, 0, &m->link) == -1) {
+		warn("can't watch the peer link");
+		return -1;
+	}
+	
+	/* the greeting goes first */
+	if (mux_reserve(m, sizeof(MUX_MAGIC) - 1) == NULL)
+		return -1;
+	memcpy(m->out, MUX_MAGIC, sizeof(MUX_MAGIC) - 1);
+	m->olen = sizeof(MUX_MAGIC) - 1;
+	
+	return 0;
+}
+
+/*
+ * Print the counters of a link.
+ */
+
+static void
+mux_report(struct mux_t *m)
+{
+	warnx("%lu streams, sent %llu bytes as %llu, received %llu bytes "
+		"as %llu", m->opened, m->sent, m->wsent, m->received,
+		m->wreceived);
+}
+
+/*
+ * Accept local connections on the listen address, and tunnel each of
+ * them as a stream over the link to the prcat peer on sock. If the
+ * buffer is not NULL, its pending data is the start of what the peer
+ * sent.
+ *
+ * Runs until SIGINT or SIGTERM, or until the peer closes the link.
+ * Prints the counters of the link if config->stats is set. Returns an
+ * exit code.
+ */
+
+int
+mux_handler(struct config_t *config, int sock, struct buffer_t *b)
+{
+	int status, reuseport = 0;
+	size_t len;
+	struct mux_t *m;
+	
+	if ((m = malloc(sizeof(*m))) == NULL) {
+		warn("malloc failed");
+		return EX_OSERR;
+	}
+	
+	if (mux_init(m, config, sock) == -1)
+		return EX_OSERR;
+	
+	m->hello = 1;
+	
+	if ((m->lfd = listen_socket(config->listen, &reuseport, 0)) == -1)
+		return EX_UNAVAILABLE;
+	
+	if (event_add(&m->ev, m->lfd, EVENT_READ, &m->lfd) == -1) {
+		warn("can't watch listening socket");
+		return EX_OSERR;
+	}
+	
+	/* what followed the CONNECT response, handled as if it was read
+	 * from the link; m->in always has room for a frame once the
+	 * complete ones are handled */
+	for (; b && b->len; buffer_consume(b, len)) {
+		len = b->size - b->head;
+		if (len > b->len)
+			len = b->len;
+		if (len > sizeof(m->in) - m->ilen)
+			len = sizeof(m->in) - m->ilen;
+		if (len == 0) {
+			warnx("peer sent a bad frame");
+			return EX_PROTOCOL;
+		}
+		memcpy(m->in + m->ilen, b->data + b->head, len);
+		m->ilen += len;
+		m->wreceived += len;
+		if (mux_parse(m) == -1)
+			return EX_PROTOCOL;
+	}
+	
+	/* a client that goes away must not kill us */
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, mux_signal);
+	signal(SIGTERM, mux_signal);
+	
+	status = mux_loop(m);
+	
+	if (status == 0 && !mux_stop)
+		warnx("peer closed the link");
+	
+	if (config->stats)
+		mux_report(m);
+	
+	return (status == 0 && mux_stop) ? EX_OK : EX_UNAVAILABLE;
+}
+
+/*
+ * Serve the link of a prcat client on fd, whose greeting was read
+ * already: connect every stream it opens to the destination. Runs
+ * until the client closes the link. Returns an exit code.
+ */
+
+int
+mux_serve(struct config_t *config, int fd)
+{
+	int status;
+	struct mux_t *m;
+	
+	if ((m = malloc(sizeof(*m))) == NULL) {
+		warn("malloc failed");
+		return EX_OSERR;
+	}
+	
+	if (mux_init(m, config, fd) == -1)
+		return EX_OSERR;
+	
+	/* resolve the destination once; every stream races its addresses */
+	if ((m->naddrs = tcp_addrs(config->hostname, config->hostport,
+		m->addrs, TCP_MAX_ADDRS)) == -1)
+		return EX_UNAVAILABLE;
+	
+	status = mux_loop(m);
+	
+	if (config->stats)
+		mux_report(m);
+	
+	return (status == 0) ? EX_OK : EX_IOERR;
+}
@@ -0,0 +1,776 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "connect.h"
+#include "listen.h"
+#include "lz4.h"
+#include "mux.h"
+#include "peer.h"
+#include "stripe.h"
+#include "trace.h"
+#include "tunnel.h"
+
+/*
+ * In peer mode, the far end of the tunnel is another prcat, running
+ * with --serve, and data is compressed between the two.
+ *
+ * Each side starts with PEER_MAGIC, then sends its data as frames: a
+ * 4 byte header in network byte order, with PEER_COMPRESSED set if the
+ * payload is an LZ4 block, and the length of the payload in the other
+ * bits. A frame is sent for every read, so nothing waits for a block
+ * to fill up: interactive traffic goes out right away. The blocks are
+ * part of one stream per direction: matches can copy data from earlier
+ * frames, which is what makes small frames compress.
+ *
+ * Data that doesn't compress is sent as it is. After such a block, the
+ * next blocks are sent without trying, for a number of blocks that
+ * doubles for every poor block in a row, up to PEER_BACKOFF, so data
+ * that doesn't compress costs almost nothing extra. The other side
+ * doesn't care: it keeps the history of both kinds of frames.
+ */
+
+#define PEER_MAGIC "PRZ1"
+
+/* frame header */
+#define PEER_HEADER		4
+#define PEER_COMPRESSED		0x80000000UL
+
+/* raw data kept for matches, and the size of the buffer holding it
+ * and new data; the history moves back when the buffer is full */
+#define PEER_HISTORY	65536
+#define PEER_BUFFER	(PEER_HISTORY + 4 * PEER_BLOCK)
+
+/* largest frame */
+#define PEER_FRAME (PEER_HEADER + LZ4_BOUND(PEER_BLOCK))
+
+/* blocks smaller than this are not compressed */
+#define PEER_MIN 16
+
+/* a block is poor if it doesn't save 1/PEER_POOR of its size */
+#define PEER_POOR 16
+
+/* max blocks sent without trying, after poor ones */
+#define PEER_BACKOFF 64
+
+/* direction state flags */
+#define PEER_EOF	0x01	/* read side hit EOF */
+#define PEER_SHUT	0x02	/* write side was shut down */
+
+/* one direction: compress from rfd to wfd, or expand */
+typedef struct peer_dir_t {
+	int rfd;			/* read data from this fd */
+	int wfd;			/* write data to this fd */
+	int state;			/* EOF/shutdown flags */
+	int compress;			/* compress, or expand */
+	struct peer_codec_t codec;
+	size_t raw;			/* expand: raw bytes not written yet */
+	unsigned char *frame;		/* frames to write, or read */
+	size_t fsize;			/* size of frame */
+	size_t flen;			/* bytes in frame */
+	size_t foff;			/* compress: bytes of frame written */
+	int hello;			/* expand: PEER_MAGIC not seen yet */
+	size_t early;			/* expand: bytes from the CONNECT */
+	size_t owed;			/* expand: early bytes of raw */
+	struct tunnel_stats_t *stats;	/* transfer counters */
+} peer_dir_t;
+
+/*
+ * Prepare a codec for one direction of a stream: compress, or expand.
+ * Returns 0 if OK, -1 on error.
+ */
+
+int
+peer_codec_init(struct peer_codec_t *c, int compress)
+{
+	c->pos = 0;
+	c->skip = 0;
+	c->backoff = 0;
+	c->lz = NULL;
+	
+	if ((c->hist = malloc(PEER_BUFFER)) == NULL)
+		return -1;
+	
+	if (compress) {
+		if ((c->lz = malloc(sizeof(*c->lz))) == NULL) {
+			free(c->hist);
+			return -1;
+		}
+		lz4_init(c->lz);
+	}
+	
+	return 0;
+}
+
+/*
+ * Release the memory of a codec.
+ */
+
+void
+peer_codec_free(struct peer_codec_t *c)
+{
+	free(c->hist);
+	free(c->lz);
+}
+
+/*
+ * Make room for a block after the raw data, by moving the history to
+ * the start of the buffer. Returns where the block goes.
+ */
+
+unsigned char *
+peer_codec_room(struct peer_codec_t *c)
+{
+	size_t delta;
+	
+	if (c->pos + PEER_BLOCK > PEER_BUFFER) {
+		delta = c->pos - PEER_HISTORY;
+		memmove(c->hist, c->hist + delta, PEER_HISTORY);
+		c->pos = PEER_HISTORY;
+		if (c->lz)
+			lz4_slide(c->lz, delta);
+	}
+	
+	return c->hist + c->pos;
+}
+
+/*
+ * Make the payload of a frame at out, of at most LZ4_BOUND(len) bytes,
+ * from the len bytes that were put in the room of the codec. Sets
+ * *compressed if the payload is an LZ4 block. Returns its size.
+ */
+
+size_t
+peer_codec_pack(struct peer_codec_t *c, size_t len, unsigned char *out,
+	int *compressed)
+{
+	size_t clen = 0;
+	
+	if (c->skip) {
+		--c->skip;
+	} else if (len >= PEER_MIN) {
+		clen = lz4_compress(c->lz, c->hist, c->pos, len, out,
+			len - len / PEER_POOR);
+		if (clen) {
+			c->backoff = 0;
+		} else {
+			c->backoff = c->backoff ? c->backoff * 2 : 1;
+			if (c->backoff > PEER_BACKOFF)
+				c->backoff = PEER_BACKOFF;
+			c->skip = c->backoff;
+		}
+	}
+	
+	if ((*compressed = (clen != 0)) == 0) {
+		memcpy(out, c->hist + c->pos, len);
+		clen = len;
+	}
+	
+	c->pos += len;
+	
+	return clen;
+}
+
+/*
+ * Expand the payload of a frame of len bytes at in, which is an LZ4
+ * block if compressed is set. The data is added to the history, and
+ * *data points to it.
+ *
+ * Returns the length of the data, or -1 if the payload is not valid.
+ */
+
+ssize_t
+peer_codec_unpack(struct peer_codec_t *c, const unsigned char *in,
+	size_t len, int compressed, unsigned char **data)
+{
+	ssize_t raw;
+	unsigned char *room = peer_codec_room(c);
+	
+	if (compressed) {
+		raw = lz4_decompress(in, len, c->hist, c->pos, PEER_BLOCK);
+		if (raw == -1)
+			return -1;
+	} else {
+		if (len > PEER_BLOCK)
+			return -1;
+		memcpy(room, in, len);
+		raw = len;
+	}
+	
+	c->pos += raw;
+	*data = room;
+	
+	return raw;
+}
+
+/*
+ * Returns the amount of bytes waiting to be written for a direction.
+ */
+
+static size_t
+peer_pending(struct peer_dir_t *d)
+{
+	return d->compress ? d->flen - d->foff : d->raw;
+}
+
+/*
+ * Make a frame of the len bytes that were read into the room of the
+ * codec.
+ */
+
+static void
+peer_pack(struct peer_dir_t *d, size_t len)
+{
+	int compressed;
+	unsigned long header;
+	
+	header = peer_codec_pack(&d->codec, len, d->frame + PEER_HEADER,
+		&compressed);
+	d->flen = PEER_HEADER + header;
+	d->foff = 0;
+	
+	if (compressed)
+		header |= PEER_COMPRESSED;
+	
+	d->frame[0] = (header >> 24) & 0xff;
+	d->frame[1] = (header >> 16) & 0xff;
+	d->frame[2] = (header >> 8) & 0xff;
+	d->frame[3] = header & 0xff;
+	
+	d->stats->bytes += len;
+}
+
+/*
+ * Take the next frame that was read, and expand it after the raw data.
+ *
+ * Returns 1 if there is new raw data to write, 0 if the frame was not
+ * read completely yet, -1 on error.
+ */
+
+static int
+peer_unpack(struct peer_dir_t *d)
+{
+	ssize_t len;
+	size_t flen, used = 0;
+	unsigned long header;
+	unsigned char *data;
+	
+	if (d->hello) {
+		if (d->flen < sizeof(PEER_MAGIC) - 1)
+			return 0;
+		if (memcmp(d->frame, PEER_MAGIC, sizeof(PEER_MAGIC) - 1) != 0)
+		{
+			warnx("the far end is not a prcat peer");
+			return -1;
+		}
+		d->hello = 0;
+		used = sizeof(PEER_MAGIC) - 1;
+		d->flen -= used;
+		memmove(d->frame, d->frame + sizeof(PEER_MAGIC) - 1, d->flen);
+	}
+	
+	if (d->flen < PEER_HEADER)
+		return 0;
+	
+	header = ((unsigned long)d->frame[0] << 24) | (d->frame[1] << 16) |
+		(d->frame[2] << 8) | d->frame[3];
+	flen = header & ~PEER_COMPRESSED;
+	
+	if (flen > ((header & PEER_COMPRESSED) ? LZ4_BOUND(PEER_BLOCK)
+		: PEER_BLOCK))
+	{
+		warnx("peer sent a bad frame");
+		return -1;
+	}
+	
+	if (d->flen < PEER_HEADER + flen)
+		return 0;
+	
+	if ((len = peer_codec_unpack(&d->codec, d->frame + PEER_HEADER, flen,
+		(header & PEER_COMPRESSED) != 0, &data)) == -1)
+	{
+		warnx("peer sent a bad frame");
+		return -1;
+	}
+	
+	d->raw = len;
+	d->stats->wire += PEER_HEADER + flen;
+	
+	/* counted as leftover once the raw data is written */
+	used += PEER_HEADER + flen;
+	d->owed = used < d->early ? used : d->early;
+	d->early -= d->owed;
+	
+	/* drop the frame */
+	d->flen -= PEER_HEADER + flen;
+	memmove(d->frame, d->frame + PEER_HEADER + flen, d->flen);
+	
+	return 1;
+}
+
+/*
+ * Write pending data of a direction. Expanded data goes out frame by
+ * frame, for as long as the write fd takes it.
+ *
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+peer_flush(struct peer_dir_t *d)
+{
+	int status;
+	ssize_t nwritten;
+	unsigned char *data;
+	
+	for (;;)
+	{
+		if (!peer_pending(d)) {
+			if (d->compress || (status = peer_unpack(d)) == 0)
+				return 0;
+			if (status == -1)
+				return -1;
+		}
+		
+		data = d->compress ? d->frame + d->foff :
+			d->codec.hist + d->codec.pos - d->raw;
+		
+		if ((nwritten = write(d->wfd, data, peer_pending(d))) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+				errno == EINTR)
+				return 0;
+			warn("write error");
+			return -1;
+		}
+		
+		++d->stats->writes;
+		
+		if (d->compress) {
+			d->foff += nwritten;
+			d->stats->wire += nwritten;
+		} else {
+			d->raw -= nwritten;
+			d->stats->bytes += nwritten;
+			if (!d->raw) {
+				d->stats->leftover += d->owed;
+				d->owed = 0;
+			}
+		}
+		
+		/* short write: wait until the fd takes more */
+		if (peer_pending(d))
+			return 0;
+	}
+}
+
+/*
+ * Read data for a direction: a block to compress, or frames to expand.
+ * Only called when nothing is pending.
+ *
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+peer_fill(struct peer_dir_t *d)
+{
+	ssize_t nread;
+	
+	if (d->compress) {
+		nread = read(d->rfd, peer_codec_room(&d->codec), PEER_BLOCK);
+	} else {
+		nread = read(d->rfd, d->frame + d->flen, d->fsize - d->flen);
+	}
+	
+	if (nread == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		warn("read error");
+		return -1;
+	}
+	
+	++d->stats->reads;
+	
+	if (nread == 0)
+		d->state |= PEER_EOF;
+	else if (d->compress)
+		peer_pack(d, nread);
+	else
+		d->flen += nread;
+	
+	return 0;
+}
+
+/*
+ * Shut down the write side of a direction once its read side hit EOF
+ * and all data was written, see tunnel_shut. Returns 0 if OK, -1 if the
+ * peer closed in the middle of a frame.
+ */
+
+static int
+peer_shut(struct peer_dir_t *d, struct peer_dir_t *other)
+{
+	if (!(d->state & PEER_EOF) || (d->state & PEER_SHUT))
+		return 0;
+	if (peer_pending(d))
+		return 0;
+	
+	if (!d->compress && (d->flen || d->hello)) {
+		warnx("peer closed the connection %s", d->hello ?
+			"before the greeting" : "in the middle of a frame");
+		return -1;
+	}
+	
+	d->state |= PEER_SHUT;
+	
+	if (shutdown(d->wfd, SHUT_WR) == 0 || errno != ENOTSOCK)
+		return 0;
+	
+	if (d->wfd != other->rfd) {
+		close(d->wfd);
+		d->wfd = -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Add events of fd to the poll set of n fds, merging them with the
+ * events of an fd that is there already.
+ */
+
+static void
+peer_watch(struct pollfd *pfd, int *n, int fd, int events)
+{
+	int i;
+	
+	for (i = 0; i < *n; ++i)
+		if (pfd[i].fd == fd)
+			break;
+	
+	if (i == *n) {
+		pfd[i].fd = fd;
+		pfd[i].events = 0;
+		++*n;
+	}
+	
+	pfd[i].events |= events;
+}
+
+/*
+ * Returns the events that poll returned for fd.
+ */
+
+static int
+peer_revents(struct pollfd *pfd, int n, int fd)
+{
+	int i;
+	
+	for (i = 0; i < n; ++i)
+		if (pfd[i].fd == fd)
+			return pfd[i].revents;
+	
+	return 0;
+}
+
+/*
+ * Prepare one direction.
+ */
+
+static void
+peer_dir_init(struct peer_dir_t *d, int rfd, int wfd, int compress,
+	size_t extra, struct tunnel_stats_t *stats)
+{
+	d->rfd = rfd;
+	d->wfd = wfd;
+	d->state = 0;
+	d->compress = compress;
+	d->raw = 0;
+	d->fsize = PEER_FRAME + extra;
+	d->flen = 0;
+	d->foff = 0;
+	d->hello = !compress;
+	d->early = 0;
+	d->owed = 0;
+	d->stats = stats;
+	
+	if (peer_codec_init(&d->codec, compress) == -1 ||
+		(d->frame = malloc(d->fsize)) == NULL)
+		err(EX_OSERR, "buffer allocation failed");
+	
+	if (compress) {
+		memcpy(d->frame, PEER_MAGIC, sizeof(PEER_MAGIC) - 1);
+		d->flen = sizeof(PEER_MAGIC) - 1;
+	}
+}
+
+/*
+ * Tunnel data between x and a prcat peer on sock, compressing what
+ * goes to the peer, and expanding what comes from it.
+ *
+ * If the buffer is not NULL, its pending data is the start of what the
+ * peer sent. The EOF handling is the same as in tunnel_handler. The
+ * bytes counters in stats[TUNNEL_TX] (x to the peer) and
+ * stats[TUNNEL_RX] (the peer to x) count data as it is, and the wire
+ * counters the data on the peer connection. Never returns if there is
+ * an error.
+ */
+
+void
+peer_handler(struct buffer_t *b, int rfdx, int wfdx, int sock,
+	struct tunnel_stats_t *stats)
+{
+	int i, n, nready, first = 0, fds[3], flags[3];
+	size_t len;
+	struct peer_dir_t dir[2], *d;
+	struct pollfd pfd[3];
+	
+	peer_dir_init(&dir[TUNNEL_TX], rfdx, sock, 1, 0, &stats[TUNNEL_TX]);
+	peer_dir_init(&dir[TUNNEL_RX], sock, wfdx, 0, b ? b->len : 0,
+		&stats[TUNNEL_RX]);
+	
+	/* what followed the CONNECT response */
+	for (d = &dir[TUNNEL_RX]; b && b->len; buffer_consume(b, len)) {
+		len = b->size - b->head;
+		if (len > b->len)
+			len = b->len;
+		memcpy(d->frame + d->flen, b->data + b->head, len);
+		d->flen += len;
+		d->early += len;
+	}
+	
+	/* all fds non-blocking, restored when done */
+	fds[0] = rfdx;
+	fds[1] = wfdx;
+	fds[2] = sock;
+	for (i = 0; i < 3; ++i)
+	{
+		if ((flags[i] = fcntl(fds[i], F_GETFL)) == -1 ||
+			fcntl(fds[i], F_SETFL, flags[i] | O_NONBLOCK) == -1)
+			err(EX_SOFTWARE, "can't set fd %i non-blocking",
+				fds[i]);
+	}
+	
+	/* frames that came with the response */
+	if (peer_flush(&dir[TUNNEL_RX]) == -1)
+		exit(EX_IOERR);
+	
+	while (!(dir[TUNNEL_TX].state & dir[TUNNEL_RX].state & PEER_SHUT))
+	{
+		for (n = 0, i = TUNNEL_TX; i <= TUNNEL_RX; ++i)
+		{
+			d = &dir[i];
+			if (!(d->state & PEER_EOF) && !peer_pending(d))
+				peer_watch(pfd, &n, d->rfd, POLLIN);
+			if (peer_pending(d))
+				peer_watch(pfd, &n, d->wfd, POLLOUT);
+		}
+		
+		nready = poll(pfd, n, -1);
+		tunnel_json_check();
+		
+		if (nready == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_SOFTWARE, "poll failed");
+		}
+		
+		for (i = TUNNEL_TX; i <= TUNNEL_RX; ++i)
+		{
+			d = &dir[i];
+			
+			if (peer_revents(pfd, n, d->rfd) ||
+				peer_revents(pfd, n, d->wfd))
+				++d->stats->wakeups;
+			
+			/* room on the write side: write pending data */
+			if (peer_pending(d) && (peer_revents(pfd, n, d->wfd) &
+				(POLLOUT | POLLERR | POLLHUP)) &&
+				peer_flush(d) == -1)
+				exit(EX_IOERR);
+			
+			/* data on the read side: read it once per wakeup,
+			 * so one direction can't keep the other waiting */
+			if (!(d->state & PEER_EOF) && !peer_pending(d) &&
+				(peer_revents(pfd, n, d->rfd) &
+				(POLLIN | POLLERR | POLLHUP)) &&
+				(peer_fill(d) == -1 || peer_flush(d) == -1))
+				exit(EX_IOERR);
+			
+			if (peer_shut(d, &dir[!i]) == -1)
+				exit(EX_IOERR);
+		}
+		
+		/* time to first byte from the far end */
+		if (!first && stats[TUNNEL_RX].bytes) {
+			trace_mark("first-byte");
+			first = 1;
+		}
+	}
+	
+	/* cleanup, x may have been closed, see peer_shut */
+	for (i = 0; i < 3; ++i)
+		if (fds[i] != wfdx || dir[TUNNEL_RX].wfd != -1)
+			fcntl(fds[i], F_SETFL, flags[i]);
+	
+	for (i = TUNNEL_TX; i <= TUNNEL_RX; ++i) {
+		peer_codec_free(&dir[i].codec);
+		free(dir[i].frame);
+	}
+}
+
+/*
+ * Serve one peer connection: connect to the destination, and tunnel
+ * between the two. Returns an exit code.
+ */
+
+static int
+peer_connection(struct config_t *config, int fd)
+{
+	int sock, status;
+	char magic[sizeof(PEER_MAGIC) - 1];
+	struct timeval tv = { config->timeout, 0 };
+	struct buffer_t b;
+	struct tunnel_stats_t stats[2];
+	
+	/* the greeting tells a multiplexed link from a single stream */
+	if (config->timeout)
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	
+	if (recv(fd, magic, sizeof(magic), MSG_WAITALL) != sizeof(magic)) {
+		warnx("peer closed the connection before the greeting");
+		close(fd);
+		return EX_PROTOCOL;
+	}
+	
+	/* the rest of its greeting comes with the same timeout */
+	if (memcmp(magic, STRIPE_MAGIC, sizeof(magic)) == 0) {
+		status = stripe_serve(config, fd);
+		close(fd);
+		return status;
+	}
+	
+	tv.tv_sec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	
+	if (memcmp(magic, MUX_MAGIC, sizeof(magic)) == 0) {
+		status = mux_serve(config, fd);
+		close(fd);
+		return status;
+	}
+	
+	if (memcmp(magic, PEER_MAGIC, sizeof(magic)) != 0) {
+		warnx("the far end is not a prcat peer");
+		close(fd);
+		return EX_PROTOCOL;
+	}
+	
+	if ((sock = tcp_connect(config->hostname, config->hostport,
+		config->timeout)) == -1)
+	{
+		close(fd);
+		return EX_UNAVAILABLE;
+	}
+	
+	/* hand the greeting to the handler */
+	if (buffer_init(&b, BUFFER_MIN_SIZE) == -1)
+		err(EX_OSERR, "buffer allocation failed");
+	memcpy(b.data, magic, sizeof(magic));
+	buffer_commit(&b, sizeof(magic));
+	
+	memset(stats, 0, sizeof(stats));
+	peer_handler(&b, sock, sock, fd, stats);
+	
+	if (config->stats)
+		tunnel_report(stats);
+	
+	buffer_free(&b);
+	close(sock);
+	close(fd);
+	
+	return EX_OK;
+}
+
+/*
+ * Accept prcat peers on the listen address, and tunnel each of them to
+ * the destination, in a process of its own. Runs until killed. Returns
+ * an exit code on error.
+ */
+
+int
+peer_serve(struct config_t *config)
+{
+	int fd, lfd, reuseport = 0;
+	
+	if ((lfd = listen_socket(config->listen, &reuseport, 0)) == -1)
+		return EX_UNAVAILABLE;
+	
+	/* accept blocks; a peer that goes away must not kill us, and
+	 * the kernel reaps the children */
+	fcntl(lfd, F_SETFL, 0);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGCHLD, SIG_IGN);
+	
+	for (;;)
+	{
+		if ((fd = accept(lfd, NULL, NULL)) == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			warn("accept failed");
+			return EX_OSERR;
+		}
+		
+		switch (fork()) {
+		case -1:
+			warn("fork failed");
+			break;
+		case 0:
+			close(lfd);
+			exit(peer_connection(config, fd));
+		default:
+			break;
+		}
+		
+		close(fd);
+	}
+}
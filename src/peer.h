@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PEER_H_
+#define _PEER_H_
+
+#include <sys/types.h>
+
+#include "buffer.h"
+#include "lz4.h"
+#include "setup.h"
+#include "tunnel.h"
+
+/* max raw bytes in a frame */
+#define PEER_BLOCK 65536
+
+/* one direction of a compressed stream, see peer_codec_init */
+typedef struct peer_codec_t {
+	struct lz4_t *lz;	/* compressor, or NULL to expand */
+	unsigned char *hist;	/* raw data, with history for matches */
+	size_t pos;		/* end of the raw data */
+	int skip;		/* blocks not to compress */
+	int backoff;		/* skip after a poor block */
+} peer_codec_t;
+
+int peer_codec_init(struct peer_codec_t *codec, int compress);
+void peer_codec_free(struct peer_codec_t *codec);
+unsigned char *peer_codec_room(struct peer_codec_t *codec);
+size_t peer_codec_pack(struct peer_codec_t *codec, size_t len,
+	unsigned char *out, int *compressed);
+ssize_t peer_codec_unpack(struct peer_codec_t *codec, const unsigned char *in,
+	size_t len, int compressed, unsigned char **data);
+void peer_handler(struct buffer_t *buffer, int rfdx, int wfdx, int sock,
+	struct tunnel_stats_t *stats);
+int peer_serve(struct config_t *config);
+
+#endif /* _PEER_H_ */
@@ -28,20 +28,355 @@
  * THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <err.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sysexits.h>
 
+#include "agent.h"
 #include "askpass.h"
+#include "auth.h"
 #include "buffer.h"
 #include "setup.h"
 #include "connect.h"
 #include "tunnel.h"
+#include "mux.h"
+#include "peer.h"
+#include "stripe.h"
 #include "proxy.h"
+#include "listen.h"
+#include "broker.h"
+#include "dnscache.h"
+#include "failover.h"
+#include "trace.h"
 
 #define PASSWORD_PROMPT "Proxy password: "
 
+/*
+ * Ask password if none was given, but username is set. The credential
+ * agent is asked first, if there is one, so the terminal prompt comes
+ * only once per agent. Returns 0 if OK, -1 if unable to get the
+ * password.
+ */
+
+static int
+ask_password(struct config_t *config)
+{
+	if (config->username && !config->password && config->agent &&
+		!config->agentd)
+		config->password = agent_request(config->agent,
+			config->username);
+	
+	if (config->username && !config->password)
+		config->password = askpass_tty(PASSWORD_PROMPT);
+	
+	return (config->username && !config->password) ? -1 : 0;
+}
+
+/*
+ * Look up the addresses of the proxy, and store them in the DNS cache,
+ * if there is one. Returns the number of addresses, or -1 on error.
+ */
+
+static int
+resolve_proxy(struct config_t *config, struct tcp_addr_t *addrs)
+{
+	int naddrs;
+	
+	if ((naddrs = tcp_addrs(config->proxyname, config->proxyport,
+		addrs, TCP_MAX_ADDRS)) == -1)
+		return -1;
+	
+	trace_mark("resolve");
+	
+	/* in the background: only the TTL is left to ask */
+	if (config->dnscache)
+		dnscache_refresh(config->dnscache, config->proxyname, addrs,
+			naddrs);
+	
+	return naddrs;
+}
+
+/*
+ * Connect to the proxy. With a DNS cache, the addresses of the proxy
+ * come from the cache if it has them, and are looked up again if none
+ * of them works, see resolve_proxy. Sets *refresh if the cached entry
+ * should be refreshed once the tunnel is up, as it is about to expire.
+ * Returns the socket, or -1 on error.
+ */
+
+static int
+connect_proxy(struct config_t *config, int *refresh)
+{
+	int sock, naddrs = 0, timeout = config->timeout * 1000;
+	struct tcp_addr_t addrs[TCP_MAX_ADDRS];
+	
+	*refresh = 0;
+	
+	if (config->dnscache)
+		naddrs = dnscache_lookup(config->dnscache, config->proxyname,
+			config->proxyport, addrs, TCP_MAX_ADDRS, refresh);
+	
+	if (naddrs > 0) {
+		trace_mark("cache");
+		sock = tcp_race(config->proxyname, config->proxyport, addrs,
+			naddrs, timeout);
+		if (sock != -1)
+			return sock;
+	}
+	
+	/* not cached, or the proxy may have moved */
+	*refresh = 0;
+	if ((naddrs = resolve_proxy(config, addrs)) == -1)
+		return -1;
+	
+	return tcp_race(config->proxyname, config->proxyport, addrs, naddrs,
+		timeout);
+}
+
+/*
+ * Append the client data that can be read right away to the CONNECT
+ * request in b, so it goes out with the request instead of a round
+ * trip after the response. Returns the bytes added, or -1 on error.
+ */
+
+static ssize_t
+early_data(struct config_t *config, struct buffer_t *b)
+{
+	ssize_t nread;
+	struct pollfd pfd;
+	
+	pfd.fd = config->ifd;
+	pfd.events = POLLIN;
+	
+	if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN))
+		return 0;
+	
+	/* the request starts at the beginning of the buffer */
+	nread = read(config->ifd, b->data + b->len, buffer_room(b));
+	
+	if (nread == -1) {
+		warn("read failed");
+		return -1;
+	}
+	
+	buffer_commit(b, nread);
+	
+	return nread;
+}
+
+/*
+ * Open the tunnel on a connected proxy socket, see proxy_connect, or
+ * auth_connect for Digest and NTLM. In optimistic mode, client data
+ * that is ready is sent along with the CONNECT request. That data is
+ * lost if the proxy refuses the tunnel, so there is no way to retry.
+ * Returns 0 if OK, AUTH_RECONNECT, or -1 on error.
+ */
+
+static int
+open_tunnel(struct config_t *config, int sock, struct buffer_t *b)
+{
+	ssize_t early, nwritten;
+	
+	if (config->auth != AUTH_BASIC)
+		return auth_connect(sock, b, config);
+	
+	if (!config->optimistic)
+		return proxy_connect(sock, b, config->hostname,
+			config->hostport, config->username, config->password);
+	
+	/* compose headers, and add what the client has to say */
+	if (proxy_request(b, config->hostname, config->hostport,
+		config->username, config->password) != 0 ||
+		(early = early_data(config, b)) == -1)
+		return -1;
+	
+	/* send both at once */
+	nwritten = write(sock, b->data, b->len);
+	
+	if (nwritten == -1) {
+		warn("http send headers failed");
+		return -1;
+	} else if ((size_t)nwritten != b->len) {
+		warnx("http send headers failed: short write");
+		return -1;
+	}
+	
+	/* receive headers */
+	if (proxy_wait(sock, b) != 0) {
+		if (early)
+			warnx("%zi bytes of client data were lost", early);
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Connect to the proxy and open the tunnel. Connects once more if the
+ * proxy closed the connection after a Digest challenge, to answer it
+ * on a new connection. Returns the socket, or -1 on error.
+ */
+
+static int
+tunnel_proxy(struct config_t *config, struct buffer_t *b, int *refresh)
+{
+	int sock, status, tries = 0;
+	
+	do {
+		if ((sock = connect_proxy(config, refresh)) == -1)
+			return -1;
+		if ((status = open_tunnel(config, sock, b)) != 0)
+			close(sock);
+	} while (status == AUTH_RECONNECT && ++tries < 2);
+	
+	return (status == 0) ? sock : -1;
+}
+
+/*
+ * Connect to the proxy with TCP Fast Open, so the CONNECT request goes
+ * out in the SYN, and wait for the response. The addresses come from
+ * the DNS cache as in connect_proxy. Without a TFO cookie for the
+ * proxy, this is a normal connect followed by the request. Returns the
+ * socket with the tunnel open, or -1 on error.
+ */
+
+static int
+fastopen_proxy(struct config_t *config, struct buffer_t *b, int *refresh)
+{
+	int sock = -1, naddrs = 0, timeout = config->timeout * 1000;
+	size_t sent = 0;
+	ssize_t early = 0, nwritten;
+	struct tcp_addr_t addrs[TCP_MAX_ADDRS];
+	
+	*refresh = 0;
+	
+	/* compose headers, and add what the client has to say */
+	if (proxy_request(b, config->hostname, config->hostport,
+		config->username, config->password) != 0)
+		return -1;
+	if (config->optimistic && (early = early_data(config, b)) == -1)
+		return -1;
+	
+	if (config->dnscache)
+		naddrs = dnscache_lookup(config->dnscache, config->proxyname,
+			config->proxyport, addrs, TCP_MAX_ADDRS, refresh);
+	
+	if (naddrs > 0) {
+		trace_mark("cache");
+		sock = tcp_fastopen(config->proxyname, config->proxyport,
+			addrs, naddrs, b->data, b->len, &sent, timeout);
+	}
+	
+	/* not cached, or the proxy may have moved */
+	if (sock == -1) {
+		*refresh = 0;
+		if ((naddrs = resolve_proxy(config, addrs)) == -1)
+			return -1;
+		if ((sock = tcp_fastopen(config->proxyname,
+			config->proxyport, addrs, naddrs, b->data, b->len,
+			&sent, timeout)) == -1)
+			return -1;
+	}
+	
+	/* send the headers that did not go out with the SYN */
+	if (sent < b->len) {
+		nwritten = write(sock, b->data + sent, b->len - sent);
+		if (nwritten == -1) {
+			warn("http send headers failed");
+			close(sock);
+			return -1;
+		} else if ((size_t)nwritten != b->len - sent) {
+			warnx("http send headers failed: short write");
+			close(sock);
+			return -1;
+		}
+	}
+	
+	/* receive headers */
+	if (proxy_wait(sock, b) != 0) {
+		if (early)
+			warnx("%zi bytes of client data were lost", early);
+		close(sock);
+		return -1;
+	}
+	
+	/* the handshake is done by now, so this is final */
+	if (config->stats)
+		warnx("tcp fast open: %s", tcp_fastopen_used(sock) ?
+			"CONNECT sent in the SYN" :
+			"not used (no cookie yet, or not supported)");
+	
+	return sock;
+}
+
+/*
+ * Get a socket with the tunnel open, from the broker if there is one,
+ * or else by connecting to the proxy. Also used to open more tunnels to
+ * a prcat peer, see stripe_handler. Returns the socket, or -1 on error.
+ */
+
+static int
+get_tunnel(struct config_t *config, struct buffer_t *b)
+{
+	int sock = -1, tunnel = 0, refresh = 0;
+	
+	/* get a socket from the broker, if there is one */
+	if (config->broker)
+		sock = broker_request(config->broker, config->hostname,
+			config->hostport, &tunnel);
+	
+	if (sock != -1) {
+		/* the broker sent the CONNECT request */
+		if (!tunnel && proxy_wait(sock, b) != 0) {
+			close(sock);
+			return -1;
+		}
+		trace_mark("tunnel");
+		return sock;
+	}
+	
+	/* no broker, and no proxy to fall back to */
+	if (!config->proxyname || !config->proxyport) {
+		warnx("no socket from broker %s, and no proxy configured",
+			config->broker);
+		return -1;
+	}
+	
+	/* fail if unable to get password */
+	if (ask_password(config) == -1)
+		return -1;
+	
+	if (config->username)
+		trace_mark("password");
+	
+	if (config->nproxies > 1) {
+		/* race the proxies */
+		sock = failover_connect(config, b);
+	} else if (config->fastopen) {
+		/* send the CONNECT in the SYN */
+		sock = fastopen_proxy(config, b, &refresh);
+	} else {
+		sock = tunnel_proxy(config, b, &refresh);
+	}
+	
+	if (sock != -1)
+		trace_mark("tunnel");
+	
+	/* tunnel is up: update the DNS cache in the background */
+	if (sock != -1 && refresh)
+		dnscache_refresh(config->dnscache, config->proxyname, NULL, 0);
+	
+	/* the subflows the kernel set up by now */
+	if (sock != -1 && config->mptcp && config->stats)
+		tcp_multipath_report(sock);
+	
+	return sock;
+}
+
 /*
  * Handles main program flow.
  *
@@ -49,17 +384,35 @@
  * username was provided, but no password was provided. Connect to the
  * requested HTTP proxy server. Send the required HTTP CONNECT headers
  * to the proxy. Tunnel all data.
+ *
+ * In listen mode, hand over to listen_handler instead, which does the
+ * same for every accepted local connection. In broker mode, hand over
+ * to broker_handler. If a broker is configured, ask it for a socket to
+ * the proxy first; it sends the CONNECT for us, or has opened the
+ * tunnel already. Without a broker, connect as usual. In agent mode,
+ * hand over to agent_handler, which keeps the password for others. In
+ * peer mode, the far end is a prcat peer, see peer_handler, or with a
+ * listen address mux_handler, which tunnels all local connections over
+ * one tunnel, or with stripes or resume stripe_handler, which spreads
+ * the data over several tunnels, and opens them again when they break;
+ * in serve mode, hand over to peer_serve.
  */
 
 int
 main(int argc, char **argv)
 {
-	int sock;
+	int sock, status;
 	struct config_t config;
 	struct buffer_t buffer;
+	struct tunnel_opts_t opts;
+	/* static: written out at exit, see tunnel_json_open */
+	static struct tunnel_stats_t stats[2];
 	
-	/* initialize buffer */
-	buffer_init(&buffer);
+	/* the start of a trace */
+	trace_init();
+	
+	/* initialize counters */
+	memset(stats, 0, sizeof(stats));
 	
 	/* parse arguments and config file */
 	if (setup(&config, argc, argv) != SETUP_OK) {
@@ -67,32 +420,78 @@ main(int argc, char **argv)
 		return EX_USAGE;
 	}
 	
-	/* ask password if none was given, but username is set */
-	if (config.username && !config.password) {
-		config.password = askpass_tty(PASSWORD_PROMPT);
-		/* exit if unable to get password */
-		if (!config.password)
+	/* trace the phases of setting up the tunnel */
+	if (config.tracefile && trace_open(config.tracefile) == -1)
+		return EX_CANTCREAT;
+	trace_mark("setup");
+	
+	/* connections to the proxy */
+	tcp_multipath(config.mptcp);
+	
+	/* tunnel settings */
+	opts.relay = config.relay;
+	opts.bufsize = config.bufsize;
+	opts.adaptive = config.adaptive;
+	
+	/* serve prcat peers until killed */
+	if (config.serve)
+		return peer_serve(&config);
+	
+	/* serve local connections or prcat clients until killed; in
+	 * peer mode, local connections share one tunnel instead */
+	if ((config.listen && !config.peer) || config.daemon ||
+		config.agentd)
+	{
+		if (ask_password(&config) == -1)
 			return EX_NOINPUT;
+		if (config.agentd)
+			return agent_handler(&config);
+		if (config.daemon)
+			return broker_handler(&config);
+		return listen_handler(&config, &opts);
 	}
 	
-	/* connect to proxy */
-	if ((sock = tcp_connect(config.proxyname, config.proxyport)) == -1)
-		return EX_UNAVAILABLE;
+	/* counters as JSON, from here on until exit */
+	if (config.statsjson && tunnel_json_open(config.statsjson,
+		config.hostname, config.hostport, stats) == -1)
+		return EX_CANTCREAT;
 	
-	/* tunnel setup */
-	if (proxy_connect(sock, &buffer, config.hostname, config.hostport,
-		config.username, config.password) != 0)
-	{
-		close(sock);
-		return EX_UNAVAILABLE;
+	/* initialize buffer */
+	if (buffer_init(&buffer, tunnel_bufsize(&opts)) == -1) {
+		warn("buffer allocation failed");
+		return EX_OSERR;
 	}
 	
-	/* tunnel data (does not return on failure) */
-	tunnel_handler(&buffer, config.ifd, config.ofd, sock, sock);
+	/* get a socket with the tunnel open */
+	if ((sock = get_tunnel(&config, &buffer)) == -1)
+		return (config.username && !config.password) ?
+			EX_NOINPUT : EX_UNAVAILABLE;
+	
+	/* multiplex local connections over the tunnel */
+	if (config.peer && config.listen)
+		return mux_handler(&config, sock, &buffer);
+	
+	/* tunnel data (does not return on failure, except striped) */
+	status = EX_OK;
+	if (config.peer && (config.stripes > 1 || config.resume)) {
+		/* closes the socket, which it may have replaced */
+		status = stripe_handler(&config, sock, &buffer, get_tunnel,
+			stats);
+		sock = -1;
+	} else if (config.peer)
+		peer_handler(&buffer, config.ifd, config.ofd, sock, stats);
+	else
+		tunnel_handler(&buffer, config.ifd, config.ofd, sock, sock,
+			&opts, stats);
+	
+	/* show what was transfered */
+	if (config.stats)
+		tunnel_report(stats);
 	
 	/* cleanup */
-	close(sock);
+	if (sock != -1)
+		close(sock);
 	
-	return EX_OK;
+	return status;
 }
 
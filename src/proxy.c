@@ -28,7 +28,9 @@
  * THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <ctype.h>
 #include <err.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,6 +42,22 @@
 #include "buffer.h"
 #include "proxy.h"
 
+/* parser states: the headers, see proxy_response */
+#define PROXY_STATUS		0	/* in the status line */
+#define PROXY_LINE		1	/* at the start of a header line */
+#define PROXY_NAME		2	/* in a header name */
+#define PROXY_VALUE		3	/* in a header value */
+
+/* parser states: the body, see proxy_body */
+#define PROXY_BODY		4	/* at the start of the body */
+#define PROXY_CHUNK		5	/* in a chunk size */
+#define PROXY_CHUNK_EXT		6	/* in chunk extensions */
+#define PROXY_DATA		7	/* in (chunk) data */
+#define PROXY_DATA_END		8	/* in the line end after chunk data */
+#define PROXY_TRAILER		9	/* at the start of a trailer line */
+#define PROXY_TRAILER_LINE	10	/* in a trailer line */
+#define PROXY_DONE		11	/* past the body */
+
 /*
  * Returns base64 encoded "username:password" or NULL on error.
  * Both username and password MUST point to a string.
@@ -77,25 +95,21 @@ proxy_basic_auth_token(char *username, char *password)
 }
 
 /*
- * Setup a proxy tunnel using HTTP CONNECT.
+ * Compose the HTTP CONNECT headers in an empty buffer.
  *
- * Function sends an HTTP CONNECT header to the socket file descriptor
- * passed to this function. It will attempt to open a tunnel to the
- * hostname and (host)port passed to this function. If username and
- * password are not NULL, they will be used for basic authentication.
+ * The request opens a tunnel to the hostname and (host)port passed to
+ * this function. If username and password are not NULL, they will be
+ * used for basic authentication.
  *
- * This function will also check the response. If the proxy responds
- * with "HTTP/1.x 200", the function will return 0. In the other case,
- * or in case of an error, it will return -1.
+ * Returns 0 if OK, -1 on error.
  */
 
 int
-proxy_connect(int sock, struct buffer_t *b, char *hostname,
-	int hostport, char *username, char *password)
+proxy_request(struct buffer_t *b, char *hostname, int hostport,
+	char *username, char *password)
 {
-	int slen, nread, hlen, eoflen = 4;
+	int slen;
 	char *auth = NULL;
-	char *bp, *ep;
 	
 	/* get auth string if username and password are defined */
 	if (username && password) {
@@ -106,128 +120,444 @@ proxy_connect(int sock, struct buffer_t *b, char *hostname,
 		}
 	}
 	
+	/* start with an empty buffer, so headers are contiguous */
+	buffer_reset(b);
+	
 	/* compose headers */
 	if (auth) {
-		slen = snprintf(b->data, sizeof(b->data),
+		slen = snprintf(b->data, b->size,
 			"CONNECT %s:%i HTTP/1.0\r\n"
 			"Proxy-Authorization: Basic %s\r\n"
 			"\r\n", hostname, hostport, auth);
 		free(auth);
 	} else {
-		slen = snprintf(b->data, sizeof(b->data),
+		slen = snprintf(b->data, b->size,
 			"CONNECT %s:%i HTTP/1.0\r\n"
 			"\r\n", hostname, hostport);
 	}
 	
-	if (slen >= sizeof(b->data)) {
+	if (slen >= b->size) {
 		warnx("http send headers too long");
 		return -1;
 	}
 
 	/* update the length of stored bytes */
-	b->s_len = slen;
+	buffer_commit(b, slen);
 	
-	/* send headers */
-	b->w_len = write(sock, b->data, b->s_len);
+	return 0;
+}
+
+/*
+ * Reset the parser for a new response.
+ *
+ * If header is not NULL, it is called for every header of the response,
+ * with the name and the value (without leading and trailing white
+ * space) as strings. It also makes the parser read all the headers of
+ * a 407 response, so the caller can answer the challenge; other
+ * responses that are not 2xx are refused after the status line.
+ */
+
+void
+proxy_parser_init(struct proxy_parser_t *p,
+	void (*header)(void *arg, char *name, char *value), void *arg)
+{
+	p->state = PROXY_STATUS;
+	p->status = 0;
+	p->keep = 0;
+	p->chunked = 0;
+	p->length = -1;
+	p->left = 0;
+	p->header = header;
+	p->arg = arg;
+	p->nlen = 0;
+	p->vlen = 0;
+}
+
+/*
+ * Append character c to string s of size bytes, holding len bytes.
+ * The character is dropped if s is full.
+ */
+
+static void
+proxy_append(char *s, size_t *len, size_t size, int c)
+{
+	if (*len < size - 1)
+		s[(*len)++] = c;
+}
+
+/*
+ * Terminate string s of len bytes, without trailing white space.
+ */
+
+static void
+proxy_trim(char *s, size_t *len)
+{
+	while (*len && (s[*len - 1] == '\r' || s[*len - 1] == ' ' ||
+		s[*len - 1] == '\t'))
+		--*len;
 	
-	if (b->w_len == 0) {
-		warnx("http send headers failed: eof from proxy");
-		return -1;
-	} else if (b->w_len == -1) {
-		warn("http send headers failed");
-		return -1;
-	} else if (b->w_len != b->s_len) {
-		warn("http send headers failed: short write");
-		return -1;
+	s[*len] = '\0';
+}
+
+/*
+ * Check the status line in the value of the parser.
+ *
+ * Returns 0 if the headers should be parsed, -1 if the response
+ * refuses the tunnel.
+ */
+
+static int
+proxy_status(struct proxy_parser_t *p)
+{
+	unsigned char *s = (unsigned char *)p->value;
+	
+	if (strncmp(p->value, "HTTP/1.", 7) == 0 && isdigit(s[7]) &&
+		s[8] == ' ' && isdigit(s[9]) && isdigit(s[10]) &&
+		isdigit(s[11]))
+	{
+		p->status = atoi(p->value + 9);
+		/* HTTP/1.1 keeps connections open by default */
+		p->keep = (s[7] != '0');
+	}
+	
+	if (p->status / 100 == 2 || (p->status == 407 && p->header))
+		return 0;
+	
+	warnx("proxy connect failed: %s", p->value);
+	
+	return -1;
+}
+
+/*
+ * Take what the parser needs from the header in its name and value,
+ * then pass it on to the header callback.
+ */
+
+static void
+proxy_header(struct proxy_parser_t *p)
+{
+	if (strcasecmp(p->name, "Content-Length") == 0) {
+		p->length = isdigit((unsigned char)p->value[0])
+			? strtol(p->value, NULL, 10) : -1;
+	} else if (strcasecmp(p->name, "Connection") == 0 ||
+		strcasecmp(p->name, "Proxy-Connection") == 0) {
+		if (strcasecmp(p->value, "close") == 0)
+			p->keep = 0;
+		else if (strcasecmp(p->value, "keep-alive") == 0)
+			p->keep = 1;
+	} else if (strcasecmp(p->name, "Transfer-Encoding") == 0) {
+		/* chunked is always the last coding */
+		p->chunked = (p->vlen >= 7 &&
+			strcasecmp(p->value + p->vlen - 7, "chunked") == 0);
+	}
+	
+	if (p->header)
+		p->header(p->arg, p->name, p->value);
+}
+
+/*
+ * Feed one character of the response headers to the parser.
+ */
+
+static int
+proxy_parse(struct proxy_parser_t *p, int c)
+{
+	switch (p->state) {
+	case PROXY_STATUS:
+		if (c != '\n') {
+			proxy_append(p->value, &p->vlen, PROXY_VALUE_SIZE, c);
+			return PROXY_MORE;
+		}
+		proxy_trim(p->value, &p->vlen);
+		if (proxy_status(p) == -1)
+			return PROXY_ERROR;
+		p->state = PROXY_LINE;
+		return PROXY_MORE;
+	case PROXY_LINE:
+		if (c == '\r')
+			return PROXY_MORE;
+		if (c == '\n') {
+			/* empty line: end of the headers */
+			p->state = PROXY_BODY;
+			return (p->status / 100 == 2) ? PROXY_OK : PROXY_ERROR;
+		}
+		p->nlen = 0;
+		p->vlen = 0;
+		p->state = PROXY_NAME;
+		/* FALLTHROUGH */
+	case PROXY_NAME:
+		if (c == '\n') {
+			/* not a header, ignore it */
+			p->state = PROXY_LINE;
+		} else if (c == ':') {
+			p->name[p->nlen] = '\0';
+			p->state = PROXY_VALUE;
+		} else {
+			proxy_append(p->name, &p->nlen, PROXY_NAME_SIZE, c);
+		}
+		return PROXY_MORE;
+	case PROXY_VALUE:
+		if (c == '\n') {
+			proxy_trim(p->value, &p->vlen);
+			proxy_header(p);
+			p->state = PROXY_LINE;
+		} else if (p->vlen || (c != ' ' && c != '\t')) {
+			proxy_append(p->value, &p->vlen, PROXY_VALUE_SIZE, c);
+		}
+		return PROXY_MORE;
+	}
+	
+	return PROXY_ERROR;
+}
+
+/*
+ * Parse the response headers received so far, in one pass.
+ *
+ * The parser keeps its state between calls, so every byte is looked
+ * at only once, and the bytes it has seen are dropped from the buffer.
+ * When it returns PROXY_MORE the buffer is empty, and reset, so the
+ * next read can go at the start of the buffer; the headers need not
+ * fit in the buffer.
+ *
+ * If the proxy responded with any 2xx status, PROXY_OK is returned;
+ * any bytes left in the buffer are tunnel data. Returns PROXY_MORE if
+ * the end of the headers was not received yet. Returns PROXY_ERROR if
+ * the response refused the tunnel; after a 407 that was parsed to the
+ * end (see proxy_parser_init), the buffer holds the start of the body.
+ */
+
+int
+proxy_response(struct buffer_t *b, struct proxy_parser_t *p)
+{
+	int status = PROXY_MORE;
+	size_t n, pos = b->head;
+	
+	for (n = 0; n < b->len && status == PROXY_MORE; ++n)
+	{
+		status = proxy_parse(p, b->data[pos]);
+		if (++pos == b->size)
+			pos = 0;
+	}
+	
+	buffer_consume(b, n);
+	if (b->len == 0)
+		buffer_reset(b);
+	
+	return status;
+}
+
+/*
+ * Drop the body received so far of a response whose headers were
+ * parsed, using the Content-Length or the chunked encoding.
+ *
+ * Returns PROXY_OK when the body is complete; anything after it is
+ * left in the buffer. Returns PROXY_MORE if more of the body must be
+ * read (the buffer is empty, and reset). Returns PROXY_ERROR if the
+ * body ends only when the proxy closes the connection, or it's not
+ * valid.
+ */
+
+int
+proxy_body(struct buffer_t *b, struct proxy_parser_t *p)
+{
+	int c;
+	size_t n;
+	
+	if (p->state == PROXY_BODY) {
+		if (p->chunked) {
+			p->left = 0;
+			p->state = PROXY_CHUNK;
+		} else if (p->length >= 0) {
+			p->left = p->length;
+			p->state = p->left ? PROXY_DATA : PROXY_DONE;
+		} else {
+			return PROXY_ERROR;
+		}
+	}
+	
+	while (b->len && p->state != PROXY_DONE)
+	{
+		if (p->state == PROXY_DATA) {
+			n = (b->len < p->left) ? b->len : p->left;
+			buffer_consume(b, n);
+			if ((p->left -= n) == 0)
+				p->state = p->chunked ? PROXY_DATA_END
+					: PROXY_DONE;
+			continue;
+		}
+		
+		c = (unsigned char)b->data[b->head];
+		buffer_consume(b, 1);
+		
+		switch (p->state) {
+		case PROXY_CHUNK:
+			if (isxdigit(c)) {
+				if (p->left > (LONG_MAX >> 4))
+					return PROXY_ERROR;
+				p->left = (p->left << 4) + (isdigit(c) ?
+					c - '0' : tolower(c) - 'a' + 10);
+				break;
+			} else if (c == ';') {
+				p->state = PROXY_CHUNK_EXT;
+				break;
+			} else if (c != '\n') {
+				if (c != '\r' && c != ' ' && c != '\t')
+					return PROXY_ERROR;
+				break;
+			}
+			/* FALLTHROUGH */
+		case PROXY_CHUNK_EXT:
+			if (c == '\n')
+				p->state = p->left ? PROXY_DATA : PROXY_TRAILER;
+			break;
+		case PROXY_DATA_END:
+			if (c == '\n') {
+				p->left = 0;
+				p->state = PROXY_CHUNK;
+			} else if (c != '\r') {
+				return PROXY_ERROR;
+			}
+			break;
+		case PROXY_TRAILER:
+			if (c == '\n')
+				p->state = PROXY_DONE;
+			else if (c != '\r')
+				p->state = PROXY_TRAILER_LINE;
+			break;
+		case PROXY_TRAILER_LINE:
+			if (c == '\n')
+				p->state = PROXY_TRAILER;
+			break;
+		default:
+			return PROXY_ERROR;
+		}
 	}
 	
+	if (b->len == 0)
+		buffer_reset(b);
+	
+	return (p->state == PROXY_DONE) ? PROXY_OK : PROXY_MORE;
+}
+
+/*
+ * Read the response to a CONNECT request that was sent on sock, using
+ * buffer b and parser p, which must have been reset. Blocks until the
+ * headers are in.
+ *
+ * Returns what proxy_response returned at the end of the headers, or
+ * PROXY_ERROR on error.
+ */
+
+int
+proxy_read(int sock, struct buffer_t *b, struct proxy_parser_t *p)
+{
+	int status;
+	ssize_t nread;
+	
 	/* receive headers */
-	for (b->s_len = 0, bp = b->data; /* forever */ ; bp += nread)
+	for (buffer_reset(b); /* forever */ ; )
 	{
 		/* read header(s) */
-		nread = read(sock, bp, sizeof(b->data) - b->s_len);
+		nread = read(sock, b->data + b->len, buffer_room(b));
 		
 		if (nread == 0) {
 			warnx("http read headers failed: eof from proxy");
-			return -1;
+			return PROXY_ERROR;
 		} else if (nread == -1) {
 			warn("http read headers failed"); /* errno knows */
-			return -1;
+			return PROXY_ERROR;
 		}
 		
 		/* read was ok, count the read bytes */
-		b->s_len += nread;
-		
-		/* avoid undefined behaviour in memmem */
-		if (b->s_len < 4)
-			continue;
+		buffer_commit(b, nread);
 		
-		/* check if end of headers received */
-		if (b->s_len - nread < 3) {
-			/* search entire buffer */
-			if ((ep = memmem(b->data, b->s_len, "\r\n\r\n", 4)))
-				break; /* end of headers found */
-#ifdef PROXY_HEADER_END_ALLOW_LFLF
-			if ((ep = memmem(b->data, b->s_len, "\n\n", 2))) {
-				eoflen = 2;
-				break; /* end of headers found */
-			}
-#endif /* PROXY_HEADER_END_ALLOW_LFLF */
-		} else {
-			/* search part of the buffer */
-			if ((ep = memmem(bp - 3, nread + 3, "\r\n\r\n", 4)))
-				break; /* end of headers found */
-#ifdef PROXY_HEADER_END_ALLOW_LFLF
-			if ((ep = memmem(bp - 1, nread + 1, "\n\n", 2))) {
-				eoflen = 2;
-				break; /* end of headers found */
-			}
-#endif /* PROXY_HEADER_END_ALLOW_LFLF */
-		}
-		
-		if (b->s_len == sizeof(b->data)) {
-			warnx("http read headers failed: buffer too small");
+		/* parse what came in */
+		if ((status = proxy_response(b, p)) != PROXY_MORE)
+			return status;
+	}
+}
+
+/*
+ * Read and drop the body of a response that refused the tunnel, see
+ * proxy_body, so the connection can be used for the next request.
+ * Blocks until the body is in.
+ *
+ * Returns 0 if OK, -1 if the connection can't be used.
+ */
+
+int
+proxy_drain(int sock, struct buffer_t *b, struct proxy_parser_t *p)
+{
+	int status;
+	ssize_t nread;
+	
+	if (!p->keep)
+		return -1;
+	
+	while ((status = proxy_body(b, p)) == PROXY_MORE)
+	{
+		nread = read(sock, b->data + b->len, buffer_room(b));
+		if (nread <= 0)
 			return -1;
-		}
+		buffer_commit(b, nread);
 	}
 	
-	/* calculate the length of the headers by pointing back to
-	 * the beginning of the buffer, substracting that pointer from
-	 * the pointer that points to where the end of header mark was
-	 * found and adding the length of the end of header mark */
-	bp = b->data;
-	hlen = (ep - bp) + eoflen;
+	return (status == PROXY_OK) ? 0 : -1;
+}
+
+/*
+ * Read the response to a CONNECT request that was sent on sock, using
+ * buffer b. Blocks until the headers are in.
+ *
+ * Returns 0 if the proxy responded with any 2xx status, -1 otherwise
+ * or on error. Bytes after the headers are left in b.
+ */
 
-	/* set the w_len to the length of the headers, so in the case
-	 * the return code was 200, it will be clear for the caller
-	 * whether there are still bytes in the buffer that need to
-	 * be handled */
-	b->w_len = hlen;
+int
+proxy_wait(int sock, struct buffer_t *b)
+{
+	struct proxy_parser_t parser;
 	
-	/* check if response was HTTP/1.x 200 */
-	if (strncmp(b->data, "HTTP/1.", 7) == 0 && strncmp(b->data + 9, "200", 3) == 0)
-		return 0; /* return OK */
+	proxy_parser_init(&parser, NULL, NULL);
 	
-	/*** it was not 200 ;-( ***/
+	return (proxy_read(sock, b, &parser) == PROXY_OK) ? 0 : -1;
+}
+
+/*
+ * Setup a proxy tunnel using HTTP CONNECT.
+ *
+ * Function sends an HTTP CONNECT header to the socket file descriptor
+ * passed to this function, see proxy_request.
+ *
+ * This function will also check the response, see proxy_wait. If the
+ * proxy responds with a 2xx status, the function will return 0. In
+ * the other case, or in case of an error, it will return -1.
+ */
+
+int
+proxy_connect(int sock, struct buffer_t *b, char *hostname,
+	int hostport, char *username, char *password)
+{
+	ssize_t nwritten;
 	
-	int pos;
+	/* compose headers */
+	if (proxy_request(b, hostname, hostport, username, password) != 0)
+		return -1;
 	
-	/* print error message by terminating first header with '\0' */
-	for (pos = 0; pos < b->s_len; ++pos, ++bp)
-	{
-#ifdef PROXY_HEADER_END_ALLOW_LFLF
-		if (*bp == '\r' || *bp == '\n') {
-#else
-		if (*bp == '\r') {
-#endif
-			*bp = '\0';
-			warnx("proxy connect failed: %s", b->data);
-			return -1;
-		}
+	/* send headers */
+	nwritten = write(sock, b->data, b->len);
+	
+	if (nwritten == 0) {
+		warnx("http send headers failed: eof from proxy");
+		return -1;
+	} else if (nwritten == -1) {
+		warn("http send headers failed");
+		return -1;
+	} else if (nwritten != b->len) {
+		warn("http send headers failed: short write");
+		return -1;
 	}
 	
-	/* should never be reached */
-	warnx("proxy connect failed: unexpected, plz debug");
-	return -1;
+	/* receive headers */
+	return proxy_wait(sock, b);
 }
-
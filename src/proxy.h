@@ -31,8 +31,47 @@
 #ifndef _PROXY_H_
 #define _PROXY_H_
 
+#include <sys/types.h>
+
 #include "buffer.h"
 
+/* proxy_response return values */
+#define PROXY_OK	0	/* tunnel is open */
+#define PROXY_MORE	1	/* need more data */
+#define PROXY_ERROR	-1	/* tunnel refused, or error */
+
+/* size of a header name, and of a header value (or the status line)
+ * kept by the parser; longer ones are cut */
+#define PROXY_NAME_SIZE		32
+#define PROXY_VALUE_SIZE	1024
+
+/* state of the parser of a response */
+typedef struct proxy_parser_t {
+	int state;		/* where in the response */
+	int status;		/* status code, 0 until known */
+	int keep;		/* proxy keeps the connection open */
+	int chunked;		/* body uses chunked encoding */
+	long length;		/* Content-Length, or -1 */
+	long left;		/* body bytes left in the current part */
+	void (*header)(void *arg, char *name, char *value);
+	void *arg;		/* passed to header */
+	size_t nlen;		/* length of name */
+	size_t vlen;		/* length of value */
+	char name[PROXY_NAME_SIZE];
+	char value[PROXY_VALUE_SIZE];
+} proxy_parser_t;
+
+int proxy_request(struct buffer_t *buffer, char *hostname, int hostport,
+	char *username, char *password);
+void proxy_parser_init(struct proxy_parser_t *parser,
+	void (*header)(void *arg, char *name, char *value), void *arg);
+int proxy_response(struct buffer_t *buffer, struct proxy_parser_t *parser);
+int proxy_body(struct buffer_t *buffer, struct proxy_parser_t *parser);
+int proxy_read(int sock, struct buffer_t *buffer,
+	struct proxy_parser_t *parser);
+int proxy_drain(int sock, struct buffer_t *buffer,
+	struct proxy_parser_t *parser);
+int proxy_wait(int sock, struct buffer_t *buffer);
 int proxy_connect(int sock, struct buffer_t *buffer, char*hostname,
 	int hostport, char *username, char *password);
 
@@ -41,21 +41,45 @@
 #include <sysexits.h>
 #include <unistd.h>
 
+#include "auth.h"
+#include "buffer.h"
 #include "setup.h"
 #include "parser.h"
+#include "tunnel.h"
 #include "version.h"
 
 /* Macros for validating input. */
 
 #define STRTOL_INVALID_FD(i, str, ep) \
-	(*ep || ep == str || i < 0 || i > FD_SETSIZE - 1)
+	(*ep || ep == str || i < 0 || i > INT_MAX)
 #define STRTOL_INVALID_PORT(i, str, ep) \
 	(*ep || ep == str || i < 1 || i > UINT16_MAX)
+#define STRTOL_INVALID_WORKERS(i, str, ep) \
+	(*ep || ep == str || i < 1 || i > MAX_WORKERS)
+#define STRTOL_INVALID_COUNT(i, str, ep, min) \
+	(*ep || ep == str || i < min || i > MAX_POOL)
+#define STRTOL_INVALID_STRIPES(i, str, ep) \
+	(*ep || ep == str || i < 1 || i > MAX_STRIPES)
+#define STRTOL_INVALID_TIMEOUT(i, str, ep) \
+	(*ep || ep == str || i < 0 || i > MAX_TIMEOUT)
 
 /* Constants. */
 
 #define UNDEFINED_FD -1
+#define UNDEFINED_RELAY -1
+#define UNDEFINED_AUTH -1
+#define UNDEFINED_BOOL -1
+#define ADAPTIVE_BUFFER_SIZE (1024 * 1024)
+#define MAX_WORKERS 1024
+#define MAX_POOL 64
+#define DEFAULT_POOL 4
+#define UNDEFINED_COUNT -1
+#define UNDEFINED_TIMEOUT -1
+#define DEFAULT_TIMEOUT 30
+#define MAX_TIMEOUT 3600
 #define CONFIG_FILE ".prcat"
+#define SCORES_FILE ".prcat.scores"
+#define AUTH_CACHE_FILE ".prcat.auth"
 
 /* Static functions - custom ordering ftw. */
 
@@ -64,6 +88,12 @@ static void config_finalize(struct config_t *config);
 static int config_validate(struct config_t *config);
 static int parse_args(struct config_t *config, int argc, char **argv);
 static int parse_conf(struct config_t *config, char *filename);
+static int parse_relay(char *value);
+static int parse_auth(char *value);
+static int parse_bool(char *value);
+static int parse_size(char *value, size_t *size);
+static int parse_proxies(struct config_t *config);
+static char *home_file(char *name);
 
 /*
  * Print "short" usage information to stream.
@@ -73,18 +103,63 @@ void
 usage(FILE *stream)
 {
 	fputs(
-	"usage: prcat [opts] <hostname> <port>\n\n"
+	"usage: prcat [opts] <hostname> <port>\n"
+	"       prcat [opts] -t|-S -l <addr:port>\n"
+	"       prcat [opts] -D -B <path>\n"
+	"       prcat [opts] -G -A <path>\n"
+	"       prcat [opts] -Z -l <addr:port> <hostname> <port>\n\n"
 	"Arguments:\n"
 	"  hostname          Connect to this hostname\n"
 	"  port              Connect to this port number\n\n"
 	"Options:\n"
 	"  -u <username>     Username for proxy authentication\n"
 	"  -p <password>     Password for proxy authentication\n"
-	"  -H <proxy-host>   Connect to this proxy server\n"
+	"  -m <scheme>       Proxy authentication: basic (default), digest\n"
+	"                    or ntlm\n"
+	"  -C <file>         Cache Digest challenges in this file\n"
+	"                    (default ~/.prcat.auth)\n"
+	"  -H <proxy-host>   Connect to this proxy server, or to the best of\n"
+	"                    a list like host1,host2:port2\n"
 	"  -P <proxy-port>   Connect to this port on proxy server\n"
 	"  -I <input-fd>     Use this file descriptor for input\n"
 	"  -O <output-fd>    Use this file descriptor for ouput\n"
 	"  -f <filename>     Use this alternate configuration file\n"
+	"  -T <seconds>      Proxy connect timeout, 0 for none (default 30)\n"
+	"  -c <file>         Cache the proxy addresses in this file\n"
+	"  -F                Send the CONNECT in the SYN (TCP Fast Open)\n"
+	"  -M                Connect to the proxy with Multipath TCP\n"
+	"  -o                Send client data with the CONNECT, before the\n"
+	"                    proxy responds\n"
+	"  -z                Compress the tunnel to a prcat -Z peer; with -l,\n"
+	"                    carry all local connections in one tunnel\n"
+	"  -J <count>        Peer mode: spread the stream over this many\n"
+	"                    tunnels (default 1, max 16)\n"
+	"  -R                Peer mode: open a tunnel again when it breaks,\n"
+	"                    and resume the stream\n"
+	"  -Z                Serve prcat -z peers at the -l address, and\n"
+	"                    connect each to hostname and port\n"
+	"  -Q <file>         Keep proxy scores in this file\n"
+	"                    (default ~/.prcat.scores)\n"
+	"  -r <relay>        Relay mode: copy (default), splice or uring\n"
+	"  -s                Print transfer counters when done\n"
+	"  -j <file>         Append counters as JSON to this file (- for\n"
+	"                    stderr) when done, and on SIGUSR1\n"
+	"  -x <file>         Append the times of the setup phases to this\n"
+	"                    file (- for stderr)\n"
+	"  -b <size>         Buffer size in bytes, k or m (default 4k)\n"
+	"  -a                Adapt buffer size to traffic (max -b or 1m)\n"
+	"  -l <addr:port>    Listen for local connections and tunnel each\n"
+	"  -w <workers>      Worker threads for -l (default: cpu count)\n"
+	"  -t                Tunnel to original destination of redirected\n"
+	"                    connections (with -l, no hostname and port)\n"
+	"  -S                Serve SOCKS5 clients (with -l, no hostname\n"
+	"                    and port)\n"
+	"  -B <path>         Get proxy sockets from the broker at path\n"
+	"  -D                Run as the broker at -B path\n"
+	"  -N <count>        Broker: sockets to keep connected (default 4)\n"
+	"  -X <count>        Broker: tunnels to open ahead (default 0)\n"
+	"  -A <path>         Get the password from the agent at path\n"
+	"  -G                Run as the agent at -A path\n"
 	"  -h                Show this help\n"
 	"  -v                Show version\n"
 	, stream);
@@ -146,6 +221,38 @@ setup(struct config_t *config, int argc, char **argv)
 	if (config_validate(config) != 0)
 		return SETUP_ERROR;
 	
+	/* split the proxy list */
+	if (config->proxyname && parse_proxies(config) != 0)
+		return SETUP_ERROR;
+	
+	/* the challenge needs a blocking exchange, see auth_connect */
+	if (config->auth != AUTH_BASIC && (config->listen || config->daemon ||
+		config->nproxies > 1))
+	{
+		warnx("digest and ntlm auth only work for a single tunnel "
+			"through a single proxy");
+		return SETUP_ERROR;
+	}
+	
+	/* the request must be ready for the SYN, see fastopen_proxy */
+	if (config->fastopen && (config->auth != AUTH_BASIC ||
+		config->nproxies > 1))
+	{
+		warnx("tcp fast open only works with basic auth through a "
+			"single proxy");
+		return SETUP_ERROR;
+	}
+	
+	/* proxy scores and Digest challenges are kept next to the config
+	 * file by default */
+	if (config->nproxies > 1 && !config->scores && getenv("HOME") &&
+		(config->scores = home_file(SCORES_FILE)) == NULL)
+		return SETUP_ERROR;
+	if (config->auth == AUTH_DIGEST && !config->authcache &&
+		getenv("HOME") &&
+		(config->authcache = home_file(AUTH_CACHE_FILE)) == NULL)
+		return SETUP_ERROR;
+	
 	return SETUP_OK;
 }
 
@@ -162,6 +269,21 @@ config_init(struct config_t *config)
 	/* set to 'undefined' where 0 is a valid value */
 	config->ifd = UNDEFINED_FD;
 	config->ofd = UNDEFINED_FD;
+	config->relay = UNDEFINED_RELAY;
+	config->auth = UNDEFINED_AUTH;
+	config->stats = UNDEFINED_BOOL;
+	config->adaptive = UNDEFINED_BOOL;
+	config->fastopen = UNDEFINED_BOOL;
+	config->mptcp = UNDEFINED_BOOL;
+	config->optimistic = UNDEFINED_BOOL;
+	config->peer = UNDEFINED_BOOL;
+	config->resume = UNDEFINED_BOOL;
+	config->transparent = UNDEFINED_BOOL;
+	config->socks = UNDEFINED_BOOL;
+	config->daemon = UNDEFINED_BOOL;
+	config->agentd = UNDEFINED_BOOL;
+	config->prefetch = UNDEFINED_COUNT;
+	config->timeout = UNDEFINED_TIMEOUT;
 }
 
 /*
@@ -179,6 +301,50 @@ config_finalize(struct config_t *config)
 		config->ifd = STDIN_FILENO;
 	if (config->ofd == UNDEFINED_FD)
 		config->ofd = STDOUT_FILENO;
+	if (config->relay == UNDEFINED_RELAY)
+		config->relay = TUNNEL_RELAY_COPY;
+	if (config->auth == UNDEFINED_AUTH)
+		config->auth = AUTH_BASIC;
+	if (config->stats == UNDEFINED_BOOL)
+		config->stats = 0;
+	if (config->adaptive == UNDEFINED_BOOL)
+		config->adaptive = 0;
+	if (config->fastopen == UNDEFINED_BOOL)
+		config->fastopen = 0;
+	if (config->mptcp == UNDEFINED_BOOL)
+		config->mptcp = 0;
+	if (config->optimistic == UNDEFINED_BOOL)
+		config->optimistic = 0;
+	if (config->peer == UNDEFINED_BOOL)
+		config->peer = 0;
+	if (config->resume == UNDEFINED_BOOL)
+		config->resume = 0;
+	if (config->transparent == UNDEFINED_BOOL)
+		config->transparent = 0;
+	if (config->socks == UNDEFINED_BOOL)
+		config->socks = 0;
+	if (config->daemon == UNDEFINED_BOOL)
+		config->daemon = 0;
+	if (config->agentd == UNDEFINED_BOOL)
+		config->agentd = 0;
+	if (!config->pool)
+		config->pool = DEFAULT_POOL;
+	if (!config->stripes)
+		config->stripes = 1;
+	if (config->prefetch == UNDEFINED_COUNT)
+		config->prefetch = 0;
+	if (config->timeout == UNDEFINED_TIMEOUT)
+		config->timeout = DEFAULT_TIMEOUT;
+	if (!config->bufsize)
+		config->bufsize = config->adaptive ?
+			ADAPTIVE_BUFFER_SIZE : BUFFER_T_SIZE;
+	if (!config->workers) {
+		config->workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (config->workers < 1)
+			config->workers = 1;
+		else if (config->workers > MAX_WORKERS)
+			config->workers = MAX_WORKERS;
+	}
 }
 
 /*
@@ -195,13 +361,117 @@ config_finalize(struct config_t *config)
 static int
 config_validate(struct config_t *config)
 {
-	/* check if mandatory options are set */
-	if (!config->proxyname) {
+	/* the agent only keeps the password */
+	if (config->agentd) {
+		if (!config->agent) {
+			warnx("agent mode needs a socket path");
+			return -1;
+		}
+		if (!config->username) {
+			warnx("agent mode needs a username");
+			return -1;
+		}
+		if (config->listen || config->daemon) {
+			warnx("agent mode can't be combined with listen or "
+				"broker mode");
+			return -1;
+		}
+		if (config->hostname) {
+			warnx("agent mode takes no hostname and port");
+			return -1;
+		}
+		return 0;
+	}
+	
+	/* the peer server connects directly, no proxy needed */
+	if (config->serve) {
+		if (!config->listen || !config->hostname) {
+			warnx("serve mode needs a listen address, hostname "
+				"and port");
+			return -1;
+		}
+		if (config->transparent || config->socks || config->daemon ||
+			config->peer)
+		{
+			warnx("serve mode can't be combined with transparent, "
+				"socks, broker or peer mode");
+			return -1;
+		}
+		return 0;
+	}
+	
+	/* frames start right after the response, see peer_handler; the
+	 * peer picks the destination of multiplexed streams, see
+	 * mux_handler */
+	if (config->peer && (config->optimistic || config->transparent ||
+		config->socks))
+	{
+		warnx("peer mode can't be combined with optimistic, "
+			"transparent or socks mode");
+		return -1;
+	}
+	
+	/* stripes carry one stream, see stripe_handler */
+	if ((config->stripes > 1 || config->resume) &&
+		(!config->peer || config->listen))
+	{
+		warnx("stripes and resume need peer mode, without listen "
+			"mode");
+		return -1;
+	}
+	
+	/* the counters and the trace are those of the one tunnel */
+	if ((config->statsjson || config->tracefile) && (config->listen ||
+		config->daemon || config->agentd || config->serve))
+	{
+		warnx("stats-json and trace-file can't be combined with "
+			"listen, broker, agent or serve mode");
+		return -1;
+	}
+	
+	/* check if mandatory options are set; a broker client only needs
+	 * them if the broker can't help, see main */
+	if (!config->proxyname && (!config->broker || config->daemon)) {
 		warnx("missing parameter: proxy hostname");
 		return -1;
 	}
-	if (!config->proxyport) {
-		warnx("missing parameter: proxy port");
+	
+	/* the broker serves any destination */
+	if (config->daemon) {
+		if (!config->broker) {
+			warnx("broker mode needs a socket path");
+			return -1;
+		}
+		if (config->listen) {
+			warnx("broker and listen mode can't be combined");
+			return -1;
+		}
+		if (config->hostname) {
+			warnx("broker mode takes no hostname and port");
+			return -1;
+		}
+		return 0;
+	}
+	
+	/* transparent and SOCKS mode take the destination from each
+	 * connection */
+	if (config->transparent && config->socks) {
+		warnx("transparent and socks mode can't be combined");
+		return -1;
+	}
+	if (config->transparent || config->socks) {
+		if (!config->listen) {
+			warnx("%s mode needs a listen address",
+				config->socks ? "socks" : "transparent");
+			return -1;
+		}
+		if (config->hostname) {
+			warnx("%s mode takes no hostname and port",
+				config->socks ? "socks" : "transparent");
+			return -1;
+		}
+	} else if (!config->hostname) {
+		warnx("need 2 arguments but got 0");
 		return -1;
 	}
 	
@@ -225,7 +495,8 @@ parse_args(struct config_t *config, int argc, char **argv)
 	char *endptr = NULL;
 	
 	/* options */
-	static char *shortopts = "hvf:u:p:P:H:I:O:";
+	static char *shortopts = "hvsatSDFMGozZR"
+		"f:u:p:P:H:I:O:r:b:l:w:B:N:X:T:c:Q:A:m:C:J:j:x:";
 	static struct option longopts[] = {
 		{ "filename",   required_argument, NULL, 'f' },
 		{ "username",   required_argument, NULL, 'u' },
@@ -234,6 +505,34 @@ parse_args(struct config_t *config, int argc, char **argv)
 		{ "proxy-port", required_argument, NULL, 'P' },
 		{ "input-fd",   required_argument, NULL, 'I' },
 		{ "output-fd",  required_argument, NULL, 'O' },
+		{ "connect-timeout", required_argument, NULL, 'T' },
+		{ "dns-cache",  required_argument, NULL, 'c' },
+		{ "proxy-scores", required_argument, NULL, 'Q' },
+		{ "fast-open",  no_argument,       NULL, 'F' },
+		{ "mptcp",      no_argument,       NULL, 'M' },
+		{ "optimistic", no_argument,       NULL, 'o' },
+		{ "peer",       no_argument,       NULL, 'z' },
+		{ "serve",      no_argument,       NULL, 'Z' },
+		{ "stripes",    required_argument, NULL, 'J' },
+		{ "resume",     no_argument,       NULL, 'R' },
+		{ "auth",       required_argument, NULL, 'm' },
+		{ "auth-cache", required_argument, NULL, 'C' },
+		{ "relay",      required_argument, NULL, 'r' },
+		{ "stats",      no_argument,       NULL, 's' },
+		{ "stats-json", required_argument, NULL, 'j' },
+		{ "trace-file", required_argument, NULL, 'x' },
+		{ "buffer-size", required_argument, NULL, 'b' },
+		{ "adaptive",   no_argument,       NULL, 'a' },
+		{ "listen",     required_argument, NULL, 'l' },
+		{ "workers",    required_argument, NULL, 'w' },
+		{ "transparent", no_argument,      NULL, 't' },
+		{ "socks",      no_argument,       NULL, 'S' },
+		{ "broker",     required_argument, NULL, 'B' },
+		{ "daemon",     no_argument,       NULL, 'D' },
+		{ "agent",      required_argument, NULL, 'A' },
+		{ "agent-daemon", no_argument,     NULL, 'G' },
+		{ "pool",       required_argument, NULL, 'N' },
+		{ "prefetch",   required_argument, NULL, 'X' },
 		{ "help",       no_argument,       NULL, 'h' },
 		{ "version",    no_argument,       NULL, 'v' },
 		{ NULL, 0, NULL, 0 }
@@ -278,6 +577,124 @@ parse_args(struct config_t *config, int argc, char **argv)
 			}
 			config->ofd = (int)num;
 			break;
+		case 'T':
+			num = strtol(optarg, &endptr, 10);
+			if (STRTOL_INVALID_TIMEOUT(num, optarg, endptr)) {
+				warnx("invalid connect timeout: %s", optarg);
+				return -1;
+			}
+			config->timeout = (int)num;
+			break;
+		case 'c':
+			config->dnscache = optarg;
+			break;
+		case 'Q':
+			config->scores = optarg;
+			break;
+		case 'F':
+			config->fastopen = 1;
+			break;
+		case 'M':
+			config->mptcp = 1;
+			break;
+		case 'o':
+			config->optimistic = 1;
+			break;
+		case 'z':
+			config->peer = 1;
+			break;
+		case 'Z':
+			config->serve = 1;
+			break;
+		case 'R':
+			config->resume = 1;
+			break;
+		case 'm':
+			if ((config->auth = parse_auth(optarg)) == -1) {
+				warnx("invalid auth scheme: %s", optarg);
+				return -1;
+			}
+			break;
+		case 'C':
+			config->authcache = optarg;
+			break;
+		case 'r':
+			if ((config->relay = parse_relay(optarg)) == -1) {
+				warnx("invalid relay mode: %s", optarg);
+				return -1;
+			}
+			break;
+		case 's':
+			config->stats = 1;
+			break;
+		case 'j':
+			config->statsjson = optarg;
+			break;
+		case 'x':
+			config->tracefile = optarg;
+			break;
+		case 'b':
+			if (parse_size(optarg, &config->bufsize) == -1) {
+				warnx("invalid buffer size: %s", optarg);
+				return -1;
+			}
+			break;
+		case 'a':
+			config->adaptive = 1;
+			break;
+		case 'l':
+			config->listen = optarg;
+			break;
+		case 't':
+			config->transparent = 1;
+			break;
+		case 'S':
+			config->socks = 1;
+			break;
+		case 'B':
+			config->broker = optarg;
+			break;
+		case 'D':
+			config->daemon = 1;
+			break;
+		case 'A':
+			config->agent = optarg;
+			break;
+		case 'G':
+			config->agentd = 1;
+			break;
+		case 'N':
+			num = strtol(optarg, &endptr, 10);
+			if (STRTOL_INVALID_COUNT(num, optarg, endptr, 1)) {
+				warnx("invalid pool size: %s", optarg);
+				return -1;
+			}
+			config->pool = (int)num;
+			break;
+		case 'J':
+			num = strtol(optarg, &endptr, 10);
+			if (STRTOL_INVALID_STRIPES(num, optarg, endptr)) {
+				warnx("invalid number of stripes: %s", optarg);
+				return -1;
+			}
+			config->stripes = (int)num;
+			break;
+		case 'X':
+			num = strtol(optarg, &endptr, 10);
+			if (STRTOL_INVALID_COUNT(num, optarg, endptr, 0)) {
+				warnx("invalid prefetch count: %s", optarg);
+				return -1;
+			}
+			config->prefetch = (int)num;
+			break;
+		case 'w':
+			num = strtol(optarg, &endptr, 10);
+			if (STRTOL_INVALID_WORKERS(num, optarg, endptr)) {
+				warnx("invalid number of workers: %s", optarg);
+				return -1;
+			}
+			config->workers = (int)num;
+			break;
 		case 'h':
 			usage(stdout);
 			exit(EX_OK);
@@ -293,7 +710,9 @@ parse_args(struct config_t *config, int argc, char **argv)
 		}
 	}
 	
-	/* need 2 non-option argument */
+	/* need 2 non-option arguments, or none for transparent mode */
+	if (argc - optind == 0)
+		return 0;
 	if (argc - optind != 2) {
 		warnx("need 2 arguments but got %i", (argc - optind));
 		return -1;
@@ -415,6 +834,253 @@ parse_conf(struct config_t *config, char *filename)
 			}
 			config->ofd = (int)num;
 		}
+		else if (strcmp(key, "connect-timeout") == 0)
+		{
+			/* skip if set */
+			if (config->timeout != UNDEFINED_TIMEOUT)
+				continue;
+			
+			num = strtol(value, &endptr, 10);
+			if (STRTOL_INVALID_TIMEOUT(num, value, endptr)) {
+				warnx("invalid connect timeout: %s", value);
+				return -1;
+			}
+			config->timeout = (int)num;
+		}
+		else if (strcmp(key, "dns-cache") == 0)
+		{
+			/* set if not set */
+			if (!config->dnscache)
+				config->dnscache = value;
+		}
+		else if (strcmp(key, "proxy-scores") == 0)
+		{
+			/* set if not set */
+			if (!config->scores)
+				config->scores = value;
+		}
+		else if (strcmp(key, "fast-open") == 0)
+		{
+			/* skip if set */
+			if (config->fastopen != UNDEFINED_BOOL)
+				continue;
+			
+			if ((config->fastopen = parse_bool(value)) == -1) {
+				warnx("invalid value for fast-open: %s", value);
+				return -1;
+			}
+		}
+		else if (strcmp(key, "mptcp") == 0)
+		{
+			/* skip if set */
+			if (config->mptcp != UNDEFINED_BOOL)
+				continue;
+			
+			if ((config->mptcp = parse_bool(value)) == -1) {
+				warnx("invalid value for mptcp: %s", value);
+				return -1;
+			}
+		}
+		else if (strcmp(key, "optimistic") == 0)
+		{
+			/* skip if set */
+			if (config->optimistic != UNDEFINED_BOOL)
+				continue;
+			
+			if ((config->optimistic = parse_bool(value)) == -1) {
+				warnx("invalid value for optimistic: %s",
+					value);
+				return -1;
+			}
+		}
+		else if (strcmp(key, "peer") == 0)
+		{
+			/* skip if set */
+			if (config->peer != UNDEFINED_BOOL)
+				continue;
+			
+			if ((config->peer = parse_bool(value)) == -1) {
+				warnx("invalid value for peer: %s", value);
+				return -1;
+			}
+		}
+		else if (strcmp(key, "resume") == 0)
+		{
+			/* skip if set */
+			if (config->resume != UNDEFINED_BOOL)
+				continue;
+			
+			if ((config->resume = parse_bool(value)) == -1) {
+				warnx("invalid value for resume: %s", value);
+				return -1;
+			}
+		}
+		else if (strcmp(key, "auth") == 0)
+		{
+			/* skip if set */
+			if (config->auth != UNDEFINED_AUTH)
+				continue;
+			
+			if ((config->auth = parse_auth(value)) == -1) {
+				warnx("invalid auth scheme: %s", value);
+				return -1;
+			}
+		}
+		else if (strcmp(key, "auth-cache") == 0)
+		{
+			/* set if not set */
+			if (!config->authcache)
+				config->authcache = value;
+		}
+		else if (strcmp(key, "relay") == 0)
+		{
+			/* skip if set */
+			if (config->relay != UNDEFINED_RELAY)
+				continue;
+			
+			if ((config->relay = parse_relay(value)) == -1) {
+				warnx("invalid relay mode: %s", value);
+				return -1;
+			}
+		}
+		else if (strcmp(key, "stats") == 0)
+		{
+			/* skip if set */
+			if (config->stats != UNDEFINED_BOOL)
+				continue;
+			
+			if ((config->stats = parse_bool(value)) == -1) {
+				warnx("invalid value for stats: %s", value);
+				return -1;
+			}
+		}
+		else if (strcmp(key, "stats-json") == 0)
+		{
+			/* set if not set */
+			if (!config->statsjson)
+				config->statsjson = value;
+		}
+		else if (strcmp(key, "trace-file") == 0)
+		{
+			/* set if not set */
+			if (!config->tracefile)
+				config->tracefile = value;
+		}
+		else if (strcmp(key, "buffer-size") == 0)
+		{
+			/* skip if set */
+			if (config->bufsize)
+				continue;
+			
+			if (parse_size(value, &config->bufsize) == -1) {
+				warnx("invalid buffer size: %s", value);
+				return -1;
+			}
+		}
+		else if (strcmp(key, "adaptive") == 0)
+		{
+			/* skip if set */
+			if (config->adaptive != UNDEFINED_BOOL)
+				continue;
+			
+			if ((config->adaptive = parse_bool(value)) == -1) {
+				warnx("invalid value for adaptive: %s", value);
+				return -1;
+			}
+		}
+		else if (strcmp(key, "listen") == 0)
+		{
+			/* set if not set */
+			if (!config->listen)
+				config->listen = value;
+		}
+		else if (strcmp(key, "transparent") == 0)
+		{
+			/* skip if set */
+			if (config->transparent != UNDEFINED_BOOL)
+				continue;
+			
+			if ((config->transparent = parse_bool(value)) == -1) {
+				warnx("invalid value for transparent: %s",
+					value);
+				return -1;
+			}
+		}
+		else if (strcmp(key, "socks") == 0)
+		{
+			/* skip if set */
+			if (config->socks != UNDEFINED_BOOL)
+				continue;
+			
+			if ((config->socks = parse_bool(value)) == -1) {
+				warnx("invalid value for socks: %s", value);
+				return -1;
+			}
+		}
+		else if (strcmp(key, "broker") == 0)
+		{
+			/* set if not set */
+			if (!config->broker)
+				config->broker = value;
+		}
+		else if (strcmp(key, "agent") == 0)
+		{
+			/* set if not set */
+			if (!config->agent)
+				config->agent = value;
+		}
+		else if (strcmp(key, "pool") == 0)
+		{
+			/* skip if set */
+			if (config->pool)
+				continue;
+			
+			num = strtol(value, &endptr, 10);
+			if (STRTOL_INVALID_COUNT(num, value, endptr, 1)) {
+				warnx("invalid pool size: %s", value);
+				return -1;
+			}
+			config->pool = (int)num;
+		}
+		else if (strcmp(key, "stripes") == 0)
+		{
+			/* skip if set */
+			if (config->stripes)
+				continue;
+			
+			num = strtol(value, &endptr, 10);
+			if (STRTOL_INVALID_STRIPES(num, value, endptr)) {
+				warnx("invalid number of stripes: %s", value);
+				return -1;
+			}
+			config->stripes = (int)num;
+		}
+		else if (strcmp(key, "prefetch") == 0)
+		{
+			/* skip if set */
+			if (config->prefetch != UNDEFINED_COUNT)
+				continue;
+			
+			num = strtol(value, &endptr, 10);
+			if (STRTOL_INVALID_COUNT(num, value, endptr, 0)) {
+				warnx("invalid prefetch count: %s", value);
+				return -1;
+			}
+			config->prefetch = (int)num;
+		}
+		else if (strcmp(key, "workers") == 0)
+		{
+			/* skip if set */
+			if (config->workers)
+				continue;
+			
+			num = strtol(value, &endptr, 10);
+			if (STRTOL_INVALID_WORKERS(num, value, endptr)) {
+				warnx("invalid number of workers: %s", value);
+				return -1;
+			}
+			config->workers = (int)num;
+		}
 		else
 		{
 			warnx("%s: invalid keyword: %s", filename, key);
@@ -425,3 +1091,184 @@ parse_conf(struct config_t *config, char *filename)
 	/* all ok */
 	return 0;
 }
+
+/*
+ * Convert a relay mode name to a TUNNEL_RELAY_* value.
+ *
+ * Returns the relay mode, or -1 if the name is unknown.
+ */
+
+static int
+parse_relay(char *value)
+{
+	if (strcmp(value, "copy") == 0)
+		return TUNNEL_RELAY_COPY;
+	if (strcmp(value, "splice") == 0)
+		return TUNNEL_RELAY_SPLICE;
+	if (strcmp(value, "uring") == 0)
+		return TUNNEL_RELAY_URING;
+	
+	return -1;
+}
+
+/*
+ * Convert "yes" or "no" to 1 or 0.
+ *
+ * Returns 1 or 0, or -1 if the value is neither.
+ */
+
+static int
+parse_bool(char *value)
+{
+	if (strcmp(value, "yes") == 0)
+		return 1;
+	if (strcmp(value, "no") == 0)
+		return 0;
+	
+	return -1;
+}
+
+/*
+ * Convert a buffer size to bytes. The size may end with 'k' or 'm'
+ * (KiB or MiB), and must be between BUFFER_MIN_SIZE and
+ * BUFFER_MAX_SIZE.
+ *
+ * Returns 0 if OK, -1 if the size is invalid.
+ */
+
+static int
+parse_size(char *value, size_t *size)
+{
+	long num;
+	char *endptr = NULL;
+	
+	num = strtol(value, &endptr, 10);
+	if (endptr == value || num < 0)
+		return -1;
+	
+	if (*endptr == 'k' || *endptr == 'K') {
+		num = (num > LONG_MAX / 1024) ? LONG_MAX : num * 1024;
+		++endptr;
+	} else if (*endptr == 'm' || *endptr == 'M') {
+		num = (num > LONG_MAX / 1048576) ? LONG_MAX : num * 1048576;
+		++endptr;
+	}
+	
+	if (*endptr || num < BUFFER_MIN_SIZE || num > BUFFER_MAX_SIZE)
+		return -1;
+	
+	*size = (size_t)num;
+	
+	return 0;
+}
+
+/*
+ * Convert an authentication scheme name to an AUTH_* value.
+ *
+ * Returns the scheme, or -1 if the name is unknown.
+ */
+
+static int
+parse_auth(char *value)
+{
+	if (strcmp(value, "basic") == 0)
+		return AUTH_BASIC;
+	if (strcmp(value, "digest") == 0)
+		return AUTH_DIGEST;
+	if (strcmp(value, "ntlm") == 0)
+		return AUTH_NTLM;
+	
+	return -1;
+}
+
+/*
+ * Split the proxy hostname into the list of proxies. It holds one or
+ * more proxies separated by commas, each optionally with a port, like
+ * "host1,host2:8080,[::1]:3128". A proxy without a port uses the proxy
+ * port. The first proxy also becomes the proxy hostname and port.
+ *
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+parse_proxies(struct config_t *config)
+{
+	long num;
+	char *list, *name, *port, *endptr = NULL;
+	struct config_proxy_t *p;
+	
+	if ((list = strdup(config->proxyname)) == NULL) {
+		warn("strdup failed");
+		return -1;
+	}
+	
+	for (name = strtok(list, ","); name; name = strtok(NULL, ","))
+	{
+		if (config->nproxies == MAX_PROXIES) {
+			warnx("too many proxies, max is %i", MAX_PROXIES);
+			return -1;
+		}
+		
+		p = &config->proxies[config->nproxies++];
+		p->port = config->proxyport;
+		
+		/* find the port, after the brackets of an IPv6 address */
+		if (*name == '[' && (port = strchr(name, ']'))) {
+			*port++ = '\0';
+			++name;
+			port = (*port == ':') ? port + 1 : NULL;
+		} else if ((port = strchr(name, ':'))) {
+			*port++ = '\0';
+		}
+		
+		p->name = name;
+		
+		if (port) {
+			num = strtol(port, &endptr, 10);
+			if (STRTOL_INVALID_PORT(num, port, endptr)) {
+				warnx("invalid proxy port: %s", port);
+				return -1;
+			}
+			p->port = (int)num;
+		}
+		
+		if (!*p->name) {
+			warnx("missing parameter: proxy hostname");
+			return -1;
+		}
+		/* broker clients may go without a proxy to fall back to */
+		if (!p->port && (!config->broker || config->daemon)) {
+			warnx("missing parameter: proxy port");
+			return -1;
+		}
+	}
+	
+	if (config->nproxies == 0) {
+		warnx("missing parameter: proxy hostname");
+		return -1;
+	}
+	
+	config->proxyname = config->proxies[0].name;
+	config->proxyport = config->proxies[0].port;
+	
+	return 0;
+}
+
+/*
+ * Return the path of the file called name in $HOME, or NULL on error.
+ */
+
+static char *
+home_file(char *name)
+{
+	char *home = getenv("HOME"), *path;
+	
+	if ((path = malloc(strlen(home) + strlen(name) + 2)) == NULL) {
+		warn("malloc failed for $HOME + %s", name);
+		return NULL;
+	}
+	
+	stpcpy(stpcpy(stpcpy(path, home), "/"), name);
+	
+	return path;
+}
@@ -31,9 +31,23 @@
 #ifndef _SETUP_H_
 #define _SETUP_H_
 
+#include <stdio.h>
+#include <sys/types.h>
+
 #define SETUP_OK 0
 #define SETUP_ERROR -1
 
+/* max proxies in the proxy hostname list */
+#define MAX_PROXIES 8
+
+/* max tunnels a peer stream is spread over */
+#define MAX_STRIPES 16
+
+typedef struct config_proxy_t {
+	char *name;
+	int port;
+} config_proxy_t;
+
 typedef struct config_t {
 	int ifd;	/* input fd */
 	int ofd;	/* output fd */
@@ -42,8 +56,38 @@ typedef struct config_t {
 	char *password; /* can me malloc'ed */
 	char *hostname;
 	int hostport;
-	char *proxyname;
+	char *proxyname;	/* first proxy, after parse_proxies */
 	int proxyport;
+	int nproxies;	/* proxies in the list */
+	struct config_proxy_t proxies[MAX_PROXIES];
+	char *scores;	/* proxy scores file */
+	int timeout;	/* proxy connect timeout in seconds, 0 for none */
+	char *dnscache;	/* proxy address cache file */
+	int fastopen;	/* send the CONNECT in the SYN */
+	int mptcp;	/* connect to the proxy with multipath TCP */
+	int optimistic;	/* send client data before the response */
+	int peer;	/* far end is a prcat peer: compress */
+	int serve;	/* serve prcat peers */
+	int stripes;	/* tunnels a peer stream is spread over */
+	int resume;	/* open broken peer tunnels again */
+	int relay;	/* tunnel relay mode */
+	int stats;	/* print transfer counters when done */
+	char *statsjson;	/* file for JSON counters, "-" for stderr */
+	char *tracefile;	/* file for the setup trace, "-" for stderr */
+	size_t bufsize;	/* tunnel buffer size */
+	int adaptive;	/* adaptive buffer size */
+	char *listen;	/* local address to accept connections on */
+	int workers;	/* listen worker threads */
+	int transparent;	/* tunnel to original destination */
+	int socks;	/* serve SOCKS5 clients */
+	char *broker;	/* broker socket path */
+	int daemon;	/* run as the broker */
+	int pool;	/* broker: warm proxy sockets */
+	int prefetch;	/* broker: tunnels opened ahead */
+	int auth;	/* proxy authentication scheme */
+	char *authcache;	/* Digest challenge cache file */
+	char *agent;	/* credential agent socket path */
+	int agentd;	/* run as the credential agent */
 } config_t;
 
 void usage(FILE *stream);
@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "socks.h"
+
+/* protocol constants */
+#define SOCKS_VERSION		0x05
+#define SOCKS_NO_AUTH		0x00
+#define SOCKS_NO_METHODS	0xff
+#define SOCKS_CMD_CONNECT	0x01
+#define SOCKS_ATYP_IPV4		0x01
+#define SOCKS_ATYP_DOMAIN	0x03
+#define SOCKS_ATYP_IPV6		0x04
+
+/*
+ * The parsers below look at the data from the head of the buffer, and
+ * expect it not to wrap around. This holds as long as the handshake is
+ * read into a buffer that was reset, and fits in it: a greeting is at
+ * most 257 bytes, a request at most 262 bytes, and buffers are at least
+ * BUFFER_MIN_SIZE bytes.
+ */
+
+/*
+ * Check the client greeting (version and authentication methods).
+ *
+ * Only "no authentication" is supported; clients connect from the local
+ * machine. If the greeting is complete, it is consumed, the method
+ * selection reply to send is stored in reply (SOCKS_METHOD_SIZE bytes),
+ * and SOCKS_OK is returned. Returns SOCKS_MORE if the greeting is not
+ * complete yet. Returns SOCKS_ERROR if the client is not a SOCKS5
+ * client, or if it does not support "no authentication"; in the last
+ * case, reply holds the refusal to send.
+ */
+
+int
+socks_greeting(struct buffer_t *b, char *reply)
+{
+	size_t n, len;
+	unsigned char *p = (unsigned char *)b->data + b->head;
+	
+	if (b->len < 2)
+		return SOCKS_MORE;
+	
+	if (p[0] != SOCKS_VERSION) {
+		warnx("socks: unsupported version %i", p[0]);
+		return SOCKS_ERROR;
+	}
+	
+	len = 2 + p[1];
+	if (b->len < len)
+		return SOCKS_MORE;
+	
+	reply[0] = SOCKS_VERSION;
+	reply[1] = (char)SOCKS_NO_METHODS;
+	
+	for (n = 2; n < len; ++n)
+		if (p[n] == SOCKS_NO_AUTH)
+			reply[1] = SOCKS_NO_AUTH;
+	
+	buffer_consume(b, len);
+	
+	if (reply[1] != SOCKS_NO_AUTH) {
+		warnx("socks: client requires authentication");
+		return SOCKS_ERROR;
+	}
+	
+	return SOCKS_OK;
+}
+
+/*
+ * Parse the client request.
+ *
+ * If the request is complete and is a CONNECT, it is consumed, the
+ * destination is stored in host (SOCKS_HOST_SIZE bytes, IPv6 addresses
+ * in brackets) and *port, and SOCKS_OK is returned. Returns SOCKS_MORE
+ * if the request is not complete yet. Returns SOCKS_ERROR if it can't
+ * be handled, with the reply code to send in *code.
+ *
+ * Domain names are passed on in the CONNECT request line, so they may
+ * only contain characters that are valid in a hostname.
+ */
+
+int
+socks_request(struct buffer_t *b, char *host, int *port, int *code)
+{
+	size_t n, len;
+	char addr[INET6_ADDRSTRLEN];
+	unsigned char *p = (unsigned char *)b->data + b->head;
+	
+	*code = SOCKS_FAILURE;
+	
+	if (b->len < 5)
+		return SOCKS_MORE;
+	
+	if (p[0] != SOCKS_VERSION) {
+		warnx("socks: unsupported version %i", p[0]);
+		return SOCKS_ERROR;
+	}
+	
+	/* header, address, port */
+	switch (p[3])
+	{
+	case SOCKS_ATYP_IPV4:
+		len = 4 + 4 + 2;
+		break;
+	case SOCKS_ATYP_DOMAIN:
+		len = 4 + 1 + p[4] + 2;
+		break;
+	case SOCKS_ATYP_IPV6:
+		len = 4 + 16 + 2;
+		break;
+	default:
+		warnx("socks: unsupported address type %i", p[3]);
+		*code = SOCKS_ATYP_UNSUPPORTED;
+		return SOCKS_ERROR;
+	}
+	
+	if (b->len < len)
+		return SOCKS_MORE;
+	
+	if (p[1] != SOCKS_CMD_CONNECT) {
+		warnx("socks: unsupported command %i", p[1]);
+		*code = SOCKS_CMD_UNSUPPORTED;
+		return SOCKS_ERROR;
+	}
+	
+	switch (p[3])
+	{
+	case SOCKS_ATYP_IPV4:
+		inet_ntop(AF_INET, p + 4, host, SOCKS_HOST_SIZE);
+		break;
+	case SOCKS_ATYP_DOMAIN:
+		for (n = 0; n < p[4]; ++n) {
+			if (!isalnum(p[5 + n]) && p[5 + n] != '-' &&
+				p[5 + n] != '.' && p[5 + n] != '_')
+			{
+				warnx("socks: invalid hostname");
+				return SOCKS_ERROR;
+			}
+		}
+		if (p[4] == 0) {
+			warnx("socks: empty hostname");
+			return SOCKS_ERROR;
+		}
+		memcpy(host, p + 5, p[4]);
+		host[p[4]] = '\0';
+		break;
+	case SOCKS_ATYP_IPV6:
+		inet_ntop(AF_INET6, p + 4, addr, sizeof(addr));
+		snprintf(host, SOCKS_HOST_SIZE, "[%s]", addr);
+		break;
+	}
+	
+	*port = (p[len - 2] << 8) | p[len - 1];
+	
+	buffer_consume(b, len);
+	
+	return SOCKS_OK;
+}
+
+/*
+ * Store the reply to a request in reply (SOCKS_REPLY_SIZE bytes). The
+ * bound address is not known to us, and is sent as 0.0.0.0:0.
+ */
+
+void
+socks_reply(char *reply, int code)
+{
+	memset(reply, 0, SOCKS_REPLY_SIZE);
+	
+	reply[0] = SOCKS_VERSION;
+	reply[1] = code;
+	reply[3] = SOCKS_ATYP_IPV4;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SOCKS_H_
+#define _SOCKS_H_
+
+#include <sys/types.h>
+
+#include "buffer.h"
+
+/* socks_greeting and socks_request return values */
+#define SOCKS_OK	0	/* message parsed and consumed */
+#define SOCKS_MORE	1	/* need more data */
+#define SOCKS_ERROR	-1	/* invalid or unsupported message */
+
+/* reply codes (RFC 1928) */
+#define SOCKS_SUCCEEDED		0x00
+#define SOCKS_FAILURE		0x01	/* general server failure */
+#define SOCKS_HOST_UNREACHABLE	0x04
+#define SOCKS_CMD_UNSUPPORTED	0x07
+#define SOCKS_ATYP_UNSUPPORTED	0x08
+
+/* size of the method selection and CONNECT replies */
+#define SOCKS_METHOD_SIZE	2
+#define SOCKS_REPLY_SIZE	10
+
+/* room for a domain name of 255 bytes, or "[ipv6-address]" */
+#define SOCKS_HOST_SIZE		256
+
+int socks_greeting(struct buffer_t *buffer, char *reply);
+int socks_request(struct buffer_t *buffer, char *host, int *port,
+	int *code);
+void socks_reply(char *reply, int code);
+
+#endif /* _SOCKS_H_ */
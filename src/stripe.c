@@ -0,0 +1,1777 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "connect.h"
+#include "lz4.h"
+#include "peer.h"
+#include "stripe.h"
+#include "tunnel.h"
+
+/*
+ * A striped stream goes to a prcat peer over several tunnels at once,
+ * for proxies that limit the bandwidth of each connection, and can
+ * survive a proxy that resets its tunnels.
+ *
+ * Every tunnel (a stripe) starts with a greeting: STRIPE_MAGIC, a
+ * random session token, the index of the stripe, the number of stripes
+ * and its generation: 0 for a new stripe, and counting up every time it
+ * is opened again. prcat -Z handles every connection in a process of its own,
+ * so the process that gets the first stripe of a session binds an
+ * abstract unix socket named after the token, and the others pass
+ * their stripe to it (SCM_RIGHTS), see stripe_gather. The peer answers
+ * with STRIPE_MAGIC on every stripe once it has all of them.
+ *
+ * Then both directions are cut in chunks of at most STRIPE_CHUNK bytes,
+ * each sent as a frame on one of the stripes: a sequence number and a
+ * length of 4 bytes each, in network byte order, and the data. The top
+ * bit of the length tells the data is compressed, as in peer mode; the
+ * chunks are compressed and expanded in sequence, so they can refer to
+ * earlier ones on any stripe. The receiver keeps chunks that arrive
+ * early until their turn. A chunk without data is the end of the
+ * stream.
+ *
+ * A chunk goes to the stripe that will send it soonest: the one with
+ * the least queued data for its drain rate. The drain rate of a stripe
+ * is measured while it has data queued, so faster stripes get more of
+ * the stream as the transfer goes on.
+ *
+ * The receiver acknowledges chunks with a frame that has STRIPE_ACK set
+ * in its length, and the sequence number of the next chunk it expects.
+ * The sender keeps the frames until then, up to STRIPE_REPLAY bytes.
+ * When a stripe breaks, the client opens a new tunnel with the next
+ * generation, which the process of the session takes over, and both
+ * ends send all frames that were not acknowledged again on it. They
+ * are the same frames, so the peer can expand them, and it drops the
+ * chunks it had already. A peer that sees a stripe break tells the
+ * client on another one, with a frame that has STRIPE_BROKE set, and
+ * the index and generation of the stripe as sequence number; the
+ * client may not have seen it break.
+ */
+
+/* session token */
+#define STRIPE_TOKEN 8
+
+/* greeting: magic, token, index, count and generation */
+#define STRIPE_HELLO (sizeof(STRIPE_MAGIC) - 1 + STRIPE_TOKEN + 3)
+
+/* frame header: sequence number and length */
+#define STRIPE_HEADER		8
+#define STRIPE_COMPRESSED	0x80000000UL
+#define STRIPE_ACK		0x40000000UL
+#define STRIPE_BROKE		0x20000000UL
+#define STRIPE_LENGTH		0x1fffffffUL
+
+/* max raw bytes in a chunk */
+#define STRIPE_CHUNK 16384
+
+/* largest frame */
+#define STRIPE_FRAME (STRIPE_HEADER + LZ4_BOUND(STRIPE_CHUNK))
+
+/* chunks only go to a stripe with less data queued */
+#define STRIPE_QUEUE 65536
+
+/* size of the queue of a stripe, with room for a frame, an ack and
+ * a broken stripe */
+#define STRIPE_OUT (STRIPE_QUEUE + STRIPE_FRAME + 2 * STRIPE_HEADER)
+
+/* max unsent bytes in the kernel for a stripe */
+#define STRIPE_LOWAT 32768
+
+/* max bytes of chunks that arrived early */
+#define STRIPE_STORE (4 * 1024 * 1024)
+
+/* max bytes of frames kept until they are acknowledged */
+#define STRIPE_REPLAY (8 * 1024 * 1024)
+
+/* chunks acknowledged at once */
+#define STRIPE_ACKS 16
+
+/* busy time of a stripe per drain rate sample, in us */
+#define STRIPE_SAMPLE 20000
+
+/* drain rate of a stripe before it was measured, in bytes per us */
+#define STRIPE_RATE 1.0
+
+/* tries to reach the process that gathers the stripes */
+#define STRIPE_TRIES 50
+
+/* tries to open a tunnel again, with a delay that doubles up to 32s */
+#define STRIPE_REDIALS 8
+
+/* seconds the peer waits for a broken stripe to come back */
+#define STRIPE_LINGER 300
+
+/* a chunk that arrived early, or a frame kept until acknowledged */
+typedef struct stripe_chunk_t {
+	uint32_t seq;
+	int compressed;
+	size_t len;
+	struct stripe_chunk_t *next;
+	unsigned char data[];
+} stripe_chunk_t;
+
+/* a stripe: one tunnel */
+typedef struct stripe_link_t {
+	int fd;			/* -1 while broken */
+	int hello;		/* greeting not seen yet */
+	int closed;		/* peer closed it when done */
+	int queued;		/* had data queued at the last tick */
+	unsigned char *out;	/* frames to send */
+	size_t olen;		/* bytes in out */
+	size_t ooff;		/* bytes of out sent */
+	size_t ctl;		/* end of the last ACK or BROKE in out, or 0 */
+	int acking;		/* an ACK is in out, up to ctl */
+	uint32_t ackseq;	/* its sequence number */
+	unsigned broken;	/* stripes whose BROKE is in out, up to ctl */
+	int tell;		/* BROKE for this stripe still to be queued */
+	unsigned char *in;	/* frames received */
+	size_t ilen;		/* bytes in in */
+	uint32_t next;		/* chunks before this one came already */
+	struct stripe_chunk_t *resend;	/* next kept frame to send again */
+	double rate;		/* drain rate in bytes per us */
+	long long busy;		/* us with data queued, this sample */
+	size_t drained;		/* bytes sent, this sample */
+	long long broke;	/* time it broke, in us */
+	long long retry;	/* time to open it again, in us, or 0 */
+	int tries;		/* tries to open it again so far */
+	unsigned long long sent;	/* bytes sent */
+	int resumed;		/* times it came back */
+	unsigned char gen;	/* generation */
+} stripe_link_t;
+
+/* a striped stream */
+typedef struct stripe_t {
+	struct config_t *config;
+	int rfd;		/* stream data to send */
+	int wfd;		/* stream data received */
+	int lfd;		/* takes over stripes, or -1 on the client */
+	stripe_dial_t dial;	/* opens stripes again, or NULL */
+	unsigned char token[STRIPE_TOKEN];
+	int n;			/* stripes */
+	struct stripe_link_t links[MAX_STRIPES];
+	uint32_t txseq;		/* next chunk to send */
+	uint32_t rxseq;		/* next chunk to write */
+	uint32_t acked;		/* rxseq in the last ACK that was sent */
+	uint32_t acking;	/* rxseq in the last ACK that was queued */
+	int txeof;		/* end of the stream was queued */
+	int rxeof;		/* end of the stream was written */
+	struct stripe_chunk_t *store;	/* early chunks, in order */
+	size_t stored;		/* bytes in store */
+	struct stripe_chunk_t *replay;	/* kept frames, in order */
+	struct stripe_chunk_t *last;	/* last kept frame */
+	size_t kept;		/* bytes in replay */
+	unsigned char *data;	/* expanded data to write */
+	size_t dlen;		/* bytes of data left */
+	size_t early;		/* bytes from the CONNECT, not handled */
+	size_t owed;		/* handled, counted once written */
+	uint32_t owedseq;	/* chunks to write before that */
+	long long then;		/* time of the last tick, in us */
+	struct peer_codec_t tx;
+	struct peer_codec_t rx;
+	struct tunnel_stats_t *stats;
+} stripe_t;
+
+/*
+ * Store a 32 bit value at p, in network byte order.
+ */
+
+static void
+stripe_put32(unsigned char *p, uint32_t value)
+{
+	p[0] = (value >> 24) & 0xff;
+	p[1] = (value >> 16) & 0xff;
+	p[2] = (value >> 8) & 0xff;
+	p[3] = value & 0xff;
+}
+
+/*
+ * Returns the 32 bit value at p, in network byte order.
+ */
+
+static uint32_t
+stripe_get32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | p[3];
+}
+
+/*
+ * Returns the monotonic time in us.
+ */
+
+static long long
+stripe_now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Returns room for len more bytes in the queue of a stripe, moving the
+ * unsent bytes to the start if needed, or NULL if it is full. There is
+ * always room for a frame if less than STRIPE_QUEUE bytes are queued.
+ */
+
+static unsigned char *
+stripe_room(struct stripe_link_t *l, size_t len)
+{
+	if (l->olen + len > STRIPE_OUT) {
+		memmove(l->out, l->out + l->ooff, l->olen - l->ooff);
+		l->olen -= l->ooff;
+		if (l->ctl)
+			l->ctl -= l->ooff;
+		l->ooff = 0;
+	}
+	
+	return (l->olen + len <= STRIPE_OUT) ? l->out + l->olen : NULL;
+}
+
+/*
+ * Update the drain rates of the stripes that had data queued since the
+ * last tick.
+ */
+
+static void
+stripe_tick(struct stripe_t *s)
+{
+	int i;
+	long long now = stripe_now();
+	struct stripe_link_t *l;
+	
+	for (i = 0; i < s->n; ++i)
+	{
+		l = &s->links[i];
+		
+		if (l->queued)
+			l->busy += now - s->then;
+		
+		/* a new sample counts for a quarter */
+		if (l->busy >= STRIPE_SAMPLE) {
+			l->rate = (3 * l->rate + (double)l->drained / l->busy)
+				/ 4;
+			l->busy = 0;
+			l->drained = 0;
+		}
+		
+		l->queued = (l->ooff < l->olen);
+	}
+	
+	s->then = now;
+}
+
+/*
+ * Returns the stripe that will send a new chunk soonest, or NULL if all
+ * of them have enough queued. Stripes that send kept frames again get
+ * no new ones until they are done, to keep their frames in order.
+ */
+
+static struct stripe_link_t *
+stripe_pick(struct stripe_t *s)
+{
+	int i;
+	double cost, best = 0;
+	struct stripe_link_t *l, *pick = NULL;
+	
+	for (i = 0; i < s->n; ++i)
+	{
+		l = &s->links[i];
+		if (l->fd == -1 || l->closed || l->resend ||
+			l->olen - l->ooff >= STRIPE_QUEUE)
+			continue;
+		
+		cost = (l->olen - l->ooff + STRIPE_CHUNK) / l->rate;
+		if (!pick || cost < best) {
+			pick = l;
+			best = cost;
+		}
+	}
+	
+	return pick;
+}
+
+/*
+ * Keep a copy of the frame of len bytes at p, until it is acknowledged.
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+stripe_keep(struct stripe_t *s, uint32_t seq, const unsigned char *p,
+	size_t len)
+{
+	struct stripe_chunk_t *c;
+	
+	if ((c = malloc(sizeof(*c) + len)) == NULL) {
+		warn("chunk allocation failed");
+		return -1;
+	}
+	
+	c->seq = seq;
+	c->len = len;
+	c->next = NULL;
+	memcpy(c->data, p, len);
+	
+	if (s->last)
+		s->last->next = c;
+	else
+		s->replay = c;
+	s->last = c;
+	s->kept += len;
+	
+	return 0;
+}
+
+/*
+ * Read a chunk of the stream, and queue it on the stripe that will
+ * send it soonest. Queues the end of the stream on EOF.
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+stripe_send(struct stripe_t *s)
+{
+	int compressed = 0;
+	size_t len = 0;
+	ssize_t nread;
+	unsigned char *p;
+	struct stripe_link_t *l;
+	
+	if ((l = stripe_pick(s)) == NULL)
+		return 0;
+	
+	p = stripe_room(l, STRIPE_FRAME);
+	
+	nread = read(s->rfd, peer_codec_room(&s->tx), STRIPE_CHUNK);
+	
+	if (nread == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		warn("read failed");
+		return -1;
+	}
+	
+	s->stats[TUNNEL_TX].reads++;
+	
+	if (nread == 0) {
+		s->txeof = 1;
+	} else {
+		len = peer_codec_pack(&s->tx, nread, p + STRIPE_HEADER,
+			&compressed);
+		s->stats[TUNNEL_TX].bytes += nread;
+	}
+	
+	stripe_put32(p, s->txseq);
+	stripe_put32(p + 4, len | (compressed ? STRIPE_COMPRESSED : 0));
+	l->olen += STRIPE_HEADER + len;
+	
+	return stripe_keep(s, s->txseq++, p, STRIPE_HEADER + len);
+}
+
+/*
+ * Queue kept frames that a stripe sends again, as far as they fit.
+ */
+
+static void
+stripe_refill(struct stripe_link_t *l)
+{
+	unsigned char *p;
+	
+	while (l->resend && l->olen - l->ooff < STRIPE_QUEUE &&
+		(p = stripe_room(l, l->resend->len)))
+	{
+		memcpy(p, l->resend->data, l->resend->len);
+		l->olen += l->resend->len;
+		l->resend = l->resend->next;
+	}
+}
+
+/*
+ * Drop the kept frames the peer acknowledged: those before seq.
+ * Returns 0 if OK, -1 if the peer acknowledged what was not sent.
+ */
+
+static int
+stripe_acked(struct stripe_t *s, uint32_t seq)
+{
+	int i;
+	struct stripe_chunk_t *c;
+	
+	if ((int32_t)(seq - s->txseq) > 0) {
+		warnx("peer sent a bad frame");
+		return -1;
+	}
+	
+	while ((c = s->replay) && (int32_t)(c->seq - seq) < 0)
+	{
+		for (i = 0; i < s->n; ++i)
+			if (s->links[i].resend == c)
+				s->links[i].resend = c->next;
+		
+		s->replay = c->next;
+		if (s->last == c)
+			s->last = NULL;
+		s->kept -= c->len;
+		free(c);
+	}
+	
+	return 0;
+}
+
+/*
+ * Queue a frame without data on the stripe with the least queued.
+ * Returns that stripe, or NULL if there is no room.
+ */
+
+static struct stripe_link_t *
+stripe_control(struct stripe_t *s, uint32_t seq, uint32_t word)
+{
+	int i;
+	unsigned char *p;
+	struct stripe_link_t *l, *pick = NULL;
+	
+	for (i = 0; i < s->n; ++i)
+	{
+		l = &s->links[i];
+		if (l->fd == -1 || l->closed || l->hello)
+			continue;
+		if (!pick || l->olen - l->ooff < pick->olen - pick->ooff)
+			pick = l;
+	}
+	
+	if (!pick || (p = stripe_room(pick, STRIPE_HEADER)) == NULL)
+		return NULL;
+	
+	stripe_put32(p, seq);
+	stripe_put32(p + 4, word);
+	pick->olen += STRIPE_HEADER;
+	pick->ctl = pick->olen;
+	
+	return pick;
+}
+
+/*
+ * Acknowledge the chunks that were written, when there are enough of
+ * them or the stream ended.
+ */
+
+static void
+stripe_ack(struct stripe_t *s)
+{
+	struct stripe_link_t *l;
+	
+	if (s->rxseq == s->acking ||
+		(s->rxseq - s->acking < STRIPE_ACKS && !s->rxeof))
+		return;
+	
+	/* a later one acknowledges these as well */
+	if ((l = stripe_control(s, s->rxseq, STRIPE_ACK))) {
+		s->acking = s->rxseq;
+		l->acking = 1;
+		l->ackseq = s->rxseq;
+	}
+}
+
+/*
+ * Tell the client on another stripe which stripes broke, see
+ * stripe_broke.
+ */
+
+static void
+stripe_tell(struct stripe_t *s)
+{
+	int i;
+	struct stripe_link_t *l, *by;
+	
+	for (i = 0; i < s->n; ++i)
+	{
+		l = &s->links[i];
+		if (l->tell && (by = stripe_control(s, (i << 8) | l->gen,
+			STRIPE_BROKE)))
+		{
+			l->tell = 0;
+			by->broken |= 1U << i;
+		}
+	}
+}
+
+/*
+ * The ACK and BROKE frames queued on a stripe went out, once the
+ * stripe sent up to the last of them.
+ */
+
+static void
+stripe_sent(struct stripe_t *s, struct stripe_link_t *l)
+{
+	if (!l->ctl || l->ooff < l->ctl)
+		return;
+	
+	if (l->acking && (int32_t)(l->ackseq - s->acked) > 0)
+		s->acked = l->ackseq;
+	
+	l->ctl = 0;
+	l->acking = 0;
+	l->broken = 0;
+}
+
+/*
+ * The frames queued on a stripe are dropped: queue its ACK and BROKE
+ * frames again, on another stripe or once it is back.
+ */
+
+static void
+stripe_lost(struct stripe_t *s, struct stripe_link_t *l)
+{
+	int i;
+	
+	if (l->acking)
+		s->acking = s->acked;
+	
+	for (i = 0; i < s->n; ++i)
+		if (l->broken & (1U << i))
+			s->links[i].tell = 1;
+	
+	l->ctl = 0;
+	l->acking = 0;
+	l->broken = 0;
+}
+
+/*
+ * Start over on a stripe with a new socket: greet the peer, and send
+ * all kept frames again.
+ */
+
+static void
+stripe_attach(struct stripe_t *s, struct stripe_link_t *l, int fd)
+{
+	int lowat = STRIPE_LOWAT;
+	unsigned char *p = l->out;
+	
+	stripe_lost(s, l);
+	
+	l->fd = fd;
+	l->tell = 0;
+	l->ilen = 0;
+	if (l == &s->links[0])
+		s->early = 0;
+	l->ooff = 0;
+	l->next = 0;
+	l->resend = s->replay;
+	
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	
+	/* keep the backlog of a stripe where its drain rate can be
+	 * seen, see stripe_tick */
+#ifdef TCP_NOTSENT_LOWAT
+	setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+		sizeof(lowat));
+#else
+	(void)lowat;
+#endif
+	
+	/* the peer answers the greeting of the client */
+	memcpy(p, STRIPE_MAGIC, sizeof(STRIPE_MAGIC) - 1);
+	l->olen = sizeof(STRIPE_MAGIC) - 1;
+	
+	if (s->lfd == -1) {
+		p += sizeof(STRIPE_MAGIC) - 1;
+		memcpy(p, s->token, STRIPE_TOKEN);
+		p[STRIPE_TOKEN] = l - s->links;
+		p[STRIPE_TOKEN + 1] = s->n;
+		p[STRIPE_TOKEN + 2] = l->gen;
+		l->olen = STRIPE_HELLO;
+		l->hello = 1;
+	}
+}
+
+/*
+ * A stripe broke, with errno set if error is set. The client opens a
+ * new tunnel in its place, if it may, see stripe_redial; the peer waits
+ * for the client to do so. Returns 0 if OK, -1 if the stream can't go
+ * on.
+ */
+
+static int
+stripe_broke(struct stripe_t *s, struct stripe_link_t *l, int error)
+{
+	int index = l - s->links;
+	
+	if (error)
+		warn("stripe %i broke", index);
+	else
+		warnx("stripe %i broke", index);
+	
+	close(l->fd);
+	l->fd = -1;
+	l->broke = stripe_now();
+	stripe_lost(s, l);
+	
+	/* the client may not know yet */
+	if (s->lfd != -1) {
+		l->tell = 1;
+		return 0;
+	}
+	if (!s->dial)
+		return -1;
+	
+	/* the first try is right away */
+	l->tries = 0;
+	l->retry = l->broke;
+	
+	return 0;
+}
+
+/*
+ * Try once to open a broken stripe again, and schedule the next try if
+ * it fails. Returns 0 if OK, -1 if it can't be resumed.
+ */
+
+static int
+stripe_resume(struct stripe_t *s, struct stripe_link_t *l)
+{
+	int fd, delay;
+	struct buffer_t b;
+	
+	if (buffer_init(&b, BUFFER_T_SIZE) == -1) {
+		warn("buffer allocation failed");
+		return -1;
+	}
+	
+	if ((fd = s->dial(s->config, &b)) != -1 && b.len) {
+		warnx("peer spoke before the greeting");
+		close(fd);
+		fd = -1;
+	}
+	
+	buffer_free(&b);
+	
+	if (fd == -1) {
+		if (++l->tries == STRIPE_REDIALS) {
+			warnx("can't resume stripe %i", (int)(l - s->links));
+			return -1;
+		}
+		delay = 1 << (l->tries - 1 < 5 ? l->tries - 1 : 5);
+		l->retry = stripe_now() + delay * 1000000LL;
+		return 0;
+	}
+	
+	/* 0 is for new stripes */
+	l->gen = (l->gen == 255) ? 1 : l->gen + 1;
+	l->retry = 0;
+	stripe_attach(s, l, fd);
+	l->resumed++;
+	
+	return 0;
+}
+
+/*
+ * Send queued frames on a stripe. Returns 0 if OK, -1 on error.
+ */
+
+static int
+stripe_flush(struct stripe_t *s, struct stripe_link_t *l)
+{
+	ssize_t nwritten;
+	
+	stripe_refill(l);
+	
+	if (l->ooff == l->olen)
+		return 0;
+	
+	nwritten = send(l->fd, l->out + l->ooff, l->olen - l->ooff,
+		MSG_NOSIGNAL);
+	
+	if (nwritten == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		return stripe_broke(s, l, 1);
+	}
+	
+	l->ooff += nwritten;
+	l->sent += nwritten;
+	if (l->queued)
+		l->drained += nwritten;
+	s->stats[TUNNEL_TX].wire += nwritten;
+	stripe_sent(s, l);
+	
+	if (l->ooff == l->olen)
+		l->olen = l->ooff = 0;
+	
+	return 0;
+}
+
+/*
+ * Expand the chunk that is next in the stream, or shut down the write
+ * side if it is the end of the stream. Returns 0 if OK, -1 on error.
+ */
+
+static int
+stripe_take(struct stripe_t *s, const unsigned char *payload, size_t len,
+	int compressed)
+{
+	ssize_t raw;
+	
+	s->rxseq++;
+	
+	if (len == 0) {
+		s->rxeof = 1;
+		if (shutdown(s->wfd, SHUT_WR) == -1 && errno == ENOTSOCK &&
+			s->wfd != s->rfd)
+		{
+			close(s->wfd);
+			s->wfd = -1;
+		}
+		return 0;
+	}
+	
+	if ((raw = peer_codec_unpack(&s->rx, payload, len, compressed,
+		&s->data)) == -1)
+	{
+		warnx("peer sent a bad frame");
+		return -1;
+	}
+	
+	s->dlen = raw;
+	
+	return 0;
+}
+
+/*
+ * Count the bytes that came with the CONNECT response as leftover, once
+ * the chunks they carried are written out.
+ */
+
+static void
+stripe_leftover(struct stripe_t *s)
+{
+	if (s->owed && s->dlen == 0 &&
+		(int32_t)(s->rxseq - s->owedseq) >= 0)
+	{
+		s->stats[TUNNEL_RX].leftover += s->owed;
+		s->owed = 0;
+	}
+}
+
+/*
+ * Write expanded data, and expand the chunks that are next in turn.
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+stripe_deliver(struct stripe_t *s)
+{
+	ssize_t nwritten;
+	struct stripe_chunk_t *c;
+	struct tunnel_stats_t *stats = &s->stats[TUNNEL_RX];
+	
+	for (;;)
+	{
+		while (s->dlen) {
+			if ((nwritten = write(s->wfd, s->data, s->dlen)) == -1) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK ||
+					errno == EINTR)
+					return 0;
+				warn("write failed");
+				return -1;
+			}
+			s->data += nwritten;
+			s->dlen -= nwritten;
+			stats->bytes += nwritten;
+			stats->writes++;
+		}
+		
+		stripe_leftover(s);
+		
+		if ((c = s->store) == NULL || c->seq != s->rxseq)
+			return 0;
+		
+		s->store = c->next;
+		s->stored -= c->len;
+		
+		if (stripe_take(s, c->data, c->len, c->compressed) == -1) {
+			free(c);
+			return -1;
+		}
+		free(c);
+	}
+}
+
+/*
+ * Handle a chunk that came on a stripe: take it if it is next in turn,
+ * or keep it until it is. Chunks that came already, on this stripe
+ * before it broke or on another one, are dropped.
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+stripe_chunk(struct stripe_t *s, struct stripe_link_t *l, uint32_t seq,
+	const unsigned char *payload, size_t len, int compressed)
+{
+	struct stripe_chunk_t *c, **cp;
+	
+	/* chunks on a stripe are in order */
+	if ((int32_t)(seq - l->next) < 0) {
+		warnx("peer sent a bad frame");
+		return -1;
+	}
+	
+	l->next = seq + 1;
+	
+	if ((int32_t)(seq - s->rxseq) < 0)
+		return 0;
+	
+	if (s->rxeof) {
+		warnx("peer sent a bad frame");
+		return -1;
+	}
+	
+	if (seq == s->rxseq && s->dlen == 0) {
+		if (stripe_take(s, payload, len, compressed) == -1)
+			return -1;
+		return stripe_deliver(s);
+	}
+	
+	for (cp = &s->store; *cp && (int32_t)((*cp)->seq - seq) < 0; )
+		cp = &(*cp)->next;
+	
+	if (*cp && (*cp)->seq == seq)
+		return 0;
+	
+	if ((c = malloc(sizeof(*c) + len)) == NULL) {
+		warn("chunk allocation failed");
+		return -1;
+	}
+	
+	c->seq = seq;
+	c->compressed = compressed;
+	c->len = len;
+	memcpy(c->data, payload, len);
+	c->next = *cp;
+	*cp = c;
+	s->stored += len;
+	
+	return 0;
+}
+
+/*
+ * Handle the frames in the input of a stripe, keeping a partial frame.
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+stripe_frames(struct stripe_t *s, struct stripe_link_t *l)
+{
+	size_t off = 0, len;
+	uint32_t seq, word;
+	unsigned char *p;
+	struct stripe_link_t *l2;
+	
+	if (l->hello) {
+		if (l->ilen < sizeof(STRIPE_MAGIC) - 1)
+			return 0;
+		if (memcmp(l->in, STRIPE_MAGIC, sizeof(STRIPE_MAGIC) - 1)) {
+			warnx("the far end is not a prcat peer");
+			return -1;
+		}
+		l->hello = 0;
+		off = sizeof(STRIPE_MAGIC) - 1;
+	}
+	
+	/* every frame is checked to be complete before it is skipped */
+	for (; off + STRIPE_HEADER <= l->ilen; off += STRIPE_HEADER + len)
+	{
+		p = l->in + off;
+		word = stripe_get32(p + 4);
+		len = word & STRIPE_LENGTH;
+		
+		/* control frames have no data */
+		if ((word & (STRIPE_BROKE | STRIPE_ACK)) && len) {
+			warnx("peer sent a bad frame");
+			return -1;
+		}
+		
+		/* a stripe broke, unless it was opened again since */
+		if (word & STRIPE_BROKE) {
+			seq = stripe_get32(p);
+			l2 = &s->links[(seq >> 8) % s->n];
+			if (s->lfd == -1 && l2->fd != -1 &&
+				l2->gen == (seq & 0xff) && l2 != l &&
+				stripe_broke(s, l2, 0) == -1)
+				return -1;
+			continue;
+		}
+		
+		if (word & STRIPE_ACK) {
+			if (stripe_acked(s, stripe_get32(p)) == -1)
+				return -1;
+			continue;
+		}
+		
+		if (len > (word & STRIPE_COMPRESSED ?
+			LZ4_BOUND(STRIPE_CHUNK) : STRIPE_CHUNK))
+		{
+			warnx("peer sent a bad frame");
+			return -1;
+		}
+		
+		if (off + STRIPE_HEADER + len > l->ilen)
+			break;
+		
+		if (l == &s->links[0] && off < s->early)
+			s->owedseq = stripe_get32(p) + 1;
+		
+		if (stripe_chunk(s, l, stripe_get32(p), p + STRIPE_HEADER,
+			len, (word & STRIPE_COMPRESSED) != 0) == -1)
+			return -1;
+	}
+	
+	l->ilen -= off;
+	memmove(l->in, l->in + off, l->ilen);
+	
+	/* what came with the CONNECT response is at the start of the
+	 * first stripe */
+	if (l == &s->links[0] && s->early) {
+		len = off < s->early ? off : s->early;
+		s->owed += len;
+		s->early -= len;
+		stripe_leftover(s);
+	}
+	
+	return 0;
+}
+
+/*
+ * Returns 1 if all chunks went both ways: the peer is done as well, and
+ * may close the stripes.
+ */
+
+static int
+stripe_finished(struct stripe_t *s)
+{
+	return s->txeof && !s->replay && s->rxeof;
+}
+
+/*
+ * Read frames from a stripe. Returns 0 if OK, -1 on error.
+ */
+
+static int
+stripe_input(struct stripe_t *s, struct stripe_link_t *l)
+{
+	ssize_t nread;
+	
+	nread = read(l->fd, l->in + l->ilen, STRIPE_FRAME - l->ilen);
+	
+	if (nread == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		return stripe_broke(s, l, 1);
+	}
+	
+	/* the peer closes the stripes when it is done; before that,
+	 * the tunnel broke */
+	if (nread == 0) {
+		if (l->hello && !l->broke) {
+			warnx("peer closed a stripe before the greeting");
+			return -1;
+		}
+		if (!stripe_finished(s))
+			return stripe_broke(s, l, 0);
+		l->closed = 1;
+		return 0;
+	}
+	
+	l->ilen += nread;
+	s->stats[TUNNEL_RX].wire += nread;
+	
+	return stripe_frames(s, l);
+}
+
+/*
+ * Returns 1 if a stripe should be read: a stripe that may have the next
+ * chunk is always read, the others only while there is room for early
+ * chunks.
+ */
+
+static int
+stripe_readable(struct stripe_t *s, struct stripe_link_t *l)
+{
+	if (l->fd == -1 || l->closed)
+		return 0;
+	
+	return s->stored < STRIPE_STORE || (int32_t)(s->rxseq - l->next) >= 0;
+}
+
+/*
+ * Returns 1 if both directions of the stream are done, and the last
+ * acknowledgement was sent.
+ */
+
+static int
+stripe_done(struct stripe_t *s)
+{
+	int i;
+	struct stripe_link_t *l;
+	
+	if (!stripe_finished(s) || s->dlen || s->acked != s->rxseq)
+		return 0;
+	
+	for (i = 0; i < s->n; ++i) {
+		l = &s->links[i];
+		if (l->fd != -1 && !l->closed && l->ooff < l->olen)
+			return 0;
+	}
+	
+	return 1;
+}
+
+/*
+ * Fill in the abstract unix socket address for a session token.
+ * Returns the address length.
+ */
+
+static socklen_t
+stripe_address(struct sockaddr_un *addr, const unsigned char *token)
+{
+	int i;
+	char *p;
+	
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	
+	/* abstract: starts with a 0 byte, and is gone with the socket */
+	p = addr->sun_path + 1;
+	p += sprintf(p, "prcat-stripe-");
+	for (i = 0; i < STRIPE_TOKEN; ++i)
+		p += sprintf(p, "%02x", token[i]);
+	
+	return offsetof(struct sockaddr_un, sun_path) + (p - addr->sun_path);
+}
+
+/*
+ * Returns 1 if the process on the other end of a unix socket runs as
+ * this user, as the abstract socket of a session is open to all.
+ */
+
+static int
+stripe_trusted(int sock)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	
+	return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+		cred.uid == getuid();
+}
+
+/*
+ * Pass stripe fd with its index and generation (2 bytes at id) to the
+ * process that gathers the stripes on sock. Returns 0 if OK, -1 on
+ * error.
+ */
+
+static int
+stripe_pass(int sock, const unsigned char *id, int fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = (void *)id;
+	iov.iov_len = 2;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) != 2) {
+		warn("can't pass stripe");
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Receive a stripe from a process that got it, see stripe_pass.
+ * Returns the fd, and sets its index and generation at id, or -1 on
+ * error.
+ */
+
+static int
+stripe_receive(int sock, unsigned char *id)
+{
+	int fd = -1;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = id;
+	iov.iov_len = 2;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 2)
+		return -1;
+	
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+		cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	
+	return fd;
+}
+
+/*
+ * Returns 1 if generation gen of a stripe is newer than than. They
+ * count from 1 to 255 and start over, so half of the others are newer.
+ */
+
+static int
+stripe_newer(unsigned char gen, unsigned char than)
+{
+	int ahead = (gen - than + 255) % 255;
+	
+	if (gen == 0 || than == 0)
+		return gen != 0;
+	
+	return ahead > 0 && ahead <= 127;
+}
+
+/*
+ * Take over a stripe that the client opened again, from the process
+ * that got it, see stripe_gather. Returns 0 if OK, -1 on error.
+ */
+
+static int
+stripe_takeover(struct stripe_t *s)
+{
+	int fd, conn;
+	unsigned char id[2];
+	struct stripe_link_t *l;
+	
+	if ((conn = accept(s->lfd, NULL, NULL)) == -1)
+		return 0;
+	
+	fd = stripe_trusted(conn) ? stripe_receive(conn, id) : -1;
+	close(conn);
+	
+	if (fd == -1)
+		return 0;
+	
+	/* a late stripe of an older generation may not replace it */
+	if (id[0] >= s->n || !stripe_newer(id[1], s->links[id[0]].gen)) {
+		close(fd);
+		return 0;
+	}
+	
+	/* the old tunnel may not know it broke */
+	l = &s->links[id[0]];
+	if (l->fd != -1)
+		close(l->fd);
+	
+	l->gen = id[1];
+	stripe_attach(s, l, fd);
+	l->resumed++;
+	l->broke = 0;
+	
+	return 0;
+}
+
+/*
+ * Returns the poll timeout in ms: the peer gives up waiting for broken
+ * stripes after STRIPE_LINGER seconds, and -1 if they all came back.
+ * Returns 0 if it gave up.
+ */
+
+static int
+stripe_linger(struct stripe_t *s)
+{
+	int i, up = 0;
+	long long broke = 0;
+	
+	if (s->lfd == -1)
+		return -1;
+	
+	for (i = 0; i < s->n; ++i) {
+		if (s->links[i].fd != -1)
+			up = 1;
+		else if (!broke || s->links[i].broke < broke)
+			broke = s->links[i].broke;
+	}
+	
+	/* a stripe that is up carries the stream */
+	if (up || !broke)
+		return -1;
+	
+	if (stripe_now() - broke >= STRIPE_LINGER * 1000000LL)
+		return 0;
+	
+	return 1000;
+}
+
+/*
+ * Open the broken stripes of the client again, when their next try is
+ * due, so the other stripes go on meanwhile. Lowers the poll timeout to
+ * the next try. Returns 0 if OK, -1 if a stripe can't be resumed.
+ */
+
+static int
+stripe_redial(struct stripe_t *s, int *timeout)
+{
+	int i, wait;
+	long long now;
+	struct stripe_link_t *l;
+	
+	for (i = 0; i < s->n; ++i)
+	{
+		l = &s->links[i];
+		if (l->fd != -1 || !l->retry)
+			continue;
+		
+		if ((now = stripe_now()) >= l->retry) {
+			if (stripe_resume(s, l) == -1)
+				return -1;
+			if (!l->retry)
+				continue;
+			now = stripe_now();
+		}
+		
+		wait = (l->retry - now + 999) / 1000;
+		if (*timeout == -1 || wait < *timeout)
+			*timeout = wait;
+	}
+	
+	return 0;
+}
+
+/*
+ * Move data between the stream and the stripes until both directions
+ * are done. Returns 0 if OK, -1 on error.
+ */
+
+static int
+stripe_loop(struct stripe_t *s)
+{
+	int i, n, ready, events, timeout;
+	struct stripe_link_t *l;
+	struct pollfd pfd[MAX_STRIPES + 3];
+	
+	s->then = stripe_now();
+	
+	/* frames that came with the responses */
+	for (i = 0; i < s->n; ++i)
+		if (stripe_frames(s, &s->links[i]) == -1)
+			return -1;
+	
+	while (!stripe_done(s))
+	{
+		stripe_tick(s);
+		stripe_ack(s);
+		stripe_tell(s);
+		
+		if ((timeout = stripe_linger(s)) == 0) {
+			warnx("the stripes did not come back");
+			return -1;
+		}
+		if (stripe_redial(s, &timeout) == -1)
+			return -1;
+		
+		for (i = 0; i < s->n; ++i)
+		{
+			l = &s->links[i];
+			stripe_refill(l);
+			events = stripe_readable(s, l) ? POLLIN : 0;
+			if (l->fd != -1 && l->ooff < l->olen)
+				events |= POLLOUT;
+			/* watched without events too, to see it break */
+			pfd[i].fd = l->closed ? -1 : l->fd;
+			pfd[i].events = events;
+		}
+		
+		n = s->n;
+		pfd[n].fd = (!s->txeof && s->kept < STRIPE_REPLAY &&
+			stripe_pick(s)) ? s->rfd : -1;
+		pfd[n++].events = POLLIN;
+		pfd[n].fd = s->dlen ? s->wfd : -1;
+		pfd[n++].events = POLLOUT;
+		pfd[n].fd = s->lfd;
+		pfd[n++].events = POLLIN;
+		
+		ready = poll(pfd, n, timeout);
+		tunnel_json_check();
+		
+		if (ready == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("poll failed");
+			return -1;
+		}
+		
+		/* woken up to read or send: tx, to take or deliver: rx */
+		for (i = 0, events = 0; i < s->n; ++i)
+			events |= pfd[i].revents;
+		if (pfd[s->n].revents || (events & POLLOUT))
+			s->stats[TUNNEL_TX].wakeups++;
+		if (pfd[s->n + 1].revents || (events & ~POLLOUT))
+			s->stats[TUNNEL_RX].wakeups++;
+		
+		if (pfd[s->n + 1].revents && stripe_deliver(s) == -1)
+			return -1;
+		
+		for (i = 0; i < s->n; ++i)
+		{
+			l = &s->links[i];
+			if ((pfd[i].revents & (POLLOUT | POLLERR | POLLHUP)) &&
+				l->fd != -1 && stripe_flush(s, l) == -1)
+				return -1;
+			if ((pfd[i].revents & (POLLIN | POLLERR | POLLHUP)) &&
+				l->fd != -1 && stripe_input(s, l) == -1)
+				return -1;
+		}
+		
+		/* queue a chunk; it is sent when its stripe has room, so
+		 * the backlog stays in the queue, see stripe_tick */
+		if (pfd[s->n].revents && stripe_send(s) == -1)
+			return -1;
+		
+		if (pfd[s->n + 2].revents && stripe_takeover(s) == -1)
+			return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Prepare a striped stream between rfd and wfd, over n stripes that
+ * are attached later, see stripe_attach. Returns 0 if OK, -1 on error.
+ */
+
+static int
+stripe_init(struct stripe_t *s, struct config_t *config, int rfd, int wfd,
+	int n, struct tunnel_stats_t *stats)
+{
+	int i;
+	struct stripe_link_t *l;
+	
+	memset(s, 0, sizeof(*s));
+	s->config = config;
+	s->rfd = rfd;
+	s->wfd = wfd;
+	s->lfd = -1;
+	s->n = n;
+	s->stats = stats;
+	
+	if (peer_codec_init(&s->tx, 1) == -1 ||
+		peer_codec_init(&s->rx, 0) == -1)
+	{
+		warn("buffer allocation failed");
+		return -1;
+	}
+	
+	for (i = 0; i < n; ++i)
+	{
+		l = &s->links[i];
+		l->fd = -1;
+		l->rate = STRIPE_RATE;
+		
+		if ((l->out = malloc(STRIPE_OUT)) == NULL ||
+			(l->in = malloc(STRIPE_FRAME)) == NULL)
+		{
+			warn("buffer allocation failed");
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+/*
+ * Free a striped stream, and close its stripes.
+ */
+
+static void
+stripe_free(struct stripe_t *s)
+{
+	int i;
+	struct stripe_chunk_t *c;
+	
+	for (i = 0; i < s->n; ++i) {
+		if (s->links[i].fd != -1)
+			close(s->links[i].fd);
+		free(s->links[i].out);
+		free(s->links[i].in);
+	}
+	
+	while ((c = s->store)) {
+		s->store = c->next;
+		free(c);
+	}
+	
+	while ((c = s->replay)) {
+		s->replay = c->next;
+		free(c);
+	}
+	
+	peer_codec_free(&s->tx);
+	peer_codec_free(&s->rx);
+}
+
+/*
+ * Print what went over every stripe, its drain rate, and how often it
+ * came back after it broke.
+ */
+
+static void
+stripe_report(struct stripe_t *s)
+{
+	int i;
+	
+	for (i = 0; i < s->n; ++i)
+		warnx("stripe %i: sent %llu bytes, drain rate %.1f MB/s, "
+			"resumed %i times", i, s->links[i].sent,
+			s->links[i].rate, s->links[i].resumed);
+}
+
+/*
+ * Tunnel between input and output fd of config and a prcat peer, with
+ * the stream spread over config->stripes tunnels. The first tunnel is
+ * sock, with the data that followed the CONNECT response in buffer;
+ * dial opens the others. With fewer tunnels than asked for, the stream
+ * goes over the ones that could be opened. If config->resume is set,
+ * dial also opens a tunnel again when it breaks.
+ *
+ * Counts as peer_handler does in stats. Closes sock. Returns an exit
+ * code.
+ */
+
+int
+stripe_handler(struct config_t *config, int sock, struct buffer_t *b,
+	stripe_dial_t dial, struct tunnel_stats_t *stats)
+{
+	int i, n, status, fds[MAX_STRIPES], flags[2];
+	size_t len;
+	struct buffer_t extra;
+	struct stripe_t s;
+	
+	if (buffer_init(&extra, BUFFER_T_SIZE) == -1) {
+		warn("buffer allocation failed");
+		return EX_OSERR;
+	}
+	
+	/* open the other tunnels; the peer only speaks once it has all
+	 * of them, so nothing may follow their CONNECT responses */
+	fds[0] = sock;
+	for (n = 1; n < config->stripes; ++n)
+	{
+		buffer_reset(&extra);
+		if ((fds[n] = dial(config, &extra)) == -1)
+			break;
+		if (extra.len) {
+			warnx("peer spoke before the greeting");
+			close(fds[n]);
+			break;
+		}
+	}
+	
+	buffer_free(&extra);
+	
+	if (n < config->stripes)
+		warnx("opened %i of %i stripes", n, config->stripes);
+	
+	if (stripe_init(&s, config, config->ifd, config->ofd, n,
+		stats) == -1)
+		return EX_OSERR;
+	
+	if (getentropy(s.token, sizeof(s.token)) == -1) {
+		warn("can't get random bytes");
+		return EX_OSERR;
+	}
+	
+	if (config->resume)
+		s.dial = dial;
+	
+	/* greet the peer on every stripe */
+	for (i = 0; i < n; ++i)
+		stripe_attach(&s, &s.links[i], fds[i]);
+	
+	/* input and output non-blocking, restored when done */
+	flags[0] = fcntl(config->ifd, F_GETFL);
+	flags[1] = fcntl(config->ofd, F_GETFL);
+	fcntl(config->ifd, F_SETFL, flags[0] | O_NONBLOCK);
+	fcntl(config->ofd, F_SETFL, flags[1] | O_NONBLOCK);
+	
+	/* what followed the first CONNECT response, handled as if it was
+	 * read from the first stripe, which then has room for a frame */
+	status = 0;
+	for (; b && b->len && status == 0; buffer_consume(b, len)) {
+		len = b->size - b->head;
+		if (len > b->len)
+			len = b->len;
+		if (len > STRIPE_FRAME - s.links[0].ilen)
+			len = STRIPE_FRAME - s.links[0].ilen;
+		if (len == 0) {
+			warnx("peer sent a bad frame");
+			status = -1;
+			break;
+		}
+		memcpy(s.links[0].in + s.links[0].ilen, b->data + b->head, len);
+		s.links[0].ilen += len;
+		s.early += len;
+		stats[TUNNEL_RX].wire += len;
+		status = stripe_frames(&s, &s.links[0]);
+	}
+	
+	if (status == 0)
+		status = stripe_loop(&s);
+	
+	if (s.wfd != -1)
+		fcntl(config->ofd, F_SETFL, flags[1]);
+	fcntl(config->ifd, F_SETFL, flags[0]);
+	
+	if (config->stats)
+		stripe_report(&s);
+	
+	stripe_free(&s);
+	
+	return (status == 0) ? EX_OK : EX_IOERR;
+}
+
+/*
+ * Gather the stripes of a session in one process. The first process of
+ * the session to get here waits for the others to pass their stripe,
+ * and returns the number of stripes, with every fd at its index in fds,
+ * and the socket that takes over stripes later in lfd. The others, and
+ * the process of a stripe that resumes, pass their stripe and return 0.
+ * Returns -1 on error.
+ */
+
+static int
+stripe_gather(struct config_t *config, const unsigned char *hello, int fd,
+	int *fds, int *lfd)
+{
+	int i, n, sock, conn, tries, got = 1;
+	int timeout = config->timeout ? config->timeout * 1000 : -1;
+	unsigned char id[2] = { hello[STRIPE_TOKEN], hello[STRIPE_TOKEN + 2] };
+	struct sockaddr_un addr;
+	socklen_t len;
+	struct pollfd pfd;
+	
+	n = hello[STRIPE_TOKEN + 1];
+	len = stripe_address(&addr, hello);
+	
+	if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+		warn("socket() call failed");
+		return -1;
+	}
+	
+	if (bind(sock, (struct sockaddr *)&addr, len) == -1) {
+		if (errno != EADDRINUSE) {
+			warn("can't bind stripe socket");
+			close(sock);
+			return -1;
+		}
+		
+		/* another process gathers this session, which may not
+		 * be listening yet */
+		for (tries = 0; connect(sock, (struct sockaddr *)&addr,
+			len) == -1; usleep(10000))
+		{
+			if (errno != ECONNREFUSED || ++tries == STRIPE_TRIES) {
+				warn("can't reach the first stripe");
+				close(sock);
+				return -1;
+			}
+		}
+		
+		if (!stripe_trusted(sock)) {
+			warnx("stripe socket belongs to another user");
+			close(sock);
+			return -1;
+		}
+		
+		i = stripe_pass(sock, id, fd);
+		close(sock);
+		return (i == 0) ? 0 : -1;
+	}
+	
+	if (id[1]) {
+		warnx("peer resumed a stripe of a session that is gone");
+		close(sock);
+		return -1;
+	}
+	
+	if (listen(sock, MAX_STRIPES) == -1) {
+		warn("can't listen on stripe socket");
+		close(sock);
+		return -1;
+	}
+	
+	for (i = 0; i < n; ++i)
+		fds[i] = -1;
+	fds[id[0]] = fd;
+	
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	
+	while (got < n)
+	{
+		if ((i = poll(&pfd, 1, timeout)) <= 0) {
+			if (i == -1 && errno == EINTR)
+				continue;
+			warnx("got %i of %i stripes", got, n);
+			break;
+		}
+		
+		if ((conn = accept(sock, NULL, NULL)) == -1)
+			continue;
+		
+		if (stripe_trusted(conn) &&
+			(i = stripe_receive(conn, id)) != -1)
+		{
+			if (id[0] < n && fds[id[0]] == -1) {
+				fds[id[0]] = i;
+				got++;
+			} else {
+				close(i);
+			}
+		}
+		
+		close(conn);
+	}
+	
+	if (got == n) {
+		*lfd = sock;
+		return n;
+	}
+	
+	close(sock);
+	
+	for (i = 0; i < n; ++i)
+		if (fds[i] != -1 && fds[i] != fd)
+			close(fds[i]);
+	
+	return -1;
+}
+
+/*
+ * Serve a stripe of a prcat client on fd, whose greeting magic was read
+ * already. The process that gathers all stripes of the session connects
+ * to the destination, and tunnels the stream; it takes over the stripes
+ * the client opens again after they broke. Returns an exit code.
+ */
+
+int
+stripe_serve(struct config_t *config, int fd)
+{
+	int i, n, sock, lfd, status, fds[MAX_STRIPES];
+	unsigned char hello[STRIPE_HELLO - (sizeof(STRIPE_MAGIC) - 1)];
+	struct stripe_t s;
+	struct tunnel_stats_t stats[2];
+	
+	if (recv(fd, hello, sizeof(hello), MSG_WAITALL) != sizeof(hello) ||
+		hello[STRIPE_TOKEN + 1] > MAX_STRIPES ||
+		hello[STRIPE_TOKEN] >= hello[STRIPE_TOKEN + 1])
+	{
+		warnx("peer sent a bad greeting");
+		return EX_PROTOCOL;
+	}
+	
+	if ((n = stripe_gather(config, hello, fd, fds, &lfd)) <= 0)
+		return (n == 0) ? EX_OK : EX_UNAVAILABLE;
+	
+	memset(stats, 0, sizeof(stats));
+	
+	if ((sock = tcp_connect(config->hostname, config->hostport,
+		config->timeout)) == -1)
+	{
+		for (i = 0; i < n; ++i)
+			if (fds[i] != fd)
+				close(fds[i]);
+		close(lfd);
+		return EX_UNAVAILABLE;
+	}
+	
+	if (stripe_init(&s, config, sock, sock, n, stats) == -1 ||
+		fcntl(sock, F_SETFL, O_NONBLOCK) == -1)
+		return EX_OSERR;
+	
+	/* tell the client all stripes are here; the caller closes fd */
+	s.lfd = lfd;
+	for (i = 0; i < n; ++i)
+		stripe_attach(&s, &s.links[i], (fds[i] == fd) ? dup(fd) :
+			fds[i]);
+	
+	status = stripe_loop(&s);
+	
+	if (config->stats) {
+		tunnel_report(stats);
+		stripe_report(&s);
+	}
+	
+	stripe_free(&s);
+	close(lfd);
+	close(sock);
+	
+	return (status == 0) ? EX_OK : EX_IOERR;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A trace of the phases of setting up a tunnel: one JSON line per
+ * phase, with the time since prcat started, and since the phase before
+ * it. The times come from the monotonic clock, which is also given, so
+ * the trace can be lined up with those of other processes.
+ *
+ * Phases are marked where they end. When tracing is off, marking one
+ * is a function call that returns right away.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* max size of a trace line */
+#define TRACE_LINE 256
+
+/* where the trace goes, -1 if tracing is off */
+static int trace_fd = -1;
+
+/* when prcat started, and when the last phase ended */
+static struct timespec trace_start, trace_last;
+
+/*
+ * Return the seconds from a to b.
+ */
+
+static double
+trace_seconds(struct timespec *a, struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/*
+ * Note the time prcat started, before anything else is done.
+ */
+
+void
+trace_init(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &trace_start);
+	trace_last = trace_start;
+}
+
+/*
+ * Mark the end, when the process exits.
+ */
+
+static void
+trace_exit(void)
+{
+	trace_mark("exit");
+}
+
+/*
+ * Start tracing to file, or to stderr if file is "-". The file is
+ * appended to. Returns 0 if OK, -1 if the file can't be opened.
+ */
+
+int
+trace_open(char *file)
+{
+	if (strcmp(file, "-") == 0) {
+		trace_fd = STDERR_FILENO;
+	} else if ((trace_fd = open(file, O_WRONLY | O_CREAT | O_APPEND |
+		O_CLOEXEC, 0644)) == -1)
+	{
+		warn("can't open %s", file);
+		return -1;
+	}
+	
+	atexit(trace_exit);
+	
+	return 0;
+}
+
+/*
+ * Write a trace line for phase, which ended just now.
+ */
+
+void
+trace_mark(const char *phase)
+{
+	int len;
+	struct timespec now;
+	char line[TRACE_LINE];
+	
+	if (trace_fd == -1)
+		return;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	len = snprintf(line, sizeof(line), "{\"pid\":%li,\"phase\":\"%s\","
+		"\"time\":%.6f,\"delta\":%.6f,\"monotonic\":%lli.%09li}\n",
+		(long)getpid(), phase, trace_seconds(&trace_start, &now),
+		trace_seconds(&trace_last, &now), (long long)now.tv_sec,
+		now.tv_nsec);
+	
+	trace_last = now;
+	
+	if (write(trace_fd, line, len) != len)
+		warn("can't write trace");
+}
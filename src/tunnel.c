@@ -28,150 +28,905 @@
  * THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <sys/select.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
 #include <err.h>
-#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "buffer.h"
+#include "event.h"
+#include "trace.h"
 #include "tunnel.h"
+#include "uring.h"
+
+#if defined(__linux__) && !defined(TUNNEL_NO_SPLICE)
+#define TUNNEL_USE_SPLICE
+#endif
+
+/* max bytes held by the splice pipe, default pipe capacity */
+#ifndef TUNNEL_SPLICE_SIZE
+#define TUNNEL_SPLICE_SIZE 65536
+#endif
+
+/* adaptive buffers: grow after this many reads filled the room */
+#ifndef TUNNEL_GROW_READS
+#define TUNNEL_GROW_READS 2
+#endif
+
+/* adaptive buffers: shrink after this many small reads */
+#ifndef TUNNEL_SHRINK_READS
+#define TUNNEL_SHRINK_READS 16
+#endif
+
+/* direction state flags */
+#define TUNNEL_EOF	0x01	/* read side hit EOF */
+#define TUNNEL_SHUT	0x02	/* write side was shut down */
+
+/* max size of a JSON counters line */
+#define TUNNEL_JSON_LINE 1024
+
+/* fd state flags */
+#define TUNNEL_FD_CLOSE	0x01	/* fd must be closed */
+#define TUNNEL_FD_GONE	0x02	/* fd was closed */
+
+/* JSON counters: where they go, what of, and since when */
+static int tunnel_json_fd = -1;
+static char tunnel_json_target[256];
+static struct tunnel_stats_t *tunnel_json_stats;
+static struct timespec tunnel_json_start;
+static volatile sig_atomic_t tunnel_json_signal;
+
+/*
+ * Returns the amount of bytes waiting to be written for a direction.
+ */
+
+static size_t
+tunnel_pending(struct tunnel_dir_t *d)
+{
+	return d->b->len + d->piped;
+}
+
+/*
+ * Returns the tunnel_fd_t entry of fd.
+ */
+
+static struct tunnel_fd_t *
+tunnel_fd(struct tunnel_t *t, int fd)
+{
+	int n;
+	
+	for (n = 0; n < t->nfds; ++n)
+		if (t->fds[n].fd == fd)
+			break;
+	
+	return &t->fds[n];
+}
+
+/*
+ * Adapt the buffer size of a direction to the traffic, after a read of
+ * nread bytes into room bytes of free space.
+ *
+ * Reads that keep filling all free space mean the other side sends
+ * faster than we read: the buffer doubles, up to bufmax. Reads that
+ * keep using only a fraction of the buffer mean the link is used
+ * interactively: the buffer halves, down to BUFFER_T_SIZE. A failed
+ * resize just keeps the current size.
+ */
+
+static void
+tunnel_adapt(struct tunnel_dir_t *d, size_t room, size_t nread)
+{
+	size_t size = d->b->size;
+	
+	if (nread == room && size < d->bufmax) {
+		d->smalls = 0;
+		if (++d->fills < TUNNEL_GROW_READS)
+			return;
+		d->fills = 0;
+		size = (size > d->bufmax / 2) ? d->bufmax : size * 2;
+	} else if (nread < size / 8 && size > BUFFER_T_SIZE) {
+		d->fills = 0;
+		if (++d->smalls < TUNNEL_SHRINK_READS || d->b->len > size / 2)
+			return;
+		d->smalls = 0;
+		size = (size / 2 < BUFFER_T_SIZE) ? BUFFER_T_SIZE : size / 2;
+	} else {
+		d->fills = d->smalls = 0;
+		return;
+	}
+	
+	buffer_resize(d->b, size);
+}
 
 /*
- * Read data from a file descriptor.
+ * Read data from the read fd of a direction into the free space of its
+ * buffer, which may be split in two at the wrap point.
  *
- * Returns number of bytes read. Returns 0 on EOF.
- * Never returns if there is an error.
+ * Returns number of bytes read, 0 on EOF, -1 if no data is available
+ * right now. Returns -2 on error.
  */
 
-static short
-tunnel_read(struct buffer_t *b, int rfd)
+static ssize_t
+tunnel_read(struct tunnel_dir_t *d)
 {
+	size_t room;
+	ssize_t nread;
+	
+	if ((room = buffer_room(d->b)) == 0)
+		return -1;
+	
 	/* read data */
-	b->s_len = read(rfd, b->data, sizeof(b->data));
+	if ((nread = buffer_readv(d->b, d->rfd)) == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return -1;
+		warn("read error");
+		return -2;
+	}
+	
+	++d->stats->reads;
 	
-	if (b->s_len == -1)
-		err(EX_IOERR, "read error");
+	if (d->bufmax && nread > 0)
+		tunnel_adapt(d, room, nread);
 	
-	return b->s_len;
+	return nread;
 }
 
 /*
- * Write data to a file descriptor.
+ * Write pending data in the buffer of a direction to its write fd. A
+ * short write is fine: the rest stays in the buffer.
  *
- * Returns number of bytes written.
- * Never returns if there is an error.
+ * Returns number of bytes written, -1 if the fd can't take data right
+ * now. Returns -2 on error.
  */
 
-static short
-tunnel_write(struct buffer_t *b, int wfd)
+static ssize_t
+tunnel_write(struct tunnel_dir_t *d)
 {
+	size_t n;
+	ssize_t nwritten;
+	
 	/* write data */
-	b->w_len = write(wfd, b->data, b->s_len);
+	if ((nwritten = buffer_writev(d->b, d->wfd)) == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return -1;
+		warn("write error");
+		return -2;
+	}
 	
-	if (b->w_len == -1)
-		err(EX_IOERR, "write error");
-	else if (b->w_len != b->s_len) /* who turned on O_NONBLOCK? */
-		err(EX_IOERR, "short write");
+	++d->stats->writes;
+	d->stats->bytes += nwritten;
 	
-	return b->w_len;
+	/* the data that came with the CONNECT response goes out first */
+	n = (size_t)nwritten < d->early ? (size_t)nwritten : d->early;
+	d->stats->leftover += n;
+	d->early -= n;
+	
+	return nwritten;
 }
 
+#ifdef TUNNEL_USE_SPLICE
+
 /*
- * Write pending data to a file descriptor.
+ * Check if splice(2) can be used on a file descriptor. Only pipes and
+ * sockets are accepted, terminals and the like need read/write.
+ */
+
+static int
+tunnel_splice_capable(int fd)
+{
+	struct stat st;
+	
+	if (fstat(fd, &st) == -1)
+		return 0;
+	
+	return S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode);
+}
+
+/*
+ * Move data from the read fd of a direction into its pipe, without
+ * copying it to userspace. Pending data in the buffer goes first, so
+ * nothing is moved while the buffer holds data.
  *
- * Returns number of bytes flushed.
- * Never returns if there is an error.
+ * Returns number of bytes moved, 0 on EOF, -1 if no data can be moved
+ * right now. Returns -2 on error, and -3 if the read fd can't be
+ * spliced after all (no data was consumed in that case).
  */
 
-static short
-tunnel_flush(struct buffer_t *b, int wfd)
+static ssize_t
+tunnel_splice_read(struct tunnel_dir_t *d)
 {
-	short flushed;
+	ssize_t nread;
 	
-	/* write data */
-	flushed = write(wfd, b->data + b->w_len, b->s_len - b->w_len);
+	if (d->b->len || d->piped == d->pipesize)
+		return -1;
 	
-	if (flushed == -1)
-		err(EX_IOERR, "write error");
+	nread = splice(d->rfd, NULL, d->pfd[1], NULL,
+		d->pipesize - d->piped,
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
 	
-	/* count written data */
-	b->w_len += flushed;
+	if (nread == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return -1;
+		if (errno == EINVAL && d->piped == 0)
+			return -3;
+		warn("splice read error");
+		return -2;
+	}
 	
-	if (b->w_len != b->s_len) /* who turned on O_NONBLOCK? */
-		err(EX_IOERR, "short write");
+	++d->stats->reads;
+	d->piped += nread;
 	
-	return flushed;
+	return nread;
 }
 
 /*
- * Read data from one file descriptor, and write it to the other.
+ * Move data from the pipe of a direction to its write fd.
  *
- * Returns number of bytes transmitted. Returns 0 on EOF.
- * Never returns if there is an error.
+ * Returns number of bytes moved, -1 if the fd can't take data right
+ * now. Returns -2 on error.
  */
 
-static short
-tunnel_tx(struct buffer_t *b, int rfd, int wfd)
+static ssize_t
+tunnel_splice_write(struct tunnel_dir_t *d)
 {
-	/* read data - return on eof */
-	if (tunnel_read(b, rfd) == 0)
-		return 0;
+	ssize_t nwritten;
+	
+	nwritten = splice(d->pfd[0], NULL, d->wfd, NULL, d->piped,
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	
+	if (nwritten == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return -1;
+		warn("splice write error");
+		return -2;
+	}
+	
+	++d->stats->writes;
+	d->stats->bytes += nwritten;
+	d->piped -= nwritten;
+	
+	return nwritten;
+}
+
+#endif /* TUNNEL_USE_SPLICE */
+
+/*
+ * Read data for a direction using its relay mode. A splice relay falls
+ * back to TUNNEL_RELAY_COPY if splicing turns out to be impossible.
+ *
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+tunnel_fill(struct tunnel_dir_t *d)
+{
+	ssize_t n;
+	
+#ifdef TUNNEL_USE_SPLICE
+	if (d->relay == TUNNEL_RELAY_SPLICE) {
+		n = tunnel_splice_read(d);
+		if (n == -3) {
+			close(d->pfd[0]);
+			close(d->pfd[1]);
+			d->relay = TUNNEL_RELAY_COPY;
+			n = tunnel_read(d);
+		}
+	} else
+#endif /* TUNNEL_USE_SPLICE */
+	n = tunnel_read(d);
+	
+	if (n == -2)
+		return -1;
+	if (n == 0)
+		d->state |= TUNNEL_EOF;
+	
+	return 0;
+}
+
+/*
+ * Write pending data of a direction, buffered data first, then piped
+ * data. Returns 0 if OK, -1 on error.
+ */
+
+static int
+tunnel_drain(struct tunnel_dir_t *d)
+{
+	if (d->b->len)
+		if (tunnel_write(d) == -2)
+			return -1;
+	
+#ifdef TUNNEL_USE_SPLICE
+	if (d->b->len == 0 && d->piped)
+		if (tunnel_splice_write(d) == -2)
+			return -1;
+#endif /* TUNNEL_USE_SPLICE */
+	
+	return 0;
+}
+
+/*
+ * Shut down the write side of a direction once its read side hit EOF
+ * and all data was written, so the other end sees EOF as well. Sockets
+ * are shut down. Other fds are closed, unless they are also read from.
+ */
+
+static void
+tunnel_shut(struct tunnel_t *t, struct tunnel_dir_t *d)
+{
+	struct tunnel_dir_t *other;
+	
+	if (!(d->state & TUNNEL_EOF) || (d->state & TUNNEL_SHUT))
+		return;
+	if (tunnel_pending(d))
+		return;
+	
+	d->state |= TUNNEL_SHUT;
+	other = (d == &t->dir[TUNNEL_TX]) ?
+		&t->dir[TUNNEL_RX] : &t->dir[TUNNEL_TX];
+	
+	if (shutdown(d->wfd, SHUT_WR) == 0 || errno != ENOTSOCK)
+		return;
+	
+	if (d->wfd != other->rfd)
+		tunnel_fd(t, d->wfd)->state |= TUNNEL_FD_CLOSE;
+}
+
+/*
+ * Returns the events a direction needs on fd.
+ */
+
+static int
+tunnel_dir_events(struct tunnel_dir_t *d, int fd)
+{
+	int events = 0;
+	
+	/* room to read: in the buffer, or in the pipe once the
+	 * buffer is empty */
+	if (d->rfd == fd && !(d->state & TUNNEL_EOF)) {
+		if (d->relay == TUNNEL_RELAY_SPLICE) {
+			if (d->b->len == 0 && d->piped < d->pipesize)
+				events |= EVENT_READ;
+		} else if (buffer_room(d->b))
+			events |= EVENT_READ;
+	}
+	
+	/* something to write */
+	if (d->wfd == fd && tunnel_pending(d))
+		events |= EVENT_WRITE;
+	
+	return events;
+}
+
+/*
+ * Update the watched events of all fds of a tunnel.
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+tunnel_update(struct tunnel_t *t, struct event_t *ev)
+{
+	int n, events;
+	struct tunnel_fd_t *f;
+	
+	for (n = 0; n < t->nfds; ++n)
+	{
+		f = &t->fds[n];
+		
+		if (f->state & TUNNEL_FD_GONE)
+			continue;
+		
+		/* fd was shut down by closing it */
+		if (f->state & TUNNEL_FD_CLOSE) {
+			event_del(ev, f->fd);
+			fcntl(f->fd, F_SETFL, f->flags);
+			close(f->fd);
+			f->state |= TUNNEL_FD_GONE;
+			continue;
+		}
+		
+		events = tunnel_dir_events(&t->dir[TUNNEL_TX], f->fd) |
+			tunnel_dir_events(&t->dir[TUNNEL_RX], f->fd);
+		
+		if (events == f->events)
+			continue;
+		
+		if (event_mod(ev, f->fd, events, t) == -1) {
+			warn("can't watch fd %i", f->fd);
+			return -1;
+		}
+		
+		f->events = events;
+	}
+	
+	return 0;
+}
+
+/*
+ * Prepare one direction of a tunnel.
+ */
+
+static void
+tunnel_dir_init(struct tunnel_dir_t *d, int rfd, int wfd,
+	struct buffer_t *b, struct tunnel_opts_t *opts,
+	struct tunnel_stats_t *stats)
+{
+	int pipesize;
+	
+	d->rfd = rfd;
+	d->wfd = wfd;
+	d->b = b;
+	d->early = 0;
+	d->stats = stats;
+	d->state = 0;
+	d->piped = 0;
+	d->pipesize = TUNNEL_SPLICE_SIZE;
+	d->bufmax = opts->adaptive ? opts->bufsize : 0;
+	d->fills = 0;
+	d->smalls = 0;
+	d->relay = TUNNEL_RELAY_COPY;
+	
+#ifdef TUNNEL_USE_SPLICE
+	if (opts->relay == TUNNEL_RELAY_SPLICE) {
+		if (!tunnel_splice_capable(rfd) || !tunnel_splice_capable(wfd))
+			return;
+		if (pipe2(d->pfd, O_CLOEXEC) == -1) {
+			warn("pipe failed, not using splice");
+			return;
+		}
+		/* a large buffer size asks for a large pipe too,
+		 * the kernel may cap it (fs.pipe-max-size) */
+		if (opts->bufsize > TUNNEL_SPLICE_SIZE)
+			fcntl(d->pfd[1], F_SETPIPE_SZ, (int)opts->bufsize);
+		if ((pipesize = fcntl(d->pfd[1], F_GETPIPE_SZ)) > 0)
+			d->pipesize = pipesize;
+		d->relay = TUNNEL_RELAY_SPLICE;
+	}
+#else
+	if (opts->relay == TUNNEL_RELAY_SPLICE)
+		warnx("splice not supported, using copy relay");
+#endif /* TUNNEL_USE_SPLICE */
+}
+
+/*
+ * Add fd to the fds of a tunnel, unless it is already there.
+ */
+
+static void
+tunnel_fd_init(struct tunnel_t *t, int fd)
+{
+	struct tunnel_fd_t *f = tunnel_fd(t, fd);
+	
+	if (f != &t->fds[t->nfds])
+		return;
+	
+	f->fd = fd;
+	f->events = 0;
+	f->state = 0;
+	f->flags = fcntl(fd, F_GETFL);
+	
+	t->nfds++;
+}
+
+/*
+ * Initialize a tunnel between x and y. Data read from rfdx goes to
+ * wfdy through bx, data read from rfdy goes to wfdx through by. If by
+ * contains pending data, it will be written to wfdx first.
+ *
+ * The relay mode selects how data is moved; it is decided for each
+ * direction separately, so a splice relay will still copy data for a
+ * direction that involves a terminal. With adaptive buffers, bx and by
+ * are resized between BUFFER_T_SIZE and opts->bufsize. Transfer
+ * counters are added to stats[TUNNEL_TX] (x to y) and stats[TUNNEL_RX]
+ * (y to x).
+ *
+ * All fds are switched to non-blocking mode and watched by ev, with
+ * the tunnel as event data. Returns 0 if OK, -1 on error.
+ */
+
+int
+tunnel_init(struct tunnel_t *t, struct event_t *ev, int rfdx, int wfdx,
+	int rfdy, int wfdy, struct buffer_t *bx, struct buffer_t *by,
+	struct tunnel_opts_t *opts, struct tunnel_stats_t *stats)
+{
+	int n;
+	struct tunnel_fd_t *f;
+	
+	tunnel_dir_init(&t->dir[TUNNEL_TX], rfdx, wfdy, bx, opts,
+		&stats[TUNNEL_TX]);
+	tunnel_dir_init(&t->dir[TUNNEL_RX], rfdy, wfdx, by, opts,
+		&stats[TUNNEL_RX]);
+	t->dir[TUNNEL_RX].early = by->len;
+	
+	t->nfds = 0;
+	tunnel_fd_init(t, rfdx);
+	tunnel_fd_init(t, wfdx);
+	tunnel_fd_init(t, rfdy);
+	tunnel_fd_init(t, wfdy);
+	
+	for (n = 0; n < t->nfds; ++n)
+	{
+		f = &t->fds[n];
+		
+		if (f->flags == -1 ||
+			fcntl(f->fd, F_SETFL, f->flags | O_NONBLOCK) == -1)
+		{
+			warn("can't set fd %i non-blocking", f->fd);
+			return -1;
+		}
+		
+		if (event_add(ev, f->fd, 0, t) == -1) {
+			warn("can't watch fd %i", f->fd);
+			return -1;
+		}
+	}
 	
-	/* write data - return bytes transfered */
-	return tunnel_write(b, wfd);
+	return tunnel_update(t, ev);
+}
+
+/*
+ * Handle events on fd, which is one of the fds of the tunnel.
+ *
+ * Returns 1 once both directions hit EOF and all data was written,
+ * 0 if the tunnel is still open. Returns -1 on error.
+ */
+
+int
+tunnel_process(struct tunnel_t *t, struct event_t *ev, int fd, int events)
+{
+	int i;
+	struct tunnel_dir_t *d;
+	
+	for (i = TUNNEL_TX; i <= TUNNEL_RX; ++i)
+	{
+		d = &t->dir[i];
+		
+		if (d->rfd == fd || d->wfd == fd)
+			++d->stats->wakeups;
+		
+		/* room on the write side: write pending data */
+		if ((events & EVENT_WRITE) && d->wfd == fd)
+			if (tunnel_drain(d) == -1)
+				return -1;
+		
+		/* data on the read side: read it and try to write it */
+		if ((events & EVENT_READ) && d->rfd == fd &&
+			!(d->state & TUNNEL_EOF))
+		{
+			if (tunnel_fill(d) == -1 || tunnel_drain(d) == -1)
+				return -1;
+		}
+		
+		tunnel_shut(t, d);
+	}
+	
+	if (tunnel_update(t, ev) == -1)
+		return -1;
+	
+	return (t->dir[TUNNEL_TX].state & t->dir[TUNNEL_RX].state &
+		TUNNEL_SHUT) ? 1 : 0;
+}
+
+/*
+ * Stop watching the fds of a tunnel, restore their blocking mode and
+ * release resources of the relay. The fds are not closed.
+ */
+
+void
+tunnel_free(struct tunnel_t *t, struct event_t *ev)
+{
+	int n;
+	struct tunnel_fd_t *f;
+	
+	for (n = 0; n < t->nfds; ++n)
+	{
+		f = &t->fds[n];
+		
+		if (f->state & TUNNEL_FD_GONE)
+			continue;
+		
+		event_del(ev, f->fd);
+		fcntl(f->fd, F_SETFL, f->flags);
+	}
+	
+	for (n = TUNNEL_TX; n <= TUNNEL_RX; ++n) {
+		if (t->dir[n].relay == TUNNEL_RELAY_SPLICE) {
+			close(t->dir[n].pfd[0]);
+			close(t->dir[n].pfd[1]);
+		}
+	}
 }
 
 /* 
  * Tunnel data between two file descriptiors.
  *
+ * Both directions are handled independently: a slow reader on one side
+ * does not stall the other direction. When one side hits EOF, the EOF
+ * is passed on to the other side after all data was written, and the
+ * other direction keeps running until it hits EOF as well.
+ *
  * If the buffer contains pending data, it will be written to wfdx.
+ * See tunnel_init for the relay mode and stats. The io_uring relay is
+ * handled by uring_tunnel, with the same EOF handling. Never returns if
+ * there is an error.
  */
 
 void
-tunnel_handler(struct buffer_t *b, int rfdx, int wfdx, int rfdy, int wfdy)
+tunnel_handler(struct buffer_t *b, int rfdx, int wfdx, int rfdy, int wfdy,
+	struct tunnel_opts_t *opts, struct tunnel_stats_t *stats)
 {
-	int nfds;
-	fd_set read_fds, all_rfds;
+	int n, nready, first = 0, status = 0;
+	struct buffer_t bx;
+	struct tunnel_t tunnel;
+	struct tunnel_opts_t copy;
+	struct event_t ev;
+	struct event_item_t ready[4];
 	
-	/* init fd sets */
-	FD_ZERO(&all_rfds);
-	FD_SET(rfdx, &all_rfds);
-	FD_SET(rfdy, &all_rfds);
+	/* buffer for data from x to y */
+	if (buffer_init(&bx, tunnel_bufsize(opts)) == -1)
+		err(EX_OSERR, "buffer allocation failed");
+	
+	/* io_uring relay, or fall back to copy if the kernel can't */
+	if (opts->relay == TUNNEL_RELAY_URING) {
+		status = uring_tunnel(rfdx, wfdx, rfdy, wfdy, &bx, b, stats);
+		if (status == URING_OK) {
+			buffer_free(&bx);
+			return;
+		}
+		if (status == URING_ERROR)
+			exit(EX_IOERR);
+		warn("io_uring not available, using copy relay");
+		copy = *opts;
+		copy.relay = TUNNEL_RELAY_COPY;
+		opts = &copy;
+		status = 0;
+	}
 	
-	/* calculate nfds parameter */
-	nfds = (rfdx > rfdy) ? rfdx : rfdy;
-	if (nfds == INT_MAX)
-		errx(EX_SOFTWARE, "nfds too large for select()");
-	else
-		++nfds;
+	if (event_init(&ev) == -1)
+		err(EX_OSERR, "event init failed");
 	
-	/* flush pending data to wfdx */
-	if (b->w_len < b->s_len)
-		tunnel_flush(b, wfdx);
+	if (tunnel_init(&tunnel, &ev, rfdx, wfdx, rfdy, wfdy, &bx, b,
+		opts, stats) == -1)
+		exit(EX_SOFTWARE);
 	
-	for (;;)
+	while (status == 0)
 	{
-		/* re-init read set */
-		read_fds = all_rfds;
+		/* wait for the fds to become ready */
+		nready = event_wait(&ev, ready, 4, -1);
+		tunnel_json_check();
 		
-		/* wait for input on read set */
-		if (select(nfds, &read_fds, NULL, NULL, NULL) == -1)
-			err(EX_SOFTWARE, "select failed");
+		if (nready == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EX_SOFTWARE, "event wait failed");
+		}
 		
-		/* input on rfdx: transmit data to wfdy */
-		if (FD_ISSET(rfdx, &read_fds))
-			if (tunnel_tx(b, rfdx, wfdy) == 0)
-				break;
+		for (n = 0; n < nready && status == 0; ++n)
+			status = tunnel_process(&tunnel, &ev, ready[n].fd,
+				ready[n].events);
 		
-		/* input on rfdy: transmit data to wfdx */
-		if (FD_ISSET(rfdy, &read_fds))
-			if (tunnel_tx(b, rfdy, wfdx) == 0)
-				break;
+		/* time to first byte from the far end */
+		if (!first && stats[TUNNEL_RX].bytes) {
+			trace_mark("first-byte");
+			first = 1;
+		}
 	}
 	
+	if (status == -1)
+		exit(EX_IOERR);
+	
+	/* cleanup */
+	tunnel_free(&tunnel, &ev);
+	event_free(&ev);
+	buffer_free(&bx);
+	
 	return;
 }
 
+/*
+ * Returns the size to allocate tunnel buffers with. Adaptive buffers
+ * start small and grow up to opts->bufsize, except for the io_uring
+ * relay which can't resize them.
+ */
+
+size_t
+tunnel_bufsize(struct tunnel_opts_t *opts)
+{
+	if (opts->adaptive && opts->relay != TUNNEL_RELAY_URING &&
+		opts->bufsize > BUFFER_T_SIZE)
+		return BUFFER_T_SIZE;
+	
+	return opts->bufsize;
+}
+
+/*
+ * Print transfer counters of both directions of a tunnel. For the
+ * io_uring relay, submissions and completions per MB are shown. In
+ * peer mode, the compressed size is shown as well.
+ */
+
+void
+tunnel_report(struct tunnel_stats_t *stats)
+{
+	int i;
+	double mb;
+	unsigned long calls;
+	static const char *dir[] = { "sent", "received" };
+	
+	for (i = TUNNEL_TX; i <= TUNNEL_RX; ++i)
+	{
+		if (stats[i].sqes) {
+			mb = stats[i].bytes / 1048576.0;
+			warnx("%s %llu bytes in %lu submissions, "
+				"%lu completions (%.1f/%.1f per MB)",
+				dir[i], stats[i].bytes, stats[i].sqes,
+				stats[i].cqes, mb ? stats[i].sqes / mb : 0.0,
+				mb ? stats[i].cqes / mb : 0.0);
+			continue;
+		}
+		
+		calls = stats[i].reads + stats[i].writes;
+		warnx("%s %llu bytes in %lu calls (%.1f bytes/call)",
+			dir[i], stats[i].bytes, calls,
+			calls ? (double)stats[i].bytes / calls : 0.0);
+		
+		if (stats[i].wire)
+			warnx("%s %llu bytes over the peer link (%.1f%%)",
+				dir[i], stats[i].wire, stats[i].bytes ?
+				100.0 * stats[i].wire / stats[i].bytes : 0.0);
+	}
+}
+
+/*
+ * Signal handler for SIGUSR1: have the counters written, see
+ * tunnel_json_check.
+ */
+
+static void
+tunnel_json_usr1(int sig)
+{
+	tunnel_json_signal = 1;
+}
+
+/*
+ * Write the final counters when the process exits.
+ */
+
+static void
+tunnel_json_exit(void)
+{
+	tunnel_json(1);
+}
+
+/*
+ * Format the counters of one direction as a JSON object into line.
+ * Returns the length of the line.
+ */
+
+static int
+tunnel_json_dir(char *line, size_t size, struct tunnel_stats_t *stats)
+{
+	return snprintf(line, size, "{\"bytes\":%llu,\"wire\":%llu,"
+		"\"reads\":%lu,\"writes\":%lu,\"wakeups\":%lu,"
+		"\"leftover\":%llu,\"sqes\":%lu,\"cqes\":%lu}",
+		stats->bytes, stats->wire, stats->reads, stats->writes,
+		stats->wakeups, stats->leftover, stats->sqes, stats->cqes);
+}
+
+/*
+ * Write the counters in stats[TUNNEL_TX] and stats[TUNNEL_RX] as one
+ * JSON line to file, or to stderr if file is "-": at exit, and when
+ * SIGUSR1 arrives. The file is appended to, so processes can share it.
+ * Host and port name the tunnel in the line. Returns 0 if OK, -1 if
+ * the file can't be opened.
+ */
+
+int
+tunnel_json_open(char *file, char *host, int port,
+	struct tunnel_stats_t *stats)
+{
+	int n = 0;
+	struct sigaction sa;
+	
+	if (strcmp(file, "-") == 0) {
+		tunnel_json_fd = STDERR_FILENO;
+	} else if ((tunnel_json_fd = open(file, O_WRONLY | O_CREAT |
+		O_APPEND | O_CLOEXEC, 0644)) == -1)
+	{
+		warn("can't open %s", file);
+		return -1;
+	}
+	
+	/* as a JSON string: hostnames don't need more than this */
+	for (; *host && n < sizeof(tunnel_json_target) - 8; ++host)
+		if (*host != '"' && *host != '\\' &&
+			(unsigned char)*host >= ' ')
+			tunnel_json_target[n++] = *host;
+	snprintf(tunnel_json_target + n, sizeof(tunnel_json_target) - n,
+		":%i", port);
+	
+	tunnel_json_stats = stats;
+	clock_gettime(CLOCK_MONOTONIC, &tunnel_json_start);
+	
+	/* SA_RESTART, so the proxy handshake (here, or when a stripe is
+	 * opened again) does not fail on it; the waits of the relays
+	 * return EINTR all the same, and write them */
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = tunnel_json_usr1;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+	
+	/* a closed output ends the relay with an error, not the process,
+	 * so the final line is still written */
+	signal(SIGPIPE, SIG_IGN);
+	
+	atexit(tunnel_json_exit);
+	
+	return 0;
+}
+
+/*
+ * Write a JSON line with the counters and the time since
+ * tunnel_json_open, if it was called. Final is set for the line
+ * written at exit.
+ */
+
+void
+tunnel_json(int final)
+{
+	int len;
+	double duration;
+	struct timespec now;
+	char line[TUNNEL_JSON_LINE];
+	
+	if (tunnel_json_fd == -1)
+		return;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	duration = (now.tv_sec - tunnel_json_start.tv_sec) +
+		(now.tv_nsec - tunnel_json_start.tv_nsec) / 1e9;
+	
+	len = snprintf(line, sizeof(line), "{\"pid\":%li,\"target\":\"%s\","
+		"\"final\":%s,\"duration\":%.6f,\"tx\":", (long)getpid(),
+		tunnel_json_target, final ? "true" : "false", duration);
+	len += tunnel_json_dir(line + len, sizeof(line) - len,
+		&tunnel_json_stats[TUNNEL_TX]);
+	len += snprintf(line + len, sizeof(line) - len, ",\"rx\":");
+	len += tunnel_json_dir(line + len, sizeof(line) - len,
+		&tunnel_json_stats[TUNNEL_RX]);
+	len += snprintf(line + len, sizeof(line) - len, "}\n");
+	
+	/* one write, so lines of processes sharing the file don't mix */
+	if (write(tunnel_json_fd, line, len) != len)
+		warn("can't write counters");
+}
+
+/*
+ * Write the counters if SIGUSR1 arrived since the last check. Called
+ * by the relays after every wait, which SIGUSR1 interrupts.
+ */
+
+void
+tunnel_json_check(void)
+{
+	int error = errno;
+	
+	if (!tunnel_json_signal)
+		return;
+	
+	tunnel_json_signal = 0;
+	tunnel_json(0);
+	
+	/* the caller may look at errno of its wait */
+	errno = error;
+}
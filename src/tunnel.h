@@ -31,9 +31,86 @@
 #ifndef _TUNNEL_H_
 #define _TUNNEL_H_
 
+#include <sys/types.h>
+
 #include "buffer.h"
+#include "event.h"
+
+/* relay modes */
+#define TUNNEL_RELAY_COPY	0	/* read(2) and write(2) */
+#define TUNNEL_RELAY_SPLICE	1	/* splice(2) through a pipe */
+#define TUNNEL_RELAY_URING	2	/* io_uring with fixed buffers */
+
+/* index of tunnel_stats_t per direction */
+#define TUNNEL_TX	0	/* x to y */
+#define TUNNEL_RX	1	/* y to x */
+
+/* tunnel settings */
+typedef struct tunnel_opts_t {
+	int relay;		/* relay mode */
+	size_t bufsize;		/* buffer size, or max size if adaptive */
+	int adaptive;		/* grow/shrink buffers with the traffic */
+} tunnel_opts_t;
+
+/* transfer counters of one direction */
+typedef struct tunnel_stats_t {
+	unsigned long long bytes;	/* bytes transmitted */
+	unsigned long long wire;	/* peer mode: compressed bytes */
+	unsigned long reads;		/* reads (or receives) of data */
+	unsigned long writes;		/* writes (or sends) of data */
+	unsigned long wakeups;		/* waits that woke up for it */
+	unsigned long long leftover;	/* from the CONNECT, written */
+	unsigned long sqes;		/* io_uring submissions */
+	unsigned long cqes;		/* io_uring completions */
+} tunnel_stats_t;
+
+/* one direction of a tunnel */
+typedef struct tunnel_dir_t {
+	int rfd;			/* read data from this fd */
+	int wfd;			/* write data to this fd */
+	int relay;			/* relay mode in use */
+	int state;			/* EOF/shutdown flags */
+	int pfd[2];			/* splice pipe */
+	size_t piped;			/* bytes in the splice pipe */
+	size_t pipesize;		/* capacity of the splice pipe */
+	size_t bufmax;			/* adaptive: max buffer size */
+	int fills;			/* adaptive: reads filling the room */
+	int smalls;			/* adaptive: small reads */
+	struct buffer_t *b;		/* data read, not written yet */
+	size_t early;			/* bytes of b from the CONNECT */
+	struct tunnel_stats_t *stats;	/* transfer counters */
+} tunnel_dir_t;
+
+/* an fd used by a tunnel */
+typedef struct tunnel_fd_t {
+	int fd;
+	int events;	/* events being watched */
+	int state;	/* close flags */
+	int flags;	/* original file status flags */
+} tunnel_fd_t;
+
+/* two directions between x and y */
+typedef struct tunnel_t {
+	struct tunnel_dir_t dir[2];	/* TUNNEL_TX, TUNNEL_RX */
+	int nfds;			/* amount of distinct fds */
+	struct tunnel_fd_t fds[4];	/* distinct fds */
+} tunnel_t;
+
+int tunnel_init(struct tunnel_t *t, struct event_t *ev, int rfdx, int wfdx,
+	int rfdy, int wfdy, struct buffer_t *bx, struct buffer_t *by,
+	struct tunnel_opts_t *opts, struct tunnel_stats_t *stats);
+int tunnel_process(struct tunnel_t *t, struct event_t *ev, int fd,
+	int events);
+void tunnel_free(struct tunnel_t *t, struct event_t *ev);
 
+size_t tunnel_bufsize(struct tunnel_opts_t *opts);
 void tunnel_handler(struct buffer_t *buffer, int rfdx, int wfdx,
-	int rfdy, int wfdy);
+	int rfdy, int wfdy, struct tunnel_opts_t *opts,
+	struct tunnel_stats_t *stats);
+void tunnel_report(struct tunnel_stats_t *stats);
+int tunnel_json_open(char *file, char *host, int port,
+	struct tunnel_stats_t *stats);
+void tunnel_json(int final);
+void tunnel_json_check(void);
 
 #endif /* _TUNNEL_H_ */
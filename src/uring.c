@@ -0,0 +1,411 @@
+/*
+ * Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ *  3. The names of the authors may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+
+#include "buffer.h"
+#include "tunnel.h"
+#include "uring.h"
+
+#if defined(__linux__) && !defined(URING_DISABLE)
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <linux/io_uring.h>
+
+#include <err.h>
+#include <string.h>
+#include <unistd.h>
+
+/* submission queue entries, each direction needs a read and a write */
+#define URING_ENTRIES 4
+
+/* user_data of a request: direction and operation */
+#define URING_OP_READ	0
+#define URING_OP_WRITE	1
+#define URING_DATA(dir, op)	(((__u64)(dir) << 1) | (op))
+#define URING_DATA_DIR(data)	((int)((data) >> 1))
+#define URING_DATA_OP(data)	((int)((data) & 1))
+
+/* direction state flags */
+#define URING_READING	0x01	/* read submitted */
+#define URING_WRITING	0x02	/* write submitted */
+#define URING_EOF	0x04	/* read side hit EOF */
+#define URING_SHUT	0x08	/* write side was shut down */
+
+/* one direction of the tunnel */
+typedef struct uring_dir_t {
+	int rfd;
+	int wfd;
+	int state;
+	struct buffer_t *b;
+	size_t early;		/* bytes of b from the CONNECT */
+	struct tunnel_stats_t *stats;
+} uring_dir_t;
+
+/* mapped submission and completion queues */
+typedef struct uring_t {
+	int fd;
+	unsigned queued;		/* sqes not submitted yet */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+} uring_t;
+
+/*
+ * Set up an io_uring instance and map its queues.
+ * Returns 0 if OK, -1 on error.
+ */
+
+static int
+uring_init(struct uring_t *u, unsigned entries)
+{
+	struct io_uring_params p;
+	
+	memset(&p, 0, sizeof(p));
+	
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd == -1)
+		return -1;
+	
+	/* reads at the current position of pipes, sockets and files */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		close(u->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+	
+	u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_len = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	
+	u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	
+	if (u->sq_ptr == MAP_FAILED || u->cq_ptr == MAP_FAILED ||
+		u->sqes == MAP_FAILED)
+	{
+		if (u->sq_ptr != MAP_FAILED)
+			munmap(u->sq_ptr, u->sq_len);
+		if (u->cq_ptr != MAP_FAILED)
+			munmap(u->cq_ptr, u->cq_len);
+		if (u->sqes != MAP_FAILED)
+			munmap(u->sqes, u->sqes_len);
+		close(u->fd);
+		return -1;
+	}
+	
+	u->sq_head = (unsigned *)((char *)u->sq_ptr + p.sq_off.head);
+	u->sq_tail = (unsigned *)((char *)u->sq_ptr + p.sq_off.tail);
+	u->sq_mask = (unsigned *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)((char *)u->sq_ptr + p.sq_off.array);
+	u->cq_head = (unsigned *)((char *)u->cq_ptr + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)u->cq_ptr + p.cq_off.tail);
+	u->cq_mask = (unsigned *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ptr + p.cq_off.cqes);
+	u->queued = 0;
+	
+	return 0;
+}
+
+/*
+ * Unmap the queues and close the io_uring instance.
+ */
+
+static void
+uring_free(struct uring_t *u)
+{
+	munmap(u->sqes, u->sqes_len);
+	munmap(u->cq_ptr, u->cq_len);
+	munmap(u->sq_ptr, u->sq_len);
+	close(u->fd);
+}
+
+/*
+ * Queue a fixed buffer read or write. There are never more requests
+ * outstanding than URING_ENTRIES, so the queue can't be full.
+ */
+
+static void
+uring_queue(struct uring_t *u, int op, int fd, struct iovec *iov,
+	int index, __u64 data)
+{
+	unsigned tail, slot;
+	struct io_uring_sqe *sqe;
+	
+	tail = *u->sq_tail;
+	slot = tail & *u->sq_mask;
+	sqe = &u->sqes[slot];
+	
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = (op == URING_OP_READ) ?
+		IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+	sqe->fd = fd;
+	sqe->off = (__u64)-1;	/* current position */
+	sqe->addr = (unsigned long)iov->iov_base;
+	sqe->len = iov->iov_len;
+	sqe->buf_index = index;
+	sqe->user_data = data;
+	
+	u->sq_array[slot] = slot;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	
+	u->queued++;
+}
+
+/*
+ * Shut down the write side of a direction, see tunnel_shut.
+ */
+
+static void
+uring_shut(struct uring_dir_t *d, struct uring_dir_t *other)
+{
+	d->state |= URING_SHUT;
+	
+	if (shutdown(d->wfd, SHUT_WR) == 0 || errno != ENOTSOCK)
+		return;
+	
+	if (d->wfd != other->rfd)
+		close(d->wfd);
+}
+
+/*
+ * Queue the requests a direction needs: a read into the free space of
+ * its buffer, and a write of the data in its buffer. Both can be in
+ * flight at the same time, as they use different parts of the buffer.
+ */
+
+static void
+uring_dir_queue(struct uring_t *u, struct uring_dir_t *d,
+	struct uring_dir_t *other, int dir)
+{
+	struct iovec iov[2];
+	
+	if (!(d->state & (URING_READING | URING_EOF)) &&
+		buffer_room_iov(d->b, iov))
+	{
+		uring_queue(u, URING_OP_READ, d->rfd, &iov[0], dir,
+			URING_DATA(dir, URING_OP_READ));
+		d->state |= URING_READING;
+		d->stats->sqes++;
+	}
+	
+	if (!(d->state & URING_WRITING) && buffer_data_iov(d->b, iov)) {
+		uring_queue(u, URING_OP_WRITE, d->wfd, &iov[0], dir,
+			URING_DATA(dir, URING_OP_WRITE));
+		d->state |= URING_WRITING;
+		d->stats->sqes++;
+	}
+	
+	if ((d->state & (URING_EOF | URING_WRITING | URING_SHUT)) ==
+		URING_EOF && d->b->len == 0)
+		uring_shut(d, other);
+}
+
+/*
+ * Handle a completion. Returns 0 if OK, -1 on error.
+ */
+
+static int
+uring_complete(struct uring_dir_t *d, int op, int res)
+{
+	size_t n;
+	
+	d->stats->cqes++;
+	
+	if (res < 0) {
+		errno = -res;
+		warn("%s error", (op == URING_OP_READ) ? "read" : "write");
+		return -1;
+	}
+	
+	if (op == URING_OP_READ) {
+		d->stats->reads++;
+		d->state &= ~URING_READING;
+		if (res == 0)
+			d->state |= URING_EOF;
+		else
+			buffer_commit(d->b, res);
+	} else {
+		d->stats->writes++;
+		d->state &= ~URING_WRITING;
+		buffer_consume(d->b, res);
+		d->stats->bytes += res;
+		n = (size_t)res < d->early ? (size_t)res : d->early;
+		d->stats->leftover += n;
+		d->early -= n;
+	}
+	
+	return 0;
+}
+
+/*
+ * Tunnel data between x and y with io_uring.
+ *
+ * The buffers are registered with the kernel, so reads and writes use
+ * them without mapping them for each request. A read is kept in flight
+ * on both rfdx and rfdy. Each completed read queues a write of its data
+ * to the opposite fd, while the next read goes into the free space that
+ * is left. If by contains pending data, it will be written to wfdx.
+ *
+ * The file descriptors must be blocking. EOF is handled the same way
+ * as by tunnel_handler. Buffers are never resized, as the kernel holds
+ * on to them. Submissions and completions are counted in
+ * stats[TUNNEL_TX] (x to y) and stats[TUNNEL_RX] (y to x).
+ *
+ * Returns URING_OK when both directions are closed. Returns
+ * URING_UNSUPPORTED if io_uring can't be used, before any data was
+ * moved. Returns URING_ERROR on error.
+ */
+
+int
+uring_tunnel(int rfdx, int wfdx, int rfdy, int wfdy,
+	struct buffer_t *bx, struct buffer_t *by,
+	struct tunnel_stats_t *stats)
+{
+	int i, woke, entered, status = URING_OK;
+	unsigned head, tail;
+	struct uring_t u;
+	struct uring_dir_t dir[2];
+	struct io_uring_cqe *cqe;
+	struct iovec bufs[2];
+	
+	if (uring_init(&u, URING_ENTRIES) == -1)
+		return URING_UNSUPPORTED;
+	
+	/* register the buffers: index TUNNEL_TX and TUNNEL_RX */
+	bufs[TUNNEL_TX].iov_base = bx->data;
+	bufs[TUNNEL_TX].iov_len = bx->size;
+	bufs[TUNNEL_RX].iov_base = by->data;
+	bufs[TUNNEL_RX].iov_len = by->size;
+	
+	if (syscall(__NR_io_uring_register, u.fd, IORING_REGISTER_BUFFERS,
+		bufs, 2) == -1)
+	{
+		uring_free(&u);
+		return URING_UNSUPPORTED;
+	}
+	
+	dir[TUNNEL_TX].rfd = rfdx;
+	dir[TUNNEL_TX].wfd = wfdy;
+	dir[TUNNEL_TX].b = bx;
+	dir[TUNNEL_RX].rfd = rfdy;
+	dir[TUNNEL_RX].wfd = wfdx;
+	dir[TUNNEL_RX].b = by;
+	
+	for (i = TUNNEL_TX; i <= TUNNEL_RX; ++i) {
+		dir[i].state = 0;
+		dir[i].early = 0;
+		dir[i].stats = &stats[i];
+	}
+	dir[TUNNEL_RX].early = by->len;
+	
+	for (;;)
+	{
+		uring_dir_queue(&u, &dir[TUNNEL_TX], &dir[TUNNEL_RX],
+			TUNNEL_TX);
+		uring_dir_queue(&u, &dir[TUNNEL_RX], &dir[TUNNEL_TX],
+			TUNNEL_RX);
+		
+		if (dir[TUNNEL_TX].state & dir[TUNNEL_RX].state & URING_SHUT)
+			break;
+		
+		/* submit and wait for at least one completion */
+		entered = syscall(__NR_io_uring_enter, u.fd, u.queued, 1,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+		tunnel_json_check();
+		
+		if (entered == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			warn("io_uring_enter failed");
+			status = URING_ERROR;
+			break;
+		}
+		
+		u.queued = 0;
+		
+		/* reap completions */
+		head = *u.cq_head;
+		tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+		
+		for (woke = 0; head != tail; ++head) {
+			cqe = &u.cqes[head & *u.cq_mask];
+			i = URING_DATA_DIR(cqe->user_data);
+			woke |= 1 << i;
+			if (uring_complete(&dir[i],
+				URING_DATA_OP(cqe->user_data), cqe->res) == -1)
+				status = URING_ERROR;
+		}
+		
+		for (i = TUNNEL_TX; i <= TUNNEL_RX; ++i)
+			if (woke & (1 << i))
+				stats[i].wakeups++;
+		
+		__atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+		
+		if (status != URING_OK)
+			break;
+	}
+	
+	uring_free(&u);
+	
+	return status;
+}
+
+#else /* __linux__ && !URING_DISABLE */
+
+/*
+ * No io_uring on this platform.
+ */
+
+int
+uring_tunnel(int rfdx, int wfdx, int rfdy, int wfdy,
+	struct buffer_t *bx, struct buffer_t *by,
+	struct tunnel_stats_t *stats)
+{
+	errno = ENOSYS;
+	return URING_UNSUPPORTED;
+}
+
+#endif /* __linux__ && !URING_DISABLE */
@@ -0,0 +1,4 @@
+#ifndef _VERSION_H_
+#define _VERSION_H_
+#define BUILD_VERSION "cb5eba71-unstable"
+#endif /* _VERSION_H_ */
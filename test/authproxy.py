@@ -0,0 +1,342 @@
+#!/usr/bin/env python3
+
+######
+# authproxy: stand-in proxy that asks for Digest or NTLMv2 authentication
+###
+#
+# Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#  1. Redistributions of source code must retain the above copyright notice,
+#     this list of conditions and the following disclaimer.
+#
+#  2. Redistributions in binary form must reproduce the above copyright
+#     notice, this list of conditions and the following disclaimer in the
+#     documentation and/or other materials provided with the distribution.
+#
+#  3. The names of the authors may not be used to endorse or promote products
+#     derived from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+# EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+# PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+# THE POSSIBILITY OF SUCH DAMAGE.
+#
+######
+
+#
+# Usage: authproxy.py [-s digest|ntlm|none] [-u user] [-p password] [-c]
+#                     [-n uses] [-k] [-x bytes] [-r bytes] port
+#
+# Listens on 127.0.0.1:port, and answers CONNECT requests with a 407
+# challenge until they carry the right credentials (default user
+# "DOMAIN\user", password "secret"). Then it opens the tunnel, and
+# relays the data. With -c, it closes the connection after each 407.
+# With -n, a Digest nonce is valid for that many requests, after which
+# it is stale. With -k, the body of a 407 is sent chunked. With -x,
+# every response carries that many bytes of extra headers. Every
+# response is logged on stderr, so a test can count the 407 round
+# trips. With -s none, every CONNECT is answered right away. With -r,
+# the first tunnel is reset after that many bytes came from the far
+# end, e.g.:
+#
+#   $ ./authproxy.py -s digest 3128 &
+#   $ prcat -H 127.0.0.1 -P 3128 -m digest -u 'DOMAIN\user' -p secret \
+#         example.com 22
+#
+
+import argparse, base64, hashlib, hmac, os, socket, struct, sys, threading
+import time
+
+def md4(data):
+	# MD4 (RFC 1320); hashlib may not have it
+	def f(x, y, z): return (x & y) | (~x & z)
+	def g(x, y, z): return (x & y) | (x & z) | (y & z)
+	def h(x, y, z): return x ^ y ^ z
+	def rotl(x, n): return ((x << n) | (x >> (32 - n))) & 0xffffffff
+	
+	msg = data + b"\x80" + b"\0" * ((55 - len(data)) % 64) + \
+		struct.pack("<Q", len(data) * 8)
+	state = [0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476]
+	rounds = [
+		(f, 0, range(16), (3, 7, 11, 19)),
+		(g, 0x5a827999, (0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14,
+			3, 7, 11, 15), (3, 5, 9, 13)),
+		(h, 0x6ed9eba1, (0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13,
+			3, 11, 7, 15), (3, 9, 11, 15))]
+	
+	for off in range(0, len(msg), 64):
+		x = struct.unpack("<16I", msg[off:off + 64])
+		a, b, c, d = state
+		for fn, k, order, shifts in rounds:
+			for i, w in enumerate(order):
+				t = (a + fn(b, c, d) + x[w] + k) & 0xffffffff
+				a, b, c, d = d, rotl(t, shifts[i % 4]), b, c
+		state = [(s + v) & 0xffffffff for s, v in
+			zip(state, (a, b, c, d))]
+	
+	return struct.pack("<4I", *state)
+
+def md5hex(*parts):
+	return hashlib.md5(":".join(parts).encode()).hexdigest()
+
+class Digest:
+	def __init__(self, uses):
+		self.uses = uses
+		self.lock = threading.Lock()
+		self.new_nonce()
+	
+	def new_nonce(self):
+		self.nonce = os.urandom(12).hex()
+		self.seen = set()
+	
+	def challenge(self, stale=False):
+		return 'Digest realm="prcat test", qop="auth", ' \
+			'algorithm=MD5, nonce="%s", opaque="0pa9ue"%s' % \
+			(self.nonce, ", stale=true" if stale else "")
+	
+	def check(self, args, value):
+		# returns None if OK, or the challenge to send
+		if not value or not value.startswith("Digest "):
+			return self.challenge()
+		
+		p = {}
+		for k, v in parse_params(value[7:]):
+			p[k] = v
+		
+		with self.lock:
+			if p.get("nonce") != self.nonce:
+				return self.challenge(stale=True)
+			if p.get("nc") in self.seen:
+				log("nonce count %s used twice" % p.get("nc"))
+				return self.challenge()
+			if self.uses and len(self.seen) >= self.uses:
+				self.new_nonce()
+				return self.challenge(stale=True)
+			self.seen.add(p.get("nc"))
+		
+		ha1 = md5hex(args.user, p["realm"], args.password)
+		ha2 = md5hex("CONNECT", p["uri"])
+		want = md5hex(ha1, p["nonce"], p["nc"], p["cnonce"],
+			p["qop"], ha2)
+		
+		if p.get("response") != want or p.get("username") != args.user:
+			return self.challenge()
+		
+		return None
+
+def parse_params(s):
+	# name=value or name="quoted value" parameters
+	i = 0
+	while i < len(s):
+		while i < len(s) and s[i] in " ,":
+			i += 1
+		j = s.find("=", i)
+		if j == -1:
+			return
+		name = s[i:j]
+		i = j + 1
+		if i < len(s) and s[i] == '"':
+			j = s.find('"', i + 1)
+			yield name, s[i + 1:j]
+			i = j + 1
+		else:
+			j = s.find(",", i)
+			j = len(s) if j == -1 else j
+			yield name, s[i:j]
+			i = j
+
+class Ntlm:
+	def __init__(self):
+		self.challenge = None
+	
+	def check(self, args, value):
+		if not value or not value.startswith("NTLM "):
+			return "NTLM"
+		
+		msg = base64.b64decode(value[5:])
+		kind = struct.unpack("<I", msg[8:12])[0]
+		
+		if kind == 1:
+			# challenge, with target info holding a timestamp
+			self.challenge = os.urandom(8)
+			info = struct.pack("<HH", 2, 12) + \
+				"DOMAIN".encode("utf-16-le") + \
+				struct.pack("<HHQ", 7, 8, int((time.time() +
+				11644473600) * 10000000)) + \
+				struct.pack("<HH", 0, 0)
+			name = "DOMAIN".encode("utf-16-le")
+			head = b"NTLMSSP\0" + struct.pack("<I", 2) + \
+				struct.pack("<HHI", len(name), len(name), 48) + \
+				struct.pack("<I", 0xa2890205) + self.challenge + \
+				b"\0" * 8 + struct.pack("<HHI", len(info),
+				len(info), 48 + len(name))
+			return "NTLM " + base64.b64encode(head + name +
+				info).decode()
+		
+		if kind != 3 or not self.challenge:
+			return "NTLM"
+		
+		def field(off):
+			n, _, pos = struct.unpack("<HHI", msg[off:off + 8])
+			return msg[pos:pos + n]
+		
+		nt = field(20)
+		domain = field(28).decode("utf-16-le")
+		user = field(36).decode("utf-16-le")
+		
+		want_domain, _, want_user = args.user.rpartition("\\")
+		nthash = md4(args.password.encode("utf-16-le"))
+		v2hash = hmac.new(nthash, (want_user.upper() +
+			want_domain).encode("utf-16-le"), "md5").digest()
+		proof = hmac.new(v2hash, self.challenge + nt[16:],
+			"md5").digest()
+		
+		if proof != nt[:16] or user != want_user or \
+			domain != want_domain:
+			log("NTLM response for %s\\%s is wrong" % (domain, user))
+			self.challenge = None
+			return "NTLM"
+		
+		return None
+
+def log(s):
+	sys.stderr.write("authproxy: %s\n" % s)
+	sys.stderr.flush()
+
+def pump(a, b, limit=0):
+	n = 0
+	try:
+		while True:
+			d = a.recv(65536)
+			if not d:
+				break
+			b.sendall(d)
+			n += len(d)
+			if limit and n >= limit:
+				log("reset after %i bytes" % n)
+				linger = struct.pack("ii", 1, 0)
+				b.setsockopt(socket.SOL_SOCKET,
+					socket.SO_LINGER, linger)
+				b.close()
+				a.close()
+				return
+	except OSError:
+		pass
+	try:
+		b.shutdown(socket.SHUT_WR)
+	except OSError:
+		pass
+
+def padding(args):
+	lines = ["X-Padding-%i: %s\r\n" % (i, "x" * 64)
+		for i in range(args.extra // 80 + (args.extra > 0))]
+	return "".join(lines)
+
+def handle(c, args, digest):
+	ntlm = Ntlm()
+	data = b""
+	
+	while True:
+		while b"\r\n\r\n" not in data:
+			d = c.recv(4096)
+			if not d:
+				c.close()
+				return
+			data += d
+		
+		head, data = data.split(b"\r\n\r\n", 1)
+		lines = head.decode().split("\r\n")
+		target = lines[0].split()[1]
+		auth = None
+		for line in lines[1:]:
+			name, _, value = line.partition(":")
+			if name.lower() == "proxy-authorization":
+				auth = value.strip()
+		
+		if args.scheme == "none":
+			challenge = None
+		elif args.scheme == "digest":
+			challenge = digest.check(args, auth)
+		else:
+			challenge = ntlm.check(args, auth)
+		
+		if challenge is None:
+			break
+		
+		body = b"authentication required\n"
+		if args.chunked:
+			length = "Transfer-Encoding: chunked\r\n"
+			body = b"%x\r\n%s\r\n0\r\n\r\n" % (len(body), body)
+		else:
+			length = "Content-Length: %i\r\n" % len(body)
+		log("407 %s" % target)
+		c.sendall(("HTTP/1.1 407 Proxy Authentication Required\r\n"
+			"Proxy-Authenticate: %s\r\n"
+			"%s%s%s\r\n" % (challenge, length, padding(args),
+			"Connection: close\r\n" if args.close else "")).encode()
+			+ body)
+		
+		if args.close:
+			c.close()
+			return
+	
+	host, port = target.rsplit(":", 1)
+	try:
+		u = socket.create_connection((host, int(port)))
+	except OSError:
+		log("502 %s" % target)
+		c.sendall(b"HTTP/1.1 502 Bad Gateway\r\n\r\n")
+		c.close()
+		return
+	
+	log("200 %s" % target)
+	c.sendall(("HTTP/1.1 200 Connection established\r\n%s\r\n" %
+		padding(args)).encode())
+	if data:
+		u.sendall(data)
+	limit, args.reset = args.reset, 0
+	t = threading.Thread(target=pump, args=(u, c, limit))
+	t.start()
+	pump(c, u)
+	t.join()
+	c.close()
+	u.close()
+
+def main():
+	p = argparse.ArgumentParser()
+	p.add_argument("-s", dest="scheme",
+		choices=("digest", "ntlm", "none"), default="digest")
+	p.add_argument("-u", dest="user", default="DOMAIN\\user")
+	p.add_argument("-p", dest="password", default="secret")
+	p.add_argument("-c", dest="close", action="store_true")
+	p.add_argument("-n", dest="uses", type=int, default=0)
+	p.add_argument("-k", dest="chunked", action="store_true")
+	p.add_argument("-x", dest="extra", type=int, default=0)
+	p.add_argument("-r", dest="reset", type=int, default=0)
+	p.add_argument("port", type=int)
+	args = p.parse_args()
+	
+	digest = Digest(args.uses)
+	
+	s = socket.socket()
+	s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+	s.bind(("127.0.0.1", args.port))
+	s.listen(16)
+	
+	while True:
+		c, _ = s.accept()
+		threading.Thread(target=handle, args=(c, args, digest),
+			daemon=True).start()
+
+main()
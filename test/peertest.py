@@ -0,0 +1,242 @@
+#!/usr/bin/env python3
+
+######
+# peertest: check peer mode transfers through authproxy
+###
+#
+# Copyright (C) 2012 Jimmy Scott #jimmy#inet-solutions#be#. Belgium.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#  1. Redistributions of source code must retain the above copyright notice,
+#     this list of conditions and the following disclaimer.
+#
+#  2. Redistributions in binary form must reproduce the above copyright
+#     notice, this list of conditions and the following disclaimer in the
+#     documentation and/or other materials provided with the distribution.
+#
+#  3. The names of the authors may not be used to endorse or promote products
+#     derived from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY
+# EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+# PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+# THE POSSIBILITY OF SUCH DAMAGE.
+#
+
+#
+# Usage: peertest.py [prcat]
+#
+# Runs prcat -Z behind authproxy.py, with an echo server as its
+# destination, and checks that prcat -z gets every byte back as it was
+# sent: over several streams in one tunnel (-z -l), over a number of
+# stripes (-J), and over stripes of which one is reset halfway (-J -R).
+# It also checks that prcat gives up on a peer that sends a malformed
+# frame, in each of these modes. Prints a line for each case, and exits
+# non-zero if one failed, e.g.:
+#
+#   $ cd src && make && ../test/peertest.py ./prcat
+#
+
+import os, shutil, socket, struct, subprocess, sys, tempfile, threading
+import time
+
+AUTH = ["-m", "digest", "-u", "DOMAIN\\user", "-p", "secret"]
+
+# a bad frame for each peer protocol, after its greeting
+BAD = {
+	b"PRZ1": struct.pack(">I", 0x7fffffff),
+	b"PRM1": struct.pack(">BBHI", 2, 0, 60000, 1),
+	b"PRS1": struct.pack(">II", 0, 0x20000000 | 5) + b"xxxxx",
+}
+
+failed = 0
+
+def report(name, ok, why=""):
+	global failed
+	if not ok:
+		failed += 1
+	print("%s %s%s" % ("ok  " if ok else "FAIL", name,
+		": " + why if why and not ok else ""))
+	sys.stdout.flush()
+
+def free_port():
+	s = socket.socket()
+	s.bind(("127.0.0.1", 0))
+	port = s.getsockname()[1]
+	s.close()
+	return port
+
+def wait_port(port):
+	for i in range(100):
+		try:
+			socket.create_connection(("127.0.0.1", port)).close()
+			return
+		except OSError:
+			time.sleep(0.05)
+	raise RuntimeError("nothing listens on port %i" % port)
+
+def serve(handler):
+	s = socket.socket()
+	s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+	s.bind(("127.0.0.1", 0))
+	s.listen(64)
+	
+	def loop():
+		while True:
+			c, _ = s.accept()
+			threading.Thread(target=handler, args=(c,),
+				daemon=True).start()
+	
+	threading.Thread(target=loop, daemon=True).start()
+	return s.getsockname()[1]
+
+def echo(c):
+	while True:
+		d = c.recv(65536)
+		if not d:
+			break
+		c.sendall(d)
+	c.shutdown(socket.SHUT_WR)
+	c.close()
+
+def bad_peer(c):
+	# answer the greeting of the client with a malformed frame
+	hello = c.recv(4096)
+	c.sendall(hello[:4] + BAD.get(hello[:4], b""))
+	time.sleep(2)
+	c.close()
+
+def run(prcat, args, data, timeout=60):
+	p = subprocess.run([prcat] + args, input=data, timeout=timeout,
+		stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+	return p.returncode, p.stdout, p.stderr.decode(errors="replace")
+
+def check_copy(name, prcat, args, data):
+	try:
+		status, out, err = run(prcat, args, data)
+	except subprocess.TimeoutExpired:
+		report(name, False, "timeout")
+		return
+	if status != 0:
+		report(name, False, "exit %i: %s" % (status, err.strip()))
+	elif out != data:
+		report(name, False, "got %i of %i bytes, or other bytes" %
+			(len(out), len(data)))
+	else:
+		report(name, True)
+
+def check_bad(name, prcat, args):
+	try:
+		status, out, err = run(prcat, args, b"", timeout=10)
+	except subprocess.TimeoutExpired:
+		report(name, False, "timeout")
+		return
+	report(name, status != 0 and "bad frame" in err,
+		"exit %i: %s" % (status, err.strip()))
+
+def stream(port, data, results, i):
+	c = socket.create_connection(("127.0.0.1", port))
+	t = threading.Thread(target=lambda: (c.sendall(data),
+		c.shutdown(socket.SHUT_WR)))
+	t.start()
+	got = []
+	while True:
+		d = c.recv(65536)
+		if not d:
+			break
+		got.append(d)
+	t.join()
+	c.close()
+	results[i] = b"".join(got) == data
+
+def check_streams(name, prcat, args, port, count, size):
+	p = subprocess.Popen([prcat] + args, stderr=subprocess.DEVNULL)
+	try:
+		wait_port(port)
+		results = [False] * count
+		threads = [threading.Thread(target=stream, args=(port,
+			os.urandom(size), results, i)) for i in range(count)]
+		for t in threads:
+			t.start()
+		for t in threads:
+			t.join(60)
+		report(name, all(results), "%i of %i streams differ" %
+			(results.count(False), count))
+	finally:
+		p.terminate()
+		p.wait()
+
+def main():
+	here = os.path.dirname(os.path.abspath(__file__))
+	prcat = sys.argv[1] if len(sys.argv) > 1 else \
+		os.path.join(here, "..", "src", "prcat")
+	authproxy = os.path.join(here, "authproxy.py")
+	tmp = tempfile.mkdtemp()
+	auth = AUTH + ["-C", os.path.join(tmp, "auth")]
+	procs = []
+	
+	def start(args, port, log):
+		procs.append(subprocess.Popen(args,
+			stderr=open(os.path.join(tmp, log), "w")))
+		wait_port(port)
+	
+	epeer = serve(echo)
+	bpeer = serve(bad_peer)
+	peer, proxy, plain, flaky = [free_port() for i in range(4)]
+	
+	try:
+		start([prcat, "-Z", "-l", "127.0.0.1:%i" % peer,
+			"127.0.0.1", str(epeer)], peer, "peer.log")
+		start([sys.executable, authproxy, str(proxy)], proxy,
+			"proxy.log")
+		start([sys.executable, authproxy, "-s", "none", str(plain)],
+			plain, "plain.log")
+		start([sys.executable, authproxy, "-r", "200000",
+			str(flaky)], flaky, "flaky.log")
+		
+		data = os.urandom(4 << 20)
+		via = ["-H", "127.0.0.1", "-P"]
+		
+		check_copy("tunnel", prcat, ["-z"] + via + [str(proxy)] +
+			auth + ["127.0.0.1", str(peer)], data)
+		for n in (2, 5):
+			check_copy("%i stripes" % n, prcat,
+				["-z", "-J", str(n)] + via + [str(proxy)] +
+				auth + ["127.0.0.1", str(peer)], data)
+		check_copy("3 stripes, one reset", prcat,
+			["-z", "-J", "3", "-R"] + via + [str(flaky)] + auth +
+			["127.0.0.1", str(peer)], data)
+		with open(os.path.join(tmp, "flaky.log")) as f:
+			report("proxy reset a stripe", "reset" in f.read())
+		
+		local = free_port()
+		check_streams("8 streams", prcat, ["-z", "-l", "127.0.0.1:%i" %
+			local] + via + [str(plain), "127.0.0.1", str(peer)],
+			local, 8, 512 * 1024)
+		
+		check_bad("tunnel, bad frame", prcat, ["-z"] + via +
+			[str(proxy)] + auth + ["127.0.0.1", str(bpeer)])
+		check_bad("stripes, bad frame", prcat, ["-z", "-J", "2"] +
+			via + [str(proxy)] + auth + ["127.0.0.1", str(bpeer)])
+		check_bad("streams, bad frame", prcat, ["-z", "-l",
+			"127.0.0.1:%i" % free_port()] + via +
+			[str(plain), "127.0.0.1", str(bpeer)])
+	finally:
+		for p in procs:
+			p.terminate()
+			p.wait()
+		shutil.rmtree(tmp)
+	
+	sys.exit(1 if failed else 0)
+
+main()